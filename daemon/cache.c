@@ -18,6 +18,19 @@ int cache_error = 0;
 
 const int initial_pool_size = 64;
 
+/**
+ * The free objects a thread keeps for itself. Only the owning thread
+ * touches the objects; the list of magazines of a cache is protected by
+ * the mutex of the cache.
+ */
+struct cache_magazine {
+    cache_t *cache;
+    struct cache_magazine *next;
+    cache_stats_t stats;
+    int count;
+    void *ptr[CACHE_MAGAZINE_SIZE];
+};
+
 #ifndef NDEBUG
 static bool inFreeList(cache_t *cache, void *object) {
     bool rv = false;
@@ -26,8 +39,18 @@ static bool inFreeList(cache_t *cache, void *object) {
     }
     return rv;
 }
+
+static bool inMagazine(struct cache_magazine *mag, void *object) {
+    bool rv = false;
+    for (int i = 0; i < mag->count; i++) {
+        rv |= mag->ptr[i] == object;
+    }
+    return rv;
+}
 #endif
 
+static void magazine_destructor(void *arg);
+
 cache_t* cache_create(const char *name, size_t bufsize, size_t align,
                       cache_constructor_t* constructor,
                       cache_destructor_t* destructor) {
@@ -42,6 +65,14 @@ cache_t* cache_create(const char *name, size_t bufsize, size_t align,
         return NULL;
     }
 
+    if (pthread_key_create(&ret->magazine_key, magazine_destructor) != 0) {
+        pthread_mutex_destroy(&ret->mutex);
+        free(ret);
+        free(nm);
+        free(ptr);
+        return NULL;
+    }
+
     ret->name = nm;
     ret->ptr = ptr;
     ret->freetotal = initial_pool_size;
@@ -66,13 +97,104 @@ static inline void* get_object(void *ptr) {
 #endif
 }
 
+static void release_object(cache_t *cache, void *ptr) {
+    if (cache->destructor) {
+        cache->destructor(get_object(ptr), NULL);
+    }
+    free(ptr);
+}
+
+/*
+ * Put a free object in the shared pool. Must be called with the mutex
+ * of the cache held.
+ */
+static void pool_put(cache_t *cache, void *ptr) {
+    assert(!inFreeList(cache, ptr));
+    if (cache->freecurr < cache->freetotal) {
+        cache->ptr[cache->freecurr++] = ptr;
+        assert(inFreeList(cache, ptr));
+    } else {
+        /* try to enlarge free connections array */
+        size_t newtotal = cache->freetotal * 2;
+        void **new_free = realloc(cache->ptr, sizeof(char *) * newtotal);
+        if (new_free) {
+            cache->freetotal = newtotal;
+            cache->ptr = new_free;
+            cache->ptr[cache->freecurr++] = ptr;
+            assert(inFreeList(cache, ptr));
+        } else {
+            release_object(cache, ptr);
+            assert(!inFreeList(cache, ptr));
+        }
+    }
+}
+
+/*
+ * Get the magazine of the calling thread, or NULL if it could not be
+ * created (the shared pool is used directly then).
+ */
+static struct cache_magazine *get_magazine(cache_t *cache) {
+    struct cache_magazine *mag = pthread_getspecific(cache->magazine_key);
+    if (mag == NULL) {
+        mag = calloc(1, sizeof(*mag));
+        if (mag == NULL) {
+            return NULL;
+        }
+        if (pthread_setspecific(cache->magazine_key, mag) != 0) {
+            free(mag);
+            return NULL;
+        }
+        mag->cache = cache;
+        pthread_mutex_lock(&cache->mutex);
+        mag->next = cache->magazines;
+        cache->magazines = mag;
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    return mag;
+}
+
+static void add_stats(cache_stats_t *dst, const cache_stats_t *src) {
+    dst->magazine_hits += src->magazine_hits;
+    dst->pool_refills += src->pool_refills;
+    dst->pool_flushes += src->pool_flushes;
+}
+
+/*
+ * Called when a thread exits: give the objects in its magazine back to
+ * the shared pool.
+ */
+static void magazine_destructor(void *arg) {
+    struct cache_magazine *mag = arg;
+    cache_t *cache = mag->cache;
+
+    pthread_mutex_lock(&cache->mutex);
+    while (mag->count > 0) {
+        pool_put(cache, mag->ptr[--mag->count]);
+    }
+    add_stats(&cache->stats, &mag->stats);
+
+    struct cache_magazine **prev = &cache->magazines;
+    while (*prev != mag) {
+        prev = &(*prev)->next;
+    }
+    *prev = mag->next;
+    pthread_mutex_unlock(&cache->mutex);
+    free(mag);
+}
+
 void cache_destroy(cache_t *cache) {
-    while (cache->freecurr > 0) {
-        void *ptr = cache->ptr[--cache->freecurr];
-        if (cache->destructor) {
-            cache->destructor(get_object(ptr), NULL);
+    pthread_setspecific(cache->magazine_key, NULL);
+    pthread_key_delete(cache->magazine_key);
+    while (cache->magazines != NULL) {
+        struct cache_magazine *mag = cache->magazines;
+        cache->magazines = mag->next;
+        while (mag->count > 0) {
+            release_object(cache, mag->ptr[--mag->count]);
         }
-        free(ptr);
+        free(mag);
+    }
+    while (cache->freecurr > 0) {
+        release_object(cache, cache->ptr[--cache->freecurr]);
     }
     free(cache->name);
     free(cache->ptr);
@@ -80,11 +202,37 @@ void cache_destroy(cache_t *cache) {
 }
 
 void* cache_alloc(cache_t *cache) {
-    void *ret;
+    void *ret = NULL;
     void *object;
-    pthread_mutex_lock(&cache->mutex);
-    if (cache->freecurr > 0) {
-        ret = cache->ptr[--cache->freecurr];
+    struct cache_magazine *mag = get_magazine(cache);
+
+    if (mag != NULL && mag->count > 0) {
+        ret = mag->ptr[--mag->count];
+        mag->stats.magazine_hits++;
+    } else {
+        pthread_mutex_lock(&cache->mutex);
+        if (mag != NULL) {
+            /* Refill half of the magazine, keeping the most recently
+             * freed objects on top */
+            int count = CACHE_MAGAZINE_SIZE / 2;
+            if (count > cache->freecurr) {
+                count = cache->freecurr;
+            }
+            cache->freecurr -= count;
+            memcpy(mag->ptr, cache->ptr + cache->freecurr,
+                   count * sizeof(void*));
+            mag->count = count;
+            mag->stats.pool_refills++;
+            if (mag->count > 0) {
+                ret = mag->ptr[--mag->count];
+            }
+        } else if (cache->freecurr > 0) {
+            ret = cache->ptr[--cache->freecurr];
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    }
+
+    if (ret != NULL) {
         object = get_object(ret);
         assert(!inFreeList(cache, ret));
     } else {
@@ -99,7 +247,6 @@ void* cache_alloc(cache_t *cache) {
             }
         }
     }
-    pthread_mutex_unlock(&cache->mutex);
 
 #ifndef NDEBUG
     if (object != NULL) {
@@ -117,7 +264,6 @@ void* cache_alloc(cache_t *cache) {
 
 void cache_free(cache_t *cache, void *object) {
     void *ptr = object;
-    pthread_mutex_lock(&cache->mutex);
 
 #ifndef NDEBUG
     /* validate redzone... */
@@ -125,7 +271,6 @@ void cache_free(cache_t *cache, void *object) {
                &redzone_pattern, sizeof(redzone_pattern)) != 0) {
         raise(SIGABRT);
         cache_error = 1;
-        pthread_mutex_unlock(&cache->mutex);
         return;
     }
     uint64_t *pre = ptr;
@@ -133,32 +278,41 @@ void cache_free(cache_t *cache, void *object) {
     if (*pre != redzone_pattern) {
         raise(SIGABRT);
         cache_error = -1;
-        pthread_mutex_unlock(&cache->mutex);
         return;
     }
     ptr = pre;
 #endif
-    assert(!inFreeList(cache, ptr));
-    if (cache->freecurr < cache->freetotal) {
-        cache->ptr[cache->freecurr++] = ptr;
-        assert(inFreeList(cache, ptr));
-    } else {
-        /* try to enlarge free connections array */
-        size_t newtotal = cache->freetotal * 2;
-        void **new_free = realloc(cache->ptr, sizeof(char *) * newtotal);
-        if (new_free) {
-            cache->freetotal = newtotal;
-            cache->ptr = new_free;
-            cache->ptr[cache->freecurr++] = ptr;
-            assert(inFreeList(cache, ptr));
-        } else {
-            if (cache->destructor) {
-                cache->destructor(ptr, NULL);
-            }
-            free(ptr);
-            assert(!inFreeList(cache, ptr));
+
+    struct cache_magazine *mag = get_magazine(cache);
+    if (mag == NULL) {
+        pthread_mutex_lock(&cache->mutex);
+        pool_put(cache, ptr);
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+
+    assert(!inMagazine(mag, ptr));
+    if (mag->count == CACHE_MAGAZINE_SIZE) {
+        /* Move the half of the magazine freed the longest ago back */
+        const int count = CACHE_MAGAZINE_SIZE / 2;
+        pthread_mutex_lock(&cache->mutex);
+        for (int ii = 0; ii < count; ++ii) {
+            pool_put(cache, mag->ptr[ii]);
         }
+        mag->stats.pool_flushes++;
+        pthread_mutex_unlock(&cache->mutex);
+        mag->count -= count;
+        memmove(mag->ptr, mag->ptr + count, mag->count * sizeof(void*));
     }
-    pthread_mutex_unlock(&cache->mutex);
+    mag->ptr[mag->count++] = ptr;
 }
 
+void cache_get_stats(cache_t *cache, cache_stats_t *stats) {
+    pthread_mutex_lock(&cache->mutex);
+    *stats = cache->stats;
+    for (struct cache_magazine *mag = cache->magazines; mag != NULL;
+         mag = mag->next) {
+        add_stats(stats, &mag->stats);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
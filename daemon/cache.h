@@ -2,6 +2,7 @@
 #ifndef CACHE_H
 #define CACHE_H
 #include <pthread.h>
+#include <stdint.h>
 
 #ifdef HAVE_UMEM_H
 #include <umem.h>
@@ -38,6 +39,26 @@ typedef int cache_constructor_t(void* obj, void* notused1, int notused2);
  */
 typedef void cache_destructor_t(void* obj, void* notused);
 
+/**
+ * The number of objects a thread may keep in its magazine. Every time a
+ * thread has to go to the shared pool it moves half of them at once.
+ */
+#define CACHE_MAGAZINE_SIZE 32
+
+struct cache_magazine;
+
+/**
+ * Counters for the use of the magazines of a cache
+ */
+typedef struct {
+    /** Number of objects allocated from the magazine of a thread */
+    uint64_t magazine_hits;
+    /** Number of allocations that had to lock the shared pool */
+    uint64_t pool_refills;
+    /** Number of frees that moved objects back to the shared pool */
+    uint64_t pool_flushes;
+} cache_stats_t;
+
 /**
  * Definition of the structure to keep track of the internal details of
  * the cache allocator. Touching any of these variables results in
@@ -46,6 +67,12 @@ typedef void cache_destructor_t(void* obj, void* notused);
 typedef struct {
     /** Mutex to protect access to the structure */
     pthread_mutex_t mutex;
+    /** The key of the magazine of the calling thread */
+    pthread_key_t magazine_key;
+    /** List of the magazines of all threads using this cache */
+    struct cache_magazine *magazines;
+    /** Counters of the magazines of threads that exited */
+    cache_stats_t stats;
     /** Name of the cache objects in this cache (provided by the caller) */
     char *name;
     /** List of pointers to available buffers in this cache */
@@ -67,7 +94,10 @@ typedef struct {
  *
  * The object cache will let you allocate objects of the same size. It is fully
  * MT safe, so you may allocate objects from multiple threads without having to
- * do any syncrhonization in the application code.
+ * do any syncrhonization in the application code. Every thread keeps a
+ * magazine of up to CACHE_MAGAZINE_SIZE free objects it allocates from and
+ * frees to without locking; only when it is empty (or full) the objects are
+ * moved from (or to) the pool shared by all threads in bulk.
  *
  * @param name the name of the object cache. This name may be used for debug purposes
  *             and may help you track down what kind of object you have problems with
@@ -111,6 +141,16 @@ void* cache_alloc(cache_t* handle);
  * @param ptr pointer to the object to return.
  */
 void cache_free(cache_t* handle, void* ptr);
+/**
+ * Get the counters for the use of the magazines of a cache.
+ *
+ * The counters of the threads still running are read without
+ * synchronization, so they may be slightly behind.
+ *
+ * @param handle handle to the object cache
+ * @param stats where to store the counters
+ */
+void cache_get_stats(cache_t* handle, cache_stats_t* stats);
 #endif
 
 #endif
@@ -0,0 +1,303 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Latency histograms of the get, set, incr, decr and delete commands.
+ *
+ * Every worker thread keeps its own histograms, so recording takes no
+ * lock, and they are merged when the stats are asked for. For each
+ * command the thread records the time from the parsing of the command
+ * until its response is queued, and the part of it spent in the engine.
+ *
+ * The histograms are log-linear: values below 2 * LATENCY_SUB_BUCKETS
+ * nanoseconds get a bucket each, and every power of two above that is
+ * split in LATENCY_SUB_BUCKETS buckets, so a bucket is within 1/16 of
+ * the values in it. Values from 2^LATENCY_MAX_BITS ns (about 18 minutes)
+ * up go into the last bucket.
+ *
+ * The histograms of a command carry a sequence number that is odd while
+ * the owner changes them, so the stats can be read while the owner keeps
+ * going, like the prefix stats.
+ */
+#include "config.h"
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sched.h>
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS \
+    ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+typedef struct {
+    volatile uint64_t seq;
+    uint64_t          count;
+    latency_histogram total;  /* parse to response */
+    latency_histogram engine; /* in engine calls */
+} latency_op_stats;
+
+typedef struct {
+    latency_op_stats  ops[LATENCY_NUM_OPS];
+    volatile uint64_t resets; /* # of clears asked for */
+    volatile uint64_t resets_done; /* # of clears carried out */
+} latency_table;
+
+static latency_table * volatile *latency_tables;
+static int num_latency_tables;
+
+static const char * const latency_op_names[LATENCY_NUM_OPS] = {
+    [LATENCY_GET] = "get",
+    [LATENCY_SET] = "set",
+    [LATENCY_INCR] = "incr",
+    [LATENCY_DECR] = "decr",
+    [LATENCY_DELETE] = "delete"
+};
+
+void latency_stats_init() {
+    /* One table for each worker thread and one for the tap thread */
+    num_latency_tables = settings.num_threads + 1;
+    latency_tables = calloc(num_latency_tables, sizeof(latency_table *));
+    if (latency_tables == NULL) {
+        perror("Can't allocate latency stats tables: calloc");
+        num_latency_tables = 0;
+    }
+}
+
+/*
+ * Asks the threads to clear their histograms. A table reads as empty from
+ * now on, and its owner clears it the next time it records a command.
+ */
+void latency_stats_clear() {
+    int i;
+
+    for (i = 0; i < num_latency_tables; i++) {
+        latency_table *table = __atomic_load_n(&latency_tables[i],
+                                               __ATOMIC_ACQUIRE);
+        if (table != NULL) {
+            __sync_add_and_fetch(&table->resets, 1);
+        }
+    }
+}
+
+static inline int latency_bucket(uint64_t ns) {
+    if (ns < 2 * LATENCY_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    if (ns >= (1ULL << LATENCY_MAX_BITS)) {
+        ns = (1ULL << LATENCY_MAX_BITS) - 1;
+    }
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return shift * LATENCY_SUB_BUCKETS + (int)(ns >> shift);
+}
+
+/* The highest value that goes into a bucket */
+static uint64_t latency_bucket_value(int bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t top = bucket - shift * LATENCY_SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+static inline void latency_histogram_add(latency_histogram *h, uint64_t ns) {
+    int bucket = latency_bucket(ns);
+    __atomic_store_n(&h->buckets[bucket], h->buckets[bucket] + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+    if (ns > h->max) {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void latency_op_begin(latency_op_stats *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void latency_op_end(latency_op_stats *s) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+}
+
+/* Clears the table of the calling thread */
+static void latency_table_clear(latency_table *table) {
+    int i;
+
+    for (i = 0; i < LATENCY_NUM_OPS; i++) {
+        latency_op_stats *s = &table->ops[i];
+        if (s->count == 0) {
+            continue;
+        }
+        latency_op_begin(s);
+        s->count = 0;
+        memset(&s->total, 0, sizeof(s->total));
+        memset(&s->engine, 0, sizeof(s->engine));
+        latency_op_end(s);
+    }
+}
+
+static latency_table *latency_table_new(void) {
+    void *table = NULL;
+    if (posix_memalign(&table, 64, sizeof(latency_table)) != 0) {
+        perror("Can't allocate latency stats table");
+        return NULL;
+    }
+    memset(table, 0, sizeof(latency_table));
+    return table;
+}
+
+/*
+ * Records the latency of a command in the table of the calling thread:
+ * the total time and the time spent in the engine, in nanoseconds.
+ */
+void latency_stats_record(int thread, latency_op op, uint64_t total,
+                          uint64_t engine) {
+    latency_table *table;
+
+    if (thread < 0 || thread >= num_latency_tables) {
+        return;
+    }
+
+    table = latency_tables[thread];
+    if (table == NULL) {
+        if ((table = latency_table_new()) == NULL) {
+            return;
+        }
+        table->resets_done = table->resets;
+        __atomic_store_n(&latency_tables[thread], table, __ATOMIC_RELEASE);
+    }
+
+    uint64_t resets = table->resets;
+    if (resets != table->resets_done) {
+        latency_table_clear(table);
+        table->resets_done = resets;
+    }
+
+    latency_op_stats *s = &table->ops[op];
+    latency_op_begin(s);
+    __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+    latency_histogram_add(&s->total, total);
+    latency_histogram_add(&s->engine, engine);
+    latency_op_end(s);
+}
+
+static void latency_op_snapshot(latency_op_stats *s, latency_op_stats *copy) {
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, (const void *)s, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+static void latency_histogram_merge(latency_histogram *out,
+                                    const latency_histogram *h) {
+    int i;
+
+    out->sum += h->sum;
+    if (h->max > out->max) {
+        out->max = h->max;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        out->buckets[i] += h->buckets[i];
+    }
+}
+
+/* The value at or below which are permille/1000 of the count values */
+static uint64_t latency_percentile(const latency_histogram *h, uint64_t count,
+                                   int permille) {
+    uint64_t rank = (count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    int i;
+
+    if (count == 0) {
+        return 0;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    uint64_t value = latency_bucket_value(i < LATENCY_BUCKETS ? i :
+                                          LATENCY_BUCKETS - 1);
+    return value < h->max ? value : h->max;
+}
+
+static void latency_histogram_stat(const char *op, const char *kind,
+                                   const latency_histogram *h, uint64_t count,
+                                   ADD_STAT add_stats, const void *cookie) {
+    char key[32];
+    char val[256];
+    int klen = snprintf(key, sizeof(key), "%s_%s", op, kind);
+    int vlen = snprintf(val, sizeof(val),
+                        "count=%"PRIu64",mean=%"PRIu64",p50=%"PRIu64
+                        ",p99=%"PRIu64",p999=%"PRIu64",max=%"PRIu64,
+                        count, count ? h->sum / count : 0,
+                        latency_percentile(h, count, 500),
+                        latency_percentile(h, count, 990),
+                        latency_percentile(h, count, 999), h->max);
+    add_stats(key, klen, val, vlen, cookie);
+}
+
+/*
+ * Merges the histograms of all threads and reports, for each command,
+ * the count, mean, p50, p99, p999 and max of its total and engine
+ * latencies in nanoseconds.
+ */
+bool latency_stats(ADD_STAT add_stats, const void *cookie) {
+    latency_op_stats *merged = calloc(LATENCY_NUM_OPS, sizeof(*merged));
+    latency_op_stats *copy = malloc(sizeof(*copy));
+    int i, j;
+
+    if (merged == NULL || copy == NULL) {
+        free(merged);
+        free(copy);
+        return false;
+    }
+
+    for (i = 0; i < num_latency_tables; i++) {
+        latency_table *table = __atomic_load_n(&latency_tables[i],
+                                               __ATOMIC_ACQUIRE);
+        if (table == NULL || table->resets != table->resets_done) {
+            continue;
+        }
+
+        for (j = 0; j < LATENCY_NUM_OPS; j++) {
+            if (__atomic_load_n(&table->ops[j].count, __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            latency_op_snapshot(&table->ops[j], copy);
+            merged[j].count += copy->count;
+            latency_histogram_merge(&merged[j].total, &copy->total);
+            latency_histogram_merge(&merged[j].engine, &copy->engine);
+        }
+    }
+
+    for (j = 0; j < LATENCY_NUM_OPS; j++) {
+        latency_histogram_stat(latency_op_names[j], "total", &merged[j].total,
+                               merged[j].count, add_stats, cookie);
+        latency_histogram_stat(latency_op_names[j], "engine",
+                               &merged[j].engine, merged[j].count,
+                               add_stats, cookie);
+    }
+
+    free(copy);
+    free(merged);
+    return true;
+}
@@ -0,0 +1,30 @@
+/* latency histograms */
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <time.h>
+
+/* The commands we keep latency histograms for */
+typedef enum {
+    LATENCY_GET = 0,
+    LATENCY_SET,
+    LATENCY_INCR,
+    LATENCY_DECR,
+    LATENCY_DELETE,
+    LATENCY_NUM_OPS
+} latency_op;
+
+void latency_stats_init(void);
+void latency_stats_clear(void);
+void latency_stats_record(int thread, latency_op op, uint64_t total,
+                          uint64_t engine);
+bool latency_stats(ADD_STAT add_stats, const void *cookie);
+
+/* A monotonic timestamp in nanoseconds */
+static inline uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif
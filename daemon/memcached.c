@@ -33,21 +33,26 @@
 #include <stddef.h>
 
 #include "sflow_mc.h"
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
 
 static inline void item_set_cas(const void *cookie, item *it, uint64_t cas) {
     settings.engine.v1->item_set_cas(settings.engine.v0, cookie, it, cas);
 }
 
 /* The item must always be called "it" */
-#define SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_stats[info.clsid].slab_op++;
+#define SLAB_GUTS(conn, thread_stats, slab_op, thread_op) { \
+    struct slab_stats *slab = thread_stats_slab(thread_stats, info.clsid); \
+    __atomic_store_n(&slab->slab_op, slab->slab_op + 1, __ATOMIC_RELAXED); \
+}
 
 #define THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->thread_op++;
+    THREAD_STATS_ADD(thread_stats, thread_op, 1);
 
 #define THREAD_GUTS2(conn, thread_stats, slab_op, thread_op) \
-    thread_stats->slab_op++; \
-    thread_stats->thread_op++;
+    THREAD_STATS_ADD(thread_stats, slab_op, 1); \
+    THREAD_STATS_ADD(thread_stats, thread_op, 1);
 
 #define SLAB_THREAD_GUTS(conn, thread_stats, slab_op, thread_op) \
     SLAB_GUTS(conn, thread_stats, slab_op, thread_op) \
@@ -58,10 +63,10 @@ static inline void item_set_cas(const void *cookie, item *it, uint64_t cas) {
     struct thread_stats *thread_stats = \
         &independent_stats->thread_stats[conn->thread->index]; \
     topkeys_t *topkeys = independent_stats->topkeys; \
-    pthread_mutex_lock(&thread_stats->mutex); \
+    thread_stats_begin(thread_stats); \
     GUTS(conn, thread_stats, slab_op, thread_op); \
-    pthread_mutex_unlock(&thread_stats->mutex); \
-    TK(topkeys, slab_op, key, nkey, current_time); \
+    thread_stats_end(thread_stats); \
+    TK(topkeys, conn->thread->index, slab_op, key, nkey, current_time); \
     } 
 
 #define STATS_INCR(conn, op, key, nkey) \
@@ -85,26 +90,42 @@ static inline void item_set_cas(const void *cookie, item *it, uint64_t cas) {
 #define STATS_NOKEY(conn, op) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    pthread_mutex_lock(&thread_stats->mutex); \
-    thread_stats->op++; \
-    pthread_mutex_unlock(&thread_stats->mutex); \
+    thread_stats_begin(thread_stats); \
+    THREAD_STATS_ADD(thread_stats, op, 1); \
+    thread_stats_end(thread_stats); \
 }
 
 #define STATS_NOKEY2(conn, op1, op2) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    pthread_mutex_lock(&thread_stats->mutex); \
-    thread_stats->op1++; \
-    thread_stats->op2++; \
-    pthread_mutex_unlock(&thread_stats->mutex); \
+    thread_stats_begin(thread_stats); \
+    THREAD_STATS_ADD(thread_stats, op1, 1); \
+    THREAD_STATS_ADD(thread_stats, op2, 1); \
+    thread_stats_end(thread_stats); \
 }
 
 #define STATS_ADD(conn, op, amt) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    pthread_mutex_lock(&thread_stats->mutex); \
-    thread_stats->op += amt; \
-    pthread_mutex_unlock(&thread_stats->mutex); \
+    thread_stats_begin(thread_stats); \
+    THREAD_STATS_ADD(thread_stats, op, amt); \
+    thread_stats_end(thread_stats); \
+}
+
+/* Counts the time spent in an engine call towards the command's latency */
+#define LATENCY_ENGINE(conn, call) { \
+    uint64_t latency_begin = latency_now(); \
+    call; \
+    (conn)->latency_engine += latency_now() - latency_begin; \
+}
+
+/* Records the latency of a command once it isn't waiting on the engine */
+#define LATENCY_DONE(conn, op, ret) { \
+    if ((ret) != ENGINE_EWOULDBLOCK) { \
+        latency_stats_record((conn)->thread->index, op, \
+                             latency_now() - (conn)->latency_start, \
+                             (conn)->latency_engine); \
+    } \
 }
 
 volatile sig_atomic_t memcached_shutdown;
@@ -152,12 +173,19 @@ static void settings_init(void);
 
 /* event handling, network IO */
 static void event_handler(const int fd, const short which, void *arg);
+#ifdef USE_IO_URING
+static void conn_handle_event(conn *c, const int fd, const short which,
+                              bool resume);
+static void uring_cancel(conn *c);
+#endif
 static void complete_nread(conn *c);
 static char *process_command(conn *c, char *command);
 static void write_and_free(conn *c, char *buf, int bytes);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
 static int add_msghdr(conn *c);
+static int conn_start_response(conn *c);
+static void bin_get_batch_free(conn *c);
 
 
 /* time handling */
@@ -237,6 +265,7 @@ static void stats_init(void) {
     stats.curr_conns = stats.total_conns = stats.conn_structs = 0;
 
     stats_prefix_init();
+    latency_stats_init();
 }
 
 static void stats_reset(const void *cookie) {
@@ -246,6 +275,7 @@ static void stats_reset(const void *cookie) {
     stats.total_conns = 0;
     stats_prefix_clear();
     STATS_UNLOCK();
+    latency_stats_clear();
     threadlocal_stats_reset(get_independent_stats(conn)->thread_stats);
     settings.engine.v1->reset_stats(settings.engine.v0, cookie);
 }
@@ -270,11 +300,16 @@ static void settings_init(void) {
     settings.prefix_delimiter = ':';
     settings.detail_enabled = 0;
     settings.allow_detailed = true;
+    settings.prefix_stats_max = DEFAULT_PREFIX_STATS_MAX;
     settings.reqs_per_event = DEFAULT_REQS_PER_EVENT;
+    settings.udp_reassembly_max = DEFAULT_UDP_REASSEMBLY_MAX;
+    settings.reuseport = false;
+    settings.io_uring = false;
     settings.backlog = 1024;
     settings.binding_protocol = negotiating_prot;
     settings.item_size_max = 1024 * 1024; /* The famous 1MB upper limit. */
     settings.topkeys = 0;
+    settings.topkeys_frequent = false;
     settings.require_sasl = false;
     settings.extensions.logger = get_stderr_logger();
 }
@@ -322,6 +357,29 @@ static int add_msghdr(conn *c)
     return 0;
 }
 
+/*
+ * Start building the response to a request (dropping what was built of
+ * it so far). It follows the responses parked to be sent with it.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int conn_start_response(conn *c)
+{
+    c->msgcurr = 0;
+    if (c->iovparked == 0) {
+        c->msgused = 0;
+        c->iovused = 0;
+        return add_msghdr(c);
+    }
+
+    /* Continue the last message of the parked responses */
+    c->msgused = c->msgparked;
+    c->iovused = c->iovparked;
+    c->msglist[c->msgused - 1].msg_iovlen = c->parked_iovlen;
+    c->msgbytes = c->parked_msgbytes;
+    return 0;
+}
+
 static const char *prot_text(enum protocol prot) {
     char *rv = "unknown";
     switch(prot) {
@@ -361,21 +419,42 @@ static uint64_t get_listen_disabled_num(void) {
     return ret;
 }
 
-static void disable_listen(void) {
+static void set_listen_events(conn *list, bool enable) {
+    conn *next;
+    for (next = list; next; next = next->next) {
+        update_event(next, enable ? EV_READ | EV_PERSIST : 0);
+        if (listen(next->sfd, enable ? settings.backlog : 1) != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "listen() failed",
+                                            strerror(errno));
+        }
+    }
+}
+
+/*
+ * Stop accepting on the listeners of the calling thread. Worker threads
+ * only own their SO_REUSEPORT listeners, the others belong to the
+ * dispatcher.
+ */
+static void disable_listen(LIBEVENT_THREAD *thread) {
     pthread_mutex_lock(&listen_state.mutex);
     listen_state.disabled = true;
     listen_state.count = 10;
     ++listen_state.num_disable;
     pthread_mutex_unlock(&listen_state.mutex);
 
-    conn *next;
-    for (next = listen_conn; next; next = next->next) {
-        update_event(next, 0);
-        if (listen(next->sfd, 1) != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "listen() failed",
-                                            strerror(errno));
-        }
+    if (thread == NULL) {
+        set_listen_events(listen_conn, false);
+    } else {
+        thread->listen_disabled = true;
+        set_listen_events(thread->listen_conns, false);
+    }
+}
+
+void resume_thread_listen(LIBEVENT_THREAD *me) {
+    if (me->listen_disabled && !is_listen_disabled()) {
+        me->listen_disabled = false;
+        set_listen_events(me->listen_conns, true);
     }
 }
 
@@ -408,10 +487,146 @@ void safe_close(SOCKET sfd) {
  */
 cache_t *conn_cache;      /* suffix cache */
 
+/*
+ * The read and write buffers of the connections come from one cache per
+ * size, from DATA_BUFFER_SIZE to DATA_BUFFER_SIZE << (CONN_BUFFER_CLASSES - 1).
+ * Every thread keeps a magazine of free buffers of each size, so a
+ * connection mostly gets back a buffer freed on its own thread. Larger
+ * buffers are malloc'ed.
+ */
+static cache_t *conn_buffer_cache[CONN_BUFFER_CLASSES];
+#define CONN_BUFFER_MAX (DATA_BUFFER_SIZE << (CONN_BUFFER_CLASSES - 1))
+
+/* bytes of buffers held by connections */
+static volatile uint64_t conn_buffer_bytes;
+
+/* The size of the buffer used to hold size bytes */
+static uint32_t conn_buffer_size(uint32_t size) {
+    uint32_t ret = DATA_BUFFER_SIZE;
+    while (ret < size && ret <= UINT32_MAX / 2) {
+        ret *= 2;
+    }
+    return ret < size ? size : ret;
+}
+
+/* The cache holding buffers of the given size, or -1 if it is too big */
+static int conn_buffer_class(uint32_t size) {
+    for (int ii = 0; ii < CONN_BUFFER_CLASSES; ++ii) {
+        if (size == (DATA_BUFFER_SIZE << ii)) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+static char *conn_buffer_alloc(uint32_t size) {
+    int clazz = conn_buffer_class(size);
+    char *ret;
+    if (clazz == -1) {
+        ret = malloc(size);
+    } else {
+        ret = cache_alloc(conn_buffer_cache[clazz]);
+    }
+    if (ret != NULL) {
+        __sync_add_and_fetch(&conn_buffer_bytes, size);
+    }
+    return ret;
+}
+
+static void conn_buffer_free(char *buf, uint32_t size) {
+    if (buf == NULL) {
+        return;
+    }
+    __sync_sub_and_fetch(&conn_buffer_bytes, size);
+    int clazz = conn_buffer_class(size);
+    if (clazz == -1) {
+        free(buf);
+    } else {
+        cache_free(conn_buffer_cache[clazz], buf);
+    }
+}
+
+/**
+ * Get the read and write buffers for a connection about to read a request.
+ * The read buffer has the size the recent requests of the connection
+ * needed.
+ *
+ * @return false if there isn't enough memory
+ */
+static bool conn_acquire_buffers(conn *c) {
+    if (c->rbuf == NULL) {
+        c->rbuf = conn_buffer_alloc(c->rwant);
+        if (c->rbuf == NULL) {
+            return false;
+        }
+        c->rcurr = c->rbuf;
+        c->rsize = c->rwant;
+    }
+
+    if (c->wbuf == NULL) {
+        c->wbuf = conn_buffer_alloc(DATA_BUFFER_SIZE);
+        if (c->wbuf == NULL) {
+            return false;
+        }
+        c->wcurr = c->wbuf;
+        c->wsize = DATA_BUFFER_SIZE;
+    }
+    return true;
+}
+
+/**
+ * Give the read and write buffers of a connection back to the pool, so
+ * that idle connections don't hold on to any. Any unparsed input is lost.
+ */
+static void conn_release_buffers(conn *c) {
+    conn_buffer_free(c->rbuf, c->rsize);
+    c->rcurr = c->rbuf = NULL;
+    c->rsize = 0;
+    c->rbytes = 0;
+
+    conn_buffer_free(c->wbuf, c->wsize);
+    c->wcurr = c->wbuf = NULL;
+    c->wsize = 0;
+
+    assert(c->iovparked == 0 || c->sfd == INVALID_SOCKET);
+    conn_buffer_free(c->pbuf, DATA_BUFFER_SIZE);
+    c->pbuf = NULL;
+    c->pbytes = 0;
+}
+
+/**
+ * Replace the read buffer of a connection with one that holds at least
+ * size bytes. The unparsed input is moved to the start of the new buffer.
+ *
+ * @return false if there isn't enough memory (the buffer is unchanged)
+ */
+static bool conn_resize_rbuf(conn *c, uint32_t size) {
+    assert(size >= c->rbytes);
+    size = conn_buffer_size(size);
+
+    char *ptr = conn_buffer_alloc(size);
+    if (ptr == NULL) {
+        return false;
+    }
+    if (c->rbytes != 0) {
+        memcpy(ptr, c->rcurr, c->rbytes);
+    }
+    conn_buffer_free(c->rbuf, c->rsize);
+    c->rcurr = c->rbuf = ptr;
+    c->rsize = size;
+
+    /* Start with the larger buffer the next time too */
+    if (size > c->rwant) {
+        c->rwant = size < CONN_BUFFER_MAX ? size : CONN_BUFFER_MAX;
+    }
+    return true;
+}
+
 /**
  * Reset all of the dynamic buffers used by a connection back to their
- * default sizes. The strategy for resizing the buffers is to allocate a
- * new one of the correct size and free the old one if the allocation succeeds
+ * default sizes, and give its read and write buffers back to the pool. The
+ * strategy for resizing the other buffers is to allocate a new one of the
+ * correct size and free the old one if the allocation succeeds
  * instead of using realloc to change the buffer size (because realloc may
  * not shrink the buffers, and will also copy the memory). If the allocation
  * fails the buffer will be unchanged.
@@ -423,27 +638,7 @@ cache_t *conn_cache;      /* suffix cache */
 static bool conn_reset_buffersize(conn *c) {
     bool ret = true;
 
-    if (c->rsize != DATA_BUFFER_SIZE) {
-        void *ptr = malloc(DATA_BUFFER_SIZE);
-        if (ptr != NULL) {
-            free(c->rbuf);
-            c->rbuf = ptr;
-            c->rsize = DATA_BUFFER_SIZE;
-        } else {
-            ret = false;
-        }
-    }
-
-    if (c->wsize != DATA_BUFFER_SIZE) {
-        void *ptr = malloc(DATA_BUFFER_SIZE);
-        if (ptr != NULL) {
-            free(c->wbuf);
-            c->wbuf = ptr;
-            c->wsize = DATA_BUFFER_SIZE;
-        } else {
-            ret = false;
-        }
-    }
+    conn_release_buffers(c);
 
     if (c->isize != ITEM_LIST_INITIAL) {
         void *ptr = malloc(sizeof(item *) * ITEM_LIST_INITIAL);
@@ -492,6 +687,122 @@ static bool conn_reset_buffersize(conn *c) {
     return ret;
 }
 
+/*
+ * A multi-packet UDP request being reassembled. The datagrams of a
+ * request may be read by any thread serving the socket, so the requests
+ * are shared by all threads, in a hash of (socket, peer, request id)
+ * with a lock per bucket. The clock expires the requests that didn't
+ * complete in time.
+ */
+struct udp_request {
+    struct udp_request *next;
+    SOCKET sfd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int request_id;
+    int npackets;
+    int received;         /* number of packets received */
+    size_t length;        /* bytes of the request received */
+    size_t nbytes;        /* memory used */
+    rel_time_t started;
+    struct iovec packet[]; /* the payload of every sequence number */
+};
+
+struct udp_request_bucket {
+    pthread_mutex_t mutex;
+    struct udp_request *requests;
+};
+
+static struct {
+    struct udp_request_bucket *buckets;
+    volatile uint64_t nbytes;      /* memory used by all requests */
+    volatile uint64_t reassembled; /* number of requests completed */
+    volatile uint64_t dropped;     /* number of requests timed out or over the limit */
+} udp_reassembly;
+
+#ifdef USE_UDP_BATCH
+/*
+ * The datagrams a UDP connection received with one recvmmsg but didn't
+ * process yet, and the packets of the responses it queued to send with
+ * one sendmmsg. The packets are copied, so the buffers and items of a
+ * response may be released as soon as it is queued. Every datagram is
+ * received into a buffer of its own, which is swapped with the read
+ * buffer of the connection when the datagram is processed.
+ */
+struct udp_batch {
+    int size;      /* number of datagrams in each direction */
+    int rx_count;  /* number of datagrams received */
+    int rx_next;   /* the next of them to process */
+    int tx_count;  /* number of packets queued */
+    int tx_sent;   /* number of them sent */
+    struct mmsghdr *rx_msgs;
+    struct iovec *rx_iov;
+    struct sockaddr_storage *rx_addr;
+    struct mmsghdr *tx_msgs;
+    struct iovec *tx_iov;
+    struct sockaddr_storage *tx_addr;
+    char *tx_buf;  /* size * UDP_MAX_PAYLOAD_SIZE bytes */
+};
+
+static void udp_batch_free(struct udp_batch *b) {
+    if (b != NULL) {
+        free(b->rx_msgs);
+        free(b->rx_iov);
+        free(b->rx_addr);
+        if (b->rx_iov != NULL) {
+            for (int ii = 0; ii < b->size; ++ii) {
+                conn_buffer_free(b->rx_iov[ii].iov_base, UDP_READ_BUFFER_SIZE);
+            }
+        }
+        free(b->tx_msgs);
+        free(b->tx_iov);
+        free(b->tx_addr);
+        free(b->tx_buf);
+        free(b);
+    }
+}
+
+static struct udp_batch *udp_batch_create(int size) {
+    struct udp_batch *b = calloc(1, sizeof(*b));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->size = size;
+    b->rx_msgs = calloc(size, sizeof(struct mmsghdr));
+    b->rx_iov = calloc(size, sizeof(struct iovec));
+    b->rx_addr = calloc(size, sizeof(struct sockaddr_storage));
+    b->tx_msgs = calloc(size, sizeof(struct mmsghdr));
+    b->tx_iov = calloc(size, sizeof(struct iovec));
+    b->tx_addr = calloc(size, sizeof(struct sockaddr_storage));
+    b->tx_buf = malloc((size_t)size * UDP_MAX_PAYLOAD_SIZE);
+    if (b->rx_msgs == NULL || b->rx_iov == NULL || b->rx_addr == NULL ||
+        b->tx_msgs == NULL || b->tx_iov == NULL ||
+        b->tx_addr == NULL || b->tx_buf == NULL) {
+        udp_batch_free(b);
+        return NULL;
+    }
+
+    for (int ii = 0; ii < size; ++ii) {
+        b->rx_iov[ii].iov_base = conn_buffer_alloc(UDP_READ_BUFFER_SIZE);
+        if (b->rx_iov[ii].iov_base == NULL) {
+            udp_batch_free(b);
+            return NULL;
+        }
+        b->rx_iov[ii].iov_len = UDP_READ_BUFFER_SIZE;
+        b->rx_msgs[ii].msg_hdr.msg_iov = &b->rx_iov[ii];
+        b->rx_msgs[ii].msg_hdr.msg_iovlen = 1;
+        b->rx_msgs[ii].msg_hdr.msg_name = &b->rx_addr[ii];
+        b->tx_iov[ii].iov_base = b->tx_buf + ii * UDP_MAX_PAYLOAD_SIZE;
+        b->tx_msgs[ii].msg_hdr.msg_iov = &b->tx_iov[ii];
+        b->tx_msgs[ii].msg_hdr.msg_iovlen = 1;
+        b->tx_msgs[ii].msg_hdr.msg_name = &b->tx_addr[ii];
+    }
+
+    return b;
+}
+#endif
+
 /**
  * Constructor for all memory allocations of connection objects. Initialize
  * all members and allocate the transfer buffers.
@@ -501,6 +812,7 @@ static bool conn_reset_buffersize(conn *c) {
  * @param unused2 not used
  * @return 0 on success, 1 if we failed to allocate memory
  */
+
 static int conn_constructor(void *buffer, void *unused1, int unused2) {
     (void)unused1; (void)unused2;
 
@@ -509,8 +821,6 @@ static int conn_constructor(void *buffer, void *unused1, int unused2) {
     MEMCACHED_CONN_CREATE(c);
 
     if (!conn_reset_buffersize(c)) {
-        free(c->rbuf);
-        free(c->wbuf);
         free(c->ilist);
         free(c->suffixlist);
         free(c->iov);
@@ -537,12 +847,14 @@ static int conn_constructor(void *buffer, void *unused1, int unused2) {
 static void conn_destructor(void *buffer, void *unused) {
     (void)unused;
     conn *c = buffer;
-    free(c->rbuf);
-    free(c->wbuf);
     free(c->ilist);
     free(c->suffixlist);
     free(c->iov);
     free(c->msglist);
+    free(c->vinfo);
+#ifdef USE_UDP_BATCH
+    udp_batch_free(c->udp_batch);
+#endif
 
     STATS_LOCK();
     stats.conn_structs--;
@@ -560,17 +872,13 @@ conn *conn_new(const SOCKET sfd, STATE_FUNC init_state,
 
     assert(c->thread == NULL);
 
-    if (c->rsize < read_buffer_size) {
-        void *mem = malloc(read_buffer_size);
-        if (mem) {
-            c->rsize = read_buffer_size;
-            free(c->rbuf);
-            c->rbuf = mem;
-        } else {
-            assert(c->thread == NULL);
-            cache_free(conn_cache, c);
-            return NULL;
-        }
+    c->rwant = conn_buffer_size(read_buffer_size);
+    c->rpeak = 0;
+    c->rrequests = 0;
+    if (!conn_acquire_buffers(c)) {
+        conn_release_buffers(c);
+        cache_free(conn_cache, c);
+        return NULL;
     }
 
     c->transport = transport;
@@ -578,6 +886,15 @@ conn *conn_new(const SOCKET sfd, STATE_FUNC init_state,
 
     if (IS_UDP(transport)) {
         c->request_addr_size = sizeof(c->request_addr);
+#ifdef USE_UDP_BATCH
+        if (c->udp_batch != NULL) {
+            c->udp_batch->rx_count = c->udp_batch->rx_next = 0;
+            c->udp_batch->tx_count = c->udp_batch->tx_sent = 0;
+        } else if (settings.udp_batch > 1) {
+            /* Receive and send one datagram at a time if this fails */
+            c->udp_batch = udp_batch_create(settings.udp_batch);
+        }
+#endif
     } else {
         c->request_addr_size = 0;
     }
@@ -617,6 +934,7 @@ conn *conn_new(const SOCKET sfd, STATE_FUNC init_state,
     c->wcurr = c->wbuf;
     c->rcurr = c->rbuf;
     c->ritem = 0;
+    c->riovcnt = 0;
     c->icurr = c->ilist;
     c->suffixcurr = c->suffixlist;
     c->ileft = 0;
@@ -624,6 +942,11 @@ conn *conn_new(const SOCKET sfd, STATE_FUNC init_state,
     c->iovused = 0;
     c->msgcurr = 0;
     c->msgused = 0;
+    c->iovparked = 0;
+    c->msgparked = 0;
+    c->responses = 0;
+    c->flushing = false;
+    c->getbatch = NULL;
     c->next = NULL;
     c->list_state = 0;
 
@@ -661,6 +984,8 @@ conn *conn_new(const SOCKET sfd, STATE_FUNC init_state,
 static void conn_cleanup(conn *c) {
     assert(c != NULL);
 
+    bin_get_batch_free(c);
+
     if (c->item) {
         settings.engine.v1->release(settings.engine.v0, c, c->item);
         c->item = 0;
@@ -739,23 +1064,37 @@ void conn_close(conn *c) {
 static void conn_shrink(conn *c) {
     assert(c != NULL);
 
-    if (IS_UDP(c->transport))
+    if (IS_UDP(c->transport)) {
+        /* Give back the larger buffer a reassembled request needed */
+        if (c->rsize > UDP_READ_BUFFER_SIZE &&
+            c->rbytes <= UDP_READ_BUFFER_SIZE) {
+            conn_resize_rbuf(c, UDP_READ_BUFFER_SIZE);
+        }
         return;
+    }
 
-    if (c->rsize > READ_BUFFER_HIGHWAT && c->rbytes < DATA_BUFFER_SIZE) {
-        char *newbuf;
-
-        if (c->rcurr != c->rbuf)
-            memmove(c->rbuf, c->rcurr, (size_t)c->rbytes);
+    /*
+     * Keep a read buffer as large as the input the connection had to
+     * buffer lately, so clients pipelining large requests don't have to
+     * grow it over and over again.
+     */
+    if (++c->rrequests >= CONN_BUFFER_ADJUST_INTERVAL) {
+        c->rwant = conn_buffer_size(c->rpeak);
+        if (c->rwant > CONN_BUFFER_MAX) {
+            c->rwant = CONN_BUFFER_MAX;
+        }
+        c->rpeak = 0;
+        c->rrequests = 0;
+    }
 
-        newbuf = (char *)realloc((void *)c->rbuf, DATA_BUFFER_SIZE);
+    if (c->rsize > c->rwant && c->rbytes <= c->rwant) {
+        /* keep the old buffer if this fails */
+        conn_resize_rbuf(c, c->rwant);
+    }
 
-        if (newbuf) {
-            c->rbuf = newbuf;
-            c->rsize = DATA_BUFFER_SIZE;
-        }
-        /* TODO check other branch... */
-        c->rcurr = c->rbuf;
+    if (c->iovparked > 0) {
+        /* The lists hold the parked responses */
+        return;
     }
 
     if (c->isize > ITEM_LIST_HIGHWAT) {
@@ -949,6 +1288,78 @@ static int add_iov(conn *c, const void *buf, int len) {
     return 0;
 }
 
+/*
+ * Get all of the pieces the value of an item is stored in. An engine may
+ * store a large value in more than one piece, in which case info (which
+ * only has room for one) tells how many there are. The pieces are then
+ * returned in a buffer owned by the connection, which is only valid until
+ * the next call.
+ *
+ * Returns NULL on out-of-memory.
+ */
+static item_info *get_item_value(conn *c, const item *it, item_info *info) {
+    if (info->nvalue <= 1) {
+        return info;
+    }
+
+    if (c->vinfosize < info->nvalue) {
+        size_t size = sizeof(item_info) +
+            (info->nvalue - 1) * sizeof(struct iovec);
+        item_info *ptr = realloc(c->vinfo, size);
+        if (ptr == NULL) {
+            return NULL;
+        }
+        c->vinfo = ptr;
+        c->vinfosize = info->nvalue;
+    }
+
+    c->vinfo->nvalue = c->vinfosize;
+    if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                           c->vinfo) ||
+        c->vinfo->nvalue > c->vinfosize) {
+        return NULL;
+    }
+    return c->vinfo;
+}
+
+/*
+ * Adds the value of an item to the list of pending data.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int add_item_value_iov(conn *c, const item *it, item_info *info) {
+    item_info *value = get_item_value(c, it, info);
+    if (value == NULL) {
+        return -1;
+    }
+
+    for (int ii = 0; ii < value->nvalue; ++ii) {
+        if (add_iov(c, value->value[ii].iov_base,
+                    value->value[ii].iov_len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set up the connection to read the value of an item (in conn_nread).
+ *
+ * Returns false on out-of-memory.
+ */
+static bool set_item_read_iov(conn *c, const item *it, item_info *info) {
+    item_info *value = get_item_value(c, it, info);
+    if (value == NULL) {
+        return false;
+    }
+
+    c->ritem = value->value[0].iov_base;
+    c->rlbytes = value->value[0].iov_len;
+    c->riov = value->value + 1;
+    c->riovcnt = value->nvalue - 1;
+    return true;
+}
+
 
 /*
  * Constructs a set of UDP headers and attaches them to the outgoing messages.
@@ -1015,10 +1426,7 @@ static void out_string(conn *c, const char *str) {
     }
 
     /* Nuke a partial output... */
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    add_msghdr(c);
+    conn_start_response(c);
 
     len = strlen(str);
     if ((len + 2) > c->wsize) {
@@ -1065,8 +1473,9 @@ static void complete_update_ascii(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->store(settings.engine.v0, c, it, &c->cas,
-                                        c->store_op, 0);
+        LATENCY_ENGINE(c, ret = settings.engine.v1->store(settings.engine.v0,
+                                                          c, it, &c->cas,
+                                                          c->store_op, 0));
     }
 
     SFLOW_SAMPLE(SFMC_CMD_OTHER, c, info.key, info.nkey, 0, (ret == ENGINE_SUCCESS) ? info.nbytes : -1, ret);
@@ -1151,6 +1560,8 @@ static void complete_update_ascii(conn *c) {
         out_string(c, "SERVER_ERROR internal");
     }
 
+    LATENCY_DONE(c, LATENCY_SET, ret);
+
     if (c->store_op == OPERATION_CAS) {
         switch (ret) {
         case ENGINE_SUCCESS:
@@ -1290,10 +1701,7 @@ static void add_bin_header(conn *c, uint16_t err, uint8_t hdr_len, uint16_t key_
 
     assert(c);
 
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
+    if (conn_start_response(c) != 0) {
         /* XXX:  out_string is inappropriate here */
         out_string(c, "SERVER_ERROR out of memory");
         return;
@@ -1497,13 +1905,13 @@ static void complete_incr_bin(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->arithmetic(settings.engine.v0,
+        LATENCY_ENGINE(c, ret = settings.engine.v1->arithmetic(settings.engine.v0,
                                              c, key, nkey, incr,
                                              req->message.body.expiration != 0xffffffff,
                                              delta, initial, expiration,
                                              &c->cas,
                                              &rsp->message.body.value,
-                                             c->binary_header.request.vbucket);
+                                             c->binary_header.request.vbucket));
     }
 
     SFLOW_SAMPLE(SFMC_CMD_OTHER, c, key, nkey, 0, -1, ret);
@@ -1557,6 +1965,8 @@ static void complete_incr_bin(conn *c) {
     default:
         abort();
     }
+
+    LATENCY_DONE(c, incr ? LATENCY_INCR : LATENCY_DECR, ret);
 }
 
 static void complete_update_bin(conn *c) {
@@ -1577,9 +1987,9 @@ static void complete_update_bin(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->store(settings.engine.v0, c,
-                                        it, &c->cas, c->store_op,
-                                        c->binary_header.request.vbucket);
+        LATENCY_ENGINE(c, ret = settings.engine.v1->store(settings.engine.v0,
+                                        c, it, &c->cas, c->store_op,
+                                        c->binary_header.request.vbucket));
     }
 
     SFLOW_SAMPLE(SFMC_CMD_OTHER, c, info.key, info.nkey, 0, (ret == ENGINE_SUCCESS) ? info.nbytes : -1, ret);
@@ -1649,6 +2059,8 @@ static void complete_update_bin(conn *c) {
         write_bin_packet(c, eno, 0);
     }
 
+    LATENCY_DONE(c, LATENCY_SET, ret);
+
     if (c->store_op == OPERATION_CAS) {
         switch (ret) {
         case ENGINE_SUCCESS:
@@ -1674,44 +2086,214 @@ static void complete_update_bin(conn *c) {
     }
 }
 
-static void process_bin_get(conn *c) {
-    item *it;
-
-    protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->wbuf;
-    char* key = binary_get_key(c);
-    size_t nkey = c->binary_header.request.keylen;
+/*
+ * Look up a number of keys, with a single call to the engine if it
+ * implements get_multi.
+ */
+static void engine_get_multi(conn *c, item_lookup *lookups, int nlookups) {
+    uint64_t latency_begin = latency_now();
+    if (settings.engine.v1->get_multi != NULL) {
+        settings.engine.v1->get_multi(settings.engine.v0, c,
+                                      lookups, nlookups);
+    } else {
+        for (int ii = 0; ii < nlookups; ++ii) {
+            lookups[ii].status = settings.engine.v1->get(settings.engine.v0, c,
+                                                         &lookups[ii].item,
+                                                         lookups[ii].key,
+                                                         lookups[ii].nkey,
+                                                         lookups[ii].vbucket);
+            if (lookups[ii].status == ENGINE_EWOULDBLOCK) {
+                break;
+            }
+        }
+    }
+    c->latency_engine += latency_now() - latency_begin;
+}
 
-    if (settings.verbose > 1) {
-        char buffer[1024];
-        if (key_to_printable_buffer(buffer, sizeof(buffer), c->sfd, true,
-                                    "GET", key, nkey) != -1) {
-            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c, "%s\n",
-                                            buffer);
+/*
+ * Release the items found by lookups we won't use.
+ */
+static void release_lookups(conn *c, item_lookup *lookups, int nlookups) {
+    for (int ii = 0; ii < nlookups; ++ii) {
+        if (lookups[ii].status == ENGINE_SUCCESS) {
+            settings.engine.v1->release(settings.engine.v0, c,
+                                        lookups[ii].item);
+            lookups[ii].status = ENGINE_KEY_ENOENT;
         }
     }
+}
 
-    ENGINE_ERROR_CODE ret = c->aiostat;
-    c->aiostat = ENGINE_SUCCESS;
-    if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->get(settings.engine.v0, c, &it, key, nkey,
-                                      c->binary_header.request.vbucket);
+/* The most gets of a run of pipelined binary gets looked up together */
+#define BIN_GET_BATCH 32
+
+/*
+ * The gets following a quiet binary get in the input buffer are looked
+ * up together with it, and pick up their results from here. The keys are
+ * copied, because the input buffer may move before they're processed.
+ */
+struct bin_get_batch {
+    int nlookups;
+    int curr; /* the lookup of the next get */
+    item_lookup lookups[BIN_GET_BATCH];
+    char keys[];
+};
+
+static void bin_get_batch_free(conn *c) {
+    struct bin_get_batch *batch = c->getbatch;
+    if (batch != NULL) {
+        release_lookups(c, batch->lookups + batch->curr,
+                        batch->nlookups - batch->curr);
+        free(batch);
+        c->getbatch = NULL;
     }
+}
 
-    uint16_t keylen;
-    uint32_t bodylen;
-    item_info info = { .nvalue = 1 };
+static bool is_bin_get(const protocol_binary_request_header *req) {
+    switch (req->request.opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        return req->request.magic == PROTOCOL_BINARY_REQ &&
+            req->request.extlen == 0;
+    default:
+        return false;
+    }
+}
 
-    switch (ret) {
-    case ENGINE_SUCCESS:
-        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it, &info)) {
-            settings.engine.v1->release(settings.engine.v0, c, it);
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                            "%d: Failed to get item info\n",
-                                            c->sfd);
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
+/*
+ * Start a batch with the key of the quiet get being processed and the
+ * keys of the complete gets following it in the input buffer.
+ */
+static struct bin_get_batch *bin_get_batch_new(conn *c, const char *key,
+                                               uint16_t nkey) {
+    int nlookups = 1;
+    size_t nkeys = nkey;
+    const char *ptr = c->rcurr;
+    const char *end = c->rcurr + c->rbytes;
+    while (nlookups < BIN_GET_BATCH &&
+           end - ptr >= (ptrdiff_t)sizeof(protocol_binary_request_header)) {
+        const protocol_binary_request_header *req = (const void *)ptr;
+        uint16_t keylen = ntohs(req->request.keylen);
+        if (!is_bin_get(req) || ntohl(req->request.bodylen) != keylen ||
+            keylen == 0 || keylen > KEY_MAX_LENGTH ||
+            end - ptr < (ptrdiff_t)(sizeof(*req) + keylen)) {
             break;
         }
-
+        ++nlookups;
+        nkeys += keylen;
+        ptr += sizeof(*req) + keylen;
+    }
+    if (nlookups == 1) {
+        return NULL;
+    }
+
+    struct bin_get_batch *batch = malloc(sizeof(*batch) + nkeys);
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->nlookups = nlookups;
+    batch->curr = 0;
+
+    char *keys = batch->keys;
+    ptr = c->rcurr;
+    for (int ii = 0; ii < nlookups; ++ii) {
+        item_lookup *lookup = &batch->lookups[ii];
+        if (ii == 0) {
+            lookup->nkey = nkey;
+            lookup->vbucket = c->binary_header.request.vbucket;
+        } else {
+            const protocol_binary_request_header *req = (const void *)ptr;
+            lookup->nkey = ntohs(req->request.keylen);
+            lookup->vbucket = ntohs(req->request.vbucket);
+            key = ptr + sizeof(*req);
+            ptr = key + lookup->nkey;
+        }
+        memcpy(keys, key, lookup->nkey);
+        lookup->key = keys;
+        lookup->status = ENGINE_EWOULDBLOCK;
+        lookup->item = NULL;
+        keys += lookup->nkey;
+    }
+
+    engine_get_multi(c, batch->lookups, nlookups);
+    return batch;
+}
+
+/*
+ * Get the item for the key of the binary get being processed, from the
+ * batch of lookups if it covers it. A quiet get starts a new batch.
+ */
+static ENGINE_ERROR_CODE bin_get_lookup(conn *c, item **it,
+                                        const char *key, uint16_t nkey) {
+    uint16_t vbucket = c->binary_header.request.vbucket;
+    struct bin_get_batch *batch = c->getbatch;
+    if (batch != NULL) {
+        item_lookup *lookup = &batch->lookups[batch->curr];
+        if (lookup->nkey != nkey || lookup->vbucket != vbucket ||
+            memcmp(lookup->key, key, nkey) != 0) {
+            bin_get_batch_free(c);
+            batch = NULL;
+        }
+    }
+    if (batch == NULL && c->noreply) {
+        batch = c->getbatch = bin_get_batch_new(c, key, nkey);
+    }
+    if (batch == NULL) {
+        ENGINE_ERROR_CODE ret;
+        LATENCY_ENGINE(c, ret = settings.engine.v1->get(settings.engine.v0, c,
+                                                        it, key, nkey,
+                                                        vbucket));
+        return ret;
+    }
+
+    item_lookup *lookup = &batch->lookups[batch->curr++];
+    ENGINE_ERROR_CODE ret = lookup->status;
+    *it = lookup->item;
+    /* The engine stopped at a lookup that would block */
+    if (batch->curr == batch->nlookups || ret == ENGINE_EWOULDBLOCK) {
+        bin_get_batch_free(c);
+    }
+    return ret;
+}
+
+static void process_bin_get(conn *c) {
+    item *it;
+
+    protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->wbuf;
+    char* key = binary_get_key(c);
+    size_t nkey = c->binary_header.request.keylen;
+
+    if (settings.verbose > 1) {
+        char buffer[1024];
+        if (key_to_printable_buffer(buffer, sizeof(buffer), c->sfd, true,
+                                    "GET", key, nkey) != -1) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c, "%s\n",
+                                            buffer);
+        }
+    }
+
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    if (ret == ENGINE_SUCCESS) {
+        ret = bin_get_lookup(c, &it, key, nkey);
+    }
+
+    uint16_t keylen;
+    uint32_t bodylen;
+    item_info info = { .nvalue = 1 };
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it, &info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                            "%d: Failed to get item info\n",
+                                            c->sfd);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
+            break;
+        }
+
         keylen = 0;
         bodylen = sizeof(rsp->message.body) + info.nbytes;
 
@@ -1732,7 +2314,11 @@ static void process_bin_get(conn *c) {
             add_iov(c, info.key, nkey);
         }
 
-        add_iov(c, info.value[0].iov_base, info.value[0].iov_len);
+        if (add_item_value_iov(c, it, &info) != 0) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+            break;
+        }
         conn_set_state(c, conn_mwrite);
         /* Remember this item so we can garbage collect it later */
         c->item = it;
@@ -1777,8 +2363,11 @@ static void process_bin_get(conn *c) {
         abort();
     }
 
+    LATENCY_DONE(c, LATENCY_GET, ret);
+
     if (settings.detail_enabled && ret != ENGINE_EWOULDBLOCK) {
-        stats_prefix_record_get(key, nkey, ret == ENGINE_SUCCESS);
+        stats_prefix_record_get(c->thread->index, key, nkey,
+                                ret == ENGINE_SUCCESS);
     }
 }
 
@@ -1941,6 +2530,11 @@ static void process_bin_stat(conn *c) {
                         append_stats("detailed", strlen("detailed"), dump_buf, len, c);
                         free(dump_buf);
                     }
+                } else if (strncmp(subcmd_pos, " prefixes", 9) == 0) {
+                    if (!stats_prefix_stats(append_stats, c)) {
+                        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+                        return ;
+                    }
                 } else if (strncmp(subcmd_pos, " on", 3) == 0) {
                     settings.detail_enabled = 1;
                 } else if (strncmp(subcmd_pos, " off", 4) == 0) {
@@ -1955,6 +2549,8 @@ static void process_bin_stat(conn *c) {
             }
         } else if (strncmp(subcommand, "aggregate", 9) == 0) {
             server_stats(&append_stats, c, true);
+        } else if (strncmp(subcommand, "threads", 7) == 0) {
+            threads_wakeup_stats(&append_stats, c);
         } else if (strncmp(subcommand, "topkeys", 7) == 0) {
             topkeys_t *tk = get_independent_stats(c)->topkeys;
             if (tk != NULL) {
@@ -1963,6 +2559,11 @@ static void process_bin_stat(conn *c) {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
                 return;
             }
+        } else if (strncmp(subcommand, "latency", 7) == 0) {
+            if (!latency_stats(append_stats, c)) {
+                write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
+                return;
+            }
         } else {
             ret = settings.engine.v1->get_stats(settings.engine.v0, c,
                                                 subcommand, nkey,
@@ -2008,9 +2609,12 @@ static void bin_read_chunk(conn *c, enum bin_substates next_substate, uint32_t c
 
     /* Ok... do we have room for everything in our buffer? */
     ptrdiff_t offset = c->rcurr + sizeof(protocol_binary_request_header) - c->rbuf;
+    size_t size = c->rlbytes + sizeof(protocol_binary_request_header);
+    if (size > c->rpeak) {
+        c->rpeak = size;
+    }
     if (c->rlbytes > c->rsize - offset) {
         size_t nsize = c->rsize;
-        size_t size = c->rlbytes + sizeof(protocol_binary_request_header);
 
         while (size > nsize) {
             nsize *= 2;
@@ -2022,8 +2626,8 @@ static void bin_read_chunk(conn *c, enum bin_substates next_substate, uint32_t c
                         "%d: Need to grow buffer from %lu to %lu\n",
                         c->sfd, (unsigned long)c->rsize, (unsigned long)nsize);
             }
-            char *newm = realloc(c->rbuf, nsize);
-            if (newm == NULL) {
+            /* this moves the packet to the start of the buffer */
+            if (!conn_resize_rbuf(c, nsize)) {
                 if (settings.verbose) {
                     settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                             "%d: Failed to grow buffer.. closing connection\n",
@@ -2032,11 +2636,6 @@ static void bin_read_chunk(conn *c, enum bin_substates next_substate, uint32_t c
                 conn_set_state(c, conn_closing);
                 return;
             }
-
-            c->rbuf= newm;
-            /* rcurr should point to the same offset in the packet */
-            c->rcurr = c->rbuf + offset - sizeof(protocol_binary_request_header);
-            c->rsize = nsize;
         }
         if (c->rbuf != c->rcurr) {
             memmove(c->rbuf, c->rcurr, c->rbytes);
@@ -2479,7 +3078,7 @@ static void ship_tap_log(conn *c) {
 
             add_iov(c, info.key, info.nkey);
             if ((tap_flags & TAP_FLAG_NO_VALUE) == 0) {
-                add_iov(c, info.value[0].iov_base, info.value[0].iov_len);
+                add_item_value_iov(c, it, &info);
             }
 
             break;
@@ -2517,7 +3116,7 @@ static void ship_tap_log(conn *c) {
 
             add_iov(c, info.key, info.nkey);
             if ((tap_flags & TAP_FLAG_NO_VALUE) == 0) {
-                add_iov(c, info.value[0].iov_base, info.value[0].iov_len);
+                add_item_value_iov(c, it, &info);
             }
 
             pthread_mutex_lock(&tap_stats.mutex);
@@ -2878,6 +3477,8 @@ static void dispatch_bin_command(conn *c) {
 
     MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->rcurr, c->rbytes);
     SFLOW_SAMPLE_TEST(c);
+    c->latency_start = latency_now();
+    c->latency_engine = 0;
     c->noreply = true;
 
     /* binprot supports 16bit keys, but internals are still 8bit */
@@ -3111,7 +3712,7 @@ static void process_bin_update(conn *c) {
     }
 
     if (settings.detail_enabled) {
-        stats_prefix_record_set(key, nkey);
+        stats_prefix_record_set(c->thread->index, key, nkey);
     }
 
     ENGINE_ERROR_CODE ret = c->aiostat;
@@ -3120,11 +3721,11 @@ static void process_bin_update(conn *c) {
     item_info info = { .nvalue = 1 };
 
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->allocate(settings.engine.v0, c,
-                                           &it, key, nkey,
+        LATENCY_ENGINE(c, ret = settings.engine.v1->allocate(settings.engine.v0,
+                                           c, &it, key, nkey,
                                            vlen,
                                            req->message.body.flags,
-                                           expiration);
+                                           expiration));
         if (ret == ENGINE_SUCCESS && !settings.engine.v1->get_item_info(settings.engine.v0,
                                                                         c, it, &info)) {
             settings.engine.v1->release(settings.engine.v0, c, it);
@@ -3155,9 +3756,12 @@ static void process_bin_update(conn *c) {
             c->store_op = OPERATION_CAS;
         }
 
+        if (!set_item_read_iov(c, it, &info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, vlen);
+            return;
+        }
         c->item = it;
-        c->ritem = info.value[0].iov_base;
-        c->rlbytes = vlen;
         conn_set_state(c, conn_nread);
         c->substate = bin_read_set_value;
         break;
@@ -3209,7 +3813,7 @@ static void process_bin_append_prepend(conn *c) {
     }
 
     if (settings.detail_enabled) {
-        stats_prefix_record_set(key, nkey);
+        stats_prefix_record_set(c->thread->index, key, nkey);
     }
 
     ENGINE_ERROR_CODE ret = c->aiostat;
@@ -3218,9 +3822,9 @@ static void process_bin_append_prepend(conn *c) {
     item_info info = { .nvalue = 1 };
 
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->allocate(settings.engine.v0, c,
-                                           &it, key, nkey,
-                                           vlen, 0, 0);
+        LATENCY_ENGINE(c, ret = settings.engine.v1->allocate(settings.engine.v0,
+                                           c, &it, key, nkey,
+                                           vlen, 0, 0));
         if (ret == ENGINE_SUCCESS && !settings.engine.v1->get_item_info(settings.engine.v0,
                                                                         c, it, &info)) {
             settings.engine.v1->release(settings.engine.v0, c, it);
@@ -3244,9 +3848,12 @@ static void process_bin_append_prepend(conn *c) {
             assert(0);
         }
 
+        if (!set_item_read_iov(c, it, &info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, vlen);
+            return;
+        }
         c->item = it;
-        c->ritem = info.value[0].iov_base;
-        c->rlbytes = vlen;
         conn_set_state(c, conn_nread);
         c->substate = bin_read_set_value;
         break;
@@ -3319,11 +3926,12 @@ static void process_bin_delete(conn *c) {
 
     if (ret == ENGINE_SUCCESS) {
         if (settings.detail_enabled) {
-            stats_prefix_record_delete(key, nkey);
+            stats_prefix_record_delete(c->thread->index, key, nkey);
         }
-        ret = settings.engine.v1->remove(settings.engine.v0, c, key, nkey,
+        LATENCY_ENGINE(c, ret = settings.engine.v1->remove(settings.engine.v0,
+                                         c, key, nkey,
                                          ntohll(req->message.header.request.cas),
-                                         c->binary_header.request.vbucket);
+                                         c->binary_header.request.vbucket));
     }
 
     SFLOW_SAMPLE(SFMC_CMD_DELETE, c, key, nkey, 0, -1, ret);
@@ -3351,6 +3959,8 @@ static void process_bin_delete(conn *c) {
     default:
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
     }
+
+    LATENCY_DONE(c, LATENCY_DELETE, ret);
 }
 
 static void complete_nread_binary(conn *c) {
@@ -3678,6 +4288,16 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     struct slab_stats slab_stats;
     slab_stats_aggregate(&thread_stats, &slab_stats);
 
+#ifndef HAVE_UMEM_H
+    cache_stats_t conn_cache_stats;
+    cache_stats_t suffix_stats;
+    cache_get_stats(conn_cache, &conn_cache_stats);
+    suffix_cache_stats(&suffix_stats);
+#endif
+
+    uint64_t udp_reassembled = udp_reassembly.reassembled;
+    uint64_t udp_reassembly_dropped = udp_reassembly.dropped;
+
 #ifndef __WIN32__
     struct rusage usage;
     getrusage(RUSAGE_SELF, &usage);
@@ -3729,6 +4349,38 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("rejected_conns", "%" PRIu64, (unsigned long long)stats.rejected_conns);
     APPEND_STAT("threads", "%d", settings.num_threads);
     APPEND_STAT("conn_yields", "%" PRIu64, (unsigned long long)thread_stats.conn_yields);
+    APPEND_STAT("udp_recv_calls", "%"PRIu64, thread_stats.udp_recv_calls);
+    APPEND_STAT("udp_datagrams_received", "%"PRIu64,
+                thread_stats.udp_datagrams_received);
+    APPEND_STAT("udp_send_calls", "%"PRIu64, thread_stats.udp_send_calls);
+    APPEND_STAT("udp_datagrams_sent", "%"PRIu64,
+                thread_stats.udp_datagrams_sent);
+    APPEND_STAT("udp_reassembled", "%"PRIu64, udp_reassembled);
+    APPEND_STAT("udp_reassembly_dropped", "%"PRIu64, udp_reassembly_dropped);
+    APPEND_STAT("value_bytes_copied", "%"PRIu64,
+                thread_stats.value_bytes_copied);
+    APPEND_STAT("value_bytes_read_inplace", "%"PRIu64,
+                thread_stats.value_bytes_read_inplace);
+    APPEND_STAT("response_flushes", "%"PRIu64, thread_stats.response_flushes);
+    APPEND_STAT("responses_per_flush", "%.2f",
+                thread_stats.response_flushes == 0 ? 0.0 :
+                (double)thread_stats.responses_flushed /
+                thread_stats.response_flushes);
+    APPEND_STAT("conn_buffer_bytes", "%"PRIu64, conn_buffer_bytes);
+#ifndef HAVE_UMEM_H
+    APPEND_STAT("conn_cache_magazine_hits", "%"PRIu64,
+                conn_cache_stats.magazine_hits);
+    APPEND_STAT("conn_cache_pool_refills", "%"PRIu64,
+                conn_cache_stats.pool_refills);
+    APPEND_STAT("conn_cache_pool_flushes", "%"PRIu64,
+                conn_cache_stats.pool_flushes);
+    APPEND_STAT("suffix_cache_magazine_hits", "%"PRIu64,
+                suffix_stats.magazine_hits);
+    APPEND_STAT("suffix_cache_pool_refills", "%"PRIu64,
+                suffix_stats.pool_refills);
+    APPEND_STAT("suffix_cache_pool_flushes", "%"PRIu64,
+                suffix_stats.pool_flushes);
+#endif
     STATS_UNLOCK();
 
     /*
@@ -3813,8 +4465,14 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
                 settings.detail_enabled ? "yes" : "no");
     APPEND_STAT("allow_detailed", "%s",
                 settings.allow_detailed ? "yes" : "no");
+    APPEND_STAT("prefix_stats_max", "%d", settings.prefix_stats_max);
     APPEND_STAT("reqs_per_event", "%d", settings.reqs_per_event);
     APPEND_STAT("reqs_per_tap_event", "%d", settings.reqs_per_tap_event);
+    APPEND_STAT("udp_batch", "%d", settings.udp_batch);
+    APPEND_STAT("udp_reassembly_max", "%lu",
+                (unsigned long)settings.udp_reassembly_max);
+    APPEND_STAT("reuseport", "%s", settings.reuseport ? "yes" : "no");
+    APPEND_STAT("io_uring", "%s", settings.io_uring ? "yes" : "no");
     APPEND_STAT("cas_enabled", "%s", settings.use_cas ? "yes" : "no");
     APPEND_STAT("tcp_backlog", "%d", settings.backlog);
     APPEND_STAT("binding_protocol", "%s",
@@ -3835,6 +4493,8 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("auth_required_sasl", "%s", settings.require_sasl ? "yes" : "no");
     APPEND_STAT("item_size_max", "%d", settings.item_size_max);
     APPEND_STAT("topkeys", "%d", settings.topkeys);
+    APPEND_STAT("topkeys_mode", "%s",
+                settings.topkeys_frequent ? "frequent" : "recent");
 
     for (EXTENSION_DAEMON_DESCRIPTOR *ptr = settings.extensions.daemons;
          ptr != NULL;
@@ -3910,6 +4570,8 @@ static char *process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return NULL;
     } else if (strcmp(subcommand, "aggregate") == 0) {
         server_stats(&append_stats, c, true);
+    } else if (strcmp(subcommand, "threads") == 0) {
+        threads_wakeup_stats(&append_stats, c);
     } else if (strcmp(subcommand, "topkeys") == 0) {
         topkeys_t *tk = get_independent_stats(c)->topkeys;
         if (tk != NULL) {
@@ -3918,6 +4580,11 @@ static char *process_stat(conn *c, token_t *tokens, const size_t ntokens) {
             out_string(c, "ERROR");
             return NULL;
         }
+    } else if (strcmp(subcommand, "latency") == 0) {
+        if (!latency_stats(append_stats, c)) {
+            out_string(c, "SERVER_ERROR out of memory writing stats");
+            return NULL;
+        }
     } else {
         /* getting here means that the subcommand is either engine specific or
            is invalid. query the engine and see. */
@@ -4012,25 +4679,42 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
     int i = c->ileft;
     item *it;
     token_t *key_token = &tokens[KEY_TOKEN];
+    item_lookup lookups[MAX_TOKENS];
+    int nlookups, curr;
     assert(c != NULL);
 
     do {
-        while(key_token->length != 0) {
-
-            key = key_token->value;
-            nkey = key_token->length;
-
-            if(nkey > KEY_MAX_LENGTH) {
+        /* Look up all keys in this set of tokens at once */
+        nlookups = 0;
+        for (token_t *t = key_token; t->length != 0; ++t) {
+            if (t->length > KEY_MAX_LENGTH) {
                 out_string(c, "CLIENT_ERROR bad command line format");
                 return NULL;
             }
+            lookups[nlookups].key = t->value;
+            lookups[nlookups].nkey = t->length;
+            lookups[nlookups].vbucket = 0;
+            lookups[nlookups].status = ENGINE_EWOULDBLOCK;
+            lookups[nlookups].item = NULL;
+            ++nlookups;
+        }
 
-            ENGINE_ERROR_CODE ret = c->aiostat;
+        curr = 0;
+        if (nlookups > 0) {
+            /* The engine notified us about the key it blocked on */
+            int first = (c->aiostat == ENGINE_SUCCESS) ? 0 : 1;
+            lookups[0].status = c->aiostat;
             c->aiostat = ENGINE_SUCCESS;
+            engine_get_multi(c, lookups + first, nlookups - first);
+        }
 
-            if (ret == ENGINE_SUCCESS) {
-                ret = settings.engine.v1->get(settings.engine.v0, c, &it, key, nkey, 0);
-            }
+        while(key_token->length != 0) {
+
+            key = key_token->value;
+            nkey = key_token->length;
+
+            ENGINE_ERROR_CODE ret = lookups[curr].status;
+            it = lookups[curr].item;
 
             switch (ret) {
             case ENGINE_EWOULDBLOCK:
@@ -4047,7 +4731,7 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
             }
 
             if (settings.detail_enabled) {
-                stats_prefix_record_get(key, nkey, NULL != it);
+                stats_prefix_record_get(c->thread->index, key, nkey, NULL != it);
             }
 
             if (it) {
@@ -4075,6 +4759,7 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
                 if (suffix == NULL) {
                     out_string(c, "SERVER_ERROR out of memory rebuilding suffix");
                     settings.engine.v1->release(settings.engine.v0, c, it);
+                    release_lookups(c, lookups + curr + 1, nlookups - curr - 1);
                     return NULL;
                 }
                 int suffix_len = snprintf(suffix, SUFFIX_SIZE,
@@ -4100,6 +4785,7 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
                   if (cas == NULL) {
                     out_string(c, "SERVER_ERROR out of memory making CAS suffix");
                     settings.engine.v1->release(settings.engine.v0, c, it);
+                    release_lookups(c, lookups + curr + 1, nlookups - curr - 1);
                     return NULL;
                   }
                   int cas_len = snprintf(cas, SUFFIX_SIZE, " %"PRIu64"\r\n",
@@ -4108,7 +4794,7 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
                       add_iov(c, info.key, info.nkey) != 0 ||
                       add_iov(c, suffix, suffix_len - 2) != 0 ||
                       add_iov(c, cas, cas_len) != 0 ||
-                      add_iov(c, info.value[0].iov_base, info.value[0].iov_len) != 0 ||
+                      add_item_value_iov(c, it, &info) != 0 ||
                       add_iov(c, "\r\n", 2) != 0)
                       {
                           settings.engine.v1->release(settings.engine.v0, c, it);
@@ -4120,7 +4806,7 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
                   if (add_iov(c, "VALUE ", 6) != 0 ||
                       add_iov(c, info.key, info.nkey) != 0 ||
                       add_iov(c, suffix, suffix_len) != 0 ||
-                      add_iov(c, info.value[0].iov_base, info.value[0].iov_len) != 0 ||
+                      add_item_value_iov(c, it, &info) != 0 ||
                       add_iov(c, "\r\n", 2) != 0)
                       {
                           settings.engine.v1->release(settings.engine.v0, c, it);
@@ -4147,6 +4833,12 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
             }
 
             key_token++;
+            curr++;
+        }
+
+        if (key_token->length != 0) {
+            /* We bailed out on the key at curr */
+            release_lookups(c, lookups + curr + 1, nlookups - curr - 1);
         }
 
         /*
@@ -4184,6 +4876,7 @@ static inline char* process_get_command(conn *c, token_t *tokens, size_t ntokens
         c->msgcurr = 0;
     }
 
+    LATENCY_DONE(c, LATENCY_GET, ENGINE_SUCCESS);
     return NULL;
 }
 
@@ -4233,7 +4926,7 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     }
 
     if (settings.detail_enabled) {
-        stats_prefix_record_set(key, nkey);
+        stats_prefix_record_set(c->thread->index, key, nkey);
     }
 
     ENGINE_ERROR_CODE ret = c->aiostat;
@@ -4241,9 +4934,9 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     c->ewouldblock = false;
 
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->allocate(settings.engine.v0, c,
-                                           &it, key, nkey,
-                                           vlen, htonl(flags), exptime);
+        LATENCY_ENGINE(c, ret = settings.engine.v1->allocate(settings.engine.v0,
+                                           c, &it, key, nkey,
+                                           vlen, htonl(flags), exptime));
     }
 
     item_info info = { .nvalue = 1 };
@@ -4255,9 +4948,14 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
             out_string(c, "SERVER_ERROR error getting item data");
             break;
         }
+        if (!set_item_read_iov(c, it, &info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            out_string(c, "SERVER_ERROR out of memory storing object");
+            c->write_and_go = conn_swallow;
+            c->sbytes = vlen + 2;
+            break;
+        }
         c->item = it;
-        c->ritem = info.value[0].iov_base;
-        c->rlbytes = vlen;
         c->store_op = store_op;
         conn_set_state(c, conn_nread);
         break;
@@ -4313,9 +5011,10 @@ static char* process_arithmetic_command(conn *c, token_t *tokens, const size_t n
     uint64_t cas;
     uint64_t result;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->arithmetic(settings.engine.v0, c, key, nkey,
+        LATENCY_ENGINE(c, ret = settings.engine.v1->arithmetic(settings.engine.v0,
+                                             c, key, nkey,
                                              incr, false, delta, 0, 0, &cas,
-                                             &result, 0);
+                                             &result, 0));
     }
 
     SFLOW_SAMPLE(incr ? SFMC_CMD_INCR : SFMC_CMD_DECR, c, key, nkey, 0, 0, ret);
@@ -4364,6 +5063,7 @@ static char* process_arithmetic_command(conn *c, token_t *tokens, const size_t n
         abort();
     }
 
+    LATENCY_DONE(c, incr ? LATENCY_INCR : LATENCY_DECR, ret);
     return NULL;
 }
 
@@ -4398,8 +5098,8 @@ static char *process_delete_command(conn *c, token_t *tokens,
     c->aiostat = ENGINE_SUCCESS;
     c->ewouldblock = false;
     if (ret == ENGINE_SUCCESS) {
-        ret = settings.engine.v1->remove(settings.engine.v0, c,
-                                         key, nkey, 0, 0);
+        LATENCY_ENGINE(c, ret = settings.engine.v1->remove(settings.engine.v0,
+                                                           c, key, nkey, 0, 0));
     }
 
     SFLOW_SAMPLE(SFMC_CMD_DELETE, c, key, nkey, 0, 0, ret);
@@ -4423,8 +5123,9 @@ static char *process_delete_command(conn *c, token_t *tokens,
     }
 
     if (ret != ENGINE_EWOULDBLOCK && settings.detail_enabled) {
-        stats_prefix_record_delete(key, nkey);
+        stats_prefix_record_delete(c->thread->index, key, nkey);
     }
+    LATENCY_DONE(c, LATENCY_DELETE, ret);
     return NULL;
 }
 
@@ -4481,10 +5182,9 @@ static char* process_command(conn *c, char *command) {
          */
         c->ewouldblock = false;
     } else {
-        c->msgcurr = 0;
-        c->msgused = 0;
-        c->iovused = 0;
-        if (add_msghdr(c) != 0) {
+        c->latency_start = latency_now();
+        c->latency_engine = 0;
+        if (conn_start_response(c) != 0) {
             out_string(c, "SERVER_ERROR out of memory preparing response");
             return NULL;
         }
@@ -4648,7 +5348,7 @@ static int try_read_command(conn *c) {
     assert(c->rbytes > 0);
 
     if (c->protocol == negotiating_prot || c->transport == udp_transport)  {
-        if ((unsigned char)c->rbuf[0] == (unsigned char)PROTOCOL_BINARY_REQ) {
+        if ((unsigned char)c->rcurr[0] == (unsigned char)PROTOCOL_BINARY_REQ) {
             c->protocol = binary_prot;
         } else {
             c->protocol = ascii_prot;
@@ -4721,10 +5421,7 @@ static int try_read_command(conn *c) {
                 return -1;
             }
 
-            c->msgcurr = 0;
-            c->msgused = 0;
-            c->iovused = 0;
-            if (add_msghdr(c) != 0) {
+            if (conn_start_response(c) != 0) {
                 out_string(c, "SERVER_ERROR out of memory");
                 return 0;
             }
@@ -4823,6 +5520,351 @@ static int try_read_command(conn *c) {
     return 1;
 }
 
+#ifdef USE_UDP_BATCH
+/*
+ * Make the next datagram of the batch the content of the read buffer,
+ * receiving a new batch if all of them were processed. The buffer of the
+ * datagram becomes the read buffer, and the old read buffer receives a
+ * datagram of the next batch. Only a read buffer of another size (grown
+ * for a reassembled request) has the datagram copied into it.
+ *
+ * Returns the length of the datagram, or -1 if there is none.
+ */
+static int udp_batch_receive(conn *c) {
+    struct udp_batch *b = c->udp_batch;
+
+    if (b->rx_next == b->rx_count) {
+        b->rx_count = b->rx_next = 0;
+        for (int ii = 0; ii < b->size; ++ii) {
+            b->rx_msgs[ii].msg_hdr.msg_namelen = sizeof(b->rx_addr[ii]);
+        }
+        int n = recvmmsg(c->sfd, b->rx_msgs, b->size, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            return -1;
+        }
+
+        uint64_t bytes = 0;
+        for (int ii = 0; ii < n; ++ii) {
+            bytes += b->rx_msgs[ii].msg_len;
+        }
+        struct thread_stats *thread_stats = get_thread_stats(c);
+        thread_stats_begin(thread_stats);
+        THREAD_STATS_ADD(thread_stats, udp_recv_calls, 1);
+        THREAD_STATS_ADD(thread_stats, udp_datagrams_received, n);
+        THREAD_STATS_ADD(thread_stats, bytes_read, bytes);
+        thread_stats_end(thread_stats);
+        b->rx_count = n;
+    }
+
+    int ii = b->rx_next++;
+    int len = b->rx_msgs[ii].msg_len;
+    if (c->rsize == UDP_READ_BUFFER_SIZE) {
+        char *buf = b->rx_iov[ii].iov_base;
+        b->rx_iov[ii].iov_base = c->rbuf;
+        c->rcurr = c->rbuf = buf;
+        c->rbytes = 0;
+    } else {
+        if (len > c->rsize) {
+            len = c->rsize;
+        }
+        memcpy(c->rbuf, b->rx_iov[ii].iov_base, len);
+    }
+    memcpy(&c->request_addr, &b->rx_addr[ii],
+           b->rx_msgs[ii].msg_hdr.msg_namelen);
+    c->request_addr_size = b->rx_msgs[ii].msg_hdr.msg_namelen;
+    return len;
+}
+
+/*
+ * Send the packets queued by udp_batch_transmit.
+ */
+static enum transmit_result udp_batch_flush(conn *c) {
+    struct udp_batch *b = c->udp_batch;
+
+    while (b->tx_sent < b->tx_count) {
+        int n = sendmmsg(c->sfd, b->tx_msgs + b->tx_sent,
+                         b->tx_count - b->tx_sent, 0);
+        if (n > 0) {
+            uint64_t bytes = 0;
+            for (int ii = 0; ii < n; ++ii) {
+                bytes += b->tx_msgs[b->tx_sent + ii].msg_len;
+            }
+            struct thread_stats *thread_stats = get_thread_stats(c);
+            thread_stats_begin(thread_stats);
+            THREAD_STATS_ADD(thread_stats, udp_send_calls, 1);
+            THREAD_STATS_ADD(thread_stats, udp_datagrams_sent, n);
+            THREAD_STATS_ADD(thread_stats, bytes_written, bytes);
+            thread_stats_end(thread_stats);
+            b->tx_sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+                if (settings.verbose > 0) {
+                    settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                            "Couldn't update event\n");
+                }
+                conn_set_state(c, conn_closing);
+                return TRANSMIT_HARD_ERROR;
+            }
+            return TRANSMIT_SOFT_ERROR;
+        } else if (errno != EINTR) {
+            /* Drop the packet that failed, like transmit() would */
+            if (settings.verbose > 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "Failed to write, and not due to blocking: %s",
+                                                strerror(errno));
+            }
+            b->tx_sent++;
+        }
+    }
+
+    b->tx_count = b->tx_sent = 0;
+    return TRANSMIT_COMPLETE;
+}
+
+/*
+ * Queue the packets of the response to be sent with the rest of the
+ * batch, sending the batch first if it is full.
+ */
+static enum transmit_result udp_batch_transmit(conn *c) {
+    struct udp_batch *b = c->udp_batch;
+
+    while (c->msgcurr < c->msgused) {
+        if (b->tx_count == b->size) {
+            enum transmit_result ret = udp_batch_flush(c);
+            if (ret != TRANSMIT_COMPLETE) {
+                return ret;
+            }
+        }
+
+        struct msghdr *m = &c->msglist[c->msgcurr];
+        int ii = b->tx_count++;
+        char *dst = b->tx_iov[ii].iov_base;
+        size_t len = 0;
+        for (int jj = 0; jj < m->msg_iovlen; ++jj) {
+            assert(len + m->msg_iov[jj].iov_len <= UDP_MAX_PAYLOAD_SIZE);
+            memcpy(dst + len, m->msg_iov[jj].iov_base, m->msg_iov[jj].iov_len);
+            len += m->msg_iov[jj].iov_len;
+        }
+        b->tx_iov[ii].iov_len = len;
+        memcpy(&b->tx_addr[ii], m->msg_name, m->msg_namelen);
+        b->tx_msgs[ii].msg_hdr.msg_namelen = m->msg_namelen;
+        m->msg_iovlen = 0;
+        c->msgcurr++;
+    }
+
+    return TRANSMIT_COMPLETE;
+}
+#endif
+
+/*
+ * Is there input that was read but not processed yet?
+ */
+static bool has_pending_input(conn *c) {
+    if (c->rbytes > 0) {
+        return true;
+    }
+#ifdef USE_UDP_BATCH
+    if (c->udp_batch != NULL &&
+        c->udp_batch->rx_next < c->udp_batch->rx_count) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+static void udp_request_free(struct udp_request *req) {
+    for (int ii = 0; ii < req->npackets; ++ii) {
+        free(req->packet[ii].iov_base);
+    }
+    free(req);
+}
+
+/*
+ * Remove a request from its bucket. Must be called with the mutex of the
+ * bucket held.
+ */
+static void udp_request_unlink(struct udp_request_bucket *bucket,
+                               struct udp_request *req) {
+    struct udp_request **prev = &bucket->requests;
+    while (*prev != req) {
+        prev = &(*prev)->next;
+    }
+    *prev = req->next;
+    __sync_sub_and_fetch(&udp_reassembly.nbytes, req->nbytes);
+}
+
+static void udp_request_drop(struct udp_request_bucket *bucket,
+                             struct udp_request *req) {
+    udp_request_unlink(bucket, req);
+    udp_request_free(req);
+    __sync_add_and_fetch(&udp_reassembly.dropped, 1);
+}
+
+/*
+ * Reserve memory for reassembly. Returns false if it would go over the
+ * limit.
+ */
+static bool udp_reassembly_reserve(size_t size) {
+    uint64_t nbytes = __sync_add_and_fetch(&udp_reassembly.nbytes, size);
+    if (nbytes > settings.udp_reassembly_max) {
+        __sync_sub_and_fetch(&udp_reassembly.nbytes, size);
+        return false;
+    }
+    return true;
+}
+
+static bool udp_reassembly_init(void) {
+    udp_reassembly.buckets = calloc(UDP_REASSEMBLY_BUCKETS,
+                                    sizeof(struct udp_request_bucket));
+    if (udp_reassembly.buckets == NULL) {
+        return false;
+    }
+    for (int ii = 0; ii < UDP_REASSEMBLY_BUCKETS; ++ii) {
+        pthread_mutex_init(&udp_reassembly.buckets[ii].mutex, NULL);
+    }
+    return true;
+}
+
+/*
+ * Drop the requests that didn't complete in time. Called by the clock.
+ */
+static void udp_reassembly_expire(void) {
+    if (udp_reassembly.buckets == NULL || udp_reassembly.nbytes == 0) {
+        return;
+    }
+
+    for (int ii = 0; ii < UDP_REASSEMBLY_BUCKETS; ++ii) {
+        struct udp_request_bucket *bucket = &udp_reassembly.buckets[ii];
+        if (bucket->requests == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&bucket->mutex);
+        struct udp_request *next = bucket->requests;
+        while (next != NULL) {
+            struct udp_request *r = next;
+            next = r->next;
+            if (r->started + UDP_REASSEMBLY_TIMEOUT < current_time) {
+                udp_request_drop(bucket, r);
+            }
+        }
+        pthread_mutex_unlock(&bucket->mutex);
+    }
+}
+
+/*
+ * Add a datagram of a multi-packet request (still in the read buffer) to
+ * the requests being reassembled. When it completes the request, the
+ * request is copied to the read buffer.
+ *
+ * Returns the length of the complete request, or -1.
+ */
+static int udp_reassemble(conn *c, int len) {
+    const unsigned char *buf = (unsigned char *)c->rbuf;
+    int seq = buf[2] * 256 + buf[3];
+    int npackets = buf[4] * 256 + buf[5];
+    struct udp_request *req = NULL;
+    struct udp_request *complete = NULL;
+
+    len -= UDP_HEADER_SIZE;
+
+    uint32_t hv = hash(&c->request_addr, c->request_addr_size,
+                       ((uint32_t)c->sfd << 16) ^ c->request_id);
+    struct udp_request_bucket *bucket =
+        &udp_reassembly.buckets[hv % UDP_REASSEMBLY_BUCKETS];
+
+    pthread_mutex_lock(&bucket->mutex);
+    for (req = bucket->requests; req != NULL; req = req->next) {
+        if (req->sfd == c->sfd && req->request_id == c->request_id &&
+            req->addrlen == c->request_addr_size &&
+            memcmp(&req->addr, &c->request_addr, req->addrlen) == 0) {
+            break;
+        }
+    }
+
+    if (npackets == 0 || seq >= npackets) {
+        /* Not a valid packet of the request */
+        if (req != NULL) {
+            udp_request_drop(bucket, req);
+        }
+        goto done;
+    }
+
+    if (req != NULL && req->npackets != npackets) {
+        /* The client must have started over */
+        udp_request_drop(bucket, req);
+        req = NULL;
+    }
+
+    if (req == NULL) {
+        size_t size = sizeof(*req) + npackets * sizeof(struct iovec);
+        if (!udp_reassembly_reserve(size)) {
+            __sync_add_and_fetch(&udp_reassembly.dropped, 1);
+            goto done;
+        }
+        if ((req = calloc(1, size)) == NULL) {
+            __sync_sub_and_fetch(&udp_reassembly.nbytes, size);
+            __sync_add_and_fetch(&udp_reassembly.dropped, 1);
+            goto done;
+        }
+        req->sfd = c->sfd;
+        memcpy(&req->addr, &c->request_addr, c->request_addr_size);
+        req->addrlen = c->request_addr_size;
+        req->request_id = c->request_id;
+        req->npackets = npackets;
+        req->started = current_time;
+        req->nbytes = size;
+        req->next = bucket->requests;
+        bucket->requests = req;
+    }
+
+    if (req->packet[seq].iov_base == NULL) {
+        void *ptr = NULL;
+        if (!udp_reassembly_reserve(len)) {
+            udp_request_drop(bucket, req);
+            goto done;
+        }
+        req->nbytes += len;
+        if ((ptr = malloc(len + 1)) == NULL) {
+            udp_request_drop(bucket, req);
+            goto done;
+        }
+        memcpy(ptr, buf + UDP_HEADER_SIZE, len);
+        req->packet[seq].iov_base = ptr;
+        req->packet[seq].iov_len = len;
+        req->received++;
+        req->length += len;
+    }
+
+    if (req->received == req->npackets) {
+        udp_request_unlink(bucket, req);
+        __sync_add_and_fetch(&udp_reassembly.reassembled, 1);
+        complete = req;
+    }
+
+done:
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (complete == NULL) {
+        return -1;
+    }
+
+    int ret = -1;
+    c->rbytes = 0; /* the request replaces the buffer content */
+    if (complete->length > c->rsize) {
+        conn_resize_rbuf(c, complete->length);
+    }
+    if (complete->length <= c->rsize) {
+        ret = 0;
+        for (int ii = 0; ii < complete->npackets; ++ii) {
+            memcpy(c->rbuf + ret, complete->packet[ii].iov_base,
+                   complete->packet[ii].iov_len);
+            ret += complete->packet[ii].iov_len;
+        }
+    }
+    udp_request_free(complete);
+    return ret;
+}
+
 /*
  * read a UDP request.
  */
@@ -4831,28 +5873,46 @@ static enum try_read_result try_read_udp(conn *c) {
 
     assert(c != NULL);
 
-    c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, (struct sockaddr *)&c->request_addr, &c->request_addr_size);
+#ifdef USE_UDP_BATCH
+    if (c->udp_batch != NULL) {
+        /* The bytes read are counted per batch */
+        res = udp_batch_receive(c);
+    } else
+#endif
+    {
+        c->request_addr_size = sizeof(c->request_addr);
+        res = recvfrom(c->sfd, c->rbuf, c->rsize, 0,
+                       (struct sockaddr *)&c->request_addr,
+                       &c->request_addr_size);
+        if (res > 0) {
+            STATS_ADD(c, bytes_read, res);
+        }
+    }
+
     if (res > 8) {
         unsigned char *buf = (unsigned char *)c->rbuf;
-        STATS_ADD(c, bytes_read, res);
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
 
-        /* If this is a multi-packet request, drop it. */
         if (buf[4] != 0 || buf[5] != 1) {
-            out_string(c, "SERVER_ERROR multi-packet request not supported");
-            return READ_NO_DATA_RECEIVED;
+            if (settings.udp_reassembly_max == 0) {
+                out_string(c, "SERVER_ERROR multi-packet request not supported");
+                return READ_NO_DATA_RECEIVED;
+            }
+            res = udp_reassemble(c, res);
+            if (res <= 0) {
+                return READ_NO_DATA_RECEIVED;
+            }
+            c->rbytes = res;
+            c->rcurr = c->rbuf;
+            return READ_DATA_RECEIVED;
         }
 
-        /* Don't care about any of the rest of the header. */
-        res -= 8;
-        memmove(c->rbuf, c->rbuf + 8, res);
-
-        c->rbytes += res;
-        c->rcurr = c->rbuf;
+        /* Don't care about any of the rest of the header; the request
+         * is parsed where it was received. */
+        c->rbytes = res - UDP_HEADER_SIZE;
+        c->rcurr = c->rbuf + UDP_HEADER_SIZE;
         return READ_DATA_RECEIVED;
     }
     return READ_NO_DATA_RECEIVED;
@@ -4870,12 +5930,37 @@ static enum try_read_result try_read_udp(conn *c) {
  *
  * @return enum try_read_result
  */
+/*
+ * Does the input buffer start with the header of a binary packet that
+ * doesn't fit? Growing the buffer for it would only make conn_nread copy
+ * more of the value, which it reads straight into the item otherwise.
+ */
+static bool large_bin_packet(conn *c) {
+    /* The first packet on a connection decides about its protocol */
+    if (c->protocol == ascii_prot ||
+        c->rbytes < sizeof(protocol_binary_request_header) ||
+        (unsigned char)c->rcurr[0] != (unsigned char)PROTOCOL_BINARY_REQ) {
+        return false;
+    }
+    protocol_binary_request_header *req = (void *)c->rcurr;
+    return sizeof(*req) + ntohl(req->request.bodylen) > c->rsize;
+}
+
 static enum try_read_result try_read_network(conn *c) {
     enum try_read_result gotdata = READ_NO_DATA_RECEIVED;
     int res;
     int num_allocs = 0;
     assert(c != NULL);
 
+    if (!conn_acquire_buffers(c)) {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                            "Couldn't allocate input buffer\n");
+        }
+        conn_set_state(c, conn_closing);
+        return READ_MEMORY_ERROR;
+    }
+
     if (c->rcurr != c->rbuf) {
         if (c->rbytes != 0) /* otherwise there's nothing to copy */
             memmove(c->rbuf, c->rcurr, c->rbytes);
@@ -4884,12 +5969,11 @@ static enum try_read_result try_read_network(conn *c) {
 
     while (1) {
         if (c->rbytes >= c->rsize) {
-            if (num_allocs == 4) {
+            if (num_allocs == 4 || large_bin_packet(c)) {
                 return gotdata;
             }
             ++num_allocs;
-            char *new_rbuf = realloc(c->rbuf, c->rsize * 2);
-            if (!new_rbuf) {
+            if (!conn_resize_rbuf(c, c->rsize * 2)) {
                 if (settings.verbose > 0) {
                  settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                           "Couldn't realloc input buffer\n");
@@ -4899,8 +5983,6 @@ static enum try_read_result try_read_network(conn *c) {
                 c->write_and_go = conn_closing;
                 return READ_MEMORY_ERROR;
             }
-            c->rcurr = c->rbuf = new_rbuf;
-            c->rsize *= 2;
         }
 
         int avail = c->rsize - c->rbytes;
@@ -4925,6 +6007,9 @@ static enum try_read_result try_read_network(conn *c) {
             return READ_ERROR;
         }
     }
+    if (c->rbytes > c->rpeak) {
+        c->rpeak = c->rbytes;
+    }
     return gotdata;
 }
 
@@ -4980,6 +6065,262 @@ bool update_event(conn *c, const int new_flags) {
     return register_event(c, NULL);
 }
 
+/*
+ * Remove the iovec entries written by a sendmsg() from the list of
+ * pending writes.
+ */
+static void msghdr_written(conn *c, struct msghdr *m, ssize_t res) {
+    STATS_ADD(c, bytes_written, res);
+
+    /* We've written some of the data. Remove the completed
+       iovec entries from the list of pending writes. */
+    while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
+        res -= m->msg_iov->iov_len;
+        m->msg_iovlen--;
+        m->msg_iov++;
+    }
+
+    /* Might have written just part of the last iovec entry;
+       adjust it so the next write will do the rest. */
+    if (res > 0) {
+        m->msg_iov->iov_base = (caddr_t)m->msg_iov->iov_base + res;
+        m->msg_iov->iov_len -= res;
+    }
+}
+
+#ifdef USE_IO_URING
+/*
+ * With io_uring the worker threads don't wait for a TCP connection to
+ * become readable or writable. They queue the receive or send itself on
+ * the ring of the thread, and resume the state machine of the connection
+ * from the completion. Everything queued while handling one batch of
+ * completions is submitted with a single system call.
+ */
+enum uring_op {
+    URING_RECV,
+    URING_SENDMSG
+};
+
+struct uring_req {
+    conn *c;
+    enum uring_op op;
+};
+
+static cache_t *uring_req_cache;
+
+static bool uring_conn(conn *c) {
+    return c->thread != NULL && c->thread->ring != NULL &&
+        !IS_UDP(c->transport);
+}
+
+static struct io_uring_sqe *uring_prep(conn *c, enum uring_op op) {
+    assert(c->uring_req == NULL);
+
+    /* Completions resume the connection, not libevent */
+    if (!update_event(c, 0)) {
+        return NULL;
+    }
+
+    struct uring_req *req = cache_alloc(uring_req_cache);
+    if (req == NULL) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(c->thread->ring);
+    if (sqe == NULL) {
+        cache_free(uring_req_cache, req);
+        return NULL;
+    }
+
+    req->c = c;
+    req->op = op;
+    c->uring_req = req;
+    sqe->fd = c->sfd;
+    sqe->user_data = (uintptr_t)req;
+    return sqe;
+}
+
+/*
+ * Queue a receive into one of the buffers of the ring.
+ * Returns false if the connection should wait for libevent instead
+ */
+static bool uring_recv(conn *c) {
+    struct io_uring_sqe *sqe = uring_prep(c, URING_RECV);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->len = URING_BUFFER_SIZE;
+    return true;
+}
+
+/*
+ * Queue sending a message of the response.
+ * Returns false if the connection should call sendmsg() instead
+ */
+static bool uring_sendmsg(conn *c, struct msghdr *m) {
+    struct io_uring_sqe *sqe = uring_prep(c, URING_SENDMSG);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uintptr_t)m;
+    sqe->len = 1;
+    return true;
+}
+
+/*
+ * Ask the kernel to cancel the operation in flight for a connection being
+ * closed. The kernel may use the buffers and items of the connection until
+ * the operation completes, so the operation holds a reference on it that
+ * keeps it in conn_pending_close until the completion arrives.
+ */
+static void uring_cancel(conn *c) {
+    struct uring_req *req = c->uring_req;
+    if (req == NULL) {
+        return;
+    }
+    ++c->refcount;
+
+    /* uring_get_sqe() submits what is queued to make room if it has to */
+    struct io_uring_sqe *sqe = uring_get_sqe(c->thread->ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)req;
+        sqe->user_data = 0;
+    } else {
+        /* Make the operation fail instead of waiting for the client */
+        shutdown(c->sfd, SHUT_RDWR);
+    }
+}
+
+/*
+ * Drop the reference the operation held on a connection that was closed
+ * while it was in flight, and finish the close if nothing else holds one.
+ */
+static void uring_closed(conn *c) {
+    c->uring_req = NULL;
+    if (--c->refcount == 1 && c->state == conn_pending_close) {
+        conn_close(c);
+    }
+}
+
+/*
+ * Append received data to the input buffer of a connection.
+ * Returns false if the buffer couldn't grow (c->state is set)
+ */
+static bool uring_received(conn *c, const char *data, int len) {
+    if (!conn_acquire_buffers(c)) {
+        conn_set_state(c, conn_closing);
+        return false;
+    }
+
+    if (c->rcurr != c->rbuf) {
+        if (c->rbytes != 0) /* otherwise there's nothing to copy */
+            memmove(c->rbuf, c->rcurr, c->rbytes);
+        c->rcurr = c->rbuf;
+    }
+
+    if (c->rbytes + len > c->rsize) {
+        if (!conn_resize_rbuf(c, c->rbytes + len)) {
+            if (settings.verbose > 0) {
+             settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                      "Couldn't realloc input buffer\n");
+            }
+            c->rbytes = 0; /* ignore what we read */
+            out_string(c, "SERVER_ERROR out of memory reading request");
+            c->write_and_go = conn_closing;
+            return false;
+        }
+    }
+
+    memcpy(c->rbuf + c->rbytes, data, len);
+    c->rbytes += len;
+    if (c->rbytes > c->rpeak) {
+        c->rpeak = c->rbytes;
+    }
+    STATS_ADD(c, bytes_read, len);
+    return true;
+}
+
+static void uring_completed(conn *c, enum uring_op op, int res,
+                            const char *data) {
+    if (op == URING_RECV) {
+        if (res > 0) {
+            if (uring_received(c, data, res)) {
+                conn_set_state(c, conn_parse_cmd);
+            }
+        } else if (res == -ENOBUFS) {
+            /* All buffers of the ring are in use, read it ourselves */
+            conn_set_state(c, conn_read);
+        } else {
+            conn_set_state(c, conn_closing);
+        }
+    } else {
+        if (res > 0) {
+            msghdr_written(c, &c->msglist[c->msgcurr], res);
+        } else {
+            if (settings.verbose > 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                                                "Failed to write, and not due to blocking: %s",
+                                                strerror(-res));
+            }
+            conn_set_state(c, conn_closing);
+        }
+    }
+}
+
+/*
+ * Handle the completions on the ring of a worker thread, and submit what
+ * the connections queued meanwhile.
+ */
+void uring_event_handler(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    struct io_uring_cqe *cqe;
+    (void)fd;
+    (void)which;
+
+    me->ring_dispatching = true;
+    while ((cqe = uring_peek_cqe(me->ring)) != NULL) {
+        struct uring_req *req = (void *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(me->ring);
+
+        if (req == NULL) {
+            /* the result of a cancel */
+            continue;
+        }
+
+        conn *c = req->c;
+        enum uring_op op = req->op;
+        cache_free(uring_req_cache, req);
+
+        if (c->sfd == INVALID_SOCKET) {
+            if (flags & IORING_CQE_F_BUFFER) {
+                uring_buffer_release(me->ring, flags);
+            }
+            uring_closed(c);
+            continue;
+        }
+
+        c->uring_req = NULL;
+        uring_completed(c, op, res, (flags & IORING_CQE_F_BUFFER) ?
+                        uring_buffer(me->ring, flags) : NULL);
+        if (flags & IORING_CQE_F_BUFFER) {
+            uring_buffer_release(me->ring, flags);
+        }
+        conn_handle_event(c, c->sfd, op == URING_RECV ? EV_READ : EV_WRITE,
+                          op == URING_SENDMSG);
+    }
+    me->ring_dispatching = false;
+
+    uring_submit(me->ring);
+}
+#endif
+
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
  *
@@ -4992,6 +6333,12 @@ bool update_event(conn *c, const int new_flags) {
 static enum transmit_result transmit(conn *c) {
     assert(c != NULL);
 
+#ifdef USE_UDP_BATCH
+    if (c->udp_batch != NULL) {
+        return udp_batch_transmit(c);
+    }
+#endif
+
     if (c->msgcurr < c->msgused &&
             c->msglist[c->msgcurr].msg_iovlen == 0) {
         /* Finished writing the current msg; advance to the next. */
@@ -5001,24 +6348,15 @@ static enum transmit_result transmit(conn *c) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
+#ifdef USE_IO_URING
+        if (uring_conn(c) && uring_sendmsg(c, m)) {
+            return TRANSMIT_SOFT_ERROR;
+        }
+#endif
+
         res = sendmsg(c->sfd, m, 0);
         if (res > 0) {
-            STATS_ADD(c, bytes_written, res);
-
-            /* We've written some of the data. Remove the completed
-               iovec entries from the list of pending writes. */
-            while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
-                res -= m->msg_iov->iov_len;
-                m->msg_iovlen--;
-                m->msg_iov++;
-            }
-
-            /* Might have written just part of the last iovec entry;
-               adjust it so the next write will do the rest. */
-            if (res > 0) {
-                m->msg_iov->iov_base = (caddr_t)m->msg_iov->iov_base + res;
-                m->msg_iov->iov_len -= res;
-            }
+            msghdr_written(c, m, res);
             return TRANSMIT_INCOMPLETE;
         }
         if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
@@ -5062,7 +6400,7 @@ bool conn_listening(conn *c)
                 settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
                                                 "Too many open connections\n");
             }
-            disable_listen();
+            disable_listen(c->thread);
         } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                             "Failed to accept new client: %s\n",
@@ -5095,8 +6433,14 @@ bool conn_listening(conn *c)
         return false;
     }
 
-    dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
-                      DATA_BUFFER_SIZE, tcp_transport);
+    if (c->thread != NULL) {
+        /* SO_REUSEPORT listener: serve the client on this worker */
+        dispatch_conn_local(c->thread, sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                            DATA_BUFFER_SIZE, tcp_transport);
+    } else {
+        dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                          DATA_BUFFER_SIZE, tcp_transport);
+    }
 
     return false;
 }
@@ -5157,18 +6501,56 @@ bool conn_ship_log(conn *c) {
         }
     }
 
-    if (!update_event(c, mask)) {
-        if (settings.verbose > 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_INFO,
-                                            c, "Couldn't update event\n");
-        }
-        conn_set_state(c, conn_closing);
+    if (!update_event(c, mask)) {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_INFO,
+                                            c, "Couldn't update event\n");
+        }
+        conn_set_state(c, conn_closing);
+    }
+
+    return cont;
+}
+
+bool conn_waiting(conn *c) {
+    if (c->iovparked > 0) {
+        /* Send the parked responses before waiting for more input */
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+        return true;
+    }
+
+    if (!IS_UDP(c->transport) && c->rbytes == 0) {
+        /* Don't hold on to buffers until the next request arrives */
+        conn_release_buffers(c);
+    }
+
+#ifdef USE_UDP_BATCH
+    if (c->udp_batch != NULL) {
+        if (has_pending_input(c)) {
+            /* The socket won't tell about datagrams received already */
+            conn_set_state(c, conn_read);
+            return true;
+        }
+        /* Send the responses to the whole batch before waiting */
+        switch (udp_batch_flush(c)) {
+        case TRANSMIT_SOFT_ERROR:
+            return false;
+        case TRANSMIT_HARD_ERROR:
+            return true;
+        default:
+            break;
+        }
+    }
+#endif
+
+#ifdef USE_IO_URING
+    if (uring_conn(c) && uring_recv(c)) {
+        conn_set_state(c, conn_read);
+        return false;
     }
+#endif
 
-    return cont;
-}
-
-bool conn_waiting(conn *c) {
     if (!update_event(c, EV_READ | EV_PERSIST)) {
         if (settings.verbose > 0) {
             settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -5217,7 +6599,8 @@ bool conn_new_cmd(conn *c) {
         reset_cmd_handler(c);
     } else {
         STATS_NOKEY(c, conn_yields);
-        if (c->rbytes > 0) {
+        /* A connection resumed by io_uring isn't waiting for any event */
+        if (has_pending_input(c) || c->ev_flags == 0) {
             /* We have already read in data into the input buffer,
                so libevent will most likely not signal read events
                on the socket (unless more data is available. As a
@@ -5293,9 +6676,68 @@ bool conn_swallow(conn *c) {
 
 }
 
+/*
+ * Read the rest of a value straight into the memory of the item. Data
+ * following the value (the next requests) goes to the input buffer,
+ * which is empty at this point.
+ *
+ * Returns the result of readv()
+ */
+static ssize_t read_value(conn *c) {
+    struct iovec iov[VALUE_READ_IOV_MAX + 1];
+    int iovcnt = 0;
+
+    assert(c->rbytes == 0);
+    iov[iovcnt].iov_base = c->ritem;
+    iov[iovcnt++].iov_len = c->rlbytes;
+    for (int ii = 0; ii < c->riovcnt && iovcnt < VALUE_READ_IOV_MAX; ++ii) {
+        iov[iovcnt++] = c->riov[ii];
+    }
+    if (iovcnt == c->riovcnt + 1) {
+        c->rcurr = c->rbuf;
+        iov[iovcnt].iov_base = c->rbuf;
+        iov[iovcnt++].iov_len = c->rsize;
+    }
+
+    ssize_t res = readv(c->sfd, iov, iovcnt);
+    if (res <= 0) {
+        return res;
+    }
+
+    size_t left = res;
+    while (left > 0 && c->rlbytes > 0) {
+        uint32_t n = left < c->rlbytes ? left : c->rlbytes;
+        c->ritem += n;
+        c->rlbytes -= n;
+        left -= n;
+        if (c->rlbytes == 0 && c->riovcnt > 0) {
+            c->ritem = c->riov->iov_base;
+            c->rlbytes = c->riov->iov_len;
+            c->riov++;
+            c->riovcnt--;
+        }
+    }
+    c->rbytes = left;
+
+    struct thread_stats *thread_stats = get_thread_stats(c);
+    thread_stats_begin(thread_stats);
+    THREAD_STATS_ADD(thread_stats, bytes_read, res);
+    THREAD_STATS_ADD(thread_stats, value_bytes_read_inplace, res - left);
+    thread_stats_end(thread_stats);
+    return res;
+}
+
 bool conn_nread(conn *c) {
     ssize_t res;
 
+    if (c->rlbytes == 0 && c->riovcnt > 0) {
+        /* On to the next piece of the value */
+        c->ritem = c->riov->iov_base;
+        c->rlbytes = c->riov->iov_len;
+        c->riov++;
+        c->riovcnt--;
+    }
+
     if (c->rlbytes == 0) {
         LIBEVENT_THREAD *t = c->thread;
         LOCK_THREAD(t);
@@ -5313,12 +6755,18 @@ bool conn_nread(conn *c) {
         UNLOCK_THREAD(t);
         return !block;
     }
+    /* The value of an item, or a part of a packet in the input buffer? */
+    bool value = c->ritem < c->rbuf || c->ritem >= c->rbuf + c->rsize;
+
     /* first check if we have leftovers in the conn_read buffer */
     if (c->rbytes > 0) {
         uint32_t tocopy = c->rbytes > c->rlbytes ? c->rlbytes : c->rbytes;
         if (c->ritem != c->rcurr) {
             memmove(c->ritem, c->rcurr, tocopy);
         }
+        if (value) {
+            STATS_ADD(c, value_bytes_copied, tocopy);
+        }
         c->ritem += tocopy;
         c->rlbytes -= tocopy;
         c->rcurr += tocopy;
@@ -5329,15 +6777,22 @@ bool conn_nread(conn *c) {
     }
 
     /*  now try reading from the socket */
-    res = recv(c->sfd, c->ritem, c->rlbytes, 0);
-    if (res > 0) {
-        STATS_ADD(c, bytes_read, res);
-        if (c->rcurr == c->ritem) {
-            c->rcurr += res;
+    if (value) {
+        res = read_value(c);
+        if (res > 0) {
+            return true;
+        }
+    } else {
+        res = recv(c->sfd, c->ritem, c->rlbytes, 0);
+        if (res > 0) {
+            STATS_ADD(c, bytes_read, res);
+            if (c->rcurr == c->ritem) {
+                c->rcurr += res;
+            }
+            c->ritem += res;
+            c->rlbytes -= res;
+            return true;
         }
-        c->ritem += res;
-        c->rlbytes -= res;
-        return true;
     }
     if (res == 0) { /* end of stream */
         conn_set_state(c, conn_closing);
@@ -5376,7 +6831,8 @@ bool conn_write(conn *c) {
      * assemble it into a msgbuf list (this will be a single-entry
      * list for TCP or a two-entry list for UDP).
      */
-    if (c->iovused == 0 || (IS_UDP(c->transport) && c->iovused == 1)) {
+    if (c->iovused == c->iovparked ||
+        (IS_UDP(c->transport) && c->iovused == 1)) {
         if (add_iov(c, c->wcurr, c->wbytes) != 0) {
             if (settings.verbose > 0) {
                 settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -5390,6 +6846,126 @@ bool conn_write(conn *c) {
     return conn_mwrite(c);
 }
 
+/*
+ * Can the binary response just built wait for the responses to the
+ * requests following it? It may only refer to wbuf and the item in
+ * c->item, which excludes error responses (written from the stack).
+ */
+static bool bin_response_parkable(conn *c) {
+    protocol_binary_response_header *header = (void *)c->wbuf;
+    if (header->response.status != 0) {
+        return false;
+    }
+
+    switch (c->cmd) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+    case PROTOCOL_BINARY_CMD_NOOP:
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Keep the response just built to be sent along with the responses to
+ * the requests following it in the input buffer, as long as the
+ * connection may process more requests in this event. The parts of the
+ * response in wbuf are copied to pbuf, and its item is kept in the item
+ * list until the responses are sent.
+ *
+ * Returns true if the response was parked (c->state is set)
+ */
+static bool conn_park_response(conn *c) {
+    if (c->state != conn_mwrite || c->protocol != binary_prot ||
+        IS_UDP(c->transport) || c->thread == tap_thread ||
+        c->rbytes == 0 || c->nevents <= 0 ||
+        c->write_and_go != conn_new_cmd || c->write_and_free != NULL ||
+        !bin_response_parkable(c)) {
+        return false;
+    }
+
+    uint32_t nbytes = 0;
+    for (int ii = c->iovparked; ii < c->iovused; ++ii) {
+        char *base = c->iov[ii].iov_base;
+        if (base >= c->wbuf && base < c->wbuf + c->wsize) {
+            nbytes += c->iov[ii].iov_len;
+        }
+    }
+    if (c->pbytes + nbytes > DATA_BUFFER_SIZE) {
+        return false;
+    }
+    if (c->pbuf == NULL &&
+        (c->pbuf = conn_buffer_alloc(DATA_BUFFER_SIZE)) == NULL) {
+        return false;
+    }
+
+    if (c->item != NULL) {
+        if (c->ileft == 0) {
+            c->icurr = c->ilist;
+        }
+        if (c->icurr + c->ileft == c->ilist + c->isize) {
+            item **ptr = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+            if (ptr == NULL) {
+                return false;
+            }
+            c->icurr = ptr + (c->icurr - c->ilist);
+            c->ilist = ptr;
+            c->isize *= 2;
+        }
+        c->icurr[c->ileft++] = c->item;
+        c->item = NULL;
+    }
+
+    for (int ii = c->iovparked; ii < c->iovused; ++ii) {
+        char *base = c->iov[ii].iov_base;
+        if (base >= c->wbuf && base < c->wbuf + c->wsize) {
+            memcpy(c->pbuf + c->pbytes, base, c->iov[ii].iov_len);
+            c->iov[ii].iov_base = c->pbuf + c->pbytes;
+            c->pbytes += c->iov[ii].iov_len;
+        }
+    }
+
+    c->iovparked = c->iovused;
+    c->msgparked = c->msgused;
+    c->parked_iovlen = c->msglist[c->msgused - 1].msg_iovlen;
+    c->parked_msgbytes = c->msgbytes;
+    c->responses++;
+    conn_set_state(c, conn_new_cmd);
+    return true;
+}
+
+/*
+ * All responses were sent; release what they referred to.
+ */
+static void conn_flushed(conn *c) {
+    while (c->ileft > 0) {
+        item *it = *(c->icurr);
+        settings.engine.v1->release(settings.engine.v0, c, it);
+        c->icurr++;
+        c->ileft--;
+    }
+    c->pbytes = 0;
+    c->flushing = false;
+
+    struct thread_stats *thread_stats = get_thread_stats(c);
+    thread_stats_begin(thread_stats);
+    THREAD_STATS_ADD(thread_stats, response_flushes, 1);
+    THREAD_STATS_ADD(thread_stats, responses_flushed, c->responses);
+    thread_stats_end(thread_stats);
+    c->responses = 0;
+}
+
 bool conn_mwrite(conn *c) {
     if (IS_UDP(c->transport) && c->msgcurr == 0 && build_udp_headers(c) != 0) {
         if (settings.verbose > 0) {
@@ -5400,15 +6976,23 @@ bool conn_mwrite(conn *c) {
         return true;
     }
 
+    if (!c->flushing) {
+        if (c->iovused > c->iovparked) {
+            if (conn_park_response(c)) {
+                return true;
+            }
+            c->responses++;
+        }
+        /* Send all parked responses along with this one */
+        c->iovparked = 0;
+        c->msgparked = 0;
+        c->flushing = true;
+    }
+
     switch (transmit(c)) {
     case TRANSMIT_COMPLETE:
+        conn_flushed(c);
         if (c->state == conn_mwrite) {
-            while (c->ileft > 0) {
-                item *it = *(c->icurr);
-                settings.engine.v1->release(settings.engine.v0, c, it);
-                c->icurr++;
-                c->ileft--;
-            }
             while (c->suffixleft > 0) {
                 char *suffix = *(c->suffixcurr);
                 cache_free(c->thread->suffix_cache, suffix);
@@ -5490,6 +7074,9 @@ bool conn_closing(conn *c) {
 
     // We don't want any network notifications anymore..
     unregister_event(c);
+#ifdef USE_IO_URING
+    uring_cancel(c);
+#endif
     safe_close(c->sfd);
     c->sfd = INVALID_SOCKET;
 
@@ -5543,10 +7130,13 @@ bool conn_setup_tap_stream(conn *c) {
     return true;
 }
 
-void event_handler(const int fd, const short which, void *arg) {
-    conn *c;
-
-    c = (conn *)arg;
+/*
+ * Drive the state machine of a connection after an event. "resume" is
+ * true if the connection continues with the requests of the previous
+ * event (after io_uring sent a response).
+ */
+static void conn_handle_event(conn *c, const int fd, const short which,
+                              bool resume) {
     assert(c != NULL);
 
     if (memcached_shutdown) {
@@ -5571,9 +7161,11 @@ void event_handler(const int fd, const short which, void *arg) {
 
     perform_callbacks(ON_SWITCH_CONN, c, c);
 
-    c->nevents = settings.reqs_per_event;
-    if (c->state == conn_ship_log) {
-        c->nevents = settings.reqs_per_tap_event;
+    if (!resume) {
+        c->nevents = settings.reqs_per_event;
+        if (c->state == conn_ship_log) {
+            c->nevents = settings.reqs_per_tap_event;
+        }
     }
 
     LIBEVENT_THREAD *thr = c->thread;
@@ -5629,11 +7221,20 @@ void event_handler(const int fd, const short which, void *arg) {
         finalize_list(pending_close, n_pending_close);
         UNLOCK_THREAD(thr);
     }
+
+#ifdef USE_IO_URING
+    if (thr != NULL && thr->ring != NULL && !thr->ring_dispatching) {
+        uring_submit(thr->ring);
+    }
+#endif
+}
+
+void event_handler(const int fd, const short which, void *arg) {
+    conn_handle_event((conn *)arg, fd, which, false);
 }
 
 static void dispatch_event_handler(int fd, short which, void *arg) {
-    char buffer[80];
-    ssize_t nr = recv(fd, buffer, sizeof(buffer), 0);
+    int nr = drain_notification_pipe(fd);
 
     if (nr != -1 && is_listen_disabled()) {
         bool enable = false;
@@ -5645,14 +7246,9 @@ static void dispatch_event_handler(int fd, short which, void *arg) {
         }
         pthread_mutex_unlock(&listen_state.mutex);
         if (enable) {
-            conn *next;
-            for (next = listen_conn; next; next = next->next) {
-                update_event(next, EV_READ | EV_PERSIST);
-                if (listen(next->sfd, settings.backlog) != 0) {
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                    "listen() failed",
-                                                    strerror(errno));
-                }
+            set_listen_events(listen_conn, true);
+            if (settings.reuseport) {
+                notify_listen_threads();
             }
         }
     }
@@ -5719,6 +7315,117 @@ static void maximize_sndbuf(const int sfd) {
 
 
 
+/*
+ * Applies the socket options memcached uses on its listening sockets.
+ * Returns -1 if the socket can't be used.
+ */
+static int set_socket_options(SOCKET sfd, int family,
+                              enum network_transport transport) {
+    int flags = 1;
+    int error;
+    struct linger ling = {0, 0};
+
+#ifdef IPV6_V6ONLY
+    if (family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(IPV6_V6ONLY): %s",
+                                            strerror(errno));
+            return -1;
+        }
+    }
+#endif
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    if (IS_UDP(transport)) {
+        maximize_sndbuf(sfd);
+    } else {
+        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_KEEPALIVE): %s",
+                                            strerror(errno));
+        }
+
+        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_LINGER): %s",
+                                            strerror(errno));
+        }
+
+        error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_NODELAY): %s",
+                                            strerror(errno));
+        }
+    }
+
+#ifdef SO_REUSEPORT
+    if (settings.reuseport && !IS_UDP(transport)) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_REUSEPORT): %s",
+                                            strerror(errno));
+            settings.reuseport = false;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Hands a listening socket bound with SO_REUSEPORT to a worker thread and
+ * opens one more listener on the same address for each of the remaining
+ * workers, so the kernel spreads new connections across them and they are
+ * accepted without going through the dispatcher.
+ */
+static int server_socket_reuseport(SOCKET sfd, struct addrinfo *ai,
+                                   enum network_transport transport) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int ii;
+
+    /* bind to the port picked by the kernel if we asked for port 0 */
+    if (getsockname(sfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "getsockname(): %s",
+                                        strerror(errno));
+        return 1;
+    }
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        if (ii > 0) {
+            if ((sfd = new_socket(ai)) == INVALID_SOCKET) {
+                return 1;
+            }
+            if (set_socket_options(sfd, ai->ai_family, transport) != 0 ||
+                bind(sfd, (struct sockaddr *)&addr, addrlen) == SOCKET_ERROR ||
+                listen(sfd, settings.backlog) == SOCKET_ERROR) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "Failed to create SO_REUSEPORT listener: %s",
+                                                strerror(errno));
+                safe_close(sfd);
+                return 1;
+            }
+        }
+
+        /* this is guaranteed to hit all threads because we round-robin */
+        dispatch_conn_new(sfd, conn_listening, EV_READ | EV_PERSIST, 1,
+                          transport);
+        STATS_LOCK();
+        ++stats.curr_conns;
+        ++stats.daemon_conns;
+        STATS_UNLOCK();
+    }
+
+    return 0;
+}
+
 /**
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -5733,7 +7440,6 @@ static int server_socket(const char *interface,
                          enum network_transport transport,
                          FILE *portnumber_file) {
     int sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints = { .ai_flags = AI_PASSIVE,
@@ -5741,7 +7447,6 @@ static int server_socket(const char *interface,
     char port_buf[NI_MAXSERV];
     int error;
     int success = 0;
-    int flags =1;
 
     hints.ai_socktype = IS_UDP(transport) ? SOCK_DGRAM : SOCK_STREAM;
 
@@ -5770,43 +7475,9 @@ static int server_socket(const char *interface,
             continue;
         }
 
-#ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(IPV6_V6ONLY): %s",
-                                                strerror(errno));
-                safe_close(sfd);
-                continue;
-            }
-        }
-#endif
-
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-        if (IS_UDP(transport)) {
-            maximize_sndbuf(sfd);
-        } else {
-            error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(SO_KEEPALIVE): %s",
-                                                strerror(errno));
-            }
-
-            error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(SO_LINGER): %s",
-                                                strerror(errno));
-            }
-
-            error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(TCP_NODELAY): %s",
-                                                strerror(errno));
-            }
+        if (set_socket_options(sfd, next->ai_family, transport) != 0) {
+            safe_close(sfd);
+            continue;
         }
 
         if (bind(sfd, next->ai_addr, next->ai_addrlen) == SOCKET_ERROR) {
@@ -5864,6 +7535,11 @@ static int server_socket(const char *interface,
                 ++stats.daemon_conns;
                 STATS_UNLOCK();
             }
+        } else if (settings.reuseport) {
+            if (server_socket_reuseport(sfd, next, transport) != 0) {
+                freeaddrinfo(ai);
+                return 1;
+            }
         } else {
             if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                              EV_READ | EV_PERSIST, 1,
@@ -6045,6 +7721,8 @@ static void clock_handler(const int fd, const short which, void *arg) {
     evtimer_add(&clockevent, &t);
 
     set_current_time();
+    threads_sample_wakeups();
+    udp_reassembly_expire();
     SFLOW_TICK(current_time);
 }
 
@@ -6108,7 +7786,21 @@ static void usage(void) {
     printf("\nEnvironment variables:\n"
            "MEMCACHED_PORT_FILENAME   File to write port information to\n"
            "MEMCACHED_TOP_KEYS        Number of top keys to keep track of\n"
-           "MEMCACHED_REQS_TAP_EVENT  Similar to -R but for tap_ship_log\n");
+           "MEMCACHED_TOP_KEYS_MODE   recent (the most recently used keys) or\n"
+           "                          frequent (the most used keys, estimated\n"
+           "                          per thread) (default: recent)\n"
+           "MEMCACHED_DETAIL_PREFIXES Number of key prefixes each worker thread\n"
+           "                          keeps detailed stats for (default: 1024)\n"
+           "MEMCACHED_REQS_TAP_EVENT  Similar to -R but for tap_ship_log\n"
+           "MEMCACHED_UDP_BATCH       Number of datagrams to receive or send per\n"
+           "                          system call (default: 16, 1 is off,\n"
+           "                          at most 64)\n"
+           "MEMCACHED_UDP_REASSEMBLY  Bytes of memory for reassembling multi-packet\n"
+           "                          UDP requests (default: 4194304, 0 is off)\n"
+           "MEMCACHED_REUSEPORT       Set to 1 to give each worker thread its own\n"
+           "                          SO_REUSEPORT TCP listener (default: 0)\n"
+           "MEMCACHED_IO_URING        Set to 1 to do TCP network IO with io_uring\n"
+           "                          instead of libevent (default: 0)\n");
 }
 
 static void usage_license(void) {
@@ -6336,13 +8028,19 @@ static int num_independent_stats(void) {
 }
 
 static void *new_independent_stats(void) {
-    int ii;
     int nrecords = num_independent_stats();
-    struct independent_stats *independent_stats = calloc(sizeof(independent_stats) + sizeof(struct thread_stats) * nrecords, 1);
+    size_t size = sizeof(struct independent_stats) +
+        sizeof(struct thread_stats) * nrecords;
+    void *ptr;
+    /* Each record gets its own cache lines */
+    if (posix_memalign(&ptr, 64, size) != 0) {
+        return NULL;
+    }
+    struct independent_stats *independent_stats = ptr;
+    memset(independent_stats, 0, size);
     if (settings.topkeys > 0)
-        independent_stats->topkeys = topkeys_init(settings.topkeys);
-    for (ii = 0; ii < nrecords; ii++)
-        pthread_mutex_init(&independent_stats->thread_stats[ii].mutex, NULL);
+        independent_stats->topkeys = topkeys_init(settings.topkeys,
+                settings.topkeys_frequent ? nrecords : 0);
     return independent_stats;
 }
 
@@ -6353,7 +8051,7 @@ static void release_independent_stats(void *stats) {
     if (independent_stats->topkeys)
         topkeys_free(independent_stats->topkeys);
     for (ii = 0; ii < nrecords; ii++)
-        pthread_mutex_destroy(&independent_stats->thread_stats[ii].mutex);
+        threadlocal_stats_free(&independent_stats->thread_stats[ii]);
     free(independent_stats);
 }
 
@@ -6394,8 +8092,9 @@ static rel_time_t get_current_time(void)
 }
 
 static void count_eviction(const void *cookie, const void *key, const int nkey) {
-    topkeys_t *tk = get_independent_stats((conn*)cookie)->topkeys;
-    TK(tk, evictions, key, nkey, get_current_time());
+    conn *c = (conn *)cookie;
+    topkeys_t *tk = get_independent_stats(c)->topkeys;
+    TK(tk, c->thread->index, evictions, key, nkey, get_current_time());
 }
 
 /**
@@ -7172,6 +8871,14 @@ int main (int argc, char **argv) {
         settings.num_threads_per_udp = settings.num_threads;
     }
 
+    if (getenv("MEMCACHED_DETAIL_PREFIXES") != NULL) {
+        settings.prefix_stats_max = atoi(getenv("MEMCACHED_DETAIL_PREFIXES"));
+    }
+
+    if (settings.prefix_stats_max <= 0) {
+        settings.prefix_stats_max = DEFAULT_PREFIX_STATS_MAX;
+    }
+
     if (getenv("MEMCACHED_REQS_TAP_EVENT") != NULL) {
         settings.reqs_per_tap_event = atoi(getenv("MEMCACHED_REQS_TAP_EVENT"));
     }
@@ -7180,6 +8887,43 @@ int main (int argc, char **argv) {
         settings.reqs_per_tap_event = DEFAULT_REQS_PER_TAP_EVENT;
     }
 
+#ifdef USE_UDP_BATCH
+    if (getenv("MEMCACHED_UDP_BATCH") != NULL) {
+        settings.udp_batch = atoi(getenv("MEMCACHED_UDP_BATCH"));
+    }
+
+    if (settings.udp_batch <= 0) {
+        settings.udp_batch = DEFAULT_UDP_BATCH;
+    } else if (settings.udp_batch > MAX_UDP_BATCH) {
+        settings.udp_batch = MAX_UDP_BATCH;
+    }
+#else
+    settings.udp_batch = 1;
+#endif
+
+    if (getenv("MEMCACHED_UDP_REASSEMBLY") != NULL) {
+        settings.udp_reassembly_max = strtoul(getenv("MEMCACHED_UDP_REASSEMBLY"),
+                                              NULL, 10);
+    }
+
+    if (getenv("MEMCACHED_REUSEPORT") != NULL) {
+#ifdef SO_REUSEPORT
+        settings.reuseport = atoi(getenv("MEMCACHED_REUSEPORT")) != 0;
+#else
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "SO_REUSEPORT is not supported on this platform\n");
+#endif
+    }
+
+    if (getenv("MEMCACHED_IO_URING") != NULL) {
+#ifdef USE_IO_URING
+        settings.io_uring = atoi(getenv("MEMCACHED_IO_URING")) != 0;
+#else
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "memcached was built without io_uring support\n");
+#endif
+    }
+
 
     if (install_sigterm_handler() != 0) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -7195,6 +8939,17 @@ int main (int argc, char **argv) {
         }
     }
 
+    char *topkeys_mode_env = getenv("MEMCACHED_TOP_KEYS_MODE");
+    if (topkeys_mode_env != NULL) {
+        if (strcmp(topkeys_mode_env, "frequent") == 0) {
+            settings.topkeys_frequent = true;
+        } else if (strcmp(topkeys_mode_env, "recent") != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "MEMCACHED_TOP_KEYS_MODE must be recent or frequent\n");
+            exit(EX_USAGE);
+        }
+    }
+
     if (settings.require_sasl) {
         if (!protocol_specified) {
             settings.binding_protocol = binary_prot;
@@ -7395,6 +9150,32 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    for (int ii = 0; ii < CONN_BUFFER_CLASSES; ++ii) {
+        char name[32];
+        snprintf(name, sizeof(name), "conn_buffer_%d", DATA_BUFFER_SIZE << ii);
+        if (!(conn_buffer_cache[ii] = cache_create(name, DATA_BUFFER_SIZE << ii,
+                                                   sizeof(void*), NULL, NULL))) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to create connection buffer cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (settings.udp_reassembly_max > 0 && !udp_reassembly_init()) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Failed to allocate the UDP reassembly hash\n");
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef USE_IO_URING
+    if (!(uring_req_cache = cache_create("uring_req", sizeof(struct uring_req),
+                                         sizeof(void*), NULL, NULL))) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Failed to create io_uring request cache\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
     default_independent_stats = new_independent_stats();
 
 #ifndef __WIN32__
@@ -45,8 +45,19 @@
 /** Initial number of sendmsg() argument structures to allocate. */
 #define MSG_LIST_INITIAL 10
 
+/** Max number of pieces of a value read with one readv() call. */
+#define VALUE_READ_IOV_MAX 16
+
+/**
+ * Number of sizes of the pooled read and write buffers of the connections,
+ * doubling from DATA_BUFFER_SIZE (up to 64KB)
+ */
+#define CONN_BUFFER_CLASSES 6
+
+/** Number of requests between adjustments of the read buffer size */
+#define CONN_BUFFER_ADJUST_INTERVAL 64
+
 /** High water marks for buffer shrinking */
-#define READ_BUFFER_HIGHWAT 8192
 #define ITEM_LIST_HIGHWAT 400
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
@@ -69,6 +80,31 @@
 #define DEFAULT_REQS_PER_EVENT     20
 #define DEFAULT_REQS_PER_TAP_EVENT 50
 
+/** Default number of datagrams received and sent per system call */
+#define DEFAULT_UDP_BATCH 16
+/** Most datagrams per system call (each needs UDP_READ_BUFFER_SIZE bytes) */
+#define MAX_UDP_BATCH 64
+
+/** Default memory for reassembling multi-packet UDP requests */
+#define DEFAULT_UDP_REASSEMBLY_MAX (4 * 1024 * 1024)
+/** Seconds to wait for the rest of a multi-packet UDP request */
+#define UDP_REASSEMBLY_TIMEOUT 2
+/** Buckets of the hash of the multi-packet UDP requests being reassembled */
+#define UDP_REASSEMBLY_BUCKETS 4096
+
+/** Default number of key prefixes each thread keeps detailed stats for */
+#define DEFAULT_PREFIX_STATS_MAX 1024
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define USE_UDP_BATCH 1
+#endif
+
+/** Submission queue entries of the io_uring of a worker thread */
+#define URING_ENTRIES 1024
+/** Number and size of the receive buffers of the io_uring of a thread */
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+
 /** Append a simple stat with a stat name, value format and value */
 #define APPEND_STAT(name, fmt, val) \
     append_stat(name, add_stats, c, fmt, val);
@@ -122,27 +158,55 @@ struct slab_stats {
     uint64_t  cas_badval;
 };
 
+/*
+ * The slab stats of a thread are kept in chunks of classes, allocated
+ * the first time the thread counts an item of a class in the chunk, so
+ * the classes the engine doesn't use cost neither memory nor time when
+ * the stats are aggregated.
+ */
+#define SLAB_STATS_PER_CHUNK 8
+#define SLAB_STATS_CHUNKS \
+    ((MAX_NUMBER_OF_SLAB_CLASSES + SLAB_STATS_PER_CHUNK - 1) / SLAB_STATS_PER_CHUNK)
+
 /**
- * Stats stored per-thread.
+ * Stats stored per-thread. Only the thread owning a record changes it,
+ * so the counters are bumped without a lock. The sequence number around
+ * every change lets other threads take a consistent snapshot of the
+ * record (threadlocal_stats_aggregate), and a reset is asked for by
+ * bumping resets and carried out by the owner on its next change.
+ * The counters most requests bump share the first cache line.
  */
 struct thread_stats {
-    pthread_mutex_t   mutex;
+    volatile uint64_t seq; /* odd while the owner changes the counters */
+    volatile uint64_t resets; /* # of resets asked for */
+    volatile uint64_t resets_done; /* # of resets carried out */
     uint64_t          cmd_get;
     uint64_t          get_misses;
+    uint64_t          bytes_read;
+    uint64_t          bytes_written;
+    uint64_t          response_flushes; /* # of batches of responses sent */
+    uint64_t          responses_flushed; /* # of responses in them */
     uint64_t          delete_misses;
     uint64_t          incr_misses;
     uint64_t          decr_misses;
     uint64_t          incr_hits;
     uint64_t          decr_hits;
     uint64_t          cas_misses;
-    uint64_t          bytes_read;
-    uint64_t          bytes_written;
     uint64_t          cmd_flush;
     uint64_t          conn_yields; /* # of yields for connections (-R option)*/
     uint64_t          auth_cmds;
     uint64_t          auth_errors;
-    struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
-};
+    uint64_t          udp_recv_calls; /* # of system calls receiving datagrams */
+    uint64_t          udp_datagrams_received;
+    uint64_t          udp_send_calls; /* # of system calls sending datagrams */
+    uint64_t          udp_datagrams_sent;
+    uint64_t          value_bytes_copied; /* value bytes copied from rbuf */
+    uint64_t          value_bytes_read_inplace; /* read into the item */
+    /* The sum over all classes (in aggregates), and the counts of classes
+     * out of range or without a chunk (in the records of the threads) */
+    struct slab_stats slab_other;
+    struct slab_stats * volatile slab_stats[SLAB_STATS_CHUNKS];
+} __attribute__((aligned(64))); /* no false sharing between threads */
 
 
 /**
@@ -190,10 +254,17 @@ struct settings {
     char prefix_delimiter;  /* character that marks a key prefix (for stats) */
     int detail_enabled;     /* nonzero if we're collecting detailed stats */
     bool allow_detailed;    /* detailed stats commands are allowed */
+    int prefix_stats_max;   /* key prefixes each thread keeps stats for */
     int reqs_per_event;     /* Maximum number of io to process on each
                                io-event. */
     int reqs_per_tap_event; /* Maximum number of tap io to process on each
                                io-event. */
+    int udp_batch;          /* Maximum number of datagrams to receive or
+                               send in one system call */
+    size_t udp_reassembly_max; /* Maximum memory for multi-packet UDP
+                                  requests (0 is off) */
+    bool reuseport;         /* one SO_REUSEPORT TCP listener per worker */
+    bool io_uring;          /* worker threads do network IO with io_uring */
     bool use_cas;
     enum protocol binding_protocol;
     int backlog;
@@ -201,6 +272,7 @@ struct settings {
     bool sasl;              /* SASL on/off */
     bool require_sasl;      /* require SASL auth */
     int topkeys;            /* Number of top keys to track */
+    bool topkeys_frequent;  /* Track the most used rather than most recent keys */
     union {
         ENGINE_HANDLE *v0;
         ENGINE_HANDLE_V1 *v1;
@@ -231,7 +303,9 @@ typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
     struct event notify_event;  /* listen event for notify pipe */
-    SOCKET notify[2];           /* notification pipes */
+    SOCKET notify[2];           /* notification pipes (the same eventfd twice
+                                   where available) */
+    volatile int notify_pending; /* set while a wakeup is on its way */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cache_t *suffix_cache;      /* suffix cache */
     pthread_mutex_t mutex;      /* Mutex to lock protect access to the pending_io */
@@ -242,6 +316,14 @@ typedef struct {
 
     rel_time_t last_checked;
     struct conn *pending_close; /* list of connections close at a later time */
+    struct conn *listen_conns;  /* SO_REUSEPORT listeners owned by this thread */
+    bool listen_disabled;       /* listen_conns paused after running out of fds */
+    uint64_t wakeups;           /* number of times the thread was notified */
+    uint64_t wakeups_sampled;   /* wakeups at the last clock tick */
+    uint64_t wakeups_per_sec;   /* wakeups during the last second */
+    struct uring *ring;         /* io_uring for network IO, if enabled */
+    struct event ring_event;    /* listen event for ring completions */
+    bool ring_dispatching;      /* handling ring completions (defer submits) */
 #ifdef ENABLE_SFLOW
     uint32_t sflow_sample_pool;
     uint32_t sflow_random;
@@ -268,10 +350,20 @@ uint32_t sflow_sample_pool_aggregate(void); // in thread.c
 
 extern void notify_thread(LIBEVENT_THREAD *thread);
 extern void notify_dispatcher(void);
+extern void notify_listen_threads(void);
+#ifdef USE_IO_URING
+extern void uring_event_handler(int fd, short which, void *arg);
+#endif
+extern void resume_thread_listen(LIBEVENT_THREAD *me);
 extern bool create_notification_pipe(LIBEVENT_THREAD *me);
+extern int drain_notification_pipe(SOCKET fd);
 
 extern LIBEVENT_THREAD* tap_thread;
 
+struct udp_batch;
+struct bin_get_batch;
+struct uring;
+struct uring_req;
 typedef struct conn conn;
 typedef bool (*STATE_FUNC)(conn *);
 
@@ -293,6 +385,9 @@ struct conn {
     char   *rcurr;  /** but if we parsed some already, this is where we stopped */
     uint32_t rsize;   /** total allocated size of rbuf */
     uint32_t rbytes;  /** how much data, starting from rcur, do we have unparsed */
+    uint32_t rwant;   /** size of rbuf the recent requests needed */
+    uint32_t rpeak;   /** most input buffered since the size was adjusted */
+    uint32_t rrequests; /** requests since the size was adjusted */
 
     char   *wbuf;
     char   *wcurr;
@@ -304,6 +399,13 @@ struct conn {
 
     char   *ritem;  /** when we read in an item's value, it goes here */
     uint32_t rlbytes;
+    /** the pieces of a value stored in more than one that are still to be read */
+    struct iovec *riov;
+    int    riovcnt;
+
+    /** the pieces of the value of an item stored in more than one */
+    item_info *vinfo;
+    int    vinfosize; /* number of elements allocated in vinfo->value[] */
 
     /* data for the nread state */
 
@@ -331,6 +433,22 @@ struct conn {
     int    msgcurr;   /* element in msglist[] being transmitted now */
     int    msgbytes;  /* number of bytes in current msg */
 
+    /*
+     * Responses to pipelined binary requests are parked and sent together
+     * with the responses to the requests that follow them.
+     */
+    int    iovparked; /* number of elements of iov[] used by them */
+    int    msgparked; /* number of elements of msglist[] used by them */
+    int    parked_iovlen;   /* msg_iovlen of the last message */
+    int    parked_msgbytes; /* msgbytes of the last message */
+    int    responses; /* number of responses to send */
+    bool   flushing;  /* sending them */
+    char   *pbuf;     /* copy of the parts they had in wbuf */
+    uint32_t pbytes;  /* number of bytes used in pbuf */
+
+    /* Lookups of a run of pipelined binary gets, made together */
+    struct bin_get_batch *getbatch;
+
     item   **ilist;   /* list of items to write out */
     int    isize;
     item   **icurr;
@@ -350,6 +468,8 @@ struct conn {
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
+    struct udp_batch *udp_batch; /* datagrams received or to be sent */
+    struct uring_req *uring_req; /* io_uring operation in flight */
 
     bool   noreply;   /* True if the reply should not be sent. */
     /* current stats command */
@@ -384,6 +504,8 @@ struct conn {
     bool ewouldblock;
     bool tap_nack_mode;
     TAP_ITERATOR tap_iterator;
+    uint64_t latency_start; /* when the command was parsed (ns) */
+    uint64_t latency_engine; /* ns it spent in the engine */
 #ifdef ENABLE_SFLOW
     struct timeval sflow_start_time;
 #endif
@@ -405,6 +527,7 @@ extern int daemonize(int nochdir, int noclose);
 #endif
 
 #include "stats.h"
+#include "latency.h"
 #include "trace.h"
 #include "hash.h"
 #include <memcached/util.h>
@@ -430,6 +553,10 @@ void threads_shutdown(void);
 int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(SOCKET sfd, STATE_FUNC init_state, int event_flags,
                        int read_buffer_size, enum network_transport transport);
+void dispatch_conn_local(LIBEVENT_THREAD *me, SOCKET sfd,
+                         STATE_FUNC init_state, int event_flags,
+                         int read_buffer_size,
+                         enum network_transport transport);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 void accept_new_conns(const bool do_accept);
@@ -440,10 +567,63 @@ int   is_listen_thread(void);
 void STATS_LOCK(void);
 void STATS_UNLOCK(void);
 void threadlocal_stats_clear(struct thread_stats *stats);
+void threadlocal_stats_clear_own(struct thread_stats *stats);
+void threadlocal_stats_free(struct thread_stats *stats);
 void threadlocal_stats_reset(struct thread_stats *thread_stats);
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats);
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
 
+/*
+ * Changes to a thread_stats record by its owner go between
+ * thread_stats_begin and thread_stats_end, and use THREAD_STATS_ADD.
+ */
+static inline void thread_stats_begin(struct thread_stats *thread_stats) {
+    __atomic_store_n(&thread_stats->seq, thread_stats->seq + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    uint64_t resets = thread_stats->resets;
+    if (resets != thread_stats->resets_done) {
+        threadlocal_stats_clear_own(thread_stats);
+        thread_stats->resets_done = resets;
+    }
+}
+
+static inline void thread_stats_end(struct thread_stats *thread_stats) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&thread_stats->seq, thread_stats->seq + 1,
+                     __ATOMIC_RELAXED);
+}
+
+struct slab_stats *thread_stats_slab_chunk(struct thread_stats *thread_stats,
+                                           int chunk);
+
+/* The slab stats of a class in a record owned by the calling thread */
+static inline struct slab_stats *thread_stats_slab(struct thread_stats *thread_stats,
+                                                   int clsid) {
+    if (clsid < 0 || clsid >= MAX_NUMBER_OF_SLAB_CLASSES) {
+        return &thread_stats->slab_other;
+    }
+    struct slab_stats *chunk =
+        thread_stats->slab_stats[clsid / SLAB_STATS_PER_CHUNK];
+    if (chunk == NULL) {
+        chunk = thread_stats_slab_chunk(thread_stats,
+                                        clsid / SLAB_STATS_PER_CHUNK);
+        if (chunk == NULL) {
+            return &thread_stats->slab_other;
+        }
+    }
+    return &chunk[clsid % SLAB_STATS_PER_CHUNK];
+}
+
+#define THREAD_STATS_ADD(thread_stats, field, amt) \
+    __atomic_store_n(&(thread_stats)->field, (thread_stats)->field + (amt), \
+                     __ATOMIC_RELAXED)
+#ifndef HAVE_UMEM_H
+void suffix_cache_stats(cache_stats_t *out);
+#endif
+void threads_sample_wakeups(void);
+void threads_wakeup_stats(ADD_STAT add_stats, conn *c);
+
 /* Stat processing functions */
 void append_stat(const char *name, ADD_STAT add_stats, conn *c,
                  const char *fmt, ...);
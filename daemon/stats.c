@@ -13,11 +13,54 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <sched.h>
 
 /*
- * Stats are tracked on the basis of key prefixes. This is a simple
- * fixed-size hash of prefixes; we run the prefixes through the same
- * CRC function used by the cache hashtable.
+ * Stats are tracked on the basis of key prefixes. Every worker thread
+ * keeps its own table of the prefixes of the keys it sees, so recording
+ * takes no lock, and the tables are merged when the stats are dumped.
+ *
+ * A table holds at most settings.prefix_stats_max prefixes; when it is
+ * full the prefix the thread saw least recently makes room for the new
+ * one. Entries are never freed, only reused, and carry a sequence number
+ * that is odd while the owner changes them, so a dump can read them
+ * while the owner keeps going and retry the ones it caught mid-change.
+ * Prefixes longer than PREFIX_MAX_LENGTH aren't tracked.
+ */
+#define PREFIX_MAX_LENGTH 79
+
+typedef struct {
+    uint64_t          num_gets;
+    uint64_t          num_sets;
+    uint64_t          num_deletes;
+    uint64_t          num_hits;
+    volatile uint32_t seq;
+    uint32_t          hnext;  /* next entry in the hash chain (index + 1) */
+    uint32_t          prev;   /* LRU neighbours (index + 1) */
+    uint32_t          next;
+    uint8_t           prefix_len; /* 0 if the entry is unused */
+    char              prefix[PREFIX_MAX_LENGTH];
+} prefix_entry; /* two cache lines */
+
+typedef struct {
+    volatile uint64_t resets; /* # of clears asked for */
+    volatile uint64_t resets_done; /* # of clears carried out */
+    volatile uint32_t nused;  /* entries in use, from the start */
+    uint32_t          nentries;
+    uint32_t          mask;   /* of the hash table */
+    uint32_t          lru_head; /* most recently used (index + 1) */
+    uint32_t          lru_tail;
+    uint32_t         *buckets; /* hash chains (index + 1) */
+    prefix_entry     *entries;
+} prefix_table;
+
+static prefix_table * volatile *prefix_tables;
+static int num_prefix_tables;
+
+/*
+ * The result of merging the tables of all threads, as a simple fixed
+ * size hash of the prefixes.
  */
 typedef struct _prefix_stats PREFIX_STATS;
 struct _prefix_stats {
@@ -32,42 +75,145 @@ struct _prefix_stats {
 
 #define PREFIX_HASH_SIZE 256
 
-static PREFIX_STATS *prefix_stats[PREFIX_HASH_SIZE];
-static int num_prefixes = 0;
-static int total_prefix_size = 0;
+typedef struct {
+    PREFIX_STATS *buckets[PREFIX_HASH_SIZE];
+    int           num_prefixes;
+    size_t        total_prefix_size;
+} prefix_merge;
 
 void stats_prefix_init() {
-    memset(prefix_stats, 0, sizeof(prefix_stats));
+    /* One table for each worker thread and one for the tap thread */
+    num_prefix_tables = settings.num_threads + 1;
+    prefix_tables = calloc(num_prefix_tables, sizeof(prefix_table *));
+    if (prefix_tables == NULL) {
+        perror("Can't allocate prefix stats tables: calloc");
+        num_prefix_tables = 0;
+    }
 }
 
 /*
- * Cleans up all our previously collected stats. NOTE: the stats lock is
- * assumed to be held when this is called.
+ * Asks the threads to clear their tables. A table reads as empty from
+ * now on, and its owner clears it the next time it records a key.
  */
 void stats_prefix_clear() {
     int i;
 
-    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
-        PREFIX_STATS *cur, *next;
-        for (cur = prefix_stats[i]; cur != NULL; cur = next) {
-            next = cur->next;
-            free(cur->prefix);
-            free(cur);
+    for (i = 0; i < num_prefix_tables; i++) {
+        prefix_table *table = __atomic_load_n(&prefix_tables[i],
+                                              __ATOMIC_ACQUIRE);
+        if (table != NULL) {
+            __sync_add_and_fetch(&table->resets, 1);
         }
-        prefix_stats[i] = NULL;
     }
-    num_prefixes = 0;
-    total_prefix_size = 0;
+}
+
+static prefix_table *prefix_table_new(void) {
+    prefix_table *table = calloc(1, sizeof(*table));
+    if (table == NULL) {
+        perror("Can't allocate prefix stats table: calloc");
+        return NULL;
+    }
+
+    table->nentries = settings.prefix_stats_max;
+    uint32_t nbuckets = 1;
+    while (nbuckets < table->nentries) {
+        nbuckets <<= 1;
+    }
+    table->mask = nbuckets - 1;
+    table->buckets = calloc(nbuckets, sizeof(uint32_t));
+    void *entries = NULL;
+    if (table->buckets == NULL ||
+        posix_memalign(&entries, 64,
+                       table->nentries * sizeof(prefix_entry)) != 0) {
+        perror("Can't allocate prefix stats table");
+        free(table->buckets);
+        free(table);
+        return NULL;
+    }
+    memset(entries, 0, table->nentries * sizeof(prefix_entry));
+    table->entries = entries;
+    return table;
+}
+
+static inline void prefix_entry_begin(prefix_entry *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void prefix_entry_end(prefix_entry *e) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+}
+
+/* Clears the table of the calling thread */
+static void prefix_table_clear(prefix_table *table) {
+    uint32_t i;
+
+    for (i = 0; i < table->nused; i++) {
+        prefix_entry *e = &table->entries[i];
+        prefix_entry_begin(e);
+        e->prefix_len = 0;
+        e->num_gets = e->num_sets = e->num_deletes = e->num_hits = 0;
+        prefix_entry_end(e);
+        e->hnext = e->prev = e->next = 0;
+    }
+    memset(table->buckets, 0, (table->mask + 1) * sizeof(uint32_t));
+    table->lru_head = table->lru_tail = 0;
+    __atomic_store_n(&table->nused, 0, __ATOMIC_RELEASE);
+}
+
+static void prefix_lru_unlink(prefix_table *table, uint32_t idx) {
+    prefix_entry *e = &table->entries[idx - 1];
+    if (e->prev) {
+        table->entries[e->prev - 1].next = e->next;
+    } else {
+        table->lru_head = e->next;
+    }
+    if (e->next) {
+        table->entries[e->next - 1].prev = e->prev;
+    } else {
+        table->lru_tail = e->prev;
+    }
+    e->prev = e->next = 0;
+}
+
+static void prefix_lru_push(prefix_table *table, uint32_t idx) {
+    prefix_entry *e = &table->entries[idx - 1];
+    e->next = table->lru_head;
+    if (table->lru_head) {
+        table->entries[table->lru_head - 1].prev = idx;
+    }
+    table->lru_head = idx;
+    if (table->lru_tail == 0) {
+        table->lru_tail = idx;
+    }
+}
+
+/* Takes the least recently used entry out of its hash chain */
+static uint32_t prefix_table_evict(prefix_table *table) {
+    uint32_t idx = table->lru_tail;
+    prefix_entry *e = &table->entries[idx - 1];
+    uint32_t *pos = &table->buckets[hash(e->prefix, e->prefix_len, 0) &
+                                    table->mask];
+    while (*pos != idx) {
+        pos = &table->entries[*pos - 1].hnext;
+    }
+    *pos = e->hnext;
+    prefix_lru_unlink(table, idx);
+    return idx;
 }
 
 /*
- * Returns the stats structure for a prefix, creating it if it's not already
- * in the list.
+ * Returns the entry of the table of the calling thread for a prefix,
+ * taking a new (or the least recently used) entry if it's not there.
  */
 /*@null@*/
-static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
-    uint32_t hashval;
+static prefix_entry *stats_prefix_find(int thread, const char *key,
+                                       const size_t nkey) {
+    prefix_table *table;
+    prefix_entry *e;
+    uint32_t *bucket;
+    uint32_t idx;
     size_t length;
     bool bailout = true;
 
@@ -80,86 +226,197 @@ static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
         }
     }
 
-    if (bailout) {
+    if (bailout || length > PREFIX_MAX_LENGTH ||
+        thread < 0 || thread >= num_prefix_tables) {
         return NULL;
     }
 
-    hashval = hash(key, length, 0) % PREFIX_HASH_SIZE;
-
-    for (pfs = prefix_stats[hashval]; NULL != pfs; pfs = pfs->next) {
-        if (strncmp(pfs->prefix, key, length) == 0)
-            return pfs;
+    table = prefix_tables[thread];
+    if (table == NULL) {
+        if ((table = prefix_table_new()) == NULL) {
+            return NULL;
+        }
+        table->resets_done = table->resets;
+        __atomic_store_n(&prefix_tables[thread], table, __ATOMIC_RELEASE);
     }
 
-    pfs = calloc(sizeof(PREFIX_STATS), 1);
-    if (NULL == pfs) {
-        perror("Can't allocate space for stats structure: calloc");
-        return NULL;
+    uint64_t resets = table->resets;
+    if (resets != table->resets_done) {
+        prefix_table_clear(table);
+        table->resets_done = resets;
     }
 
-    pfs->prefix = malloc(length + 1);
-    if (NULL == pfs->prefix) {
-        perror("Can't allocate space for copy of prefix: malloc");
-        free(pfs);
-        return NULL;
+    bucket = &table->buckets[hash(key, length, 0) & table->mask];
+    for (idx = *bucket; idx != 0; idx = e->hnext) {
+        e = &table->entries[idx - 1];
+        if (e->prefix_len == length && memcmp(e->prefix, key, length) == 0) {
+            if (table->lru_head != idx) {
+                prefix_lru_unlink(table, idx);
+                prefix_lru_push(table, idx);
+            }
+            return e;
+        }
     }
 
-    strncpy(pfs->prefix, key, length);
-    pfs->prefix[length] = '\0';      /* because strncpy() sucks */
-    pfs->prefix_len = length;
-
-    pfs->next = prefix_stats[hashval];
-    prefix_stats[hashval] = pfs;
-
-    num_prefixes++;
-    total_prefix_size += length;
+    if (table->nused < table->nentries) {
+        idx = table->nused + 1;
+    } else {
+        idx = prefix_table_evict(table);
+    }
+    e = &table->entries[idx - 1];
+    prefix_entry_begin(e);
+    memcpy(e->prefix, key, length);
+    e->prefix_len = length;
+    e->num_gets = e->num_sets = e->num_deletes = e->num_hits = 0;
+    prefix_entry_end(e);
+    if (idx > table->nused) {
+        /* Dumps may read the entry once they see it counted */
+        __atomic_store_n(&table->nused, idx, __ATOMIC_RELEASE);
+    }
 
-    return pfs;
+    e->hnext = *bucket;
+    *bucket = idx;
+    prefix_lru_push(table, idx);
+    return e;
 }
 
+#define PREFIX_ENTRY_ADD(e, field, amt) \
+    __atomic_store_n(&(e)->field, (e)->field + (amt), __ATOMIC_RELAXED)
+
 /*
  * Records a "get" of a key.
  */
-void stats_prefix_record_get(const char *key, const size_t nkey, const bool is_hit) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
-    if (NULL != pfs) {
-        pfs->num_gets++;
+void stats_prefix_record_get(int thread, const char *key, const size_t nkey,
+                             const bool is_hit) {
+    prefix_entry *e = stats_prefix_find(thread, key, nkey);
+    if (NULL != e) {
+        prefix_entry_begin(e);
+        PREFIX_ENTRY_ADD(e, num_gets, 1);
         if (is_hit) {
-            pfs->num_hits++;
+            PREFIX_ENTRY_ADD(e, num_hits, 1);
         }
+        prefix_entry_end(e);
     }
-    STATS_UNLOCK();
 }
 
 /*
  * Records a "delete" of a key.
  */
-void stats_prefix_record_delete(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
-    if (NULL != pfs) {
-        pfs->num_deletes++;
+void stats_prefix_record_delete(int thread, const char *key,
+                                const size_t nkey) {
+    prefix_entry *e = stats_prefix_find(thread, key, nkey);
+    if (NULL != e) {
+        prefix_entry_begin(e);
+        PREFIX_ENTRY_ADD(e, num_deletes, 1);
+        prefix_entry_end(e);
     }
-    STATS_UNLOCK();
 }
 
 /*
  * Records a "set" of a key.
  */
-void stats_prefix_record_set(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
+void stats_prefix_record_set(int thread, const char *key, const size_t nkey) {
+    prefix_entry *e = stats_prefix_find(thread, key, nkey);
+    if (NULL != e) {
+        prefix_entry_begin(e);
+        PREFIX_ENTRY_ADD(e, num_sets, 1);
+        prefix_entry_end(e);
+    }
+}
+
+/* Copies an entry of another thread, retrying if it changed meanwhile */
+static void prefix_entry_snapshot(prefix_entry *e, prefix_entry *copy) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, (const void *)e, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+static void prefix_merge_free(prefix_merge *merge) {
+    int i;
+
+    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
+        PREFIX_STATS *cur, *next;
+        for (cur = merge->buckets[i]; cur != NULL; cur = next) {
+            next = cur->next;
+            free(cur->prefix);
+            free(cur);
+        }
+    }
+    free(merge);
+}
+
+/*
+ * Sums up the tables of all threads.
+ */
+/*@null@*/
+static prefix_merge *stats_prefix_merge(void) {
+    prefix_merge *merge = calloc(1, sizeof(*merge));
+    int i;
 
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
-    if (NULL != pfs) {
-        pfs->num_sets++;
+    if (merge == NULL) {
+        perror("Can't allocate space for stats structure: calloc");
+        return NULL;
     }
-    STATS_UNLOCK();
+
+    for (i = 0; i < num_prefix_tables; i++) {
+        prefix_table *table = __atomic_load_n(&prefix_tables[i],
+                                              __ATOMIC_ACQUIRE);
+        if (table == NULL || table->resets != table->resets_done) {
+            continue;
+        }
+
+        uint32_t nused = __atomic_load_n(&table->nused, __ATOMIC_ACQUIRE);
+        for (uint32_t j = 0; j < nused; j++) {
+            prefix_entry e;
+            PREFIX_STATS *pfs;
+
+            prefix_entry_snapshot(&table->entries[j], &e);
+            if (e.prefix_len == 0) {
+                continue;
+            }
+
+            uint32_t hashval = hash(e.prefix, e.prefix_len, 0) % PREFIX_HASH_SIZE;
+            for (pfs = merge->buckets[hashval]; NULL != pfs; pfs = pfs->next) {
+                if (pfs->prefix_len == e.prefix_len &&
+                    memcmp(pfs->prefix, e.prefix, e.prefix_len) == 0) {
+                    break;
+                }
+            }
+
+            if (pfs == NULL) {
+                pfs = calloc(sizeof(PREFIX_STATS), 1);
+                if (NULL == pfs || NULL == (pfs->prefix = malloc(e.prefix_len + 1))) {
+                    perror("Can't allocate space for copy of prefix: malloc");
+                    free(pfs);
+                    prefix_merge_free(merge);
+                    return NULL;
+                }
+                memcpy(pfs->prefix, e.prefix, e.prefix_len);
+                pfs->prefix[e.prefix_len] = '\0';
+                pfs->prefix_len = e.prefix_len;
+                pfs->next = merge->buckets[hashval];
+                merge->buckets[hashval] = pfs;
+                merge->num_prefixes++;
+                merge->total_prefix_size += e.prefix_len;
+            }
+
+            pfs->num_gets += e.num_gets;
+            pfs->num_sets += e.num_sets;
+            pfs->num_deletes += e.num_deletes;
+            pfs->num_hits += e.num_hits;
+        }
+    }
+
+    return merge;
 }
 
 /*
@@ -169,31 +426,36 @@ void stats_prefix_record_set(const char *key, const size_t nkey) {
 char *stats_prefix_dump(int *length) {
     const char *format = "PREFIX %s get %llu hit %llu set %llu del %llu\r\n";
     PREFIX_STATS *pfs;
+    prefix_merge *merge;
     char *buf;
     int i, pos;
     size_t size = 0, written = 0, total_written = 0;
 
+    merge = stats_prefix_merge();
+    if (NULL == merge) {
+        return NULL;
+    }
+
     /*
      * Figure out how big the buffer needs to be. This is the sum of the
      * lengths of the prefixes themselves, plus the size of one copy of
      * the per-prefix output with 20-digit values for all the counts,
      * plus space for the "END" at the end.
      */
-    STATS_LOCK();
-    size = strlen(format) + total_prefix_size +
-           num_prefixes * (strlen(format) - 2 /* %s */
-                           + 4 * (20 - 4)) /* %llu replaced by 20-digit num */
-                           + sizeof("END\r\n");
+    size = strlen(format) + merge->total_prefix_size +
+           merge->num_prefixes * (strlen(format) - 2 /* %s */
+                                  + 4 * (20 - 4)) /* %llu replaced by 20-digit num */
+                                  + sizeof("END\r\n");
     buf = malloc(size);
     if (NULL == buf) {
         perror("Can't allocate stats response: malloc");
-        STATS_UNLOCK();
+        prefix_merge_free(merge);
         return NULL;
     }
 
     pos = 0;
     for (i = 0; i < PREFIX_HASH_SIZE; i++) {
-        for (pfs = prefix_stats[i]; NULL != pfs; pfs = pfs->next) {
+        for (pfs = merge->buckets[i]; NULL != pfs; pfs = pfs->next) {
             written = snprintf(buf + pos, size-pos, format,
                            pfs->prefix, pfs->num_gets, pfs->num_hits,
                            pfs->num_sets, pfs->num_deletes);
@@ -203,13 +465,42 @@ char *stats_prefix_dump(int *length) {
         }
     }
 
-    STATS_UNLOCK();
+    prefix_merge_free(merge);
     memcpy(buf + pos, "END\r\n", 6);
 
     *length = pos + 5;
     return buf;
 }
 
+/*
+ * Returns the stats of every prefix as a stat of its own, named after
+ * the prefix.
+ */
+bool stats_prefix_stats(ADD_STAT add_stats, const void *cookie) {
+    PREFIX_STATS *pfs;
+    prefix_merge *merge;
+    int i;
+
+    merge = stats_prefix_merge();
+    if (NULL == merge) {
+        return false;
+    }
+
+    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
+        for (pfs = merge->buckets[i]; NULL != pfs; pfs = pfs->next) {
+            char val[128];
+            int vlen = snprintf(val, sizeof(val),
+                                "get=%"PRIu64",hit=%"PRIu64",set=%"PRIu64
+                                ",del=%"PRIu64, pfs->num_gets, pfs->num_hits,
+                                pfs->num_sets, pfs->num_deletes);
+            add_stats(pfs->prefix, pfs->prefix_len, val, vlen, cookie);
+        }
+    }
+
+    prefix_merge_free(merge);
+    return true;
+}
+
 
 #ifdef UNIT_TEST
 
@@ -1,8 +1,10 @@
 /* stats */
 void stats_prefix_init(void);
 void stats_prefix_clear(void);
-void stats_prefix_record_get(const char *key, const size_t nkey, const bool is_hit);
-void stats_prefix_record_delete(const char *key, const size_t nkey);
-void stats_prefix_record_set(const char *key, const size_t nkey);
+void stats_prefix_record_get(int thread, const char *key, const size_t nkey,
+                             const bool is_hit);
+void stats_prefix_record_delete(int thread, const char *key, const size_t nkey);
+void stats_prefix_record_set(int thread, const char *key, const size_t nkey);
 /*@null@*/
 char *stats_prefix_dump(int *length);
+bool stats_prefix_stats(ADD_STAT add_stats, const void *cookie);
@@ -11,13 +11,24 @@
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #define ITEMS_PER_ALLOC 64
 
+#ifndef HAVE_EVENTFD
 static char devnull[8192];
+#endif
 extern volatile sig_atomic_t memcached_shutdown;
 
 /* An item in the connection queue. */
@@ -31,13 +42,13 @@ struct conn_queue_item {
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue. Any thread may push items onto it without taking a
+ * lock, and the thread owning it takes all of them off at once.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    CQ_ITEM * volatile head;    /* most recently pushed item first */
 };
 
 /* Connection lock around accepting new connections */
@@ -76,46 +87,38 @@ static void libevent_tap_process(int fd, short which, void *arg);
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    pthread_mutex_init(&cq->lock, NULL);
-    pthread_cond_init(&cq->cond, NULL);
     cq->head = NULL;
-    cq->tail = NULL;
 }
 
 /*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
+ * Takes all items off a connection queue, but doesn't block if there
+ * aren't any. Only the thread owning the queue may call this.
+ * Returns the items in the order they were pushed, or NULL if the queue
+ * is empty
  */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
+static CQ_ITEM *cq_pop_all(CQ *cq) {
+    CQ_ITEM *item = __sync_lock_test_and_set(&cq->head, NULL);
+    CQ_ITEM *list = NULL;
+
+    while (item != NULL) {
+        CQ_ITEM *next = item->next;
+        item->next = list;
+        list = item;
+        item = next;
     }
-    pthread_mutex_unlock(&cq->lock);
 
-    return item;
+    return list;
 }
 
 /*
  * Adds an item to a connection queue.
  */
 static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
-
-    pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    pthread_cond_signal(&cq->cond);
-    pthread_mutex_unlock(&cq->lock);
+    CQ_ITEM *head;
+    do {
+        head = cq->head;
+        item->next = head;
+    } while (!__sync_bool_compare_and_swap(&cq->head, head, item));
 }
 
 /*
@@ -188,6 +191,16 @@ static void create_worker(void *(*func)(void *), void *arg, pthread_t *id) {
 
 bool create_notification_pipe(LIBEVENT_THREAD *me)
 {
+#ifdef HAVE_EVENTFD
+    /* An eventfd counts the notifications, so one read consumes them all */
+    me->notify[0] = me->notify[1] = eventfd(0, EFD_NONBLOCK);
+    if (me->notify[0] == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't create notify eventfd: %s",
+                                        strerror(errno));
+        return false;
+    }
+#else
     if (evutil_socketpair(SOCKETPAIR_AF, SOCK_STREAM, 0,
                           (void*)me->notify) == SOCKET_ERROR) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -211,9 +224,62 @@ bool create_notification_pipe(LIBEVENT_THREAD *me)
             return false;
         }
     }
+#endif
     return true;
 }
 
+/*
+ * Consumes the notifications sent to a thread.
+ * Returns the number of notifications, or -1 if none could be read
+ */
+int drain_notification_pipe(SOCKET fd)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return (int)count;
+#else
+    ssize_t nr = recv(fd, devnull, sizeof(devnull), 0);
+    return nr == -1 ? -1 : (int)nr;
+#endif
+}
+
+static void signal_notification_pipe(SOCKET fd, const char *name) {
+#ifdef HAVE_EVENTFD
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == sizeof(one)) {
+        return;
+    }
+#else
+    if (send(fd, "", 1, 0) == 1) {
+        return;
+    }
+#endif
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "Failed to notify %s: %s",
+                                    name, strerror(errno));
+}
+
+/*
+ * Called by a thread when it wakes up for its notification pipe, before
+ * looking at the work queued for it.
+ */
+static void thread_woken_up(LIBEVENT_THREAD *me, SOCKET fd) {
+    if (drain_notification_pipe(fd) == -1) {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Can't read from libevent pipe: %s\n",
+                                            strerror(errno));
+        }
+    }
+
+    /* Any work queued after this is followed by a new notification */
+    __sync_fetch_and_and(&me->notify_pending, 0);
+    ++me->wakeups;
+}
+
 static void setup_dispatcher(struct event_base *main_base,
                              void (*dispatcher_callback)(int, short, void *))
 {
@@ -236,6 +302,33 @@ static void setup_dispatcher(struct event_base *main_base,
     }
 }
 
+#ifdef USE_IO_URING
+/*
+ * Give a worker thread an io_uring for its network IO, or turn io_uring
+ * off for all threads if the kernel doesn't support it.
+ */
+static void setup_thread_ring(LIBEVENT_THREAD *me) {
+    me->ring = uring_create(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+    if (me->ring == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't set up io_uring (%s), using libevent\n",
+                                        strerror(errno));
+        settings.io_uring = false;
+        return;
+    }
+
+    event_set(&me->ring_event, uring_fd(me->ring), EV_READ | EV_PERSIST,
+              uring_event_handler, me);
+    event_base_set(me->base, &me->ring_event);
+
+    if (event_add(&me->ring_event, 0) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't monitor io_uring\n");
+        exit(1);
+    }
+}
+#endif
+
 /*
  * Set up a thread's information.
  */
@@ -268,6 +361,12 @@ static void setup_thread(LIBEVENT_THREAD *me, bool tap) {
             exit(EXIT_FAILURE);
         }
         cq_init(me->new_conn_queue);
+
+#ifdef USE_IO_URING
+        if (settings.io_uring) {
+            setup_thread_ring(me);
+        }
+#endif
     }
 
     if ((pthread_mutex_init(&me->mutex, NULL) != 0)) {
@@ -324,43 +423,24 @@ static void thread_libevent_process(int fd, short which, void *arg) {
     assert(me->type == GENERAL);
     CQ_ITEM *item;
 
-    if (recv(fd, devnull, sizeof(devnull), 0) == -1) {
-        if (settings.verbose > 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "Can't read from libevent pipe: %s\n",
-                                            strerror(errno));
-        }
-    }
+    thread_woken_up(me, fd);
 
     if (memcached_shutdown) {
          event_base_loopbreak(me->base);
          return ;
     }
 
-    while ((item = cq_pop(me->new_conn_queue)) != NULL) {
-        conn *c = conn_new(item->sfd, item->init_state, item->event_flags,
-                           item->read_buffer_size, item->transport, me->base,
-                           NULL);
-        if (c == NULL) {
-            if (IS_UDP(item->transport)) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                         "Can't listen for events on UDP socket\n");
-                exit(1);
-            } else {
-                if (settings.verbose > 0) {
-                    settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
-                            "Can't listen for events on fd %d\n",
-                            item->sfd);
-                }
-                closesocket(item->sfd);
-            }
-        } else {
-            assert(c->thread == NULL);
-            c->thread = me;
-        }
+    item = cq_pop_all(me->new_conn_queue);
+    while (item != NULL) {
+        CQ_ITEM *next = item->next;
+        dispatch_conn_local(me, item->sfd, item->init_state, item->event_flags,
+                            item->read_buffer_size, item->transport);
         cqi_free(item);
+        item = next;
     }
 
+    resume_thread_listen(me);
+
     pthread_mutex_lock(&me->mutex);
     conn* pending = me->pending_io;
     me->pending_io = NULL;
@@ -382,6 +462,12 @@ static void thread_libevent_process(int fd, short which, void *arg) {
             /* do task */
         }
     }
+
+#ifdef USE_IO_URING
+    if (me->ring != NULL) {
+        uring_submit(me->ring);
+    }
+#endif
 }
 
 extern volatile rel_time_t current_time;
@@ -476,13 +562,7 @@ static void libevent_tap_process(int fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
     assert(me->type == TAP);
 
-    if (recv(fd, devnull, sizeof(devnull), 0) == -1) {
-        if (settings.verbose > 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "Can't read from libevent pipe: %s\n",
-                                            strerror(errno));
-        }
-    }
+    thread_woken_up(me, fd);
 
     if (memcached_shutdown) {
         event_base_loopbreak(me->base);
@@ -710,6 +790,40 @@ void dispatch_conn_new(SOCKET sfd, STATE_FUNC init_state, int event_flags,
     notify_thread(thread);
 }
 
+/*
+ * Creates a new connection on the calling worker thread. This is used for
+ * connections handed over through the connection queue, and directly by
+ * the per-thread SO_REUSEPORT listeners so their clients skip the queue.
+ */
+void dispatch_conn_local(LIBEVENT_THREAD *me, SOCKET sfd,
+                         STATE_FUNC init_state, int event_flags,
+                         int read_buffer_size,
+                         enum network_transport transport) {
+    conn *c = conn_new(sfd, init_state, event_flags, read_buffer_size,
+                       transport, me->base, NULL);
+    if (c == NULL) {
+        if (IS_UDP(transport) || init_state == conn_listening) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                     "Can't listen for events on %s socket\n",
+                     IS_UDP(transport) ? "UDP" : "TCP");
+            exit(1);
+        } else {
+            if (settings.verbose > 0) {
+                settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                        "Can't listen for events on fd %d\n", sfd);
+            }
+            closesocket(sfd);
+        }
+    } else {
+        assert(c->thread == NULL);
+        c->thread = me;
+        if (init_state == conn_listening) {
+            c->next = me->listen_conns;
+            me->listen_conns = c;
+        }
+    }
+}
+
 /*
  * Returns true if this is the thread that listens for new TCP connections.
  */
@@ -723,7 +837,18 @@ int is_listen_thread() {
 }
 
 void notify_dispatcher(void) {
-    notify_thread(&dispatcher_thread);
+    /* The dispatcher counts the notifications, so don't coalesce them */
+    signal_notification_pipe(dispatcher_thread.notify[1], "dispatcher");
+}
+
+/*
+ * Wakes up the worker threads so they re-arm their SO_REUSEPORT listeners.
+ */
+void notify_listen_threads(void) {
+    int ii;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        notify_thread(threads + ii);
+    }
 }
 
 /******************************* GLOBAL STATS ******************************/
@@ -737,88 +862,151 @@ void STATS_UNLOCK() {
 }
 
 void threadlocal_stats_clear(struct thread_stats *stats) {
-    stats->cmd_get = 0;
-    stats->get_misses = 0;
-    stats->delete_misses = 0;
-    stats->incr_misses = 0;
-    stats->decr_misses = 0;
-    stats->incr_hits = 0;
-    stats->decr_hits = 0;
-    stats->cas_misses = 0;
-    stats->bytes_written = 0;
-    stats->bytes_read = 0;
-    stats->cmd_flush = 0;
-    stats->conn_yields = 0;
-    stats->auth_cmds = 0;
-    stats->auth_errors = 0;
-
-    memset(stats->slab_stats, 0,
-           sizeof(struct slab_stats) * MAX_NUMBER_OF_SLAB_CLASSES);
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* Clear the counters of a record owned by the calling thread */
+void threadlocal_stats_clear_own(struct thread_stats *stats) {
+    /* The counters run from cmd_get up to the slab stats chunks */
+    memset(&stats->cmd_get, 0, offsetof(struct thread_stats, slab_stats) -
+           offsetof(struct thread_stats, cmd_get));
+    for (int ii = 0; ii < SLAB_STATS_CHUNKS; ++ii) {
+        if (stats->slab_stats[ii] != NULL) {
+            memset(stats->slab_stats[ii], 0,
+                   sizeof(struct slab_stats) * SLAB_STATS_PER_CHUNK);
+        }
+    }
+}
+
+void threadlocal_stats_free(struct thread_stats *stats) {
+    for (int ii = 0; ii < SLAB_STATS_CHUNKS; ++ii) {
+        free(stats->slab_stats[ii]);
+        stats->slab_stats[ii] = NULL;
+    }
+}
+
+struct slab_stats *thread_stats_slab_chunk(struct thread_stats *thread_stats,
+                                           int chunk) {
+    void *ptr;
+    size_t size = sizeof(struct slab_stats) * SLAB_STATS_PER_CHUNK;
+    if (posix_memalign(&ptr, 64, size) != 0) {
+        return NULL;
+    }
+    memset(ptr, 0, size);
+    /* Readers may follow the pointer as soon as they see it */
+    __atomic_store_n(&thread_stats->slab_stats[chunk], ptr, __ATOMIC_RELEASE);
+    return ptr;
 }
 
 void threadlocal_stats_reset(struct thread_stats *thread_stats) {
     int ii;
+    /* The owners clear their records on their next update */
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&thread_stats[ii].mutex);
-        threadlocal_stats_clear(&thread_stats[ii]);
-        pthread_mutex_unlock(&thread_stats[ii].mutex);
+        __sync_add_and_fetch(&thread_stats[ii].resets, 1);
     }
 }
 
-void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats) {
-    int ii, sid;
-    for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&thread_stats[ii].mutex);
-
-        stats->cmd_get += thread_stats[ii].cmd_get;
-        stats->get_misses += thread_stats[ii].get_misses;
-        stats->delete_misses += thread_stats[ii].delete_misses;
-        stats->decr_misses += thread_stats[ii].decr_misses;
-        stats->incr_misses += thread_stats[ii].incr_misses;
-        stats->decr_hits += thread_stats[ii].decr_hits;
-        stats->incr_hits += thread_stats[ii].incr_hits;
-        stats->cas_misses += thread_stats[ii].cas_misses;
-        stats->bytes_read += thread_stats[ii].bytes_read;
-        stats->bytes_written += thread_stats[ii].bytes_written;
-        stats->cmd_flush += thread_stats[ii].cmd_flush;
-        stats->conn_yields += thread_stats[ii].conn_yields;
-        stats->auth_cmds += thread_stats[ii].auth_cmds;
-        stats->auth_errors += thread_stats[ii].auth_errors;
-
-        for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            stats->slab_stats[sid].cmd_set +=
-                thread_stats[ii].slab_stats[sid].cmd_set;
-            stats->slab_stats[sid].get_hits +=
-                thread_stats[ii].slab_stats[sid].get_hits;
-            stats->slab_stats[sid].delete_hits +=
-                thread_stats[ii].slab_stats[sid].delete_hits;
-            stats->slab_stats[sid].cas_hits +=
-                thread_stats[ii].slab_stats[sid].cas_hits;
-            stats->slab_stats[sid].cas_badval +=
-                thread_stats[ii].slab_stats[sid].cas_badval;
+static void slab_stats_add(struct slab_stats *out,
+                           const struct slab_stats *in) {
+    out->cmd_set += in->cmd_set;
+    out->get_hits += in->get_hits;
+    out->delete_hits += in->delete_hits;
+    out->cas_hits += in->cas_hits;
+    out->cas_badval += in->cas_badval;
+}
+
+/*
+ * Copy the counters of the record of another thread without stopping
+ * it, summing its slab stats into slab_other of the copy. The copy is
+ * retried if the owner changed the record meanwhile, and a reset the
+ * owner hasn't carried out yet reads as zeros.
+ */
+static void threadlocal_stats_snapshot(struct thread_stats *thread_stats,
+                                       struct thread_stats *copy) {
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&thread_stats->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, (const void *)thread_stats, sizeof(*copy));
+        for (int ii = 0; ii < SLAB_STATS_CHUNKS; ++ii) {
+            struct slab_stats *chunk =
+                __atomic_load_n(&thread_stats->slab_stats[ii], __ATOMIC_ACQUIRE);
+            if (chunk != NULL) {
+                for (int jj = 0; jj < SLAB_STATS_PER_CHUNK; ++jj) {
+                    slab_stats_add(&copy->slab_other, &chunk[jj]);
+                }
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&thread_stats->seq, __ATOMIC_RELAXED) == seq) {
+            break;
         }
+    }
+    if (copy->resets != copy->resets_done) {
+        threadlocal_stats_clear(copy);
+    }
+}
 
-        pthread_mutex_unlock(&thread_stats[ii].mutex);
+void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats) {
+    int ii;
+    struct thread_stats ts;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        threadlocal_stats_snapshot(&thread_stats[ii], &ts);
+
+        stats->cmd_get += ts.cmd_get;
+        stats->get_misses += ts.get_misses;
+        stats->delete_misses += ts.delete_misses;
+        stats->decr_misses += ts.decr_misses;
+        stats->incr_misses += ts.incr_misses;
+        stats->decr_hits += ts.decr_hits;
+        stats->incr_hits += ts.incr_hits;
+        stats->cas_misses += ts.cas_misses;
+        stats->bytes_read += ts.bytes_read;
+        stats->bytes_written += ts.bytes_written;
+        stats->cmd_flush += ts.cmd_flush;
+        stats->conn_yields += ts.conn_yields;
+        stats->auth_cmds += ts.auth_cmds;
+        stats->auth_errors += ts.auth_errors;
+        stats->udp_recv_calls += ts.udp_recv_calls;
+        stats->udp_datagrams_received += ts.udp_datagrams_received;
+        stats->udp_send_calls += ts.udp_send_calls;
+        stats->udp_datagrams_sent += ts.udp_datagrams_sent;
+        stats->value_bytes_copied += ts.value_bytes_copied;
+        stats->value_bytes_read_inplace += ts.value_bytes_read_inplace;
+        stats->response_flushes += ts.response_flushes;
+        stats->responses_flushed += ts.responses_flushed;
+        slab_stats_add(&stats->slab_other, &ts.slab_other);
     }
 }
 
+/* Sum the slab stats of an aggregate (or of a record the caller owns) */
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
-    int sid;
+    int ii, jj;
 
-    out->cmd_set = 0;
-    out->get_hits = 0;
-    out->delete_hits = 0;
-    out->cas_hits = 0;
-    out->cas_badval = 0;
+    *out = stats->slab_other;
+    for (ii = 0; ii < SLAB_STATS_CHUNKS; ++ii) {
+        if (stats->slab_stats[ii] != NULL) {
+            for (jj = 0; jj < SLAB_STATS_PER_CHUNK; ++jj) {
+                slab_stats_add(out, &stats->slab_stats[ii][jj]);
+            }
+        }
+    }
+}
 
-    for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-        out->cmd_set += stats->slab_stats[sid].cmd_set;
-        out->get_hits += stats->slab_stats[sid].get_hits;
-        out->delete_hits += stats->slab_stats[sid].delete_hits;
-        out->cas_hits += stats->slab_stats[sid].cas_hits;
-        out->cas_badval += stats->slab_stats[sid].cas_badval;
+#ifndef HAVE_UMEM_H
+void suffix_cache_stats(cache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int ii = 0; ii < nthreads; ++ii) {
+        cache_stats_t stats;
+        cache_get_stats(threads[ii].suffix_cache, &stats);
+        out->magazine_hits += stats.magazine_hits;
+        out->pool_refills += stats.pool_refills;
+        out->pool_flushes += stats.pool_flushes;
     }
 }
+#endif
 
 #ifdef ENABLE_SFLOW
 /* do this specially because it does not require a lock to
@@ -893,6 +1081,44 @@ void thread_init(int nthr, struct event_base *main_base,
     pthread_mutex_unlock(&init_lock);
 }
 
+/*
+ * Works out the number of wakeups of each thread during the last second.
+ * Called once a second by the clock handler.
+ */
+void threads_sample_wakeups(void) {
+    for (int ii = 0; ii < nthreads; ++ii) {
+        uint64_t wakeups = threads[ii].wakeups;
+        threads[ii].wakeups_per_sec = wakeups - threads[ii].wakeups_sampled;
+        threads[ii].wakeups_sampled = wakeups;
+    }
+}
+
+/*
+ * The wakeups of each thread. The thread with the highest number is the
+ * tap thread.
+ */
+void threads_wakeup_stats(ADD_STAT add_stats, conn *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen, vlen;
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        APPEND_NUM_STAT(ii, "wakeups", "%"PRIu64, threads[ii].wakeups);
+        APPEND_NUM_STAT(ii, "wakeups_per_sec", "%"PRIu64,
+                        threads[ii].wakeups_per_sec);
+#ifdef USE_IO_URING
+        if (threads[ii].ring != NULL) {
+            uring_stats_t rs;
+            uring_get_stats(threads[ii].ring, &rs);
+            APPEND_NUM_STAT(ii, "ring_submit_calls", "%"PRIu64,
+                            rs.submit_calls);
+            APPEND_NUM_STAT(ii, "ring_submitted", "%"PRIu64, rs.submitted);
+            APPEND_NUM_STAT(ii, "ring_completed", "%"PRIu64, rs.completed);
+        }
+#endif
+    }
+}
+
 void threads_shutdown(void)
 {
     for (int ii = 0; ii < nthreads; ++ii) {
@@ -901,20 +1127,16 @@ void threads_shutdown(void)
     }
     for (int ii = 0; ii < nthreads; ++ii) {
         safe_close(threads[ii].notify[0]);
-        safe_close(threads[ii].notify[1]);
+        if (threads[ii].notify[1] != threads[ii].notify[0]) {
+            safe_close(threads[ii].notify[1]);
+        }
     }
 }
 
 void notify_thread(LIBEVENT_THREAD *thread) {
-    if (send(thread->notify[1], "", 1, 0) != 1) {
-        if (thread == tap_thread) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "Failed to notify TAP thread: %s",
-                                            strerror(errno));
-        } else {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "Failed to notify thread: %s",
-                                            strerror(errno));
-        }
+    /* Only the first of several notifications in a row wakes up the thread */
+    if (__sync_bool_compare_and_swap(&thread->notify_pending, 0, 1)) {
+        signal_notification_pipe(thread->notify[1],
+                                 thread == tap_thread ? "TAP thread" : "thread");
     }
 }
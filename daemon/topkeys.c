@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <memcached/genhash.h>
 #include "topkeys.h"
 
@@ -33,7 +34,7 @@ static int my_hash_eq(const void *k1, size_t nkey1,
     return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
 }
 
-topkeys_t *topkeys_init(int max_keys) {
+topkeys_t *topkeys_init(int max_keys, int nshards) {
     topkeys_t *tk = calloc(sizeof(topkeys_t), 1);
     if (tk == NULL) {
         return NULL;
@@ -44,6 +45,16 @@ topkeys_t *topkeys_init(int max_keys) {
     tk->list.next = &tk->list;
     tk->list.prev = &tk->list;
 
+    if (nshards > 0) {
+        /* The sketches are allocated by their threads when first used */
+        tk->shards = calloc(nshards, sizeof(topkeys_shard_t *));
+        if (tk->shards == NULL) {
+            free(tk);
+            return NULL;
+        }
+        tk->nshards = nshards;
+    }
+
     static struct hash_ops my_hash_ops = {
         .hashfunc = genhash_string_hash,
         .hasheq = my_hash_eq,
@@ -63,6 +74,14 @@ topkeys_t *topkeys_init(int max_keys) {
 void topkeys_free(topkeys_t *tk) {
     pthread_mutex_destroy(&tk->mutex);
     genhash_free(tk->hash);
+    for (int ii = 0; ii < tk->nshards; ++ii) {
+        if (tk->shards[ii] != NULL) {
+            free(tk->shards[ii]->buckets);
+            free(tk->shards[ii]->heap);
+            free(tk->shards[ii]);
+        }
+    }
+    free((void *)tk->shards);
     dlist_t *p = tk->list.next;
     while (p != &tk->list) {
         dlist_t *tmp = p->next;
@@ -122,6 +141,151 @@ topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk, const void *key, size_t
     return item;
 }
 
+static topkeys_shard_t *topkeys_shard_new(int max_keys) {
+    topkeys_shard_t *shard;
+    uint32_t nbuckets = 1;
+    while (nbuckets < (uint32_t)max_keys) {
+        nbuckets <<= 1;
+    }
+
+    shard = calloc(1, sizeof(*shard) + max_keys * sizeof(topkey_entry_t));
+    if (shard == NULL) {
+        return NULL;
+    }
+    shard->mask = nbuckets - 1;
+    shard->buckets = calloc(nbuckets, sizeof(uint32_t));
+    shard->heap = calloc(max_keys, sizeof(uint32_t));
+    if (shard->buckets == NULL || shard->heap == NULL) {
+        free(shard->buckets);
+        free(shard->heap);
+        free(shard);
+        return NULL;
+    }
+    return shard;
+}
+
+static inline uint64_t heap_count(topkeys_shard_t *shard, uint32_t pos) {
+    return shard->entries[shard->heap[pos]].count;
+}
+
+static inline void heap_swap(topkeys_shard_t *shard, uint32_t a, uint32_t b) {
+    uint32_t tmp = shard->heap[a];
+    shard->heap[a] = shard->heap[b];
+    shard->heap[b] = tmp;
+    shard->entries[shard->heap[a]].heap = a;
+    shard->entries[shard->heap[b]].heap = b;
+}
+
+static void heap_up(topkeys_shard_t *shard, uint32_t pos) {
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if (heap_count(shard, parent) <= heap_count(shard, pos)) {
+            break;
+        }
+        heap_swap(shard, parent, pos);
+        pos = parent;
+    }
+}
+
+static void heap_down(topkeys_shard_t *shard, uint32_t pos) {
+    uint32_t n = shard->nused;
+    for (;;) {
+        uint32_t child = pos * 2 + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            heap_count(shard, child + 1) < heap_count(shard, child)) {
+            ++child;
+        }
+        if (heap_count(shard, pos) <= heap_count(shard, child)) {
+            break;
+        }
+        heap_swap(shard, pos, child);
+        pos = child;
+    }
+}
+
+/*
+ * Counts an operation on a key in the sketch of the calling thread, and
+ * returns its entry with the change begun so that the caller can count
+ * the operation itself before topkeys_sketch_done.
+ */
+topkey_entry_t *topkeys_sketch_count(topkeys_t *tk, int thread,
+                                     const void *key, size_t nkey,
+                                     const rel_time_t ctime) {
+    topkeys_shard_t *shard;
+    topkey_entry_t *entry;
+    uint32_t *bucket, idx;
+
+    if (thread < 0 || thread >= tk->nshards || nkey > TK_MAX_KEY_LEN) {
+        return NULL;
+    }
+    shard = tk->shards[thread];
+    if (shard == NULL) {
+        if ((shard = topkeys_shard_new(tk->max_keys)) == NULL) {
+            return NULL;
+        }
+        __atomic_store_n(&tk->shards[thread], shard, __ATOMIC_RELEASE);
+    }
+
+    bucket = &shard->buckets[genhash_string_hash(key, nkey) & shard->mask];
+    for (idx = *bucket; idx != 0; idx = entry->hnext) {
+        entry = &shard->entries[idx - 1];
+        if (entry->nkey == nkey && memcmp(entry->key, key, nkey) == 0) {
+            __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            __atomic_store_n(&entry->count, entry->count + 1, __ATOMIC_RELAXED);
+            entry->atime = ctime;
+            heap_down(shard, entry->heap);
+            return entry;
+        }
+    }
+
+    uint64_t count = 1, error = 0;
+    if (shard->nused < (uint32_t)tk->max_keys) {
+        idx = shard->nused + 1;
+        entry = &shard->entries[idx - 1];
+        entry->heap = shard->nused;
+        shard->heap[entry->heap] = idx - 1;
+    } else {
+        /* Take over the counter of the least counted key */
+        idx = shard->heap[0] + 1;
+        entry = &shard->entries[idx - 1];
+        uint32_t *pos = &shard->buckets[genhash_string_hash(entry->key,
+                                                            entry->nkey) &
+                                        shard->mask];
+        while (*pos != idx) {
+            pos = &shard->entries[*pos - 1].hnext;
+        }
+        *pos = entry->hnext;
+        error = entry->count;
+        count = error + 1;
+    }
+
+    __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(entry->key, key, nkey);
+    entry->nkey = nkey;
+    entry->count = count;
+    entry->error = error;
+    entry->ctime = entry->atime = ctime;
+#define TK_ZERO(name) entry->name = 0;
+    TK_OPS(TK_ZERO)
+#undef TK_ZERO
+    entry->hnext = *bucket;
+    *bucket = idx;
+
+    if (idx > shard->nused) {
+        /* topkeys_stats may read the entry once it sees it counted */
+        __atomic_store_n(&shard->nused, idx, __ATOMIC_RELEASE);
+        heap_up(shard, entry->heap);
+    } else {
+        heap_down(shard, entry->heap);
+    }
+    return entry;
+}
+
 static inline void append_stat(const void *cookie,
                                const char *name,
                                size_t namelen,
@@ -164,6 +328,117 @@ static void tk_iterfunc(dlist_t *list, void *arg) {
     c->add_stat(item->key, item->nkey, val_str, vlen, c->cookie);
 }
 
+/* Copies an entry of another thread, retrying if it changed meanwhile */
+static void topkey_entry_snapshot(topkey_entry_t *entry, topkey_entry_t *copy) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, (const void *)entry, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+static int topkey_entry_cmp(const void *a, const void *b) {
+    const topkey_entry_t *x = *(topkey_entry_t * const *)a;
+    const topkey_entry_t *y = *(topkey_entry_t * const *)b;
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+/*
+ * Merges the sketches of all threads (summing the counts of a key, and
+ * their errors) and reports the max_keys most counted keys, most
+ * counted first.
+ */
+static ENGINE_ERROR_CODE topkeys_sketch_stats(topkeys_t *tk,
+                                              const void *cookie,
+                                              const rel_time_t current_time,
+                                              ADD_STAT add_stat) {
+    static struct hash_ops merge_hash_ops = {
+        .hashfunc = genhash_string_hash,
+        .hasheq = my_hash_eq,
+    };
+    topkey_entry_t **merged = NULL;
+    int nmerged = 0, ii;
+    genhash_t *hash = genhash_init(tk->max_keys, merge_hash_ops);
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (hash == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    for (ii = 0; ii < tk->nshards && ret == ENGINE_SUCCESS; ++ii) {
+        topkeys_shard_t *shard = __atomic_load_n(&tk->shards[ii],
+                                                 __ATOMIC_ACQUIRE);
+        if (shard == NULL) {
+            continue;
+        }
+        uint32_t nused = __atomic_load_n(&shard->nused, __ATOMIC_ACQUIRE);
+        for (uint32_t jj = 0; jj < nused; ++jj) {
+            topkey_entry_t copy;
+            topkey_entry_snapshot(&shard->entries[jj], &copy);
+            if (copy.nkey == 0) {
+                continue;
+            }
+
+            topkey_entry_t *m = genhash_find(hash, copy.key, copy.nkey);
+            if (m == NULL) {
+                if ((nmerged % 256) == 0) {
+                    void *p = realloc(merged, (nmerged + 256) * sizeof(*merged));
+                    if (p == NULL) {
+                        ret = ENGINE_ENOMEM;
+                        break;
+                    }
+                    merged = p;
+                }
+                if ((m = malloc(sizeof(*m))) == NULL) {
+                    ret = ENGINE_ENOMEM;
+                    break;
+                }
+                *m = copy;
+                merged[nmerged++] = m;
+                genhash_update(hash, m->key, m->nkey, m, sizeof(*m));
+                continue;
+            }
+            m->count += copy.count;
+            m->error += copy.error;
+            if (copy.ctime < m->ctime) {
+                m->ctime = copy.ctime;
+            }
+            if (copy.atime > m->atime) {
+                m->atime = copy.atime;
+            }
+#define TK_SUM(name) m->name += copy.name;
+            TK_OPS(TK_SUM)
+#undef TK_SUM
+        }
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        qsort(merged, nmerged, sizeof(*merged), topkey_entry_cmp);
+        for (ii = 0; ii < nmerged && ii < tk->max_keys; ++ii) {
+            topkey_entry_t *item = merged[ii];
+            char val_str[TK_MAX_VAL_LEN];
+            int vlen = snprintf(val_str, sizeof(val_str) - 1, TK_OPS(TK_FMT)"ctime=%"PRIu32",atime=%"PRIu32",count=%"PRIu64",error=%"PRIu64, TK_OPS(TK_ARGS)
+                                current_time - item->ctime, current_time - item->atime,
+                                item->count, item->error);
+            add_stat(item->key, item->nkey, val_str, vlen, cookie);
+        }
+    }
+
+    for (ii = 0; ii < nmerged; ++ii) {
+        free(merged[ii]);
+    }
+    free(merged);
+    genhash_free(hash);
+    return ret;
+}
+
 ENGINE_ERROR_CODE topkeys_stats(topkeys_t *tk,
                                 const void *cookie,
                                 const rel_time_t current_time,
@@ -173,6 +448,9 @@ ENGINE_ERROR_CODE topkeys_stats(topkeys_t *tk,
     context.add_stat = add_stat;
     context.current_time = current_time;
     assert(tk);
+    if (tk->shards != NULL) {
+        return topkeys_sketch_stats(tk, cookie, current_time, add_stat);
+    }
     pthread_mutex_lock(&tk->mutex);
     dlist_iter(&tk->list, tk_iterfunc, &context);
     pthread_mutex_unlock(&tk->mutex);
@@ -13,15 +13,24 @@
 #define TK_MAX_VAL_LEN 250
 
 /* Update the correct stat for a given operation */
-#define TK(tk, op, key, nkey, ctime) { \
+#define TK(tk, thread, op, key, nkey, ctime) { \
     if (tk) { \
         assert(key); \
         assert(nkey > 0); \
-        pthread_mutex_lock(&tk->mutex); \
-        topkey_item_t *tmp = topkeys_item_get_or_create( \
-            (tk), (key), (nkey), (ctime)); \
-        tmp->op++; \
-        pthread_mutex_unlock(&tk->mutex); \
+        if (tk->shards != NULL) { \
+            topkey_entry_t *tmp = topkeys_sketch_count( \
+                (tk), (thread), (key), (nkey), (ctime)); \
+            if (tmp != NULL) { \
+                __atomic_store_n(&tmp->op, tmp->op + 1, __ATOMIC_RELAXED); \
+                topkeys_sketch_done(tmp); \
+            } \
+        } else { \
+            pthread_mutex_lock(&tk->mutex); \
+            topkey_item_t *tmp = topkeys_item_get_or_create( \
+                (tk), (key), (nkey), (ctime)); \
+            tmp->op++; \
+            pthread_mutex_unlock(&tk->mutex); \
+        } \
     } \
 }
 
@@ -40,15 +49,58 @@ typedef struct topkey_item {
     char key[]; /* A variable length array in the struct itself */
 } topkey_item_t;
 
+/*
+ * In the "frequent" mode every thread counts the keys it sees in a
+ * sketch of its own (Space-Saving): a fixed table of max_keys counters
+ * where a key that isn't there takes over the counter of the least
+ * counted key, inheriting its count as the error of the estimate. Only
+ * the owning thread changes its sketch; the sequence number of an entry
+ * is odd while it does, so that topkeys_stats can copy the entries of
+ * all sketches without a lock and merge them.
+ */
+#define TK_MAX_KEY_LEN 250
+
+typedef struct topkey_entry {
+    volatile uint32_t seq;
+    uint32_t hnext; /* next entry in the hash chain (index + 1) */
+    uint32_t heap;  /* position in the heap of the sketch */
+    uint32_t nkey;  /* 0 if the entry is unused */
+    uint64_t count; /* estimated number of operations on the key */
+    uint64_t error; /* how much the estimate may be too high */
+    rel_time_t ctime, atime; /* Time the key got the entry/was last counted */
+#define TK_CUR(name) int name;
+    TK_OPS(TK_CUR)
+#undef TK_CUR
+    char key[TK_MAX_KEY_LEN];
+} topkey_entry_t;
+
+typedef struct topkeys_shard {
+    volatile uint32_t nused; /* entries in use, from the start */
+    uint32_t mask;     /* of the hash table */
+    uint32_t *buckets; /* hash chains (index + 1) */
+    uint32_t *heap;    /* entries, least counted first */
+    topkey_entry_t entries[];
+} topkeys_shard_t;
+
 typedef struct topkeys {
     dlist_t list;
     pthread_mutex_t mutex;
     genhash_t *hash;
     int nkeys;
     int max_keys;
+    int nshards;
+    topkeys_shard_t * volatile *shards; /* NULL unless "frequent" */
 } topkeys_t;
 
-topkeys_t *topkeys_init(int max_keys);
+topkeys_t *topkeys_init(int max_keys, int nshards);
+topkey_entry_t *topkeys_sketch_count(topkeys_t *tk, int shard, const void *key, size_t nkey, const rel_time_t ctime);
+
+/* Ends the change topkeys_sketch_count began */
+static inline void topkeys_sketch_done(topkey_entry_t *entry) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+}
+
 void topkeys_free(topkeys_t *topkeys);
 topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk, const void *key, size_t nkey, const rel_time_t ctime);
 ENGINE_ERROR_CODE topkeys_stats(topkeys_t *tk, const void *cookie, const rel_time_t current_time, ADD_STAT add_stat);
@@ -0,0 +1,287 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+struct uring {
+    int fd;
+
+    /* submission queue (shared with the kernel) */
+    volatile unsigned *sq_head;
+    volatile unsigned *sq_tail;
+    volatile unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;          /* entries handed out by uring_get_sqe() */
+
+    /* completion queue (shared with the kernel) */
+    volatile unsigned *cq_head;
+    volatile unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* receive buffers provided to the kernel */
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    unsigned nbufs;
+    unsigned bufsize;
+    char *bufs;
+
+    uring_stats_t stats;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void add_buffer(struct uring *ring, unsigned bid) {
+    struct io_uring_buf *buf;
+    buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->nbufs - 1)];
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * ring->bufsize);
+    buf->len = ring->bufsize;
+    buf->bid = bid;
+    ++ring->buf_tail;
+}
+
+static void publish_buffers(struct uring *ring) {
+    __sync_synchronize();
+    ring->buf_ring->tail = ring->buf_tail;
+}
+
+static bool setup_buffers(struct uring *ring, unsigned nbufs,
+                          unsigned bufsize) {
+    size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+    void *mem;
+
+    /* The kernel wants the buffer ring page aligned */
+    if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), ring_size) != 0) {
+        return false;
+    }
+    memset(mem, 0, ring_size);
+    ring->buf_ring = mem;
+    ring->nbufs = nbufs;
+    ring->bufsize = bufsize;
+
+    ring->bufs = malloc((size_t)nbufs * bufsize);
+    if (ring->bufs == NULL) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = nbufs;
+    reg.bgid = 0;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING,
+                              &reg, 1) != 0) {
+        return false;
+    }
+
+    for (unsigned ii = 0; ii < nbufs; ++ii) {
+        add_buffer(ring, ii);
+    }
+    publish_buffers(ring);
+    return true;
+}
+
+struct uring *uring_create(unsigned entries, unsigned nbufs, unsigned bufsize) {
+    struct io_uring_params p;
+    struct uring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_destroy(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (!setup_buffers(ring, nbufs, bufsize)) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+void uring_destroy(struct uring *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    free(ring->buf_ring);
+    free(ring->bufs);
+    free(ring);
+}
+
+int uring_fd(struct uring *ring) {
+    return ring->fd;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    if (ring->sqe_tail - *ring->sq_head >= ring->sq_entries) {
+        /* Make room by handing what we have to the kernel */
+        if (uring_submit(ring) == -1 ||
+            ring->sqe_tail - *ring->sq_head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring->sqe_tail;
+    return sqe;
+}
+
+int uring_submit(struct uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned flags = 0;
+
+    for (; tail != ring->sqe_tail; ++tail) {
+        ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    }
+    __sync_synchronize();
+    *ring->sq_tail = tail;
+    __sync_synchronize();
+
+    unsigned to_submit = tail - *ring->sq_head;
+    if (*ring->sq_flags & IORING_SQ_CQ_OVERFLOW) {
+        /* Let the kernel move the completions it couldn't post yet */
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (to_submit == 0 && flags == 0) {
+        return 0;
+    }
+
+    int ret;
+    do {
+        ret = sys_io_uring_enter(ring->fd, to_submit, 0, flags);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret >= 0) {
+        ++ring->stats.submit_calls;
+        ring->stats.submitted += ret;
+    }
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == *ring->cq_tail) {
+        return NULL;
+    }
+    __sync_synchronize();
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __sync_synchronize();
+    *ring->cq_head = *ring->cq_head + 1;
+    ++ring->stats.completed;
+}
+
+char *uring_buffer(struct uring *ring, unsigned flags) {
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    return ring->bufs + (size_t)bid * ring->bufsize;
+}
+
+void uring_buffer_release(struct uring *ring, unsigned flags) {
+    add_buffer(ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    publish_buffers(ring);
+}
+
+void uring_get_stats(struct uring *ring, uring_stats_t *out) {
+    *out = ring->stats;
+}
@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring wrapper (without liburing) used by the worker threads
+ * for their network IO. Each ring owns a group of equally sized buffers
+ * that the kernel picks from when a receive completes, so idle connections
+ * don't tie up any memory.
+ *
+ * A ring is only ever used by one thread.
+ */
+struct uring;
+
+/**
+ * Create a new ring.
+ *
+ * @param entries the number of submission queue entries
+ * @param nbufs the number of receive buffers (a power of two)
+ * @param bufsize the size of each receive buffer
+ * @return the ring, or NULL if io_uring isn't available
+ */
+struct uring *uring_create(unsigned entries, unsigned nbufs, unsigned bufsize);
+
+void uring_destroy(struct uring *ring);
+
+/** The file descriptor that becomes readable when completions arrive */
+int uring_fd(struct uring *ring);
+
+/**
+ * Get an entry to fill in and submit later. The entry is cleared, and
+ * reads with IOSQE_BUFFER_SELECT should use buf_group 0.
+ *
+ * @return the entry, or NULL if the submission queue is full and can't
+ *         be submitted
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * Submit all entries filled in since the last call.
+ *
+ * @return the number of entries submitted, or -1 on error
+ */
+int uring_submit(struct uring *ring);
+
+/** The next completion, or NULL if there is none */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/** Release the completion returned by uring_peek_cqe() */
+void uring_cqe_seen(struct uring *ring);
+
+/** The receive buffer a completion with IORING_CQE_F_BUFFER refers to */
+char *uring_buffer(struct uring *ring, unsigned flags);
+
+/** Give the buffer of such a completion back to the kernel */
+void uring_buffer_release(struct uring *ring, unsigned flags);
+
+typedef struct {
+    uint64_t submit_calls; /* number of io_uring_enter() calls */
+    uint64_t submitted;    /* number of entries submitted by them */
+    uint64_t completed;    /* number of completions seen */
+} uring_stats_t;
+
+void uring_get_stats(struct uring *ring, uring_stats_t *out);
+
+#endif
@@ -11,21 +11,354 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "default_engine.h"
 
 #define hashsize(n) ((uint32_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
+/*
+ * Give up the lock free walk of a hash chain after this many items; the
+ * chain is either very long or is being modified under our feet.
+ */
+#define MAX_UNLOCKED_DEPTH 64
+
+/* Grow the table when it holds this many items */
+static inline unsigned int assoc_expand_threshold(struct default_engine *engine) {
+    if (engine->assoc.bucketed) {
+        /* Keep the buckets two thirds full on average */
+        return (hashsize(engine->assoc.hashpower) * ASSOC_BUCKET_SLOTS * 2) / 3;
+    }
+    return (hashsize(engine->assoc.hashpower) * 3) / 2;
+}
+
+/* Buckets must be cache line aligned for the index to pay off */
+static struct assoc_bucket *assoc_bucket_alloc(size_t nbuckets) {
+    void *ptr;
+    size_t size = nbuckets * sizeof(struct assoc_bucket);
+    if (posix_memalign(&ptr, 64, size) != 0) {
+        return NULL;
+    }
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+/* The tag of a key is the top byte of its hash, with 0 meaning "free" */
+static inline uint8_t assoc_tag(uint32_t hash) {
+    uint8_t tag = hash >> 24;
+    return tag == 0 ? 1 : tag;
+}
+
+#define ASSOC_SLOT_MASK ((1U << ASSOC_BUCKET_SLOTS) - 1)
+
+/*
+ * Return a bitmask of the slots in a bucket with the given tag (pass 0 to
+ * get the free slots). The tags (and the padding after them) are 8 bytes,
+ * so they are compared all at once: with one SSE2 compare when we can, or
+ * with a SWAR compare of a 64 bit word otherwise.
+ */
+static inline unsigned int assoc_match_tags(struct default_engine *engine,
+                                            const struct assoc_bucket *b,
+                                            uint8_t tag) {
+#ifdef __SSE2__
+    if (engine->assoc.simd) {
+        __m128i tags = _mm_loadl_epi64((const __m128i *)b);
+        __m128i eq = _mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag));
+        return (unsigned int)_mm_movemask_epi8(eq) & ASSOC_SLOT_MASK;
+    }
+#endif
+
+    uint64_t word;
+    memcpy(&word, (const void *)b->tags, sizeof(word));
+    /* Bytes equal to the tag become zero; find the zero bytes */
+    word ^= 0x0101010101010101ULL * tag;
+    word = ~(((word & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) |
+             word | 0x7f7f7f7f7f7f7f7fULL);
+
+    unsigned int mask = 0;
+    for (int ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+#ifdef WORDS_BIGENDIAN
+        mask |= ((word >> (56 - ii * 8)) & 0x80) ? (1U << ii) : 0;
+#else
+        mask |= ((word >> (ii * 8)) & 0x80) ? (1U << ii) : 0;
+#endif
+    }
+    return mask;
+}
+
+static void assoc_reader_release(void *arg) {
+    struct assoc_reader *reader = arg;
+    reader->in_use = 0;
+}
+
 ENGINE_ERROR_CODE assoc_init(struct default_engine *engine) {
+    engine->assoc.bucketed = engine->config.bucketed_hash;
+    if (engine->assoc.bucketed && engine->assoc.hashpower > 2) {
+        /* A bucket holds several items, so start with fewer of them */
+        engine->assoc.hashpower -= 2;
+    }
+    if (engine->assoc.lockpower > engine->assoc.hashpower) {
+        engine->assoc.lockpower = engine->assoc.hashpower;
+    }
+
+    engine->assoc.stripes = calloc(hashsize(engine->assoc.lockpower),
+                                   sizeof(struct assoc_stripe));
+    if (engine->assoc.stripes == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    for (uint32_t ii = 0; ii < hashsize(engine->assoc.lockpower); ++ii) {
+        pthread_mutex_init(&engine->assoc.stripes[ii].lock, NULL);
+    }
+
+    engine->assoc.readers = calloc(ASSOC_MAX_READERS,
+                                   sizeof(struct assoc_reader));
+    if (engine->assoc.readers == NULL ||
+        pthread_key_create(&engine->assoc.reader_key,
+                           assoc_reader_release) != 0) {
+        free(engine->assoc.readers);
+        engine->assoc.readers = NULL;
+        return ENGINE_ENOMEM;
+    }
+
+    if (engine->assoc.bucketed) {
+#if defined(__SSE2__) && defined(__GNUC__)
+        engine->assoc.simd = engine->config.simd_tags &&
+            __builtin_cpu_supports("sse2");
+#elif defined(__SSE2__)
+        engine->assoc.simd = engine->config.simd_tags;
+#endif
+        engine->assoc.primary_buckets =
+            assoc_bucket_alloc(hashsize(engine->assoc.hashpower));
+        return (engine->assoc.primary_buckets != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
+    }
+
     engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower), sizeof(void *));
     return (engine->assoc.primary_hashtable != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
 }
 
+/* Free a table of the bucketed index, with its overflow buckets */
+static void assoc_free_buckets(struct assoc_bucket *buckets, size_t nbuckets) {
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t ii = 0; ii < nbuckets; ++ii) {
+        struct assoc_bucket *next = buckets[ii].next;
+        while (next != NULL) {
+            struct assoc_bucket *b = next;
+            next = b->next;
+            free(b);
+        }
+    }
+    free(buckets);
+}
+
+void assoc_destroy(struct default_engine *engine) {
+    if (engine->assoc.stripes != NULL) {
+        for (uint32_t ii = 0; ii < hashsize(engine->assoc.lockpower); ++ii) {
+            pthread_mutex_destroy(&engine->assoc.stripes[ii].lock);
+        }
+        free(engine->assoc.stripes);
+        engine->assoc.stripes = NULL;
+    }
+    if (engine->assoc.readers != NULL) {
+        pthread_key_delete(engine->assoc.reader_key);
+        free(engine->assoc.readers);
+        engine->assoc.readers = NULL;
+    }
+    free(engine->assoc.primary_hashtable);
+    engine->assoc.primary_hashtable = NULL;
+    free(engine->assoc.old_hashtable);
+    engine->assoc.old_hashtable = NULL;
+    assoc_free_buckets(engine->assoc.primary_buckets,
+                       hashsize(engine->assoc.hashpower));
+    engine->assoc.primary_buckets = NULL;
+    if (engine->assoc.expanding) {
+        assoc_free_buckets(engine->assoc.old_buckets,
+                           hashsize(engine->assoc.hashpower - 1));
+    }
+    engine->assoc.old_buckets = NULL;
+    /* The overflow buckets of a retired table were moved to the new one */
+    free(engine->assoc.retired_table);
+    engine->assoc.retired_table = NULL;
+}
+
+static inline struct assoc_stripe *assoc_get_stripe(struct default_engine *engine,
+                                                    uint32_t hash) {
+    return &engine->assoc.stripes[hash & hashmask(engine->assoc.lockpower)];
+}
+
+void assoc_lock(struct default_engine *engine, uint32_t hash) {
+    pthread_mutex_t *lock = &assoc_get_stripe(engine, hash)->lock;
+    if (pthread_mutex_trylock(lock) != 0) {
+        __sync_fetch_and_add(&engine->stats.item_lock_contended, 1);
+        pthread_mutex_lock(lock);
+    }
+}
+
+bool assoc_trylock(struct default_engine *engine, uint32_t hash) {
+    return pthread_mutex_trylock(&assoc_get_stripe(engine, hash)->lock) == 0;
+}
+
+void assoc_unlock(struct default_engine *engine, uint32_t hash) {
+    pthread_mutex_unlock(&assoc_get_stripe(engine, hash)->lock);
+}
+
+void assoc_lock_all(struct default_engine *engine) {
+    for (uint32_t ii = 0; ii < hashsize(engine->assoc.lockpower); ++ii) {
+        pthread_mutex_lock(&engine->assoc.stripes[ii].lock);
+    }
+}
+
+void assoc_unlock_all(struct default_engine *engine) {
+    for (uint32_t ii = 0; ii < hashsize(engine->assoc.lockpower); ++ii) {
+        pthread_mutex_unlock(&engine->assoc.stripes[ii].lock);
+    }
+}
+
+/* Called with the stripe lock held around changes to its chains */
+static inline void assoc_write_begin(struct assoc_stripe *stripe) {
+    stripe->seq++;
+    __sync_synchronize();
+}
+
+static inline void assoc_write_end(struct assoc_stripe *stripe) {
+    __sync_synchronize();
+    stripe->seq++;
+}
+
+struct assoc_reader *assoc_reader_enter(struct default_engine *engine) {
+    struct assoc_reader *reader;
+    reader = pthread_getspecific(engine->assoc.reader_key);
+    if (reader == NULL) {
+        for (int ii = 0; ii < ASSOC_MAX_READERS; ++ii) {
+            if (__sync_bool_compare_and_swap(&engine->assoc.readers[ii].in_use,
+                                             0, 1)) {
+                reader = &engine->assoc.readers[ii];
+                break;
+            }
+        }
+        if (reader == NULL ||
+            pthread_setspecific(engine->assoc.reader_key, reader) != 0) {
+            if (reader != NULL) {
+                reader->in_use = 0;
+            }
+            return NULL;
+        }
+    }
+
+    /* Full barrier: the lookup must not start before we're visible */
+    __sync_add_and_fetch(&reader->seq, 1);
+    return reader;
+}
+
+void assoc_reader_exit(struct assoc_reader *reader) {
+    __sync_add_and_fetch(&reader->seq, 1);
+}
+
+void assoc_synchronize(struct default_engine *engine) {
+    __sync_synchronize();
+    for (int ii = 0; ii < ASSOC_MAX_READERS; ++ii) {
+        struct assoc_reader *reader = &engine->assoc.readers[ii];
+        uint64_t seq = reader->seq;
+        if (seq & 1) {
+            while (reader->seq == seq) {
+                sched_yield();
+            }
+        }
+    }
+}
+
+static void assoc_migrate(struct default_engine *engine, uint32_t hash);
+
+/*
+ * Look for a key in a bucket (and its overflow buckets). Only items with
+ * the right tag are looked at. Lock free readers may see a slot being
+ * filled or emptied, so a slot without an item is skipped.
+ */
+static hash_item *assoc_bucket_find(struct default_engine *engine,
+                                    struct assoc_bucket *b, uint8_t tag,
+                                    const char *key, const size_t nkey,
+                                    int *depth) {
+    for (; b != NULL; b = b->next) {
+        unsigned int mask = assoc_match_tags(engine, b, tag);
+        while (mask != 0) {
+            int ii = __builtin_ctz(mask);
+            mask &= mask - 1;
+            hash_item *it = b->items[ii];
+            if (it != NULL && nkey == it->nkey &&
+                memcmp(key, item_get_key(it), nkey) == 0) {
+                return it;
+            }
+            ++*depth;
+        }
+    }
+    return NULL;
+}
+
+static struct assoc_bucket *assoc_get_bucket(struct default_engine *engine,
+                                             uint32_t hash) {
+    unsigned int oldbucket;
+
+    if (engine->assoc.expanding &&
+        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
+    {
+        return &engine->assoc.old_buckets[oldbucket];
+    }
+    return &engine->assoc.primary_buckets[hash & hashmask(engine->assoc.hashpower)];
+}
+
+/*
+ * Put an item in the first free slot of a bucket. The item pointer is
+ * stored before the tag, so a reader that matches the tag finds it.
+ * Returns false if we needed an overflow bucket but couldn't get one.
+ */
+static bool assoc_bucket_insert(struct default_engine *engine,
+                                struct assoc_bucket *b, uint8_t tag,
+                                hash_item *it) {
+    struct assoc_bucket *last = b;
+    for (; b != NULL; last = b, b = b->next) {
+        unsigned int mask = assoc_match_tags(engine, b, 0);
+        if (mask != 0) {
+            int ii = __builtin_ctz(mask);
+            b->items[ii] = it;
+            __sync_synchronize();
+            b->tags[ii] = tag;
+            return true;
+        }
+    }
+
+    struct assoc_bucket *overflow = assoc_bucket_alloc(1);
+    if (overflow == NULL) {
+        return false;
+    }
+    __sync_add_and_fetch(&engine->assoc.overflow_buckets, 1);
+    overflow->items[0] = it;
+    overflow->tags[0] = tag;
+    __sync_synchronize();
+    last->next = overflow;
+    return true;
+}
+
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
     hash_item *it;
     unsigned int oldbucket;
 
+    assoc_migrate(engine, hash);
+
+    if (engine->assoc.bucketed) {
+        int depth = 0;
+        it = assoc_bucket_find(engine, assoc_get_bucket(engine, hash),
+                               assoc_tag(hash), key, nkey, &depth);
+        MEMCACHED_ASSOC_FIND(key, nkey, depth);
+        return it;
+    }
+
     if (engine->assoc.expanding &&
         (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
     {
@@ -48,6 +381,140 @@ hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *
     return ret;
 }
 
+bool assoc_find_unlocked(struct default_engine *engine, uint32_t hash,
+                         const char *key, const size_t nkey,
+                         hash_item **itp) {
+    struct assoc_stripe *stripe = assoc_get_stripe(engine, hash);
+    unsigned int seq = stripe->seq;
+    unsigned int generation = engine->assoc.generation;
+    if ((seq & 1) || (generation & 1)) {
+        return false;
+    }
+    __sync_synchronize();
+
+    hash_item *it;
+    unsigned int oldbucket;
+    unsigned int hashpower = engine->assoc.hashpower;
+    hash_item **primary = engine->assoc.primary_hashtable;
+    hash_item **old = engine->assoc.old_hashtable;
+    struct assoc_bucket *primary_buckets = engine->assoc.primary_buckets;
+    struct assoc_bucket *old_buckets = engine->assoc.old_buckets;
+    bool expanding = engine->assoc.expanding;
+    __sync_synchronize();
+    if (engine->assoc.generation != generation) {
+        return false;
+    }
+
+    if (engine->assoc.bucketed) {
+        /*
+         * Overflow buckets are never freed or looped, so the walk ends
+         * even if the bucket is being changed.
+         */
+        struct assoc_bucket *b;
+        int depth = 0;
+        if (expanding &&
+            (oldbucket = (hash & hashmask(hashpower - 1))) >= engine->assoc.expand_bucket)
+        {
+            b = &old_buckets[oldbucket];
+        } else {
+            b = &primary_buckets[hash & hashmask(hashpower)];
+        }
+        it = assoc_bucket_find(engine, b, assoc_tag(hash), key, nkey, &depth);
+        if (it == NULL) {
+            __sync_synchronize();
+            if (stripe->seq != seq) {
+                return false;
+            }
+        }
+        *itp = it;
+        return true;
+    }
+
+    /*
+     * The tables we got can't be freed before we leave the read side
+     * section, and the bucket we're in can't migrate without bumping
+     * the stripe seq.
+     */
+    if (expanding &&
+        (oldbucket = (hash & hashmask(hashpower - 1))) >= engine->assoc.expand_bucket)
+    {
+        it = old[oldbucket];
+    } else {
+        it = primary[hash & hashmask(hashpower)];
+    }
+
+    int depth = 0;
+    while (it) {
+        if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
+            break;
+        }
+        it = it->h_next;
+        if (++depth > MAX_UNLOCKED_DEPTH) {
+            return false;
+        }
+    }
+
+    if (it == NULL) {
+        /* Make sure we didn't miss it because the chain changed */
+        __sync_synchronize();
+        if (stripe->seq != seq) {
+            return false;
+        }
+    }
+
+    *itp = it;
+    return true;
+}
+
+void assoc_prefetch(struct default_engine *engine, uint32_t hash,
+                    bool items) {
+    unsigned int generation = engine->assoc.generation;
+    if (generation & 1) {
+        return;
+    }
+    __sync_synchronize();
+
+    unsigned int hashpower = engine->assoc.hashpower;
+    hash_item **primary = engine->assoc.primary_hashtable;
+    hash_item **old = engine->assoc.old_hashtable;
+    struct assoc_bucket *primary_buckets = engine->assoc.primary_buckets;
+    struct assoc_bucket *old_buckets = engine->assoc.old_buckets;
+    bool expanding = engine->assoc.expanding;
+    __sync_synchronize();
+    if (engine->assoc.generation != generation) {
+        return;
+    }
+
+    unsigned int oldbucket = hash & hashmask(hashpower - 1);
+    bool in_old = expanding && oldbucket >= engine->assoc.expand_bucket;
+
+    if (engine->assoc.bucketed) {
+        struct assoc_bucket *b = in_old ? &old_buckets[oldbucket]
+            : &primary_buckets[hash & hashmask(hashpower)];
+        if (!items) {
+            __builtin_prefetch(b);
+            return;
+        }
+        /* The items with the right tag (usually the one we look for) */
+        unsigned int mask = assoc_match_tags(engine, b, assoc_tag(hash));
+        while (mask != 0) {
+            int ii = __builtin_ctz(mask);
+            mask &= mask - 1;
+            __builtin_prefetch(b->items[ii]);
+        }
+        return;
+    }
+
+    hash_item **slot = in_old ? &old[oldbucket]
+        : &primary[hash & hashmask(hashpower)];
+    if (!items) {
+        __builtin_prefetch(slot);
+    } else {
+        /* The head of the chain */
+        __builtin_prefetch(*slot);
+    }
+}
+
 /* returns the address of the item pointer before the key.  if *item == 0,
    the item wasn't found */
 
@@ -74,79 +541,323 @@ static hash_item** _hashitem_before(struct default_engine *engine,
 
 static void *assoc_maintenance_thread(void *arg);
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(struct default_engine *engine) {
-    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+static uint64_t assoc_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower + 1), sizeof(void *));
-    if (engine->assoc.primary_hashtable) {
-        engine->assoc.hashpower++;
-        engine->assoc.expanding = true;
-        engine->assoc.expand_bucket = 0;
+/*
+ * Start the maintenance thread, which grows the table and frees the old
+ * one once it is no longer in use. The caller may hold stripe locks, so
+ * it can't do either of those itself.
+ */
+static void assoc_schedule_maintenance(struct default_engine *engine) {
+    if (!__sync_bool_compare_and_swap(&engine->assoc.expand_scheduled,
+                                      false, true)) {
+        return;
+    }
 
-        /* start a thread to do the expansion */
-        int ret = 0;
-        pthread_t tid;
-        pthread_attr_t attr;
+    int ret = 0;
+    pthread_t tid;
+    pthread_attr_t attr;
 
-        if (pthread_attr_init(&attr) != 0 ||
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
-            (ret = pthread_create(&tid, &attr,
-                                  assoc_maintenance_thread, engine)) != 0)
-        {
+    if (pthread_attr_init(&attr) != 0 ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+        (ret = pthread_create(&tid, &attr,
+                              assoc_maintenance_thread, engine)) != 0)
+    {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Can't create thread: %s\n", strerror(ret));
+        engine->assoc.expand_scheduled = false;
+    }
+}
+
+/*
+ * Split a bucket of the bucketed index into the two primary buckets it
+ * maps to. Those are still empty (new items go to the old bucket until it
+ * is moved), and the overflow buckets of the old bucket are enough to hold
+ * whatever doesn't fit in them, so we never need to allocate memory here.
+ * The overflow buckets are reused in the order we read them, and never
+ * before we've read them. A lock free reader may still be walking one we
+ * reuse; it sees the stripe seq change and retries.
+ */
+static void assoc_split_bucket(struct default_engine *engine,
+                               unsigned int oldbucket) {
+    struct assoc_bucket *old = &engine->assoc.old_buckets[oldbucket];
+    struct assoc_bucket *spare = old->next;
+    struct assoc_bucket *tails[2] = {
+        &engine->assoc.primary_buckets[oldbucket],
+        &engine->assoc.primary_buckets[oldbucket + hashsize(engine->assoc.hashpower - 1)]
+    };
+    int used[2] = { 0, 0 };
+
+    for (struct assoc_bucket *b = old; b != NULL; ) {
+        hash_item *items[ASSOC_BUCKET_SLOTS];
+        uint8_t tags[ASSOC_BUCKET_SLOTS];
+        int nitems = 0;
+        for (int ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+            if (b->tags[ii] != 0) {
+                items[nitems] = b->items[ii];
+                tags[nitems++] = b->tags[ii];
+            }
+        }
+        b = b->next;
+
+        for (int ii = 0; ii < nitems; ++ii) {
+            hash_item *it = items[ii];
+            uint32_t hash = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+            int half = (hash & hashsize(engine->assoc.hashpower - 1)) ? 1 : 0;
+
+            if (used[half] == ASSOC_BUCKET_SLOTS) {
+                struct assoc_bucket *overflow = spare;
+                assert(overflow != NULL);
+                spare = spare->next;
+                memset(overflow, 0, sizeof(*overflow));
+                tails[half]->next = overflow;
+                tails[half] = overflow;
+                used[half] = 0;
+            }
+            tails[half]->items[used[half]] = it;
+            tails[half]->tags[used[half]] = tags[ii];
+            ++used[half];
+        }
+    }
+
+    /* Keep the overflow buckets we didn't need for later inserts */
+    for (struct assoc_bucket *b = spare; b != NULL; b = b->next) {
+        memset((void*)b->tags, 0, sizeof(b->tags));
+        memset((void*)b->items, 0, sizeof(b->items));
+    }
+    tails[0]->next = spare;
+    memset(old, 0, sizeof(*old));
+}
+
+/*
+ * Move the next bucket of the old table over to the primary table. The
+ * caller holds the stripe lock covering it. Returns false once all of the
+ * buckets have been moved.
+ */
+static bool assoc_move_bucket(struct default_engine *engine) {
+    hash_item *it, *next;
+    int bucket;
+    unsigned int oldbucket = engine->assoc.expand_bucket;
+    struct assoc_stripe *stripe = assoc_get_stripe(engine, oldbucket);
+
+    assoc_write_begin(stripe);
+    if (engine->assoc.bucketed) {
+        assoc_split_bucket(engine, oldbucket);
+    } else {
+        for (it = engine->assoc.old_hashtable[oldbucket];
+             NULL != it; it = next) {
+            next = it->h_next;
+
+            bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
+                & hashmask(engine->assoc.hashpower);
+            it->h_next = engine->assoc.primary_hashtable[bucket];
+            __sync_synchronize();
+            engine->assoc.primary_hashtable[bucket] = it;
+        }
+        engine->assoc.old_hashtable[oldbucket] = NULL;
+    }
+
+    __sync_synchronize();
+    engine->assoc.expand_bucket++;
+
+    bool more = true;
+    if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
+        /*
+         * Every bucket is migrated, so nobody will look in the old table
+         * again (they all compare with expand_bucket). Lock free readers
+         * may still be walking it, so it is freed after a grace period.
+         */
+        engine->assoc.generation++;
+        __sync_synchronize();
+        if (engine->assoc.bucketed) {
+            engine->assoc.retired_table = engine->assoc.old_buckets;
+            engine->assoc.old_buckets = NULL;
+        } else {
+            engine->assoc.retired_table = engine->assoc.old_hashtable;
+            engine->assoc.old_hashtable = NULL;
+        }
+        __sync_synchronize();
+        engine->assoc.expanding = false;
+        __sync_synchronize();
+        engine->assoc.generation++;
+        engine->assoc.expand_duration = assoc_usec() - engine->assoc.expand_started;
+        more = false;
+        if (engine->config.verbose > 1) {
             EXTENSION_LOGGER_DESCRIPTOR *logger;
             logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-            logger->log(EXTENSION_LOG_WARNING, NULL,
-                        "Can't create thread: %s\n", strerror(ret));
-            engine->assoc.hashpower--;
-            engine->assoc.expanding = false;
-            free(engine->assoc.primary_hashtable);
-            engine->assoc.primary_hashtable =engine->assoc.old_hashtable;
+            logger->log(EXTENSION_LOG_INFO, NULL,
+                        "Hash table expansion done\n");
         }
-    } else {
-        engine->assoc.primary_hashtable = engine->assoc.old_hashtable;
-        /* Bad news, but we can keep running. */
     }
+    assoc_write_end(stripe);
+    return more;
+}
+
+#define DEFAULT_HASH_BULK_MOVE 1
+int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+
+/*
+ * Inline expansion: move up to hash_bulk_move buckets of the old table
+ * on behalf of an insert or lookup. The caller holds the stripe lock for
+ * hash, and the stripes of the buckets to move are only tried so we
+ * can't deadlock (or wait) here.
+ */
+static void assoc_migrate(struct default_engine *engine, uint32_t hash) {
+    if (!engine->config.inline_expand || !engine->assoc.expanding ||
+        pthread_mutex_trylock(&engine->assoc.migrate_lock) != 0) {
+        return;
+    }
+
+    uint32_t held = hash & hashmask(engine->assoc.lockpower);
+    bool done = false;
+    for (int ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
+        unsigned int oldbucket = engine->assoc.expand_bucket;
+        bool locked = (oldbucket & hashmask(engine->assoc.lockpower)) == held;
+        if (!locked && !assoc_trylock(engine, oldbucket)) {
+            break;
+        }
+        done = !assoc_move_bucket(engine);
+        if (!locked) {
+            assoc_unlock(engine, oldbucket);
+        }
+    }
+    pthread_mutex_unlock(&engine->assoc.migrate_lock);
+
+    if (done) {
+        assoc_schedule_maintenance(engine);
+    }
+}
+
+void assoc_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie) {
+    char val[128];
+    int len;
+    unsigned int hashpower = engine->assoc.hashpower;
+    bool expanding = engine->assoc.expanding;
+
+    len = sprintf(val, "%u", hashpower);
+    add_stat("hash_power_level", 16, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, (uint64_t)hashsize(hashpower) *
+                  (engine->assoc.bucketed ? sizeof(struct assoc_bucket) : sizeof(void *)));
+    add_stat("hash_bytes", 10, val, len, cookie);
+    if (engine->assoc.bucketed) {
+        len = sprintf(val, "%u", engine->assoc.overflow_buckets);
+        add_stat("hash_overflow_buckets", 21, val, len, cookie);
+    }
+    len = sprintf(val, "%u", engine->assoc.hash_items);
+    add_stat("hash_items", 10, val, len, cookie);
+    add_stat("hash_is_expanding", 17, expanding ? "1" : "0", 1, cookie);
+    len = sprintf(val, "%u", expanding ? engine->assoc.expand_bucket : 0);
+    add_stat("hash_expand_bucket", 18, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, engine->assoc.expansions);
+    add_stat("hash_expansions", 15, val, len, cookie);
+    /* The running expansion, or the last one if none is running */
+    len = sprintf(val, "%"PRIu64, expanding ?
+                  assoc_usec() - engine->assoc.expand_started :
+                  engine->assoc.expand_duration);
+    add_stat("hash_expand_usec", 16, val, len, cookie);
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(struct default_engine *engine, uint32_t hash, hash_item *it) {
     unsigned int oldbucket;
+    hash_item **bucket;
+    struct assoc_stripe *stripe = assoc_get_stripe(engine, hash);
 
+    assoc_migrate(engine, hash);
     assert(assoc_find(engine, hash, item_get_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it->h_next = engine->assoc.old_hashtable[oldbucket];
-        engine->assoc.old_hashtable[oldbucket] = it;
+    if (engine->assoc.bucketed) {
+        bool inserted;
+        assoc_write_begin(stripe);
+        inserted = assoc_bucket_insert(engine, assoc_get_bucket(engine, hash),
+                                       assoc_tag(hash), it);
+        assoc_write_end(stripe);
+        if (!inserted) {
+            return 0;
+        }
     } else {
-        it->h_next = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
-        engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)] = it;
+        if (engine->assoc.expanding &&
+            (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
+        {
+            bucket = &engine->assoc.old_hashtable[oldbucket];
+        } else {
+            bucket = &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+        }
+
+        assoc_write_begin(stripe);
+        it->h_next = *bucket;
+        /* The item must be complete before lock free readers can see it */
+        __sync_synchronize();
+        *bucket = it;
+        assoc_write_end(stripe);
     }
 
-    engine->assoc.hash_items++;
-    if (! engine->assoc.expanding && engine->assoc.hash_items > (hashsize(engine->assoc.hashpower) * 3) / 2) {
-        assoc_expand(engine);
+    unsigned int items = __sync_add_and_fetch(&engine->assoc.hash_items, 1);
+    if (! engine->assoc.expanding && items > assoc_expand_threshold(engine)) {
+        assoc_schedule_maintenance(engine);
     }
 
-    MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, engine->assoc.hash_items);
+    MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, items);
     return 1;
 }
 
+/* The bucketed index version of assoc_delete */
+static void assoc_bucket_delete(struct default_engine *engine, uint32_t hash,
+                                const char *key, const size_t nkey) {
+    uint8_t tag = assoc_tag(hash);
+    for (struct assoc_bucket *b = assoc_get_bucket(engine, hash);
+         b != NULL; b = b->next) {
+        unsigned int mask = assoc_match_tags(engine, b, tag);
+        while (mask != 0) {
+            int ii = __builtin_ctz(mask);
+            mask &= mask - 1;
+            hash_item *it = b->items[ii];
+            if (nkey == it->nkey &&
+                memcmp(key, item_get_key(it), nkey) == 0) {
+                struct assoc_stripe *stripe = assoc_get_stripe(engine, hash);
+                __sync_sub_and_fetch(&engine->assoc.hash_items, 1);
+                MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
+                assoc_write_begin(stripe);
+                b->tags[ii] = 0;
+                b->items[ii] = NULL;
+                assoc_write_end(stripe);
+                return;
+            }
+        }
+    }
+    /* The callers don't delete things they can't find */
+    assert(false);
+}
+
 void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
+    if (engine->assoc.bucketed) {
+        assoc_bucket_delete(engine, hash, key, nkey);
+        return;
+    }
+
     hash_item **before = _hashitem_before(engine, hash, key, nkey);
 
     if (*before) {
-        hash_item *nxt;
-        engine->assoc.hash_items--;
+        struct assoc_stripe *stripe = assoc_get_stripe(engine, hash);
+        __sync_sub_and_fetch(&engine->assoc.hash_items, 1);
         /* The DTrace probe cannot be triggered as the last instruction
          * due to possible tail-optimization by the compiler
          */
         MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
+        /*
+         * Leave h_next of the removed item alone; a lock free reader may
+         * be standing on it and can then continue down the chain.
+         */
+        assoc_write_begin(stripe);
+        *before = (*before)->h_next;
+        assoc_write_end(stripe);
         return;
     }
     /* Note:  we never actually get here.  the callers don't delete things
@@ -156,48 +867,77 @@ void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key,
 
 
 
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
-
 static void *assoc_maintenance_thread(void *arg) {
     struct default_engine *engine = arg;
-    bool done = false;
-    do {
-        int ii;
-        pthread_mutex_lock(&engine->cache_lock);
-
-        for (ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
-            hash_item *it, *next;
-            int bucket;
-
-            for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
-                 NULL != it; it = next) {
-                next = it->h_next;
-
-                bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
-                    & hashmask(engine->assoc.hashpower);
-                it->h_next = engine->assoc.primary_hashtable[bucket];
-                engine->assoc.primary_hashtable[bucket] = it;
-            }
 
-            engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
-            engine->assoc.expand_bucket++;
-            if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
-                engine->assoc.expanding = false;
-                free(engine->assoc.old_hashtable);
-                if (engine->config.verbose > 1) {
-                    EXTENSION_LOGGER_DESCRIPTOR *logger;
-                    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-                    logger->log(EXTENSION_LOG_INFO, NULL,
-                                "Hash table expansion done\n");
-                }
+    /* Free the table left behind by the previous expansion */
+    if (engine->assoc.retired_table != NULL) {
+        void *old_table = engine->assoc.retired_table;
+        engine->assoc.retired_table = NULL;
+        assoc_synchronize(engine);
+        free(old_table);
+    }
+
+    /*
+     * Only this thread changes the table size, so we can allocate the new
+     * table before taking the locks and only hold them for the swap.
+     */
+    void *new_table = NULL;
+    if (!engine->assoc.expanding &&
+        engine->assoc.hash_items > assoc_expand_threshold(engine)) {
+        if (engine->assoc.bucketed) {
+            new_table = assoc_bucket_alloc(hashsize(engine->assoc.hashpower + 1));
+        } else {
+            new_table = calloc(hashsize(engine->assoc.hashpower + 1), sizeof(void *));
+        }
+        /* If it failed it's bad news, but we can keep running. */
+    }
+
+    if (new_table != NULL) {
+        assoc_lock_all(engine);
+        engine->assoc.generation++;
+        __sync_synchronize();
+        if (engine->assoc.bucketed) {
+            engine->assoc.old_buckets = engine->assoc.primary_buckets;
+            engine->assoc.primary_buckets = new_table;
+        } else {
+            engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+            engine->assoc.primary_hashtable = new_table;
+        }
+        engine->assoc.hashpower++;
+        engine->assoc.expand_bucket = 0;
+        __sync_synchronize();
+        engine->assoc.expanding = true;
+        __sync_synchronize();
+        engine->assoc.generation++;
+        engine->assoc.expansions++;
+        engine->assoc.expand_started = assoc_usec();
+        assoc_unlock_all(engine);
+
+        /*
+         * Unless inserts and lookups do it for us, move the buckets here.
+         * Each old bucket is moved while holding only the stripe lock
+         * covering it (and both of the new buckets it splits into), so
+         * operations on other stripes keep running during the migration.
+         */
+        bool more = !engine->config.inline_expand;
+        while (more) {
+            for (int ii = 0; ii < hash_bulk_move && more; ++ii) {
+                unsigned int oldbucket = engine->assoc.expand_bucket;
+                assoc_lock(engine, oldbucket);
+                more = assoc_move_bucket(engine);
+                assoc_unlock(engine, oldbucket);
             }
         }
-        if (!engine->assoc.expanding) {
-            done = true;
+
+        if (engine->assoc.retired_table != NULL) {
+            void *old_table = engine->assoc.retired_table;
+            engine->assoc.retired_table = NULL;
+            assoc_synchronize(engine);
+            free(old_table);
         }
-        pthread_mutex_unlock(&engine->cache_lock);
-    } while (!done);
+    }
 
+    engine->assoc.expand_scheduled = false;
     return NULL;
 }
@@ -1,10 +1,55 @@
 #ifndef ASSOC_H
 #define ASSOC_H
 
+/* The maximum number of threads that may use the lock free lookup */
+#define ASSOC_MAX_READERS 256
+
+struct assoc_stripe {
+   pthread_mutex_t lock;
+   /*
+    * Incremented before and after every change to the hash chains covered
+    * by the lock, so it is odd while a chain is being modified.
+    */
+   volatile unsigned int seq;
+};
+
+/*
+ * Every thread doing lock free lookups owns one of these. The sequence
+ * number is odd while the thread is inside a lookup, which lets a writer
+ * wait until nobody may be looking at memory it is about to free.
+ */
+struct assoc_reader {
+   volatile uint64_t seq;
+   volatile uint64_t in_use;
+   uint64_t pad[6]; /* one reader per cache line */
+};
+
+/* The number of items that fit in a bucket of the bucketed index */
+#define ASSOC_BUCKET_SLOTS 6
+
+/*
+ * A bucket of the bucketed index (config.bucketed_hash) fills a cache
+ * line. Every slot has a tag with 8 bits of the hash of its key (0 marks
+ * a free slot), so most keys that aren't in the bucket can be ruled out
+ * without touching an item. Full buckets get a chain of overflow buckets,
+ * which stay around (empty or not) until the table is freed.
+ */
+struct assoc_bucket {
+   volatile uint8_t tags[ASSOC_BUCKET_SLOTS];
+   uint16_t pad;
+   hash_item * volatile items[ASSOC_BUCKET_SLOTS];
+   struct assoc_bucket * volatile next;
+};
+
 struct assoc {
    /* how many powers of 2's worth of buckets we use */
    unsigned int hashpower;
 
+   /* Use the bucketed index instead of the hash chains */
+   bool bucketed;
+   /* Compare the tags of a bucket with SSE2 instead of the scalar code */
+   bool simd;
+
 
    /* Main hash table. This is where we look except during expansion. */
    hash_item** primary_hashtable;
@@ -15,28 +60,136 @@ struct assoc {
     */
    hash_item** old_hashtable;
 
+   /* The tables of the bucketed index, used the same way as the above */
+   struct assoc_bucket *primary_buckets;
+   struct assoc_bucket *old_buckets;
+
    /* Number of items in the hash table. */
    unsigned int hash_items;
 
+   /* Number of overflow buckets allocated by the bucketed index */
+   unsigned int overflow_buckets;
+
    /* Flag: Are we in the middle of expanding now? */
    bool expanding;
 
+   /* Flag: Has an expansion thread been started (and not finished)? */
+   bool expand_scheduled;
+
    /*
     * During expansion we migrate values with bucket granularity; this is how
     * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
     */
    unsigned int expand_bucket;
+
+   /*
+    * Odd while the tables above are swapped (hashpower, primary_hashtable,
+    * old_hashtable, expanding). Lock free readers use it to get a
+    * consistent snapshot of them.
+    */
+   volatile unsigned int generation;
+
+   /*
+    * The hash chains (and the items linked into them) are protected by
+    * an array of hashsize(lockpower) stripes selected by the low bits of
+    * the key hash. lockpower never exceeds the initial hashpower, so an
+    * old bucket and the two primary buckets it splits into during
+    * expansion always map to the same stripe.
+    */
+   struct assoc_stripe *stripes;
+   unsigned int lockpower;
+
+   /* Reader records for the lock free lookups */
+   struct assoc_reader *readers;
+   pthread_key_t reader_key;
+
+   /*
+    * Held by the thread migrating buckets from the threads doing inserts
+    * and lookups (see config.inline_expand)
+    */
+   pthread_mutex_t migrate_lock;
+
+   /* Old table waiting for a grace period before it can be freed */
+   void *retired_table;
+
+   /* Expansion statistics (times in usec) */
+   uint64_t expansions;
+   uint64_t expand_started;
+   uint64_t expand_duration;
 };
 
 /* associative array */
 ENGINE_ERROR_CODE assoc_init(struct default_engine *engine);
+void assoc_destroy(struct default_engine *engine);
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash,
                       const char *key, const size_t nkey);
+/**
+ * Add an item to the table. Returns 0 if the table couldn't get the
+ * memory to hold it.
+ */
 int assoc_insert(struct default_engine *engine, uint32_t hash,
                  hash_item *item);
 void assoc_delete(struct default_engine *engine, uint32_t hash,
                   const char *key, const size_t nkey);
-int start_assoc_maintenance_thread(struct default_engine *engine);
-void stop_assoc_maintenance_thread(struct default_engine *engine);
+
+/**
+ * Lock the stripe protecting the hash chain (and the items in it) for
+ * the given key hash. All of assoc_find/insert/delete and any change
+ * to the flags of a linked item must be done while holding this lock.
+ */
+void assoc_lock(struct default_engine *engine, uint32_t hash);
+bool assoc_trylock(struct default_engine *engine, uint32_t hash);
+void assoc_unlock(struct default_engine *engine, uint32_t hash);
+
+/**
+ * Lock / unlock every stripe (in order). Used by operations that need a
+ * stable view of the complete table (flush, swapping in a new table).
+ */
+void assoc_lock_all(struct default_engine *engine);
+void assoc_unlock_all(struct default_engine *engine);
+
+/**
+ * Enter a lock free read side section. Returns NULL if the calling
+ * thread can't get a reader record, in which case it has to use the
+ * locked functions.
+ */
+struct assoc_reader *assoc_reader_enter(struct default_engine *engine);
+void assoc_reader_exit(struct assoc_reader *reader);
+
+/**
+ * Wait until every reader that was inside a read side section when this
+ * was called has left it.
+ */
+void assoc_synchronize(struct default_engine *engine);
+
+/**
+ * Add the "stats hash" statistics (size of the table and the progress of
+ * a running expansion).
+ */
+void assoc_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie);
+
+/**
+ * Prefetch what a lookup of the hash will look at: the bucket, or with
+ * items set, the items it points to (which needs the bucket). Must be
+ * called inside a read side section. Does nothing if it raced with the
+ * tables being swapped.
+ */
+void assoc_prefetch(struct default_engine *engine, uint32_t hash,
+                    bool items);
+
+/**
+ * Look up a key without holding the stripe lock. Must be called inside
+ * a read side section. The returned item may be in the middle of being
+ * unlinked or reused, so the caller has to get a reference and then
+ * verify that it is still linked under the same key.
+ *
+ * @return false if the lookup raced with a writer (the caller should
+ *         retry, or fall back to the locked path), true otherwise with
+ *         *itp set to the candidate (or NULL if the key doesn't exist)
+ */
+bool assoc_find_unlocked(struct default_engine *engine, uint32_t hash,
+                         const char *key, const size_t nkey,
+                         hash_item **itp);
 
 #endif
@@ -43,6 +43,10 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
                                      const void* key,
                                      const int nkey,
                                      uint16_t vbucket);
+static void default_get_multi(ENGINE_HANDLE* handle,
+                              const void* cookie,
+                              item_lookup *lookups,
+                              int nlookups);
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
                   const void *cookie,
                   const char *stat_key,
@@ -176,6 +180,7 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
          .remove = default_item_delete,
          .release = default_item_release,
          .get = default_get,
+         .get_multi = default_get_multi,
          .get_stats = default_get_stats,
          .reset_stats = default_reset_stats,
          .store = default_store,
@@ -192,11 +197,16 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
       .initialized = true,
       .assoc = {
          .hashpower = 16,
+         .lockpower = 10,
+         .migrate_lock = PTHREAD_MUTEX_INITIALIZER,
       },
       .slabs = {
-         .lock = PTHREAD_MUTEX_INITIALIZER
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+         .rebal = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .cond = PTHREAD_COND_INITIALIZER
+         }
       },
-      .cache_lock = PTHREAD_MUTEX_INITIALIZER,
       .stats = {
          .lock = PTHREAD_MUTEX_INITIALIZER,
       },
@@ -210,6 +220,15 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
          .factor = 1.25,
          .chunk_size = 48,
          .item_size_max= 1024 * 1024,
+         .simd_tags = true,
+         .prefetch_lookups = true,
+         .lru_segmented = true,
+         .lru_hot_pct = 20,
+         .lru_warm_pct = 40,
+         .slab_automove_window = 10,
+         .lru_crawler = true,
+         .lru_crawler_interval = 10,
+         .lru_crawler_sleep = 100,
        },
       .scrubber = {
          .lock = PTHREAD_MUTEX_INITIALIZER,
@@ -228,8 +247,10 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    };
 
    *engine = default_engine;
+   item_init(engine);
    engine->tap_connections.clients = calloc(default_engine.tap_connections.size, sizeof(void*));
    if (engine->tap_connections.clients == NULL) {
+       item_destroy(engine);
        free(engine);
        return ENGINE_ENOMEM;
    }
@@ -274,6 +295,15 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
       return ret;
    }
 
+   if (se->config.lru_segmented) {
+      /* Without it everything stays in the hot segment; that still works */
+      item_start_lru_maintainer(se);
+   }
+
+   if (se->config.lru_crawler) {
+      item_start_lru_crawler(se);
+   }
+
    se->server.callback->register_callback(handle, ON_DISCONNECT, default_handle_disconnect, handle);
 
    return ENGINE_SUCCESS;
@@ -284,7 +314,10 @@ static void default_destroy(ENGINE_HANDLE* handle, const bool force) {
    struct default_engine* se = get_handle(handle);
 
    if (se->initialized) {
-      pthread_mutex_destroy(&se->cache_lock);
+      /* Stop the background threads, which use the item and assoc locks */
+      slabs_destroy(se);
+      item_destroy(se);
+      assoc_destroy(se);
       pthread_mutex_destroy(&se->stats.lock);
       pthread_mutex_destroy(&se->slabs.lock);
       se->initialized = false;
@@ -302,12 +335,7 @@ static ENGINE_ERROR_CODE default_item_allocate(ENGINE_HANDLE* handle,
                                                const int flags,
                                                const rel_time_t exptime) {
    struct default_engine* engine = get_handle(handle);
-   size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-   if (engine->config.use_cas) {
-      ntotal += sizeof(uint64_t);
-   }
-   unsigned int id = slabs_clsid(engine, ntotal);
-   if (id == 0) {
+   if (!item_size_ok(engine, nkey, nbytes)) {
       return ENGINE_E2BIG;
    }
 
@@ -371,6 +399,28 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
    }
 }
 
+static void default_get_multi(ENGINE_HANDLE* handle,
+                              const void* cookie,
+                              item_lookup *lookups,
+                              int nlookups) {
+   struct default_engine *engine = get_handle(handle);
+   for (int ii = 0; ii < nlookups; ++ii) {
+      if (!handled_vbucket(engine, lookups[ii].vbucket)) {
+         /* Let get sort out the vbuckets we don't handle */
+         for (ii = 0; ii < nlookups; ++ii) {
+            lookups[ii].status = default_get(handle, cookie,
+                                             &lookups[ii].item,
+                                             lookups[ii].key,
+                                             lookups[ii].nkey,
+                                             lookups[ii].vbucket);
+         }
+         return;
+      }
+   }
+
+   item_get_multi(engine, lookups, nlookups);
+}
+
 static void stats_vbucket(struct default_engine *e,
                           ADD_STAT add_stat,
                           const void *cookie) {
@@ -411,6 +461,10 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       add_stat("reclaimed", 9, val, len, cookie);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->config.maxbytes);
       add_stat("engine_maxbytes", 15, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.item_lock_contended);
+      add_stat("item_lock_contended", 19, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.lru_lock_contended);
+      add_stat("lru_lock_contended", 18, val, len, cookie);
       pthread_mutex_unlock(&engine->stats.lock);
    } else if (strncmp(stat_key, "slabs", 5) == 0) {
       slabs_stats(engine, add_stat, cookie);
@@ -420,6 +474,10 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       item_stats_sizes(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "vbucket", 7) == 0) {
       stats_vbucket(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "hash", 4) == 0) {
+      assoc_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "crawler", 7) == 0) {
+      item_crawler_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "scrub", 5) == 0) {
       char val[128];
       int len;
@@ -498,6 +556,8 @@ static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    engine->stats.evictions = 0;
    engine->stats.reclaimed = 0;
    engine->stats.total_items = 0;
+   engine->stats.item_lock_contended = 0;
+   engine->stats.lru_lock_contended = 0;
    pthread_mutex_unlock(&engine->stats.lock);
 }
 
@@ -533,12 +593,57 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
          { .key = "item_size_max",
            .datatype = DT_SIZE,
            .value.dt_size = &se->config.item_size_max },
+         { .key = "slab_chunk_max",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.slab_chunk_max },
          { .key = "ignore_vbucket",
            .datatype = DT_BOOL,
            .value.dt_bool = &se->config.ignore_vbucket },
          { .key = "vb0",
            .datatype = DT_BOOL,
            .value.dt_bool = &se->config.vb0 },
+         { .key = "inline_expand",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.inline_expand },
+         { .key = "bucketed_hash",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.bucketed_hash },
+         { .key = "simd_tags",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.simd_tags },
+         { .key = "prefetch_lookups",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.prefetch_lookups },
+         { .key = "lru_segmented",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.lru_segmented },
+         { .key = "lru_hot_pct",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_hot_pct },
+         { .key = "lru_warm_pct",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_warm_pct },
+         { .key = "slab_reassign",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.slab_reassign },
+         { .key = "slab_automove",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.slab_automove },
+         { .key = "slab_automove_window",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.slab_automove_window },
+         { .key = "lru_crawler",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.lru_crawler },
+         { .key = "lru_crawler_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_crawler_interval },
+         { .key = "lru_crawler_sleep",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_crawler_sleep },
+         { .key = "lru_crawler_tocrawl",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.lru_crawler_tocrawl },
          { .key = "config_file",
            .datatype = DT_CONFIGFILE },
          { .key = NULL}
@@ -551,6 +656,18 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
        set_vbucket_state(se, 0, vbucket_state_active);
    }
 
+   if (se->config.slab_automove) {
+       se->config.slab_reassign = true;
+   }
+
+   if (se->config.slab_chunk_max >= se->config.item_size_max) {
+       /* Every item fits in a page anyway */
+       se->config.slab_chunk_max = 0;
+   } else if (se->config.slab_chunk_max != 0 &&
+              se->config.slab_chunk_max < 4096) {
+       return ENGINE_EINVAL;
+   }
+
    return ENGINE_SUCCESS;
 }
 
@@ -619,6 +736,51 @@ static bool scrub_cmd(struct default_engine *e,
                     res, 0, cookie);
 }
 
+static bool slabs_reassign_cmd(struct default_engine *e,
+                               const void *cookie,
+                               protocol_binary_request_header *request,
+                               ADD_RESPONSE response) {
+    if (request->request.extlen != 8 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    protocol_binary_request_slabs_reassign *req = (void*)request;
+    int src = (int)ntohl(req->message.body.src);
+    int dst = (int)ntohl(req->message.body.dst);
+
+    protocol_binary_response_status res;
+    const char *msg = NULL;
+    switch (slabs_reassign(e, src, dst)) {
+    case REASSIGN_OK:
+        res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        break;
+    case REASSIGN_RUNNING:
+        res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+        msg = "A page is being moved already";
+        break;
+    case REASSIGN_NOSPARE:
+        res = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+        msg = "The source class has no page to spare";
+        break;
+    case REASSIGN_DISABLED:
+        res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+        msg = "Slab reassignment is disabled";
+        break;
+    case REASSIGN_SRC_DST_SAME:
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        msg = "Source and destination are the same class";
+        break;
+    default:
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+        msg = "Invalid slab class";
+        break;
+    }
+
+    return response(NULL, 0, NULL, 0, msg, msg ? strlen(msg) : 0,
+                    PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+}
+
 static bool touch(struct default_engine *e, const void *cookie,
                   protocol_binary_request_header *request,
                   ADD_RESPONSE response) {
@@ -646,12 +808,28 @@ static bool touch(struct default_engine *e, const void *cookie,
         if (request->request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
             ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
-        } else {
+        } else if ((item->iflag & ITEM_CHUNKED) == 0) {
             ret = response(NULL, 0, &item->flags, sizeof(item->flags),
                            item_get_data(item), item->nbytes,
                            PROTOCOL_BINARY_RAW_BYTES,
                            PROTOCOL_BINARY_RESPONSE_SUCCESS,
                            item_get_cas(item), cookie);
+        } else {
+            /* The response needs the value in one piece */
+            char *data = malloc(item->nbytes);
+            if (data == NULL) {
+                ret = response(NULL, 0, NULL, 0, NULL, 0,
+                               PROTOCOL_BINARY_RAW_BYTES,
+                               PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+            } else {
+                item_read_data(item, 0, data, item->nbytes);
+                ret = response(NULL, 0, &item->flags, sizeof(item->flags),
+                               data, item->nbytes,
+                               PROTOCOL_BINARY_RAW_BYTES,
+                               PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                               item_get_cas(item), cookie);
+                free(data);
+            }
         }
         item_release(e, item);
         return ret;
@@ -670,6 +848,9 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
     case PROTOCOL_BINARY_CMD_SCRUB:
         sent = scrub_cmd(e, cookie, request, response);
         break;
+    case PROTOCOL_BINARY_CMD_SLABS_REASSIGN:
+        sent = slabs_reassign_cmd(e, cookie, request, response);
+        break;
     case PROTOCOL_BINARY_CMD_DEL_VBUCKET:
         sent = rm_vbucket(e, cookie, request, response);
         break;
@@ -748,10 +929,10 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
     item_info->flags = it->flags;
     item_info->clsid = it->slabs_clsid;
     item_info->nkey = it->nkey;
-    item_info->nvalue = 1;
     item_info->key = item_get_key(it);
-    item_info->value[0].iov_base = item_get_data(it);
-    item_info->value[0].iov_len = it->nbytes;
+    /* Chunked items need more than one element */
+    item_info->nvalue = (uint16_t)item_get_iov(it, item_info->value,
+                                               item_info->nvalue);
     return true;
 }
 
@@ -800,7 +981,7 @@ static ENGINE_ERROR_CODE default_tap_notify(ENGINE_HANDLE* handle,
                 return ret;
             }
         }
-        memcpy(item_get_data(it), data, ndata);
+        item_write_data(it, 0, data, ndata);
         engine->server.cookie->store_engine_specific(cookie, NULL);
         item_set_cas(handle, cookie, it, cas);
         ret = default_store(handle, cookie, it, &cas, OPERATION_SET, vbucket);
@@ -885,7 +1066,7 @@ static void default_handle_disconnect(const void *cookie,
     int ii;
     for (ii = 0; ii < engine->tap_connections.size; ++ii) {
         if (engine->tap_connections.clients[ii] == cookie) {
-            free(engine->server.cookie->get_engine_specific(cookie));
+            release_item_tap_walker(engine, cookie);
             break;
         }
     }
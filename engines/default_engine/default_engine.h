@@ -49,6 +49,18 @@ extern "C" {
 /* temp */
 #define ITEM_SLABBED (2<<8)
 
+/* The item was accessed since it was last moved to the head of the LRU */
+#define ITEM_ACTIVE (4<<8)
+
+/* The LRU segment the item is in (neither means the cold segment) */
+#define ITEM_LRU_HOT (8<<8)
+#define ITEM_LRU_WARM (16<<8)
+
+/* The value is stored in chunks (see config.slab_chunk_max) */
+#define ITEM_CHUNKED (32<<8)
+/* A chunk holding a piece of the value of a chunked item */
+#define ITEM_CHUNK (64<<8)
+
 struct config {
    bool use_cas;
    size_t verbose;
@@ -59,8 +71,43 @@ struct config {
    float factor;
    size_t chunk_size;
    size_t item_size_max;
+   /*
+    * Store items larger than this in chunks of this size (0: never).
+    * It is also the size of the slab pages then.
+    */
+   size_t slab_chunk_max;
    bool ignore_vbucket;
    bool vb0;
+   /*
+    * Let the threads doing inserts and lookups move the buckets of the
+    * old hash table during an expansion, instead of a background thread
+    */
+   bool inline_expand;
+   /* Use the cache line bucketed hash index instead of hash chains */
+   bool bucketed_hash;
+   /* Use SIMD instructions to match the tags of the bucketed index */
+   bool simd_tags;
+   /* Prefetch the buckets and items of a multi-get before comparing keys */
+   bool prefetch_lookups;
+   /* Split the LRU in hot, warm and cold segments (see items.c) */
+   bool lru_segmented;
+   /* Percentage of the items of a slab class kept in the hot/warm LRU */
+   size_t lru_hot_pct;
+   size_t lru_warm_pct;
+   /* Allow slab pages to move between slab classes */
+   bool slab_reassign;
+   /* Move slab pages to the classes with the most evictions */
+   bool slab_automove;
+   /* Seconds between the checks of the automove policy */
+   size_t slab_automove_window;
+   /* Reclaim expired items with a background thread walking the LRU */
+   bool lru_crawler;
+   /* Seconds between the passes of the crawler */
+   size_t lru_crawler_interval;
+   /* Usec the crawler sleeps after every batch of items */
+   size_t lru_crawler_sleep;
+   /* The most items the crawler looks at in a list per pass (0: all) */
+   size_t lru_crawler_tocrawl;
 };
 
 MEMCACHED_PUBLIC_API
@@ -78,6 +125,9 @@ struct engine_stats {
    uint64_t curr_bytes;
    uint64_t curr_items;
    uint64_t total_items;
+   /* Number of times we had to block on an assoc stripe / LRU lock */
+   uint64_t item_lock_contended;
+   uint64_t lru_lock_contended;
 };
 
 struct engine_scrubber {
@@ -116,16 +166,15 @@ struct default_engine {
     */
    bool initialized;
 
+   /**
+    * The cache layer is protected by the stripe locks in assoc (hash
+    * chains and the items in them) and the per slab class LRU locks in
+    * items. See items.c for the locking order.
+    */
    struct assoc assoc;
    struct slabs slabs;
    struct items items;
 
-   /**
-    * The cache layer (item_* and assoc_*) is currently protected by
-    * this single mutex
-    */
-   pthread_mutex_t cache_lock;
-
    struct config config;
    struct engine_stats stats;
    struct engine_scrubber scrubber;
@@ -5,24 +5,82 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
 #include <assert.h>
 #include <inttypes.h>
 
 #include "default_engine.h"
 
+/*
+ * Locking:
+ *
+ * There is no global cache lock. The hash chains and the flags of the
+ * items in them are protected by the assoc stripe lock selected by the
+ * hash of the key (assoc_lock). The LRU list, sizes and itemstats of each
+ * slab class are protected by engine->items.lru_locks[id].
+ *
+ * The lock order is: stripe lock -> LRU lock -> slabs lock.
+ *
+ * Code that walks an LRU list (eviction, the scrubber, the tap walker)
+ * already holds the LRU lock when it finds an item, so it may only
+ * *try* to lock the stripe of that item.
+ *
+ * The do_ functions expect the caller to hold the stripe lock for the
+ * item/key they operate on, and take the LRU lock themselves (the
+ * _locked variants expect the caller to hold the LRU lock as well).
+ *
+ * Reference counting:
+ *
+ * The refcount is only changed with atomic operations. A linked item
+ * holds one reference on behalf of the hash table, so a refcount of 0
+ * means that the item is free (or about to be) and whoever drops the
+ * last reference frees it. This lets item_get find an item and take a
+ * reference without any locks: a reference can only be taken while the
+ * refcount is non-zero (see item_try_acquire), and the reader then
+ * checks that the item is still linked under the key it looked for.
+ * Item memory is never given back to the system, and a freed chunk is
+ * only reused for items of the same slab class, so looking at an item
+ * that was just freed is harmless. The slab rebalancer, which moves pages
+ * to other classes, waits for the lock free readers (assoc_synchronize)
+ * before it splits a drained page up.
+ *
+ * Hitting an item doesn't move it in the LRU, it just flags it as
+ * ITEM_ACTIVE. Active items are moved to the head when the allocator
+ * finds them at the tail, so the LRU is reordered in batches under the
+ * LRU lock the allocator holds anyway.
+ *
+ * Segmented LRU (config.lru_segmented):
+ *
+ * The list of every slab class is split in a hot, a warm and a cold
+ * segment. New items are linked into the hot segment. The LRU maintainer
+ * thread keeps the hot and warm segments within their share of the items
+ * of the class: active items at their tails move to the head of the warm
+ * segment, all others to the cold segment. Active items at the tail of the
+ * cold segment are rescued to the warm segment by the allocator, which
+ * evicts from the cold segment (and only looks at hot and then warm if
+ * cold is empty). A scan of keys that are only read once then only pushes
+ * out the hot and cold segments, while the warm items stay.
+ */
+
 /* Forward Declarations */
-static void item_link_q(struct default_engine *engine, hash_item *it);
+static void item_link_q(struct default_engine *engine, hash_item *it,
+                        enum lru_segment seg);
 static void item_unlink_q(struct default_engine *engine, hash_item *it);
+static void do_item_bump_locked(struct default_engine *engine,
+                                hash_item *it, rel_time_t current_time);
 static hash_item *do_item_alloc(struct default_engine *engine,
                                 const void *key, const size_t nkey,
                                 const int flags, const rel_time_t exptime,
                                 const int nbytes,
                                 const void *cookie);
 static hash_item *do_item_get(struct default_engine *engine,
-                              const char *key, const size_t nkey);
+                              const char *key, const size_t nkey,
+                              uint32_t hv);
 static int do_item_link(struct default_engine *engine, hash_item *it);
 static void do_item_unlink(struct default_engine *engine, hash_item *it);
+static void do_item_unlink_locked(struct default_engine *engine, hash_item *it);
 static void do_item_release(struct default_engine *engine, hash_item *it);
 static void do_item_update(struct default_engine *engine, hash_item *it);
 static int do_item_replace(struct default_engine *engine,
@@ -41,16 +99,245 @@ static void item_free(struct default_engine *engine, hash_item *it);
  */
 static const int search_items = 50;
 
+/*
+ * The most items the LRU maintainer moves off the tail of a segment
+ * before it lets go of the LRU lock
+ */
+static const int lru_juggle_batch = 100;
+
+/* How long the LRU maintainer sleeps between passes (usec) */
+#define LRU_MAINTAINER_MIN_SLEEP 1000
+#define LRU_MAINTAINER_MAX_SLEEP 1000000
+
+/* The most items the LRU crawler looks at before it lets go of the lock */
+static const int lru_crawler_batch = 100;
+
+static void item_stop_lru_maintainer(struct default_engine *engine);
+static void item_stop_lru_crawler(struct default_engine *engine);
+
+void item_init(struct default_engine *engine) {
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        pthread_mutex_init(&engine->items.lru_locks[ii], NULL);
+    }
+    pthread_mutex_init(&engine->items.maintainer.lock, NULL);
+    pthread_cond_init(&engine->items.maintainer.cond, NULL);
+    pthread_mutex_init(&engine->items.crawler.lock, NULL);
+    pthread_cond_init(&engine->items.crawler.cond, NULL);
+}
+
+void item_destroy(struct default_engine *engine) {
+    item_stop_lru_crawler(engine);
+    item_stop_lru_maintainer(engine);
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        pthread_mutex_destroy(&engine->items.lru_locks[ii]);
+    }
+    pthread_mutex_destroy(&engine->items.maintainer.lock);
+    pthread_cond_destroy(&engine->items.maintainer.cond);
+    pthread_mutex_destroy(&engine->items.crawler.lock);
+    pthread_cond_destroy(&engine->items.crawler.cond);
+}
+
+static inline void lru_lock(struct default_engine *engine, unsigned int id) {
+    if (pthread_mutex_trylock(&engine->items.lru_locks[id]) != 0) {
+        __sync_fetch_and_add(&engine->stats.lru_lock_contended, 1);
+        pthread_mutex_lock(&engine->items.lru_locks[id]);
+    }
+}
+
+static inline void lru_unlock(struct default_engine *engine, unsigned int id) {
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
+}
+
+/*
+ * Set while an item is modified in place; no new references may be
+ * taken without the stripe lock while it is set.
+ */
+#define ITEM_REFCOUNT_BUSY 0x8000
+
+/* Take a reference on an item that can't be freed under our feet */
+static inline void item_acquire(hash_item *it) {
+    __sync_add_and_fetch(&it->refcount, 1);
+}
+
+/* Take a reference on an item without holding any locks */
+static inline bool item_try_acquire(hash_item *it) {
+    unsigned short rc;
+    do {
+        rc = it->refcount;
+        if (rc == 0 || (rc & ITEM_REFCOUNT_BUSY) != 0) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&it->refcount, rc, rc + 1));
+    return true;
+}
+
+/*
+ * Take a linked item nobody else references away from the lock free
+ * readers (they can't get a reference once it is 0). The caller must
+ * hold the stripe lock and owns the item after unlinking it.
+ */
+static inline bool item_freeze(hash_item *it) {
+    return __sync_bool_compare_and_swap(&it->refcount, 1, 0);
+}
+
+static inline uint32_t item_hash(struct default_engine *engine,
+                                 const hash_item *it) {
+    return engine->server.core->hash(item_get_key(it), it->nkey, 0);
+}
+
+/* Cursors used by the scrubber and tap walkers live in the LRU lists */
+static inline bool item_is_cursor(const hash_item *it) {
+    return it->nkey == 0 && it->nbytes == 0;
+}
+
+static inline enum lru_segment item_lru_segment(const hash_item *it) {
+    if ((it->iflag & ITEM_LRU_HOT) != 0) {
+        return LRU_HOT;
+    } else if ((it->iflag & ITEM_LRU_WARM) != 0) {
+        return LRU_WARM;
+    }
+    return LRU_COLD;
+}
+
+/*
+ * Only changed under the LRU lock, but the other flags may be changed
+ * concurrently without it.
+ */
+static inline void item_set_lru_segment(hash_item *it, enum lru_segment seg) {
+    static const uint16_t flags[LRU_SEGMENTS] = {
+        [LRU_HOT] = ITEM_LRU_HOT,
+        [LRU_WARM] = ITEM_LRU_WARM,
+        [LRU_COLD] = 0
+    };
+    uint16_t old, new;
+    do {
+        old = it->iflag;
+        new = (old & ~(ITEM_LRU_HOT | ITEM_LRU_WARM)) | flags[seg];
+    } while (old != new && !__sync_bool_compare_and_swap(&it->iflag, old, new));
+}
+
+/*
+ * The order in which we look for items to evict: the warm segment holds
+ * the items we want to keep, so it goes last.
+ */
+static const enum lru_segment evict_order[LRU_SEGMENTS] = {
+    LRU_COLD, LRU_HOT, LRU_WARM
+};
+
+/*
+ * The next item of a slab class up for eviction. The caller must hold the
+ * LRU lock.
+ */
+static inline hash_item *do_item_lru_tail(struct default_engine *engine,
+                                          unsigned int id) {
+    for (int ii = 0; ii < LRU_SEGMENTS; ++ii) {
+        if (engine->items.tails[evict_order[ii]][id] != NULL) {
+            return engine->items.tails[evict_order[ii]][id];
+        }
+    }
+    return NULL;
+}
+
+static inline unsigned int do_item_lru_size(struct default_engine *engine,
+                                            unsigned int id) {
+    return engine->items.sizes[LRU_HOT][id] +
+        engine->items.sizes[LRU_WARM][id] +
+        engine->items.sizes[LRU_COLD][id];
+}
+
 void item_stats_reset(struct default_engine *engine) {
-    pthread_mutex_lock(&engine->cache_lock);
-    memset(engine->items.itemstats, 0, sizeof(engine->items.itemstats));
-    pthread_mutex_unlock(&engine->cache_lock);
+    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
+        lru_lock(engine, ii);
+        memset(&engine->items.itemstats[ii], 0, sizeof(itemstats_t));
+        lru_unlock(engine, ii);
+    }
 }
 
 
-/* warning: don't use these macros with a function, as it evals its arg twice */
-static inline size_t ITEM_ntotal(struct default_engine *engine,
-                                 const hash_item *item) {
+/*
+ * Large items (config.slab_chunk_max):
+ *
+ * An item that doesn't fit in a slab page is stored as a head item taken
+ * from the largest slab class, followed by chunks from the same class.
+ * The head holds the key, a table of the chunks and as much of the start
+ * of the value as fits; every chunk holds the next piece of the value
+ * behind a hash_item header flagged ITEM_CHUNK, whose h_next points back
+ * to the head. Chunks are never linked anywhere; they are freed with the
+ * head.
+ */
+struct item_chunks {
+    /* Number of chunks */
+    uint32_t nchunks;
+    /* Bytes of the value stored in the head */
+    uint32_t ninline;
+    hash_item *chunk[];
+};
+
+static inline bool item_is_chunked(const hash_item *it) {
+    return (it->iflag & ITEM_CHUNKED) != 0;
+}
+
+/* The chunk table follows the key, aligned for the pointers */
+static inline struct item_chunks *item_get_chunks(const hash_item *it) {
+    uintptr_t ptr = (uintptr_t)item_get_data(it);
+    ptr = (ptr + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1);
+    return (struct item_chunks *)ptr;
+}
+
+static inline size_t item_chunks_offset(struct default_engine *engine,
+                                        size_t nkey) {
+    size_t ret = sizeof(hash_item) + nkey;
+    if (engine->config.use_cas) {
+        ret += sizeof(uint64_t);
+    }
+    ret = (ret + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    return ret + sizeof(struct item_chunks);
+}
+
+/*
+ * Get the size of the head of a chunked item, and how the value is split
+ * between the head and the chunks. Returns 0 if the chunk table doesn't
+ * fit in the head.
+ */
+static size_t item_chunked_head_size(struct default_engine *engine,
+                                     size_t nkey, size_t nbytes,
+                                     uint32_t *nchunks, uint32_t *ninline) {
+    const size_t page = engine->slabs.page_size;
+    const size_t chunk_data = page - sizeof(hash_item);
+    const size_t hdr = item_chunks_offset(engine, nkey);
+    if (hdr + sizeof(hash_item *) >= page) {
+        return 0;
+    }
+
+    /* Every chunk takes a slot of the table in the head */
+    size_t avail = page - hdr;
+    size_t n = 0;
+    if (nbytes > avail) {
+        size_t per_chunk = chunk_data - sizeof(hash_item *);
+        n = (nbytes - avail + per_chunk - 1) / per_chunk;
+    }
+    if (n * sizeof(hash_item *) > avail) {
+        return 0;
+    }
+
+    size_t inl = avail - n * sizeof(hash_item *);
+    if (inl > nbytes) {
+        inl = nbytes;
+    }
+    *nchunks = (uint32_t)n;
+    *ninline = (uint32_t)inl;
+    return hdr + n * sizeof(hash_item *) + inl;
+}
+
+/* The memory taken from the slab class of the item */
+static inline size_t ITEM_nhead(struct default_engine *engine,
+                                const hash_item *item) {
+    if (item_is_chunked(item)) {
+        struct item_chunks *chunks = item_get_chunks(item);
+        return item_chunks_offset(engine, item->nkey) +
+            chunks->nchunks * sizeof(hash_item *) + chunks->ninline;
+    }
+
     size_t ret = sizeof(*item) + item->nkey + item->nbytes;
     if (engine->config.use_cas) {
         ret += sizeof(uint64_t);
@@ -59,10 +346,145 @@ static inline size_t ITEM_ntotal(struct default_engine *engine,
     return ret;
 }
 
+/* The memory used by the item, including its chunks */
+static inline size_t ITEM_ntotal(struct default_engine *engine,
+                                 const hash_item *item) {
+    size_t ret = ITEM_nhead(engine, item);
+    if (item_is_chunked(item)) {
+        struct item_chunks *chunks = item_get_chunks(item);
+        ret += chunks->nchunks * sizeof(hash_item) +
+            item->nbytes - chunks->ninline;
+    }
+    return ret;
+}
+
+bool item_size_ok(struct default_engine *engine,
+                  size_t nkey, size_t nbytes) {
+    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
+    }
+
+    if (ntotal > engine->config.item_size_max) {
+        return false;
+    }
+    if (ntotal <= engine->slabs.page_size) {
+        return slabs_clsid(engine, ntotal) != 0;
+    }
+
+    uint32_t nchunks, ninline;
+    return item_chunked_head_size(engine, nkey, nbytes,
+                                  &nchunks, &ninline) != 0;
+}
+
+/* Get the n'th piece of the value of the item */
+static inline bool item_get_segment(const hash_item *it, uint32_t n,
+                                    char **base, size_t *len) {
+    if (!item_is_chunked(it)) {
+        *base = item_get_data(it);
+        *len = it->nbytes;
+        return n == 0;
+    }
+
+    struct item_chunks *chunks = item_get_chunks(it);
+    if (n == 0) {
+        *base = (char *)&chunks->chunk[chunks->nchunks];
+        *len = chunks->ninline;
+        return true;
+    }
+    if (n > chunks->nchunks) {
+        return false;
+    }
+    hash_item *chunk = chunks->chunk[n - 1];
+    *base = (char *)(chunk + 1);
+    *len = chunk->nbytes;
+    return true;
+}
+
+int item_get_iov(const hash_item *it, struct iovec *iov, int niov) {
+    char *base;
+    size_t len;
+    int ret = 0;
+    for (uint32_t ii = 0; item_get_segment(it, ii, &base, &len); ++ii) {
+        if (len == 0) {
+            continue;
+        }
+        if (ret < niov) {
+            iov[ret].iov_base = base;
+            iov[ret].iov_len = len;
+        }
+        ++ret;
+    }
+    return ret;
+}
+
+/* Copy between buf and the value of the item, starting at offset */
+static void item_copy_data(const hash_item *it, size_t offset,
+                           char *buf, size_t len, bool write) {
+    char *base;
+    size_t seglen;
+    for (uint32_t ii = 0; len > 0 && item_get_segment(it, ii, &base, &seglen); ++ii) {
+        if (offset >= seglen) {
+            offset -= seglen;
+            continue;
+        }
+        size_t n = seglen - offset;
+        if (n > len) {
+            n = len;
+        }
+        if (write) {
+            memcpy(base + offset, buf, n);
+        } else {
+            memcpy(buf, base + offset, n);
+        }
+        buf += n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+void item_write_data(hash_item *it, size_t offset,
+                     const void *buf, size_t len) {
+    item_copy_data(it, offset, (char *)buf, len, true);
+}
+
+void item_read_data(const hash_item *it, size_t offset,
+                    void *buf, size_t len) {
+    item_copy_data(it, offset, buf, len, false);
+}
+
+/* Copy the value of src into the value of dst, starting at offset */
+static void item_copy_value(hash_item *dst, size_t offset,
+                            const hash_item *src) {
+    char *base;
+    size_t len;
+    for (uint32_t ii = 0; item_get_segment(src, ii, &base, &len); ++ii) {
+        item_write_data(dst, offset, base, len);
+        offset += len;
+    }
+}
+
+/* Give the chunks of a chunked item back to the slab allocator */
+static void item_free_chunks(struct default_engine *engine, hash_item *it) {
+    struct item_chunks *chunks = item_get_chunks(it);
+    for (uint32_t ii = 0; ii < chunks->nchunks; ++ii) {
+        hash_item *chunk = chunks->chunk[ii];
+        if (chunk == NULL) {
+            continue;
+        }
+        unsigned int clsid = chunk->slabs_clsid;
+        chunk->slabs_clsid = 0;
+        chunk->iflag = 0;
+        chunk->h_next = NULL;
+        slabs_free(engine, chunk, sizeof(hash_item) + chunk->nbytes, clsid);
+        chunks->chunk[ii] = NULL;
+    }
+}
+
 /* Get the next CAS id for a new item. */
 static uint64_t get_cas_id(void) {
     static uint64_t cas_id = 0;
-    return ++cas_id;
+    return __sync_add_and_fetch(&cas_id, 1);
 }
 
 /* Enable this for reference-count debugging. */
@@ -77,23 +499,16 @@ static uint64_t get_cas_id(void) {
 #endif
 
 
+/*
+ * Get ntotal bytes of memory from slab class id, reclaiming an expired
+ * item or evicting one if needed
+ */
 /*@null@*/
-hash_item *do_item_alloc(struct default_engine *engine,
-                         const void *key,
-                         const size_t nkey,
-                         const int flags,
-                         const rel_time_t exptime,
-                         const int nbytes,
-                         const void *cookie) {
+static hash_item *do_item_alloc_mem(struct default_engine *engine,
+                                    const size_t ntotal,
+                                    const unsigned int id,
+                                    const void *cookie) {
     hash_item *it = NULL;
-    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-    if (engine->config.use_cas) {
-        ntotal += sizeof(uint64_t);
-    }
-
-    unsigned int id = slabs_clsid(engine, ntotal);
-    if (id == 0)
-        return 0;
 
     /* do a quick check if we have any expired items in the tail.. */
     int tries = search_items;
@@ -101,26 +516,38 @@ hash_item *do_item_alloc(struct default_engine *engine,
 
     rel_time_t current_time = engine->server.core->get_current_time();
 
-    for (search = engine->items.tails[id];
-         tries > 0 && search != NULL;
-         tries--, search=search->prev) {
-        if (search->refcount == 0 &&
-            (search->exptime != 0 && search->exptime < current_time)) {
-            it = search;
-            /* I don't want to actually free the object, just steal
-             * the item to avoid to grab the slab mutex twice ;-)
-             */
-            pthread_mutex_lock(&engine->stats.lock);
-            engine->stats.reclaimed++;
-            pthread_mutex_unlock(&engine->stats.lock);
-            engine->items.itemstats[id].reclaimed++;
-            it->refcount = 1;
-            slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
-            do_item_unlink(engine, it);
-            /* Initialize the item block: */
-            it->slabs_clsid = 0;
-            it->refcount = 0;
-            break;
+    lru_lock(engine, id);
+    for (int ii = 0; ii < LRU_SEGMENTS && it == NULL; ++ii) {
+        enum lru_segment seg = evict_order[ii];
+        for (search = engine->items.tails[seg][id];
+             tries > 0 && search != NULL;
+             tries--, search=search->prev) {
+            if (search->refcount == 1 &&
+                (search->exptime != 0 && search->exptime < current_time)) {
+                uint32_t hv = item_hash(engine, search);
+                if (!assoc_trylock(engine, hv)) {
+                    continue;
+                }
+                if (!item_freeze(search)) {
+                    assoc_unlock(engine, hv);
+                    continue;
+                }
+                it = search;
+                /* I don't want to actually free the object, just steal
+                 * the item to avoid to grab the slab mutex twice ;-)
+                 */
+                __sync_add_and_fetch(&engine->stats.reclaimed, 1);
+                engine->items.itemstats[id].reclaimed++;
+                slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_nhead(engine, it), ntotal);
+                do_item_unlink_locked(engine, it);
+                assoc_unlock(engine, hv);
+                if (item_is_chunked(it)) {
+                    item_free_chunks(engine, it);
+                }
+                /* Initialize the item block: */
+                it->slabs_clsid = 0;
+                break;
+            }
         }
     }
 
@@ -137,43 +564,69 @@ hash_item *do_item_alloc(struct default_engine *engine,
 
         if (engine->config.evict_to_free == 0) {
             engine->items.itemstats[id].outofmemory++;
+            lru_unlock(engine, id);
             return NULL;
         }
 
         /*
          * try to get one off the right LRU
-         * don't necessariuly unlink the tail because it may be locked: refcount>0
-         * search up from tail an item with refcount==0 and unlink it; give up after search_items
-         * tries
+         * don't necessariuly unlink the tail because it may be locked: refcount>1
+         * search up from tail an item with refcount==1 and unlink it; give up after search_items
+         * tries. Items that were hit since they got to the head of the LRU
+         * are moved back to the head (of the warm segment) instead. The
+         * hot and warm segments are only used if the cold one runs dry.
          */
 
-        if (engine->items.tails[id] == 0) {
+        if (do_item_lru_tail(engine, id) == NULL) {
             engine->items.itemstats[id].outofmemory++;
+            lru_unlock(engine, id);
             return NULL;
         }
 
-        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-            if (search->refcount == 0) {
-                if (search->exptime == 0 || search->exptime > current_time) {
-                    engine->items.itemstats[id].evicted++;
-                    engine->items.itemstats[id].evicted_time = current_time - search->time;
-                    if (search->exptime != 0) {
-                        engine->items.itemstats[id].evicted_nonzero++;
+        int bumps = search_items;
+        bool evicted = false;
+        for (int ii = 0; ii < LRU_SEGMENTS && !evicted; ++ii) {
+            enum lru_segment seg = evict_order[ii];
+            hash_item *prev;
+            for (search = engine->items.tails[seg][id]; tries > 0 && search != NULL; search = prev) {
+                prev = search->prev;
+                if (search->refcount == 1 && !item_is_cursor(search)) {
+                    if ((search->iflag & ITEM_ACTIVE) != 0 && bumps > 0) {
+                        --bumps;
+                        do_item_bump_locked(engine, search, current_time);
+                        continue;
+                    }
+                    --tries;
+                    uint32_t hv = item_hash(engine, search);
+                    if (!assoc_trylock(engine, hv)) {
+                        continue;
                     }
-                    pthread_mutex_lock(&engine->stats.lock);
-                    engine->stats.evictions++;
-                    pthread_mutex_unlock(&engine->stats.lock);
-                    engine->server.stat->evicting(cookie,
-                                                  item_get_key(search),
-                                                  search->nkey);
+                    if (!item_freeze(search)) {
+                        assoc_unlock(engine, hv);
+                        continue;
+                    }
+                    if (search->exptime == 0 || search->exptime > current_time) {
+                        engine->items.itemstats[id].evicted++;
+                        engine->items.itemstats[id].evicted_time = current_time - search->time;
+                        if (search->exptime != 0) {
+                            engine->items.itemstats[id].evicted_nonzero++;
+                        }
+                        __sync_add_and_fetch(&engine->stats.evictions, 1);
+                        engine->server.stat->evicting(cookie,
+                                                      item_get_key(search),
+                                                      search->nkey);
+                    } else {
+                        engine->items.itemstats[id].reclaimed++;
+                        __sync_add_and_fetch(&engine->stats.reclaimed, 1);
+                    }
+                    do_item_unlink_locked(engine, search);
+                    assoc_unlock(engine, hv);
+                    item_free(engine, search);
+                    evicted = true;
+                    break;
                 } else {
-                    engine->items.itemstats[id].reclaimed++;
-                    pthread_mutex_lock(&engine->stats.lock);
-                    engine->stats.reclaimed++;
-                    pthread_mutex_unlock(&engine->stats.lock);
+                    --tries;
                 }
-                do_item_unlink(engine, search);
-                break;
             }
         }
         it = slabs_alloc(engine, ntotal, id);
@@ -187,62 +640,172 @@ hash_item *do_item_alloc(struct default_engine *engine,
              * free it anyway.
              */
             tries = search_items;
-            for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-                if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
-                    engine->items.itemstats[id].tailrepairs++;
-                    search->refcount = 0;
-                    do_item_unlink(engine, search);
-                    break;
+            bool repaired = false;
+            for (int ii = 0; ii < LRU_SEGMENTS && !repaired; ++ii) {
+                enum lru_segment seg = evict_order[ii];
+                for (search = engine->items.tails[seg][id]; tries > 0 && search != NULL; tries--, search=search->prev) {
+                    if (search->refcount > 1 && !item_is_cursor(search) &&
+                        search->time + TAIL_REPAIR_TIME < current_time) {
+                        uint32_t hv = item_hash(engine, search);
+                        if (!assoc_trylock(engine, hv)) {
+                            continue;
+                        }
+                        engine->items.itemstats[id].tailrepairs++;
+                        /* Drop everything but the reference of the hash table */
+                        search->refcount = 1;
+                        do_item_unlink_locked(engine, search);
+                        assoc_unlock(engine, hv);
+                        repaired = true;
+                        break;
+                    }
                 }
             }
             it = slabs_alloc(engine, ntotal, id);
             if (it == 0) {
+                lru_unlock(engine, id);
                 return NULL;
             }
         }
     }
+    lru_unlock(engine, id);
 
     assert(it->slabs_clsid == 0);
 
     it->slabs_clsid = id;
 
-    assert(it != engine->items.heads[it->slabs_clsid]);
+    assert(it != engine->items.heads[LRU_HOT][id] &&
+           it != engine->items.heads[LRU_WARM][id] &&
+           it != engine->items.heads[LRU_COLD][id]);
+
+    return it;
+}
+
+/*
+ * Get the chunks for the value of a chunked item that doesn't fit in
+ * its head. Returns false (with the chunks that were allocated freed) if
+ * we run out of memory.
+ */
+static bool do_item_alloc_chunks(struct default_engine *engine,
+                                 hash_item *it, uint32_t nchunks,
+                                 uint32_t ninline, const void *cookie) {
+    const unsigned int id = it->slabs_clsid;
+    const size_t chunk_data = engine->slabs.page_size - sizeof(hash_item);
+    struct item_chunks *chunks = item_get_chunks(it);
+    size_t left = it->nbytes - ninline;
+
+    chunks->nchunks = nchunks;
+    chunks->ninline = ninline;
+    memset(chunks->chunk, 0, nchunks * sizeof(hash_item *));
+
+    for (uint32_t ii = 0; ii < nchunks; ++ii) {
+        size_t len = left < chunk_data ? left : chunk_data;
+        hash_item *chunk = do_item_alloc_mem(engine, sizeof(hash_item) + len,
+                                             id, cookie);
+        if (chunk == NULL) {
+            item_free_chunks(engine, it);
+            return false;
+        }
+        chunk->next = chunk->prev = NULL;
+        chunk->h_next = it;
+        chunk->nkey = 0;
+        chunk->nbytes = (uint32_t)len;
+        chunk->refcount = 0;
+        __sync_synchronize();
+        chunk->iflag = ITEM_CHUNK;
+        chunks->chunk[ii] = chunk;
+        left -= len;
+    }
+
+    return true;
+}
+
+/*@null@*/
+hash_item *do_item_alloc(struct default_engine *engine,
+                         const void *key,
+                         const size_t nkey,
+                         const int flags,
+                         const rel_time_t exptime,
+                         const int nbytes,
+                         const void *cookie) {
+    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
+    }
+    if (ntotal > engine->config.item_size_max) {
+        return NULL;
+    }
+
+    uint32_t nchunks = 0, ninline = 0;
+    unsigned int id;
+    if (ntotal > engine->slabs.page_size) {
+        ntotal = item_chunked_head_size(engine, nkey, nbytes,
+                                        &nchunks, &ninline);
+        if (ntotal == 0) {
+            return NULL;
+        }
+        id = engine->slabs.power_largest;
+    } else {
+        id = slabs_clsid(engine, ntotal);
+        if (id == 0) {
+            return NULL;
+        }
+    }
+
+    hash_item *it = do_item_alloc_mem(engine, ntotal, id, cookie);
+    if (it == NULL) {
+        return NULL;
+    }
 
     it->next = it->prev = it->h_next = 0;
-    it->refcount = 1;     /* the caller will have a reference */
-    DEBUG_REFCNT(it, '*');
     it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
     it->nkey = nkey;
     it->nbytes = nbytes;
     it->flags = flags;
+    if (nchunks > 0) {
+        it->iflag |= ITEM_CHUNKED;
+        if (!do_item_alloc_chunks(engine, it, nchunks, ninline, cookie)) {
+            it->slabs_clsid = 0;
+            slabs_free(engine, it, ntotal, id);
+            return NULL;
+        }
+    }
     memcpy((void*)item_get_key(it), key, nkey);
     it->exptime = exptime;
+    __sync_synchronize();
+    it->refcount = 1;     /* the caller will have a reference */
+    DEBUG_REFCNT(it, '*');
     return it;
 }
 
 static void item_free(struct default_engine *engine, hash_item *it) {
-    size_t ntotal = ITEM_ntotal(engine, it);
+    size_t ntotal = ITEM_nhead(engine, it);
     unsigned int clsid;
     assert((it->iflag & ITEM_LINKED) == 0);
-    assert(it != engine->items.heads[it->slabs_clsid]);
-    assert(it != engine->items.tails[it->slabs_clsid]);
+    assert(it != engine->items.heads[item_lru_segment(it)][it->slabs_clsid]);
+    assert(it != engine->items.tails[item_lru_segment(it)][it->slabs_clsid]);
     assert(it->refcount == 0);
 
     /* so slab size changer can tell later if item is already free or not */
     clsid = it->slabs_clsid;
     it->slabs_clsid = 0;
-    it->iflag |= ITEM_SLABBED;
+    /* slabs_free flags it as ITEM_SLABBED under the slabs lock */
     DEBUG_REFCNT(it, 'F');
+    if (item_is_chunked(it)) {
+        item_free_chunks(engine, it);
+    }
     slabs_free(engine, it, ntotal, clsid);
 }
 
-static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
+/* The caller must hold the LRU lock for the item's slab class */
+static void item_link_q(struct default_engine *engine, hash_item *it,
+                        enum lru_segment seg) { /* item is the new head */
     hash_item **head, **tail;
     assert(it->slabs_clsid < POWER_LARGEST);
     assert((it->iflag & ITEM_SLABBED) == 0);
 
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
+    item_set_lru_segment(it, seg);
+    head = &engine->items.heads[seg][it->slabs_clsid];
+    tail = &engine->items.tails[seg][it->slabs_clsid];
     assert(it != *head);
     assert((*head && *tail) || (*head == 0 && *tail == 0));
     it->prev = 0;
@@ -250,15 +813,39 @@ static void item_link_q(struct default_engine *engine, hash_item *it) { /* item
     if (it->next) it->next->prev = it;
     *head = it;
     if (*tail == 0) *tail = it;
-    engine->items.sizes[it->slabs_clsid]++;
+    engine->items.sizes[seg][it->slabs_clsid]++;
     return;
 }
 
+/*
+ * Move an item that was hit while it travelled down the LRU back to the
+ * head, of the warm segment if the LRU is segmented. The caller must hold
+ * the LRU lock.
+ */
+static void do_item_bump_locked(struct default_engine *engine,
+                                hash_item *it, rel_time_t current_time) {
+    enum lru_segment seg = item_lru_segment(it);
+    unsigned int id = it->slabs_clsid;
+    if (engine->config.lru_segmented && engine->items.cursors[id] == 0) {
+        if (seg == LRU_WARM) {
+            engine->items.itemstats[id].moves_within_lru++;
+        } else {
+            engine->items.itemstats[id].moves_to_warm++;
+        }
+        seg = LRU_WARM;
+    }
+    item_unlink_q(engine, it);
+    it->time = current_time;
+    __sync_fetch_and_and(&it->iflag, (uint16_t)~ITEM_ACTIVE);
+    item_link_q(engine, it, seg);
+}
+
 static void item_unlink_q(struct default_engine *engine, hash_item *it) {
     hash_item **head, **tail;
+    enum lru_segment seg = item_lru_segment(it);
     assert(it->slabs_clsid < POWER_LARGEST);
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
+    head = &engine->items.heads[seg][it->slabs_clsid];
+    tail = &engine->items.tails[seg][it->slabs_clsid];
 
     if (*head == it) {
         assert(it->prev == 0);
@@ -273,74 +860,98 @@ static void item_unlink_q(struct default_engine *engine, hash_item *it) {
 
     if (it->next) it->next->prev = it->prev;
     if (it->prev) it->prev->next = it->next;
-    engine->items.sizes[it->slabs_clsid]--;
+    engine->items.sizes[seg][it->slabs_clsid]--;
     return;
 }
 
 int do_item_link(struct default_engine *engine, hash_item *it) {
     MEMCACHED_ITEM_LINK(item_get_key(it), it->nkey, it->nbytes);
     assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
-    assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
-    it->iflag |= ITEM_LINKED;
+    assert(it->nbytes <= engine->config.item_size_max);
     it->time = engine->server.core->get_current_time();
-    assoc_insert(engine, engine->server.core->hash(item_get_key(it),
-                                                        it->nkey, 0),
-                 it);
-
-    pthread_mutex_lock(&engine->stats.lock);
-    engine->stats.curr_bytes += ITEM_ntotal(engine, it);
-    engine->stats.curr_items += 1;
-    engine->stats.total_items += 1;
-    pthread_mutex_unlock(&engine->stats.lock);
 
     /* Allocate a new CAS ID on link. */
     item_set_cas(NULL, NULL, it, get_cas_id());
 
-    item_link_q(engine, it);
+    /* The hash table holds a reference */
+    item_acquire(it);
+    __sync_fetch_and_or(&it->iflag, ITEM_LINKED);
+    if (assoc_insert(engine, item_hash(engine, it), it) == 0) {
+        /* Nobody could see it, so just take it back */
+        __sync_fetch_and_and(&it->iflag, (uint16_t)~ITEM_LINKED);
+        __sync_sub_and_fetch(&it->refcount, 1);
+        return 0;
+    }
+
+    __sync_add_and_fetch(&engine->stats.curr_bytes, ITEM_ntotal(engine, it));
+    __sync_add_and_fetch(&engine->stats.curr_items, 1);
+    __sync_add_and_fetch(&engine->stats.total_items, 1);
+
+    lru_lock(engine, it->slabs_clsid);
+    item_link_q(engine, it,
+                engine->config.lru_segmented ? LRU_HOT : LRU_COLD);
+    lru_unlock(engine, it->slabs_clsid);
 
     return 1;
 }
 
-void do_item_unlink(struct default_engine *engine, hash_item *it) {
+static void do_item_unlink_internal(struct default_engine *engine,
+                                    hash_item *it, bool lru_locked) {
     MEMCACHED_ITEM_UNLINK(item_get_key(it), it->nkey, it->nbytes);
     if ((it->iflag & ITEM_LINKED) != 0) {
-        it->iflag &= ~ITEM_LINKED;
-        pthread_mutex_lock(&engine->stats.lock);
-        engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
-        engine->stats.curr_items -= 1;
-        pthread_mutex_unlock(&engine->stats.lock);
-        assoc_delete(engine, engine->server.core->hash(item_get_key(it),
-                                                            it->nkey, 0),
+        __sync_fetch_and_and(&it->iflag, (uint16_t)~ITEM_LINKED);
+        __sync_sub_and_fetch(&engine->stats.curr_bytes, ITEM_ntotal(engine, it));
+        __sync_sub_and_fetch(&engine->stats.curr_items, 1);
+        assoc_delete(engine, item_hash(engine, it),
                      item_get_key(it), it->nkey);
-        item_unlink_q(engine, it);
-        if (it->refcount == 0) {
+        if (lru_locked) {
+            item_unlink_q(engine, it);
+        } else {
+            lru_lock(engine, it->slabs_clsid);
+            item_unlink_q(engine, it);
+            lru_unlock(engine, it->slabs_clsid);
+        }
+        /*
+         * Drop the reference of the hash table. A linked item without
+         * any references was frozen by the caller, who now owns it.
+         */
+        if (it->refcount != 0 && __sync_sub_and_fetch(&it->refcount, 1) == 0) {
             item_free(engine, it);
         }
     }
 }
 
+void do_item_unlink(struct default_engine *engine, hash_item *it) {
+    do_item_unlink_internal(engine, it, false);
+}
+
+void do_item_unlink_locked(struct default_engine *engine, hash_item *it) {
+    do_item_unlink_internal(engine, it, true);
+}
+
 void do_item_release(struct default_engine *engine, hash_item *it) {
     MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->refcount != 0) {
-        it->refcount--;
-        DEBUG_REFCNT(it, '-');
-    }
-    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
+    DEBUG_REFCNT(it, '-');
+    if (__sync_sub_and_fetch(&it->refcount, 1) == 0) {
         item_free(engine, it);
     }
 }
 
+/*
+ * Flag the item as recently used. It is moved to the head of the LRU
+ * (or the warm segment) once it reaches the tail (see do_item_alloc and
+ * the LRU maintainer); nothing here needs a lock, and a hot item is only
+ * written to once per interval. The unlocked peek at the head is only a
+ * hint: bumping the head is a no-op.
+ */
 void do_item_update(struct default_engine *engine, hash_item *it) {
     rel_time_t current_time = engine->server.core->get_current_time();
-    MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
-        assert((it->iflag & ITEM_SLABBED) == 0);
-
-        if ((it->iflag & ITEM_LINKED) != 0) {
-            item_unlink_q(engine, it);
-            it->time = current_time;
-            item_link_q(engine, it);
-        }
+    MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
+    if (it->time < current_time - ITEM_UPDATE_INTERVAL &&
+        (it->iflag & ITEM_ACTIVE) == 0 &&
+        engine->items.heads[item_lru_segment(it)][it->slabs_clsid] != it) {
+        assert((it->iflag & ITEM_SLABBED) == 0);
+        __sync_fetch_and_or(&it->iflag, ITEM_ACTIVE);
     }
 }
 
@@ -409,32 +1020,48 @@ static void do_item_stats(struct default_engine *engine,
     int i;
     rel_time_t current_time = engine->server.core->get_current_time();
     for (i = 0; i < POWER_LARGEST; i++) {
-        if (engine->items.tails[i] != NULL) {
-            int search = search_items;
-            while (search > 0 &&
-                   engine->items.tails[i] != NULL &&
-                   ((engine->config.oldest_live != 0 && /* Item flushd */
-                     engine->config.oldest_live <= current_time &&
-                     engine->items.tails[i]->time <= engine->config.oldest_live) ||
-                    (engine->items.tails[i]->exptime != 0 && /* and not expired */
-                     engine->items.tails[i]->exptime < current_time))) {
-                --search;
-                if (engine->items.tails[i]->refcount == 0) {
-                    do_item_unlink(engine, engine->items.tails[i]);
-                } else {
-                    break;
+        lru_lock(engine, i);
+        if (do_item_lru_tail(engine, i) != NULL) {
+            for (int seg = LRU_HOT; seg < LRU_SEGMENTS; ++seg) {
+                hash_item **tails = engine->items.tails[seg];
+                int search = search_items;
+                while (search > 0 &&
+                       tails[i] != NULL &&
+                       ((engine->config.oldest_live != 0 && /* Item flushd */
+                         engine->config.oldest_live <= current_time &&
+                         tails[i]->time <= engine->config.oldest_live) ||
+                        (tails[i]->exptime != 0 && /* and not expired */
+                         tails[i]->exptime < current_time))) {
+                    hash_item *tail = tails[i];
+                    uint32_t hv;
+                    --search;
+                    if (tail->refcount != 1 || item_is_cursor(tail)) {
+                        break;
+                    }
+                    hv = item_hash(engine, tail);
+                    if (!assoc_trylock(engine, hv)) {
+                        break;
+                    }
+                    if (tail->refcount == 1) {
+                        do_item_unlink_locked(engine, tail);
+                        assoc_unlock(engine, hv);
+                    } else {
+                        assoc_unlock(engine, hv);
+                        break;
+                    }
                 }
             }
-            if (engine->items.tails[i] == NULL) {
+            if (do_item_lru_tail(engine, i) == NULL) {
                 /* We removed all of the items in this slab class */
+                lru_unlock(engine, i);
                 continue;
             }
 
             const char *prefix = "items";
             add_statistics(c, add_stats, prefix, i, "number", "%u",
-                           engine->items.sizes[i]);
+                           do_item_lru_size(engine, i));
             add_statistics(c, add_stats, prefix, i, "age", "%u",
-                           engine->items.tails[i]->time);
+                           do_item_lru_tail(engine, i)->time);
             add_statistics(c, add_stats, prefix, i, "evicted",
                            "%u", engine->items.itemstats[i].evicted);
             add_statistics(c, add_stats, prefix, i, "evicted_nonzero",
@@ -447,7 +1074,24 @@ static void do_item_stats(struct default_engine *engine,
                            "%u", engine->items.itemstats[i].tailrepairs);;
             add_statistics(c, add_stats, prefix, i, "reclaimed",
                            "%u", engine->items.itemstats[i].reclaimed);;
+            add_statistics(c, add_stats, prefix, i, "crawler_reclaimed",
+                           "%u", engine->items.itemstats[i].crawler_reclaimed);
+            if (engine->config.lru_segmented) {
+                add_statistics(c, add_stats, prefix, i, "number_hot", "%u",
+                               engine->items.sizes[LRU_HOT][i]);
+                add_statistics(c, add_stats, prefix, i, "number_warm", "%u",
+                               engine->items.sizes[LRU_WARM][i]);
+                add_statistics(c, add_stats, prefix, i, "number_cold", "%u",
+                               engine->items.sizes[LRU_COLD][i]);
+                add_statistics(c, add_stats, prefix, i, "moves_to_cold",
+                               "%u", engine->items.itemstats[i].moves_to_cold);
+                add_statistics(c, add_stats, prefix, i, "moves_to_warm",
+                               "%u", engine->items.itemstats[i].moves_to_warm);
+                add_statistics(c, add_stats, prefix, i, "moves_within_lru",
+                               "%u", engine->items.itemstats[i].moves_within_lru);
+            }
         }
+        lru_unlock(engine, i);
     }
 }
 
@@ -465,14 +1109,18 @@ static void do_item_stats_sizes(struct default_engine *engine,
 
         /* build the histogram */
         for (i = 0; i < POWER_LARGEST; i++) {
-            hash_item *iter = engine->items.heads[i];
-            while (iter) {
-                int ntotal = ITEM_ntotal(engine, iter);
-                int bucket = ntotal / 32;
-                if ((ntotal % 32) != 0) bucket++;
-                if (bucket < num_buckets) histogram[bucket]++;
-                iter = iter->next;
+            lru_lock(engine, i);
+            for (int seg = LRU_HOT; seg < LRU_SEGMENTS; ++seg) {
+                hash_item *iter = engine->items.heads[seg][i];
+                while (iter) {
+                    int ntotal = ITEM_ntotal(engine, iter);
+                    int bucket = ntotal / 32;
+                    if ((ntotal % 32) != 0) bucket++;
+                    if (bucket < num_buckets) histogram[bucket]++;
+                    iter = iter->next;
+                }
             }
+            lru_unlock(engine, i);
         }
 
         /* write the buffer */
@@ -493,11 +1141,10 @@ static void do_item_stats_sizes(struct default_engine *engine,
 
 /** wrapper around assoc_find which does the lazy expiration logic */
 hash_item *do_item_get(struct default_engine *engine,
-                       const char *key, const size_t nkey) {
+                       const char *key, const size_t nkey,
+                       uint32_t hv) {
     rel_time_t current_time = engine->server.core->get_current_time();
-    hash_item *it = assoc_find(engine, engine->server.core->hash(key,
-                                                                      nkey, 0),
-                               key, nkey);
+    hash_item *it = assoc_find(engine, hv, key, nkey);
     int was_found = 0;
 
     if (engine->config.verbose > 2) {
@@ -517,7 +1164,7 @@ hash_item *do_item_get(struct default_engine *engine,
     if (it != NULL && engine->config.oldest_live != 0 &&
         engine->config.oldest_live <= current_time &&
         it->time <= engine->config.oldest_live) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(engine, it);           /* MTSAFE - stripe lock held */
         it = NULL;
     }
 
@@ -529,7 +1176,7 @@ hash_item *do_item_get(struct default_engine *engine,
     }
 
     if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(engine, it);           /* MTSAFE - stripe lock held */
         it = NULL;
     }
 
@@ -541,7 +1188,7 @@ hash_item *do_item_get(struct default_engine *engine,
     }
 
     if (it != NULL) {
-        it->refcount++;
+        item_acquire(it);
         DEBUG_REFCNT(it, '+');
         do_item_update(engine, it);
     }
@@ -549,18 +1196,84 @@ hash_item *do_item_get(struct default_engine *engine,
     return it;
 }
 
+/*
+ * Lock free version of do_item_get. Must be called inside a read side
+ * section. Returns false if it couldn't give a definite answer (it raced
+ * with a writer, or the item needs to be expired), in which case the
+ * caller must use the locked path.
+ */
+static bool do_item_find_unlocked(struct default_engine *engine,
+                                  const char *key, const size_t nkey,
+                                  uint32_t hv, rel_time_t current_time,
+                                  hash_item **itp) {
+    for (int tries = 0; tries < 3; ++tries) {
+        hash_item *it;
+        if (!assoc_find_unlocked(engine, hv, key, nkey, &it)) {
+            continue;
+        }
+        if (it == NULL) {
+            *itp = NULL;
+            return true;
+        }
+        if (!item_try_acquire(it)) {
+            continue;
+        }
+
+        /* The key can't change while it is linked and we hold a ref */
+        bool linked = (it->iflag & ITEM_LINKED) != 0;
+        __sync_synchronize();
+        if (!linked || it->nkey != nkey ||
+            memcmp(key, item_get_key(it), nkey) != 0) {
+            do_item_release(engine, it);
+            continue;
+        }
+
+        if ((engine->config.oldest_live != 0 &&
+             engine->config.oldest_live <= current_time &&
+             it->time <= engine->config.oldest_live) ||
+            (it->exptime != 0 && it->exptime <= current_time)) {
+            /* Let the locked path unlink it */
+            do_item_release(engine, it);
+            return false;
+        }
+
+        DEBUG_REFCNT(it, '+');
+        do_item_update(engine, it);
+        *itp = it;
+        return true;
+    }
+
+    return false;
+}
+
+static bool do_item_get_unlocked(struct default_engine *engine,
+                                 const char *key, const size_t nkey,
+                                 uint32_t hv, hash_item **itp) {
+    struct assoc_reader *reader = assoc_reader_enter(engine);
+    if (reader == NULL) {
+        return false;
+    }
+
+    rel_time_t current_time = engine->server.core->get_current_time();
+    bool done = do_item_find_unlocked(engine, key, nkey, hv,
+                                      current_time, itp);
+    assoc_reader_exit(reader);
+    return done;
+}
+
 /*
  * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
+ * commands. In threaded mode, this is protected by the stripe lock for the
+ * key.
  *
  * Returns the state of storage.
  */
 static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
                                        hash_item *it, uint64_t *cas,
                                        ENGINE_STORE_OPERATION operation,
-                                       const void *cookie) {
+                                       const void *cookie, uint32_t hv) {
     const char *key = item_get_key(it);
-    hash_item *old_it = do_item_get(engine, key, it->nkey);
+    hash_item *old_it = do_item_get(engine, key, it->nkey, hv);
     ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
 
     hash_item *new_it = NULL;
@@ -582,8 +1295,11 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
             // cas validates
             // it and old_it may belong to different classes.
             // I'm updating the stats for the one that's getting pushed out
-            do_item_replace(engine, old_it, it);
-            stored = ENGINE_SUCCESS;
+            if (do_item_replace(engine, old_it, it)) {
+                stored = ENGINE_SUCCESS;
+            } else {
+                stored = ENGINE_ENOMEM;
+            }
         } else {
             if (engine->config.verbose > 1) {
                 EXTENSION_LOGGER_DESCRIPTOR *logger;
@@ -631,12 +1347,12 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
                 /* copy data from it and old_it to new_it */
 
                 if (operation == OPERATION_APPEND) {
-                    memcpy(item_get_data(new_it), item_get_data(old_it), old_it->nbytes);
-                    memcpy(item_get_data(new_it) + old_it->nbytes, item_get_data(it), it->nbytes);
+                    item_copy_value(new_it, 0, old_it);
+                    item_copy_value(new_it, old_it->nbytes, it);
                 } else {
                     /* OPERATION_PREPEND */
-                    memcpy(item_get_data(new_it), item_get_data(it), it->nbytes);
-                    memcpy(item_get_data(new_it) + it->nbytes, item_get_data(old_it), old_it->nbytes);
+                    item_copy_value(new_it, 0, it);
+                    item_copy_value(new_it, it->nbytes, old_it);
                 }
 
                 it = new_it;
@@ -644,14 +1360,19 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
         }
 
         if (stored == ENGINE_NOT_STORED) {
+            int linked;
             if (old_it != NULL) {
-                do_item_replace(engine, old_it, it);
+                linked = do_item_replace(engine, old_it, it);
             } else {
-                do_item_link(engine, it);
+                linked = do_item_link(engine, it);
             }
 
-            *cas = item_get_cas(it);
-            stored = ENGINE_SUCCESS;
+            if (linked) {
+                *cas = item_get_cas(it);
+                stored = ENGINE_SUCCESS;
+            } else {
+                stored = ENGINE_ENOMEM;
+            }
         }
     }
 
@@ -718,12 +1439,19 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
         return ENGINE_EINVAL;
     }
 
-    if (it->refcount == 1 && res <= it->nbytes) {
-        // we can do inline replacement
+    /*
+     * If only the hash table and we reference the item we can do inline
+     * replacement; the busy flag keeps lock free readers out meanwhile.
+     */
+    if (res <= it->nbytes &&
+        __sync_bool_compare_and_swap(&it->refcount, 2,
+                                     2 | ITEM_REFCOUNT_BUSY)) {
         memcpy(item_get_data(it), buf, res);
         memset(item_get_data(it) + res, ' ', it->nbytes - res);
         item_set_cas(NULL, NULL, it, get_cas_id());
         *rcas = item_get_cas(it);
+        __sync_fetch_and_and(&it->refcount,
+                             (unsigned short)~ITEM_REFCOUNT_BUSY);
     } else {
         hash_item *new_it = do_item_alloc(engine, item_get_key(it),
                                           it->nkey, it->flags,
@@ -734,7 +1462,10 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
             return ENGINE_ENOMEM;
         }
         memcpy(item_get_data(new_it), buf, res);
-        do_item_replace(engine, it, new_it);
+        if (!do_item_replace(engine, it, new_it)) {
+            do_item_release(engine, new_it);
+            return ENGINE_ENOMEM;
+        }
         *rcas = item_get_cas(new_it);
         do_item_release(engine, new_it);       /* release our reference */
     }
@@ -750,11 +1481,7 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
 hash_item *item_alloc(struct default_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie) {
-    hash_item *it;
-    pthread_mutex_lock(&engine->cache_lock);
-    it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return it;
+    return do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
 }
 
 /*
@@ -764,29 +1491,100 @@ hash_item *item_alloc(struct default_engine *engine,
 hash_item *item_get(struct default_engine *engine,
                     const void *key, const size_t nkey) {
     hash_item *it;
-    pthread_mutex_lock(&engine->cache_lock);
-    it = do_item_get(engine, key, nkey);
-    pthread_mutex_unlock(&engine->cache_lock);
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+
+    /* The debug output of the verbose mode lives in the locked path */
+    if (engine->config.verbose <= 2 &&
+        do_item_get_unlocked(engine, key, nkey, hv, &it)) {
+        return it;
+    }
+
+    assoc_lock(engine, hv);
+    it = do_item_get(engine, key, nkey, hv);
+    assoc_unlock(engine, hv);
     return it;
 }
 
+/*
+ * Looks up a number of keys like item_get. The lock free lookups of up to
+ * ITEM_GET_BATCH keys share one read side section, and the keys it
+ * couldn't answer take the locked path after leaving it.
+ *
+ * With config.prefetch_lookups all hashes are computed first, then the
+ * buckets and the items in them are prefetched before the keys are
+ * compared. The cache misses of the keys then overlap instead of being
+ * taken one after the other.
+ */
+void item_get_multi(struct default_engine *engine,
+                    item_lookup *lookups, int nlookups) {
+    for (int first = 0; first < nlookups; first += ITEM_GET_BATCH) {
+        item_lookup *batch = lookups + first;
+        int nbatch = nlookups - first;
+        if (nbatch > ITEM_GET_BATCH) {
+            nbatch = ITEM_GET_BATCH;
+        }
+
+        uint32_t hv[ITEM_GET_BATCH];
+        bool done[ITEM_GET_BATCH] = { false };
+        for (int ii = 0; ii < nbatch; ++ii) {
+            hv[ii] = engine->server.core->hash(batch[ii].key,
+                                               batch[ii].nkey, 0);
+        }
+
+        struct assoc_reader *reader = NULL;
+        if (engine->config.verbose <= 2) {
+            reader = assoc_reader_enter(engine);
+        }
+        if (reader != NULL) {
+            if (engine->config.prefetch_lookups && nbatch > 1) {
+                for (int ii = 0; ii < nbatch; ++ii) {
+                    assoc_prefetch(engine, hv[ii], false);
+                }
+                for (int ii = 0; ii < nbatch; ++ii) {
+                    assoc_prefetch(engine, hv[ii], true);
+                }
+            }
+
+            rel_time_t current_time = engine->server.core->get_current_time();
+            for (int ii = 0; ii < nbatch; ++ii) {
+                hash_item *it;
+                done[ii] = do_item_find_unlocked(engine, batch[ii].key,
+                                                 batch[ii].nkey, hv[ii],
+                                                 current_time, &it);
+                batch[ii].item = it;
+            }
+            assoc_reader_exit(reader);
+        }
+
+        for (int ii = 0; ii < nbatch; ++ii) {
+            if (!done[ii]) {
+                assoc_lock(engine, hv[ii]);
+                batch[ii].item = do_item_get(engine, batch[ii].key,
+                                             batch[ii].nkey, hv[ii]);
+                assoc_unlock(engine, hv[ii]);
+            }
+            batch[ii].status = batch[ii].item ? ENGINE_SUCCESS
+                                              : ENGINE_KEY_ENOENT;
+        }
+    }
+}
+
 /*
  * Decrements the reference count on an item and adds it to the freelist if
  * needed.
  */
 void item_release(struct default_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_release(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 /*
  * Unlinks an item from the LRU and hashtable.
  */
 void item_unlink(struct default_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
+    uint32_t hv = item_hash(engine, item);
+    assoc_lock(engine, hv);
     do_item_unlink(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
+    assoc_unlock(engine, hv);
 }
 
 static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
@@ -799,9 +1597,10 @@ static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
                                        const uint64_t initial,
                                        const rel_time_t exptime,
                                        uint64_t *cas,
-                                       uint64_t *result)
+                                       uint64_t *result,
+                                       uint32_t hv)
 {
-   hash_item *item = do_item_get(engine, key, nkey);
+   hash_item *item = do_item_get(engine, key, nkey, hv);
    ENGINE_ERROR_CODE ret;
 
    if (item == NULL) {
@@ -818,7 +1617,7 @@ static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
          }
          memcpy((void*)item_get_data(item), buffer, len);
          if ((ret = do_store_item(engine, item, cas,
-                                  OPERATION_ADD, cookie)) == ENGINE_SUCCESS) {
+                                  OPERATION_ADD, cookie, hv)) == ENGINE_SUCCESS) {
              *result = initial;
              *cas = item_get_cas(item);
          }
@@ -845,12 +1644,13 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              uint64_t *result)
 {
     ENGINE_ERROR_CODE ret;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
 
-    pthread_mutex_lock(&engine->cache_lock);
+    assoc_lock(engine, hv);
     ret = do_arithmetic(engine, cookie, key, nkey, increment,
                         create, delta, initial, exptime, cas,
-                        result);
-    pthread_mutex_unlock(&engine->cache_lock);
+                        result, hv);
+    assoc_unlock(engine, hv);
     return ret;
 }
 
@@ -862,19 +1662,21 @@ ENGINE_ERROR_CODE store_item(struct default_engine *engine,
                              ENGINE_STORE_OPERATION operation,
                              const void *cookie) {
     ENGINE_ERROR_CODE ret;
+    uint32_t hv = item_hash(engine, item);
 
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_store_item(engine, item, cas, operation, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+    assoc_lock(engine, hv);
+    ret = do_store_item(engine, item, cas, operation, cookie, hv);
+    assoc_unlock(engine, hv);
     return ret;
 }
 
 static hash_item *do_touch_item(struct default_engine *engine,
                                      const void *key,
                                      uint16_t nkey,
-                                     uint32_t exptime)
+                                     uint32_t exptime,
+                                     uint32_t hv)
 {
-   hash_item *item = do_item_get(engine, key, nkey);
+   hash_item *item = do_item_get(engine, key, nkey, hv);
    if (item != NULL) {
        item->exptime = exptime;
    }
@@ -887,10 +1689,11 @@ hash_item *touch_item(struct default_engine *engine,
                            uint32_t exptime)
 {
     hash_item *ret;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
 
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_touch_item(engine, key, nkey, exptime);
-    pthread_mutex_unlock(&engine->cache_lock);
+    assoc_lock(engine, hv);
+    ret = do_touch_item(engine, key, nkey, exptime, hv);
+    assoc_unlock(engine, hv);
     return ret;
 }
 
@@ -901,7 +1704,8 @@ void item_flush_expired(struct default_engine *engine, time_t when) {
     int i;
     hash_item *iter, *next;
 
-    pthread_mutex_lock(&engine->cache_lock);
+    /* flush_all is rare; take every stripe so we may unlink anything */
+    assoc_lock_all(engine);
 
     if (when == 0) {
         engine->config.oldest_live = engine->server.core->get_current_time() - 1;
@@ -917,21 +1721,28 @@ void item_flush_expired(struct default_engine *engine, time_t when) {
              * only need to walk back until we hit an item older than the
              * oldest_live time.
              * The oldest_live checking will auto-expire the remaining items.
+             * The cold segment is fed from both the hot and the warm
+             * segment, so it isn't sorted and has to be walked completely.
              */
-            for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
-                if (iter->time >= engine->config.oldest_live) {
+            lru_lock(engine, i);
+            for (int seg = LRU_HOT; seg < LRU_SEGMENTS; ++seg) {
+                bool sorted = seg != LRU_COLD || !engine->config.lru_segmented;
+                for (iter = engine->items.heads[seg][i]; iter != NULL; iter = next) {
                     next = iter->next;
-                    if ((iter->iflag & ITEM_SLABBED) == 0) {
-                        do_item_unlink(engine, iter);
+                    if (iter->time >= engine->config.oldest_live) {
+                        if ((iter->iflag & ITEM_SLABBED) == 0) {
+                            do_item_unlink_locked(engine, iter);
+                        }
+                    } else if (sorted) {
+                        /* We've hit the first old item. Continue to the next queue. */
+                        break;
                     }
-                } else {
-                    /* We've hit the first old item. Continue to the next queue. */
-                    break;
                 }
             }
+            lru_unlock(engine, i);
         }
     }
-    pthread_mutex_unlock(&engine->cache_lock);
+    assoc_unlock_all(engine);
 }
 
 /*
@@ -943,43 +1754,153 @@ char *item_cachedump(struct default_engine *engine,
                      unsigned int *bytes) {
     char *ret;
 
-    pthread_mutex_lock(&engine->cache_lock);
+    lru_lock(engine, slabs_clsid);
     ret = do_item_cachedump(slabs_clsid, limit, bytes);
-    pthread_mutex_unlock(&engine->cache_lock);
+    lru_unlock(engine, slabs_clsid);
     return ret;
 }
 
 void item_stats(struct default_engine *engine,
                    ADD_STAT add_stat, const void *cookie)
 {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_stats(engine, add_stat, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 
 void item_stats_sizes(struct default_engine *engine,
                       ADD_STAT add_stat, const void *cookie)
 {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_stats_sizes(engine, add_stat, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+}
+
+/*
+ * The chunk may have been freed and reused since we read its owner, so
+ * make sure it is still one of the chunks of that item (which can't
+ * change while the item is linked)
+ */
+static bool item_has_chunk(const hash_item *it, const hash_item *chunk) {
+    if (!item_is_chunked(it)) {
+        return false;
+    }
+    struct item_chunks *chunks = item_get_chunks(it);
+    for (uint32_t ii = 0; ii < chunks->nchunks; ++ii) {
+        if (chunks->chunk[ii] == chunk) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Get rid of the item stored in a chunk of a slab page that moves to
+ * another slab class. We don't hold any locks, so the chunk may be freed
+ * and reused under our feet; everything is checked again under the
+ * stripe lock.
+ */
+bool item_evict_chunk(struct default_engine *engine, hash_item *it)
+{
+    hash_item *owner = it;
+    if ((it->iflag & (ITEM_CHUNK | ITEM_SLABBED)) == ITEM_CHUNK) {
+        /* A piece of a chunked item; evict that instead */
+        owner = it->h_next;
+        if (owner == NULL) {
+            return false;
+        }
+    }
+
+    if ((owner->iflag & (ITEM_LINKED | ITEM_SLABBED)) != ITEM_LINKED) {
+        /* Free, or allocated but not linked yet */
+        return false;
+    }
+
+    uint32_t hv = item_hash(engine, owner);
+    assoc_lock(engine, hv);
+    if ((owner->iflag & ITEM_LINKED) == 0 || item_hash(engine, owner) != hv ||
+        (owner != it && !item_has_chunk(owner, it)) || !item_freeze(owner)) {
+        assoc_unlock(engine, hv);
+        return false;
+    }
+    do_item_unlink(engine, owner);
+    assoc_unlock(engine, hv);
+    item_free(engine, owner);
+
+    return true;
+}
+
+/*
+ * The LRU lists are walked in the order of their position: slab class
+ * times LRU_SEGMENTS plus segment
+ */
+#define LRU_POSITIONS (POWER_LARGEST * LRU_SEGMENTS)
+
+static inline int item_cursor_position(const hash_item *cursor) {
+    return cursor->slabs_clsid * LRU_SEGMENTS + item_lru_segment(cursor);
 }
 
 static void do_item_link_cursor(struct default_engine *engine,
-                                hash_item *cursor, int ii)
+                                hash_item *cursor, int ii,
+                                enum lru_segment seg)
 {
     cursor->slabs_clsid = (uint8_t)ii;
+    item_set_lru_segment(cursor, seg);
     cursor->next = NULL;
-    cursor->prev = engine->items.tails[ii];
-    engine->items.tails[ii]->next = cursor;
-    engine->items.tails[ii] = cursor;
-    engine->items.sizes[ii]++;
+    cursor->prev = engine->items.tails[seg][ii];
+    engine->items.tails[seg][ii]->next = cursor;
+    engine->items.tails[seg][ii] = cursor;
+    engine->items.sizes[seg][ii]++;
+    engine->items.cursors[ii]++;
+}
+
+/* The caller must hold the LRU lock of the cursor's slab class */
+static void do_item_unlink_cursor(struct default_engine *engine,
+                                  hash_item *cursor)
+{
+    item_unlink_q(engine, cursor);
+    cursor->next = cursor->prev = NULL;
+    engine->items.cursors[cursor->slabs_clsid]--;
+}
+
+static inline bool do_item_cursor_linked(struct default_engine *engine,
+                                         const hash_item *cursor)
+{
+    return cursor->prev != NULL ||
+        engine->items.heads[item_lru_segment(cursor)][cursor->slabs_clsid] == cursor;
+}
+
+/*
+ * Link the cursor at the tail of the first LRU list that isn't empty,
+ * starting at the given position. Returns false if there is none.
+ */
+static bool item_link_cursor_from(struct default_engine *engine,
+                                  hash_item *cursor, int pos)
+{
+    for (; pos < LRU_POSITIONS; ++pos) {
+        int ii = pos / LRU_SEGMENTS;
+        enum lru_segment seg = pos % LRU_SEGMENTS;
+        bool linked = false;
+        lru_lock(engine, ii);
+        if (engine->items.heads[seg][ii] != NULL) {
+            // add the item at the tail
+            do_item_link_cursor(engine, cursor, ii, seg);
+            linked = true;
+        }
+        lru_unlock(engine, ii);
+        if (linked) {
+            return true;
+        }
+    }
+    return false;
 }
 
 typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
                                       hash_item *item, void *cookie);
 
+/*
+ * Must be called with the LRU lock of the cursor's slab class held. The
+ * lock may be released and reacquired while waiting for the stripe lock
+ * of the next item. itemfunc is called with both the LRU lock and the
+ * stripe lock of the item held.
+ */
 static bool do_item_walk_cursor(struct default_engine *engine,
                                 hash_item *cursor,
                                 int steplength,
@@ -987,31 +1908,52 @@ static bool do_item_walk_cursor(struct default_engine *engine,
                                 void* itemdata,
                                 ENGINE_ERROR_CODE *error)
 {
+    const unsigned int id = cursor->slabs_clsid;
+    const enum lru_segment seg = item_lru_segment(cursor);
     int ii = 0;
     *error = ENGINE_SUCCESS;
 
     while (cursor->prev != NULL && ii < steplength) {
         ++ii;
-        /* Move cursor */
         hash_item *ptr = cursor->prev;
-        item_unlink_q(engine, cursor);
+        bool is_cursor = item_is_cursor(ptr);
+        uint32_t hv = 0;
+
+        if (!is_cursor) {
+            hv = item_hash(engine, ptr);
+            if (!assoc_trylock(engine, hv)) {
+                /* Obey the lock order, then make sure nothing moved */
+                lru_unlock(engine, id);
+                assoc_lock(engine, hv);
+                lru_lock(engine, id);
+                if (cursor->prev != ptr || item_hash(engine, ptr) != hv) {
+                    assoc_unlock(engine, hv);
+                    --ii;
+                    continue;
+                }
+            }
+        }
 
+        /* Move cursor */
         bool done = false;
-        if (ptr == engine->items.heads[cursor->slabs_clsid]) {
+        if (ptr == engine->items.heads[seg][id]) {
             done = true;
-            cursor->prev = NULL;
+            do_item_unlink_cursor(engine, cursor);
         } else {
+            item_unlink_q(engine, cursor);
             cursor->next = ptr;
             cursor->prev = ptr->prev;
             cursor->prev->next = cursor;
             ptr->prev = cursor;
+            engine->items.sizes[seg][id]++;
         }
 
         /* Ignore cursors */
-        if (ptr->nkey == 0 && ptr->nbytes == 0) {
+        if (is_cursor) {
             --ii;
         } else {
             *error = itemfunc(engine, ptr, itemdata);
+            assoc_unlock(engine, hv);
             if (*error != ENGINE_SUCCESS) {
                 return false;
             }
@@ -1022,6 +1964,12 @@ static bool do_item_walk_cursor(struct default_engine *engine,
         }
     }
 
+    if (cursor->prev == NULL && engine->items.heads[seg][id] == cursor) {
+        /* The cursor reached the head; take it out of the list */
+        do_item_unlink_cursor(engine, cursor);
+        return false;
+    }
+
     return (cursor->prev != NULL);
 }
 
@@ -1031,9 +1979,9 @@ static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
     (void)cookie;
     engine->scrubber.visited++;
     rel_time_t current_time = engine->server.core->get_current_time();
-    if (item->refcount == 0 &&
+    if (item->refcount == 1 &&
         (item->exptime != 0 && item->exptime < current_time)) {
-        do_item_unlink(engine, item);
+        do_item_unlink_locked(engine, item);
         engine->scrubber.cleaned++;
     }
     return ENGINE_SUCCESS;
@@ -1045,9 +1993,9 @@ static void item_scrub_class(struct default_engine *engine,
     ENGINE_ERROR_CODE ret;
     bool more;
     do {
-        pthread_mutex_lock(&engine->cache_lock);
+        lru_lock(engine, cursor->slabs_clsid);
         more = do_item_walk_cursor(engine, cursor, 200, item_scrub, NULL, &ret);
-        pthread_mutex_unlock(&engine->cache_lock);
+        lru_unlock(engine, cursor->slabs_clsid);
         if (ret != ENGINE_SUCCESS) {
             break;
         }
@@ -1059,20 +2007,10 @@ static void *item_scubber_main(void *arg)
     struct default_engine *engine = arg;
     hash_item cursor = { .refcount = 1 };
 
-    for (int ii = 0; ii < POWER_LARGEST; ++ii) {
-        pthread_mutex_lock(&engine->cache_lock);
-        bool skip = false;
-        if (engine->items.heads[ii] == NULL) {
-            skip = true;
-        } else {
-            // add the item at the tail
-            do_item_link_cursor(engine, &cursor, ii);
-        }
-        pthread_mutex_unlock(&engine->cache_lock);
-
-        if (!skip) {
-            item_scrub_class(engine, &cursor);
-        }
+    int pos = 0;
+    while (item_link_cursor_from(engine, &cursor, pos)) {
+        pos = item_cursor_position(&cursor) + 1;
+        item_scrub_class(engine, &cursor);
     }
 
     pthread_mutex_lock(&engine->scrubber.lock);
@@ -1121,7 +2059,7 @@ static ENGINE_ERROR_CODE item_tap_iterfunc(struct default_engine *engine,
                                     void *cookie) {
     struct tap_client *client = cookie;
     client->it = item;
-    ++client->it->refcount;
+    item_acquire(client->it);
     return ENGINE_SUCCESS;
 }
 
@@ -1146,17 +2084,15 @@ static tap_event_t do_item_tap_walker(struct default_engine *engine,
 
     ENGINE_ERROR_CODE r;
     do {
-        if (!do_item_walk_cursor(engine, &client->cursor, 1, item_tap_iterfunc, client, &r)) {
-            // find next slab class to look at..
-            bool linked = false;
-            for (int ii = client->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    // add the item at the tail
-                    do_item_link_cursor(engine, &client->cursor, ii);
-                    linked = true;
-                }
-            }
-            if (!linked) {
+        int id = client->cursor.slabs_clsid;
+        lru_lock(engine, id);
+        bool more = do_item_walk_cursor(engine, &client->cursor, 1,
+                                        item_tap_iterfunc, client, &r);
+        lru_unlock(engine, id);
+        if (!more) {
+            // find next LRU list to look at..
+            int pos = item_cursor_position(&client->cursor) + 1;
+            if (!item_link_cursor_from(engine, &client->cursor, pos)) {
                 break;
             }
         }
@@ -1174,9 +2110,7 @@ tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
 {
     tap_event_t ret;
     struct default_engine *engine = (struct default_engine*)handle;
-    pthread_mutex_lock(&engine->cache_lock);
     ret = do_item_tap_walker(engine, cookie, itm, es, nes, ttl, flags, seqno, vbucket);
-    pthread_mutex_unlock(&engine->cache_lock);
 
     return ret;
 }
@@ -1191,17 +2125,374 @@ bool initialize_item_tap_walker(struct default_engine *engine,
     client->cursor.refcount = 1;
 
     /* Link the cursor! */
-    bool linked = false;
-    for (int ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        pthread_mutex_lock(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            // add the item at the tail
-            do_item_link_cursor(engine, &client->cursor, ii);
-            linked = true;
+    item_link_cursor_from(engine, &client->cursor, 0);
+
+    engine->server.cookie->store_engine_specific(cookie, client);
+    return true;
+}
+
+void release_item_tap_walker(struct default_engine *engine,
+                             const void* cookie)
+{
+    struct tap_client *client = engine->server.cookie->get_engine_specific(cookie);
+    if (client == NULL) {
+        return;
+    }
+
+    /* The client may go away before the walk is done */
+    int id = client->cursor.slabs_clsid;
+    lru_lock(engine, id);
+    if (do_item_cursor_linked(engine, &client->cursor)) {
+        do_item_unlink_cursor(engine, &client->cursor);
+    }
+    lru_unlock(engine, id);
+    free(client);
+}
+
+/*
+ * Move items off the tail of the hot or warm segment of a slab class
+ * while the segment holds more than its share of the items of the class.
+ * Active items go to the head of the warm segment and the rest to the
+ * cold segment; expired items are reclaimed on the way. Must be called
+ * with the LRU lock held. Returns the number of items moved.
+ */
+static int do_item_lru_pull_tail(struct default_engine *engine,
+                                 unsigned int id, enum lru_segment seg,
+                                 rel_time_t current_time)
+{
+    size_t pct = (seg == LRU_HOT) ? engine->config.lru_hot_pct :
+        engine->config.lru_warm_pct;
+    unsigned int limit = (uint64_t)do_item_lru_size(engine, id) * pct / 100;
+    int moved = 0;
+
+    while (moved < lru_juggle_batch && engine->items.sizes[seg][id] > limit) {
+        hash_item *it = engine->items.tails[seg][id];
+        ++moved;
+
+        if (it->refcount == 1 &&
+            it->exptime != 0 && it->exptime < current_time) {
+            uint32_t hv = item_hash(engine, it);
+            if (assoc_trylock(engine, hv)) {
+                if (item_freeze(it)) {
+                    engine->items.itemstats[id].reclaimed++;
+                    __sync_add_and_fetch(&engine->stats.reclaimed, 1);
+                    do_item_unlink_locked(engine, it);
+                    assoc_unlock(engine, hv);
+                    item_free(engine, it);
+                    continue;
+                }
+                assoc_unlock(engine, hv);
+            }
+        }
+
+        enum lru_segment to = LRU_COLD;
+        if ((it->iflag & ITEM_ACTIVE) != 0) {
+            __sync_fetch_and_and(&it->iflag, (uint16_t)~ITEM_ACTIVE);
+            it->time = current_time;
+            if (seg == LRU_WARM) {
+                engine->items.itemstats[id].moves_within_lru++;
+            } else {
+                engine->items.itemstats[id].moves_to_warm++;
+            }
+            to = LRU_WARM;
+        } else {
+            engine->items.itemstats[id].moves_to_cold++;
         }
-        pthread_mutex_unlock(&engine->cache_lock);
+        item_unlink_q(engine, it);
+        item_link_q(engine, it, to);
     }
 
-    engine->server.cookie->store_engine_specific(cookie, client);
+    return moved;
+}
+
+/*
+ * Rebalance the segments of a slab class. Returns the number of items
+ * moved, or -1 if it stopped because it moved as many as it may at once.
+ */
+static int item_lru_juggle(struct default_engine *engine, unsigned int id)
+{
+    rel_time_t current_time = engine->server.core->get_current_time();
+    int hot = 0, warm = 0;
+
+    lru_lock(engine, id);
+    /* Leave the lists alone while somebody walks them */
+    if (engine->items.cursors[id] == 0) {
+        hot = do_item_lru_pull_tail(engine, id, LRU_HOT, current_time);
+        warm = do_item_lru_pull_tail(engine, id, LRU_WARM, current_time);
+    }
+    lru_unlock(engine, id);
+
+    if (hot == lru_juggle_batch || warm == lru_juggle_batch) {
+        return -1;
+    }
+    return hot + warm;
+}
+
+static void *item_lru_maintainer_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    struct lru_maintainer *maintainer = &engine->items.maintainer;
+    uint64_t sleep = LRU_MAINTAINER_MIN_SLEEP;
+
+    pthread_mutex_lock(&maintainer->lock);
+    while (maintainer->running) {
+        if (sleep > 0) {
+            struct timeval tv;
+            struct timespec ts;
+            gettimeofday(&tv, NULL);
+            uint64_t usec = (uint64_t)tv.tv_usec + sleep;
+            ts.tv_sec = tv.tv_sec + usec / 1000000;
+            ts.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&maintainer->cond, &maintainer->lock, &ts);
+            if (!maintainer->running) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&maintainer->lock);
+
+        bool busy = false;
+        uint64_t moved = 0;
+        for (unsigned int id = POWER_SMALLEST; id < POWER_LARGEST; ++id) {
+            int ret = item_lru_juggle(engine, id);
+            if (ret < 0) {
+                busy = true;
+                moved += lru_juggle_batch;
+            } else {
+                moved += ret;
+            }
+        }
+
+        /* Back off while there is nothing to do */
+        if (busy) {
+            sleep = 0;
+        } else if (moved > 0) {
+            sleep = LRU_MAINTAINER_MIN_SLEEP;
+        } else if (sleep < LRU_MAINTAINER_MAX_SLEEP) {
+            sleep = (sleep == 0) ? LRU_MAINTAINER_MIN_SLEEP : sleep * 2;
+        }
+
+        pthread_mutex_lock(&maintainer->lock);
+        maintainer->runs++;
+        maintainer->moves += moved;
+    }
+    pthread_mutex_unlock(&maintainer->lock);
+
+    return NULL;
+}
+
+bool item_start_lru_maintainer(struct default_engine *engine)
+{
+    struct lru_maintainer *maintainer = &engine->items.maintainer;
+    int ret;
+
+    pthread_mutex_lock(&maintainer->lock);
+    maintainer->running = true;
+    if ((ret = pthread_create(&maintainer->thread, NULL,
+                              item_lru_maintainer_main, engine)) != 0) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Can't create LRU maintainer thread: %s\n", strerror(ret));
+        maintainer->running = false;
+    }
+    pthread_mutex_unlock(&maintainer->lock);
+
+    return ret == 0;
+}
+
+static void item_stop_lru_maintainer(struct default_engine *engine)
+{
+    struct lru_maintainer *maintainer = &engine->items.maintainer;
+
+    pthread_mutex_lock(&maintainer->lock);
+    if (!maintainer->running) {
+        pthread_mutex_unlock(&maintainer->lock);
+        return;
+    }
+    maintainer->running = false;
+    pthread_cond_signal(&maintainer->cond);
+    pthread_mutex_unlock(&maintainer->lock);
+
+    pthread_join(maintainer->thread, NULL);
+}
+
+/* State of the LRU crawler while it walks one list */
+struct lru_crawl {
+    rel_time_t current_time;
+    uint64_t checked;
+    uint64_t reclaimed;
+};
+
+static ENGINE_ERROR_CODE item_crawl(struct default_engine *engine,
+                                    hash_item *item,
+                                    void *cookie) {
+    struct lru_crawl *crawl = cookie;
+    rel_time_t oldest_live = engine->config.oldest_live;
+
+    crawl->checked++;
+    if ((item->exptime != 0 && item->exptime < crawl->current_time) ||
+        (oldest_live != 0 && oldest_live <= crawl->current_time &&
+         item->time <= oldest_live)) {
+        engine->items.itemstats[item->slabs_clsid].crawler_reclaimed++;
+        crawl->reclaimed++;
+        do_item_unlink_locked(engine, item);
+    }
+    return ENGINE_SUCCESS;
+}
+
+static bool item_lru_crawler_running(struct default_engine *engine) {
+    pthread_mutex_lock(&engine->items.crawler.lock);
+    bool running = engine->items.crawler.running;
+    pthread_mutex_unlock(&engine->items.crawler.lock);
+    return running;
+}
+
+/*
+ * Walk the list the cursor is linked into, in batches of lru_crawler_batch
+ * items with config.lru_crawler_sleep usec between them, and look at no
+ * more than config.lru_crawler_tocrawl items (if set). Returns false if
+ * the crawler was stopped.
+ */
+static bool item_crawl_list(struct default_engine *engine, hash_item *cursor,
+                            struct lru_crawl *crawl) {
+    const unsigned int id = cursor->slabs_clsid;
+    const uint64_t tocrawl = engine->config.lru_crawler_tocrawl;
+    const uint64_t start = crawl->checked;
+    ENGINE_ERROR_CODE ret;
+    bool more;
+
+    do {
+        int batch = lru_crawler_batch;
+        if (tocrawl != 0 && tocrawl - (crawl->checked - start) < (uint64_t)batch) {
+            batch = (int)(tocrawl - (crawl->checked - start));
+        }
+
+        lru_lock(engine, id);
+        crawl->current_time = engine->server.core->get_current_time();
+        more = do_item_walk_cursor(engine, cursor, batch, item_crawl,
+                                   crawl, &ret);
+        if (more && tocrawl != 0 && crawl->checked - start >= tocrawl) {
+            more = false;
+        }
+        if (!more && do_item_cursor_linked(engine, cursor)) {
+            do_item_unlink_cursor(engine, cursor);
+        }
+        lru_unlock(engine, id);
+
+        if (engine->config.lru_crawler_sleep > 0) {
+            usleep(engine->config.lru_crawler_sleep);
+        }
+        if (!item_lru_crawler_running(engine)) {
+            if (more) {
+                lru_lock(engine, id);
+                do_item_unlink_cursor(engine, cursor);
+                lru_unlock(engine, id);
+            }
+            return false;
+        }
+    } while (more);
+
     return true;
 }
+
+static void *item_lru_crawler_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    struct lru_crawler *crawler = &engine->items.crawler;
+
+    pthread_mutex_lock(&crawler->lock);
+    while (crawler->running) {
+        size_t interval = engine->config.lru_crawler_interval;
+        struct timespec ts = {
+            .tv_sec = time(NULL) + (time_t)(interval > 0 ? interval : 1)
+        };
+        pthread_cond_timedwait(&crawler->cond, &crawler->lock, &ts);
+        if (!crawler->running) {
+            break;
+        }
+        pthread_mutex_unlock(&crawler->lock);
+
+        hash_item cursor = { .refcount = 1 };
+        struct lru_crawl crawl = { .checked = 0 };
+        time_t started = time(NULL);
+        bool running = true;
+        int pos = 0;
+        while (running && item_link_cursor_from(engine, &cursor, pos)) {
+            pos = item_cursor_position(&cursor) + 1;
+            running = item_crawl_list(engine, &cursor, &crawl);
+        }
+
+        pthread_mutex_lock(&crawler->lock);
+        crawler->passes++;
+        crawler->checked += crawl.checked;
+        crawler->reclaimed += crawl.reclaimed;
+        crawler->last_checked = crawl.checked;
+        crawler->last_reclaimed = crawl.reclaimed;
+        crawler->last_duration = time(NULL) - started;
+    }
+    pthread_mutex_unlock(&crawler->lock);
+
+    return NULL;
+}
+
+bool item_start_lru_crawler(struct default_engine *engine)
+{
+    struct lru_crawler *crawler = &engine->items.crawler;
+    int ret;
+
+    pthread_mutex_lock(&crawler->lock);
+    crawler->running = true;
+    if ((ret = pthread_create(&crawler->thread, NULL,
+                              item_lru_crawler_main, engine)) != 0) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Can't create LRU crawler thread: %s\n", strerror(ret));
+        crawler->running = false;
+    }
+    pthread_mutex_unlock(&crawler->lock);
+
+    return ret == 0;
+}
+
+static void item_stop_lru_crawler(struct default_engine *engine)
+{
+    struct lru_crawler *crawler = &engine->items.crawler;
+
+    pthread_mutex_lock(&crawler->lock);
+    if (!crawler->running) {
+        pthread_mutex_unlock(&crawler->lock);
+        return;
+    }
+    crawler->running = false;
+    pthread_cond_signal(&crawler->cond);
+    pthread_mutex_unlock(&crawler->lock);
+
+    pthread_join(crawler->thread, NULL);
+}
+
+void item_crawler_stats(struct default_engine *engine,
+                        ADD_STAT add_stats, const void *c)
+{
+    struct lru_crawler *crawler = &engine->items.crawler;
+    const char *prefix = "crawler";
+
+    pthread_mutex_lock(&crawler->lock);
+    add_statistics(c, add_stats, prefix, -1, "status", "%s",
+                   crawler->running ? "running" : "stopped");
+    add_statistics(c, add_stats, prefix, -1, "passes", "%"PRIu64,
+                   crawler->passes);
+    add_statistics(c, add_stats, prefix, -1, "checked", "%"PRIu64,
+                   crawler->checked);
+    add_statistics(c, add_stats, prefix, -1, "reclaimed", "%"PRIu64,
+                   crawler->reclaimed);
+    if (crawler->passes > 0) {
+        add_statistics(c, add_stats, prefix, -1, "last_checked", "%"PRIu64,
+                       crawler->last_checked);
+        add_statistics(c, add_stats, prefix, -1, "last_reclaimed", "%"PRIu64,
+                       crawler->last_reclaimed);
+        add_statistics(c, add_stats, prefix, -1, "last_run", "%"PRIu64,
+                       (uint64_t)crawler->last_duration);
+    }
+    pthread_mutex_unlock(&crawler->lock);
+}
@@ -29,15 +29,107 @@ typedef struct {
     unsigned int outofmemory;
     unsigned int tailrepairs;
     unsigned int reclaimed;
+    unsigned int moves_to_cold;
+    unsigned int moves_to_warm;
+    unsigned int moves_within_lru;
+    unsigned int crawler_reclaimed;
 } itemstats_t;
 
+/*
+ * The LRU of every slab class is split in segments. With
+ * config.lru_segmented new items start out in the hot segment, items that
+ * were hit move to the warm segment, and everything else drains into the
+ * cold segment, which is where we evict from. Otherwise only the cold
+ * segment is used.
+ */
+enum lru_segment {
+   LRU_HOT,
+   LRU_WARM,
+   LRU_COLD,
+   LRU_SEGMENTS
+};
+
+/* The thread moving items between the segments */
+struct lru_maintainer {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   bool running;
+   /* Number of passes over the slab classes and items moved by them */
+   uint64_t runs;
+   uint64_t moves;
+};
+
+/* The thread walking the LRU lists to reclaim expired items */
+struct lru_crawler {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   bool running;
+   /* Number of passes over all of the LRU lists */
+   uint64_t passes;
+   /* Items looked at / reclaimed by all passes */
+   uint64_t checked;
+   uint64_t reclaimed;
+   /* Items looked at / reclaimed by the last pass, and how long it took */
+   uint64_t last_checked;
+   uint64_t last_reclaimed;
+   time_t last_duration;
+};
+
 struct items {
-   hash_item *heads[POWER_LARGEST];
-   hash_item *tails[POWER_LARGEST];
+   hash_item *heads[LRU_SEGMENTS][POWER_LARGEST];
+   hash_item *tails[LRU_SEGMENTS][POWER_LARGEST];
    itemstats_t itemstats[POWER_LARGEST];
-   unsigned int sizes[POWER_LARGEST];
+   unsigned int sizes[LRU_SEGMENTS][POWER_LARGEST];
+   /*
+    * Number of scrubber and tap cursors in the lists of each slab class.
+    * Items don't change segment while there are any, so the walkers
+    * see every item exactly once.
+    */
+   unsigned int cursors[POWER_LARGEST];
+   /* Protects all of the above for each slab class */
+   pthread_mutex_t lru_locks[POWER_LARGEST];
+   struct lru_maintainer maintainer;
+   struct lru_crawler crawler;
 };
 
+/**
+ * Initialize the item subsystem (the per slab class LRU locks)
+ * @param engine handle to the storage engine
+ */
+void item_init(struct default_engine *engine);
+
+/**
+ * Release the resources allocated by item_init (and stop the LRU
+ * maintainer if it is running)
+ * @param engine handle to the storage engine
+ */
+void item_destroy(struct default_engine *engine);
+
+/**
+ * Start the thread moving items between the LRU segments
+ * (config.lru_segmented)
+ * @param engine handle to the storage engine
+ * @return true if the thread was started
+ */
+bool item_start_lru_maintainer(struct default_engine *engine);
+
+/**
+ * Start the thread reclaiming expired items in the background
+ * (config.lru_crawler)
+ * @param engine handle to the storage engine
+ * @return true if the thread was started
+ */
+bool item_start_lru_crawler(struct default_engine *engine);
+
+/**
+ * Add the "stats crawler" statistics
+ * @param engine handle to the storage engine
+ */
+void item_crawler_stats(struct default_engine *engine,
+                        ADD_STAT add_stats, const void *c);
+
 
 /**
  * Allocate and initialize a new item structure
@@ -53,6 +145,39 @@ hash_item *item_alloc(struct default_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie);
 
+/**
+ * Check if an item with a key and value of the given sizes can be stored
+ * @param engine handle to the storage engine
+ * @param nkey the number of bytes in the key
+ * @param nbytes the number of bytes in the value
+ * @return true if the item isn't too big
+ */
+bool item_size_ok(struct default_engine *engine, size_t nkey, size_t nbytes);
+
+/**
+ * Get the pieces the value of an item is stored in (only chunked items
+ * have more than one)
+ * @param it the item
+ * @param iov where to store the pieces
+ * @param niov the number of elements available in iov
+ * @return the number of pieces (only niov of them are stored if that is
+ *         more than niov)
+ */
+int item_get_iov(const hash_item *it, struct iovec *iov, int niov);
+
+/**
+ * Copy data into / out of the value of an item, whether it is chunked or
+ * not
+ * @param it the item
+ * @param offset where to start in the value
+ * @param buf the data
+ * @param len the number of bytes to copy
+ */
+void item_write_data(hash_item *it, size_t offset,
+                     const void *buf, size_t len);
+void item_read_data(const hash_item *it, size_t offset,
+                    void *buf, size_t len);
+
 /**
  * Get an item from the cache
  *
@@ -64,6 +189,20 @@ hash_item *item_alloc(struct default_engine *engine,
 hash_item *item_get(struct default_engine *engine,
                     const void *key, const size_t nkey);
 
+/* The number of keys item_get_multi looks up in one read side section */
+#define ITEM_GET_BATCH 32
+
+/**
+ * Get a number of items from the cache
+ *
+ * @param engine handle to the storage engine
+ * @param lookups the keys to look up, receiving the item (NULL if it
+ *                doesn't exist) and status of each lookup
+ * @param nlookups the number of keys
+ */
+void item_get_multi(struct default_engine *engine,
+                    item_lookup *lookups, int nlookups);
+
 /**
  * Reset the item statistics
  * @param engine handle to the storage engine
@@ -170,6 +309,15 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              uint64_t *result);
 
 
+/**
+ * Evict the item in a chunk of a slab page that is moved to another slab
+ * class, unless it is in use
+ * @param engine handle to the storage engine
+ * @param it the chunk
+ * @return true if the item was evicted
+ */
+bool item_evict_chunk(struct default_engine *engine, hash_item *it);
+
 /**
  * Start the item scrubber
  * @param engine handle to the storage engine
@@ -188,5 +336,11 @@ tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
 bool initialize_item_tap_walker(struct default_engine *engine,
                                 const void* cookie);
 
+/**
+ * Release the tap walker of a connection that went away
+ */
+void release_item_tap_walker(struct default_engine *engine,
+                             const void* cookie);
+
 
 #endif
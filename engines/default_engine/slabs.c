@@ -18,6 +18,9 @@
 #include <pthread.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "default_engine.h"
 
@@ -26,6 +29,7 @@
  */
 static int do_slabs_newslab(struct default_engine *engine, const unsigned int id);
 static void *memory_allocate(struct default_engine *engine, size_t size);
+static void *slab_rebalance_main(void *arg);
 
 #ifndef DONT_PREALLOC_SLABS
 /* Preallocate as many slab pages as possible (called from slabs_init)
@@ -68,6 +72,10 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
     unsigned int size = sizeof(hash_item) + engine->config.chunk_size;
 
     engine->slabs.mem_limit = limit;
+    engine->slabs.page_size = engine->config.item_size_max;
+    if (engine->config.slab_chunk_max != 0) {
+        engine->slabs.page_size = engine->config.slab_chunk_max;
+    }
 
     if (prealloc) {
         /* Allocate everything in a big chunk with malloc */
@@ -82,13 +90,13 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
 
     memset(engine->slabs.slabclass, 0, sizeof(engine->slabs.slabclass));
 
-    while (++i < POWER_LARGEST && size <= engine->config.item_size_max / factor) {
+    while (++i < POWER_LARGEST && size <= engine->slabs.page_size / factor) {
         /* Make sure items are always n-byte aligned */
         if (size % CHUNK_ALIGN_BYTES)
             size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
 
         engine->slabs.slabclass[i].size = size;
-        engine->slabs.slabclass[i].perslab = engine->config.item_size_max / engine->slabs.slabclass[i].size;
+        engine->slabs.slabclass[i].perslab = engine->slabs.page_size / engine->slabs.slabclass[i].size;
         size *= factor;
         if (engine->config.verbose > 1) {
             EXTENSION_LOGGER_DESCRIPTOR *logger;
@@ -101,7 +109,7 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
     }
 
     engine->slabs.power_largest = i;
-    engine->slabs.slabclass[engine->slabs.power_largest].size = engine->config.item_size_max;
+    engine->slabs.slabclass[engine->slabs.power_largest].size = engine->slabs.page_size;
     engine->slabs.slabclass[engine->slabs.power_largest].perslab = 1;
     if (engine->config.verbose > 1) {
         EXTENSION_LOGGER_DESCRIPTOR *logger;
@@ -131,9 +139,40 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
     }
 #endif
 
+    if (engine->config.slab_reassign) {
+        struct slab_rebalance *rebal = &engine->slabs.rebal;
+        int ret;
+        rebal->running = true;
+        if ((ret = pthread_create(&rebal->thread, NULL,
+                                  slab_rebalance_main, engine)) != 0) {
+            EXTENSION_LOGGER_DESCRIPTOR *logger;
+            logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Can't create slab rebalance thread: %s\n",
+                        strerror(ret));
+            rebal->running = false;
+            return ENGINE_FAILED;
+        }
+    }
+
     return ENGINE_SUCCESS;
 }
 
+void slabs_destroy(struct default_engine *engine) {
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+
+    pthread_mutex_lock(&rebal->lock);
+    if (!rebal->running) {
+        pthread_mutex_unlock(&rebal->lock);
+        return;
+    }
+    rebal->running = false;
+    pthread_cond_signal(&rebal->cond);
+    pthread_mutex_unlock(&rebal->lock);
+
+    pthread_join(rebal->thread, NULL);
+}
+
 #ifndef DONT_PREALLOC_SLABS
 static void slabs_preallocate (const unsigned int maxslabs) {
     int i;
@@ -168,7 +207,9 @@ static int grow_slab_list (struct default_engine *engine, const unsigned int id)
 
 static int do_slabs_newslab(struct default_engine *engine, const unsigned int id) {
     slabclass_t *p = &engine->slabs.slabclass[id];
-    int len = p->size * p->perslab;
+    /* Pages that may move to another class must fit the chunks of any class */
+    int len = engine->config.slab_reassign ? engine->slabs.page_size
+        : p->size * p->perslab;
     char *ptr;
 
     if ((engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) ||
@@ -234,6 +275,8 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
     }
 
     if (ret) {
+        /* The slab rebalancer tells free chunks by this flag */
+        ((hash_item *)ret)->iflag &= ~ITEM_SLABBED;
         p->requested += size;
         MEMCACHED_SLABS_ALLOCATE(size, id, p->size, ret);
     } else {
@@ -258,6 +301,14 @@ static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t
     return;
 #endif
 
+    ((hash_item *)ptr)->iflag |= ITEM_SLABBED;
+    if (id == engine->slabs.rebal.src &&
+        ptr >= engine->slabs.rebal.start && ptr < engine->slabs.rebal.end) {
+        /* The page is moving to another class; don't hand it out again */
+        p->requested -= size;
+        return;
+    }
+
     if (p->sl_curr == p->sl_total) { /* need more space on the free list */
         int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
         void **new_slots = realloc(p->slots, new_size * sizeof(void *));
@@ -354,6 +405,15 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
     add_statistics(cookie, add_stats, NULL, -1, "active_slabs", "%d", total);
     add_statistics(cookie, add_stats, NULL, -1, "total_malloced", "%zu",
                    engine->slabs.mem_malloced);
+    if (engine->config.slab_reassign) {
+        add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_running",
+                       "%d", engine->slabs.rebal.src != 0 ||
+                       engine->slabs.rebal.request_src != 0);
+        add_statistics(cookie, add_stats, NULL, -1, "slabs_moved", "%"PRIu64,
+                       engine->slabs.rebal.slabs_moved);
+        add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_evictions",
+                       "%"PRIu64, engine->slabs.rebal.evictions);
+    }
 }
 
 static void *memory_allocate(struct default_engine *engine, size_t size) {
@@ -422,3 +482,306 @@ void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id,
     p->requested = p->requested - old + ntotal;
     pthread_mutex_unlock(&engine->slabs.lock);
 }
+
+/*
+ * Moving slab pages between classes (config.slab_reassign)
+ */
+
+/* How many passes (1ms apart) we make over a page before we give up */
+#define SLAB_REBALANCE_MAX_PASSES 10000
+
+enum reassign_result_type slabs_reassign(struct default_engine *engine,
+                                         int src, int dst) {
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+    enum reassign_result_type ret = REASSIGN_OK;
+
+    if (!engine->config.slab_reassign) {
+        return REASSIGN_DISABLED;
+    }
+    if (src == dst) {
+        return REASSIGN_SRC_DST_SAME;
+    }
+    if (src < POWER_SMALLEST || src > engine->slabs.power_largest ||
+        dst < POWER_SMALLEST || dst > engine->slabs.power_largest) {
+        return REASSIGN_BADCLASS;
+    }
+
+    pthread_mutex_lock(&rebal->lock);
+    pthread_mutex_lock(&engine->slabs.lock);
+    if (rebal->request_src != 0 || rebal->src != 0) {
+        ret = REASSIGN_RUNNING;
+    } else if (engine->slabs.slabclass[src].slabs < 2) {
+        ret = REASSIGN_NOSPARE;
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    if (ret == REASSIGN_OK) {
+        rebal->request_src = src;
+        rebal->request_dst = dst;
+        pthread_cond_signal(&rebal->cond);
+    }
+    pthread_mutex_unlock(&rebal->lock);
+
+    return ret;
+}
+
+/*
+ * Pick the first page of the source class and stop handing out its
+ * chunks. Chunks that are free (or were never used) are flagged as
+ * ITEM_SLABBED, just like the ones freed from now on.
+ */
+static bool slab_rebalance_start(struct default_engine *engine,
+                                 int src, int dst) {
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+    slabclass_t *s = &engine->slabs.slabclass[src];
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    if (s->slabs < 2) {
+        pthread_mutex_unlock(&engine->slabs.lock);
+        return false;
+    }
+
+    char *start = s->slab_list[0];
+    char *end = start + s->size * s->perslab;
+    rebal->src = src;
+    rebal->dst = dst;
+    rebal->start = start;
+    rebal->end = end;
+    s->killing = 1;
+
+    for (unsigned int ii = 0; ii < s->sl_curr;) {
+        char *ptr = s->slots[ii];
+        if (ptr >= start && ptr < end) {
+            s->slots[ii] = s->slots[--s->sl_curr];
+        } else {
+            ++ii;
+        }
+    }
+
+    char *ptr = s->end_page_ptr;
+    if (ptr >= start && ptr < end) {
+        for (; ptr < end; ptr += s->size) {
+            ((hash_item *)ptr)->iflag |= ITEM_SLABBED;
+        }
+        s->end_page_ptr = NULL;
+        s->end_page_free = 0;
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    return true;
+}
+
+/*
+ * Evict the items stored in the page until every chunk is free. Items
+ * that are in use are retried on the next pass.
+ */
+static bool slab_rebalance_drain(struct default_engine *engine) {
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+    slabclass_t *s = &engine->slabs.slabclass[rebal->src];
+
+    for (int pass = 0; pass < SLAB_REBALANCE_MAX_PASSES; ++pass) {
+        bool busy = false;
+        for (char *ptr = rebal->start; ptr < (char *)rebal->end; ptr += s->size) {
+            hash_item *it = (hash_item *)ptr;
+            if ((it->iflag & ITEM_SLABBED) != 0) {
+                continue;
+            }
+            if (item_evict_chunk(engine, it)) {
+                rebal->evictions++;
+            } else {
+                busy = true;
+            }
+        }
+
+        if (!busy) {
+            return true;
+        }
+
+        pthread_mutex_lock(&rebal->lock);
+        bool running = rebal->running;
+        pthread_mutex_unlock(&rebal->lock);
+        if (!running) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    return false;
+}
+
+/* Give the drained page to the destination class (slabs lock held) */
+static void do_slab_rebalance_finish(struct default_engine *engine) {
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+    slabclass_t *s = &engine->slabs.slabclass[rebal->src];
+    int id = rebal->dst;
+    char *page = rebal->start;
+
+    s->slab_list[0] = s->slab_list[--s->slabs];
+    s->killing = 0;
+    rebal->src = 0;
+    rebal->start = rebal->end = NULL;
+
+    if (grow_slab_list(engine, id) == 0) {
+        /* Keep it where it was */
+        id = s - engine->slabs.slabclass;
+    }
+
+    slabclass_t *d = &engine->slabs.slabclass[id];
+    memset(page, 0, engine->slabs.page_size);
+    d->slab_list[d->slabs++] = page;
+    for (unsigned int ii = 0; ii < d->perslab; ++ii) {
+        do_slabs_free(engine, page + ii * d->size, 0, id);
+    }
+    if (id == rebal->dst) {
+        rebal->slabs_moved++;
+    }
+}
+
+/*
+ * Put the free chunks of the page back on the free list of the source
+ * class (slabs lock held). The items we couldn't get rid of stay.
+ */
+static void do_slab_rebalance_abort(struct default_engine *engine) {
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+    slabclass_t *s = &engine->slabs.slabclass[rebal->src];
+    int id = rebal->src;
+    char *start = rebal->start;
+    char *end = rebal->end;
+
+    s->killing = 0;
+    rebal->src = 0;
+    rebal->start = rebal->end = NULL;
+
+    for (char *ptr = start; ptr < end; ptr += s->size) {
+        if ((((hash_item *)ptr)->iflag & ITEM_SLABBED) != 0) {
+            do_slabs_free(engine, ptr, 0, id);
+        }
+    }
+}
+
+static void slab_rebalance_move(struct default_engine *engine,
+                                int src, int dst) {
+    if (!slab_rebalance_start(engine, src, dst)) {
+        return;
+    }
+
+    bool done = slab_rebalance_drain(engine);
+    if (done) {
+        /*
+         * A lock free reader may still look at an item it found before
+         * it was evicted. Wait for it before the page is split into the
+         * chunks of another class, where that memory belongs to the
+         * middle of some other item.
+         */
+        assoc_synchronize(engine);
+    }
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    if (done) {
+        do_slab_rebalance_finish(engine);
+    } else {
+        do_slab_rebalance_abort(engine);
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    if (engine->config.verbose > 0) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "%s moving a page from slab class %d to %d\n",
+                    done ? "Finished" : "Gave up", src, dst);
+    }
+}
+
+/*
+ * The automove policy, run once per window: a class that had the most
+ * evictions for three windows in a row gets a page from a class that had
+ * no evictions for three windows and has more than two pages.
+ */
+static bool slab_automove_decide(struct default_engine *engine,
+                                 int *src, int *dst) {
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+    unsigned int highest = 0;
+    int source = 0;
+    int dest = 0;
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    for (int ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        unsigned int evicted = engine->items.itemstats[ii].evicted;
+        /* The counters may have been reset */
+        unsigned int delta = evicted >= rebal->evicted[ii] ?
+            evicted - rebal->evicted[ii] : evicted;
+        rebal->evicted[ii] = evicted;
+
+        if (delta == 0 && engine->slabs.slabclass[ii].slabs > 2) {
+            if (++rebal->zero_windows[ii] >= 3 && source == 0) {
+                source = ii;
+            }
+        } else {
+            rebal->zero_windows[ii] = 0;
+        }
+
+        if (delta > highest) {
+            highest = delta;
+            dest = ii;
+        }
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    if (dest != 0 && dest == rebal->winner) {
+        rebal->winner_windows++;
+    } else {
+        rebal->winner = dest;
+        rebal->winner_windows = (dest != 0) ? 1 : 0;
+    }
+
+    if (source != 0 && rebal->winner_windows >= 3) {
+        rebal->zero_windows[source] = 0;
+        rebal->winner_windows = 0;
+        *src = source;
+        *dst = dest;
+        return true;
+    }
+    return false;
+}
+
+static void *slab_rebalance_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct slab_rebalance *rebal = &engine->slabs.rebal;
+    time_t window_start = time(NULL);
+
+    pthread_mutex_lock(&rebal->lock);
+    while (rebal->running) {
+        if (rebal->request_src == 0 && engine->config.slab_automove &&
+            time(NULL) >= window_start + (time_t)engine->config.slab_automove_window) {
+            window_start = time(NULL);
+            int src, dst;
+            if (slab_automove_decide(engine, &src, &dst)) {
+                rebal->request_src = src;
+                rebal->request_dst = dst;
+            }
+        }
+
+        if (rebal->request_src != 0) {
+            int src = rebal->request_src;
+            int dst = rebal->request_dst;
+            pthread_mutex_unlock(&rebal->lock);
+            slab_rebalance_move(engine, src, dst);
+            pthread_mutex_lock(&rebal->lock);
+            rebal->request_src = rebal->request_dst = 0;
+            continue;
+        }
+
+        /* Wake up every second to run the automove policy */
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        struct timespec ts = {
+            .tv_sec = tv.tv_sec + 1,
+            .tv_nsec = tv.tv_usec * 1000
+        };
+        pthread_cond_timedwait(&rebal->cond, &rebal->lock, &ts);
+    }
+    pthread_mutex_unlock(&rebal->lock);
+
+    return NULL;
+}
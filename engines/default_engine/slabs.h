@@ -28,11 +28,59 @@ typedef struct {
     size_t requested; /* The number of requested bytes */
 } slabclass_t;
 
+/*
+ * Moves pages between slab classes (config.slab_reassign). A page is
+ * moved by a background thread: it stops handing out the free chunks of
+ * the page, evicts the items stored in it, and gives it to the other
+ * class once every chunk is free.
+ */
+struct slab_rebalance {
+   pthread_t thread;
+   /* Protects running and the pending request */
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   bool running;
+   int request_src;
+   int request_dst;
+
+   /* The page being moved; protected by the slabs lock */
+   int src;
+   int dst;
+   void *start;
+   void *end;
+
+   /* Evictions seen by the automove policy in the previous window */
+   unsigned int evicted[MAX_NUMBER_OF_SLAB_CLASSES];
+   /* Number of windows in a row without evictions */
+   unsigned int zero_windows[MAX_NUMBER_OF_SLAB_CLASSES];
+   /* The class with the most evictions and for how many windows in a row */
+   int winner;
+   unsigned int winner_windows;
+
+   uint64_t slabs_moved;
+   uint64_t evictions;
+};
+
+enum reassign_result_type {
+   REASSIGN_OK = 0,
+   REASSIGN_RUNNING,
+   REASSIGN_BADCLASS,
+   REASSIGN_NOSPARE,
+   REASSIGN_SRC_DST_SAME,
+   REASSIGN_DISABLED
+};
+
 struct slabs {
    slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
    size_t mem_limit;
    size_t mem_malloced;
    int power_largest;
+   /*
+    * The size of a slab page, which is also the chunk size of the largest
+    * slab class: config.item_size_max, or config.slab_chunk_max when
+    * larger items are stored in chunks.
+    */
+   size_t page_size;
 
    void *mem_base;
    void *mem_current;
@@ -42,6 +90,8 @@ struct slabs {
     * Access to the slab allocator is protected by this lock
     */
    pthread_mutex_t lock;
+
+   struct slab_rebalance rebal;
 };
 
 
@@ -58,6 +108,9 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                              const double factor,
                              const bool prealloc);
 
+/** Stop the slab rebalancer thread (if it is running) */
+void slabs_destroy(struct default_engine *engine);
+
 
 /**
  * Given object size, return id to use when allocating/freeing memory for object
@@ -75,6 +128,13 @@ void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned
 /** Adjust the stats for memory requested */
 void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal);
 
+/**
+ * Move a page from slab class src to slab class dst. The move is done in
+ * the background; this only checks and queues the request.
+ */
+enum reassign_result_type slabs_reassign(struct default_engine *engine,
+                                         int src, int dst);
+
 /** Fill buffer with stats */ /*@null@*/
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c);
 
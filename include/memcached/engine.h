@@ -537,6 +537,24 @@ extern "C" {
         size_t (*errinfo)(ENGINE_HANDLE *handle, const void* cookie,
                           char *buffer, size_t buffsz);
 
+        /**
+         * Retrieve a number of items at once. Set to NULL if you don't
+         * implement it, and the core will call get for every key.
+         *
+         * The keys are looked up in order, and the status of each lookup
+         * is what get would have returned for it. If a lookup returns
+         * ENGINE_EWOULDBLOCK the engine must stop there; the lookups
+         * following it are left untouched.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param lookups the keys to look up and the result for each
+         * @param nlookups the number of elements in lookups
+         */
+        void (*get_multi)(ENGINE_HANDLE* handle,
+                          const void* cookie,
+                          item_lookup *lookups,
+                          int nlookups);
 
 
     } ENGINE_HANDLE_V1;
@@ -167,7 +167,9 @@ extern "C"
         PROTOCOL_BINARY_CMD_LAST_RESERVED = 0x8f,
 
         /* Scrub the data */
-        PROTOCOL_BINARY_CMD_SCRUB = 0xf0
+        PROTOCOL_BINARY_CMD_SCRUB = 0xf0,
+        /* Move a slab page to another slab class */
+        PROTOCOL_BINARY_CMD_SLABS_REASSIGN = 0xf1
     } protocol_binary_command;
 
     /**
@@ -471,6 +473,21 @@ extern "C"
 
     typedef protocol_binary_request_gat protocol_binary_request_gatq;
 
+    /**
+     * Definition of the packet used by the slabs reassign command. The
+     * page is moved in the background after the response is sent.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t src;
+                uint32_t dst;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_slabs_reassign;
+
     /**
      * Definition of the packet returned from the GAT(Q)
      */
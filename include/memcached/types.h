@@ -71,11 +71,24 @@ extern "C" {
         uint8_t clsid; /** class id for the object */
         uint16_t nkey; /**< The total length of the key (in bytes) */
         uint16_t nvalue; /** < IN: The number of elements available in value
-                          * OUT: the number of elements used in value */
+                          * OUT: the number of elements the value is stored
+                          * in. If that is more than were available, only
+                          * the available elements are filled in. */
         const void *key;
         struct iovec value[1];
     } item_info;
 
+    /**
+     * A key to look up with get_multi, and the outcome of the lookup.
+     */
+    typedef struct {
+        const void *key; /**< IN: the key to look up */
+        uint16_t nkey; /**< IN: the length of the key */
+        uint16_t vbucket; /**< IN: the virtual bucket id */
+        ENGINE_ERROR_CODE status; /**< OUT: what get would have returned */
+        item *item; /**< OUT: the item (if status is ENGINE_SUCCESS) */
+    } item_lookup;
+
     typedef struct {
         const char *username;
         const char *config;
@@ -170,6 +170,15 @@ static ENGINE_ERROR_CODE mock_get(ENGINE_HANDLE* handle,
     return ret;
 }
 
+static void mock_get_multi(ENGINE_HANDLE* handle,
+                           const void* cookie,
+                           item_lookup *lookups,
+                           int nlookups) {
+    struct mock_engine *me = get_handle(handle);
+    me->the_engine->get_multi((ENGINE_HANDLE*)me->the_engine, cookie,
+                              lookups, nlookups);
+}
+
 static ENGINE_ERROR_CODE mock_get_stats(ENGINE_HANDLE* handle,
                                         const void* cookie,
                                         const char* stat_key,
@@ -485,7 +494,8 @@ struct mock_engine default_mock_engine = {
         .get_tap_iterator = mock_get_tap_iterator,
         .item_set_cas = mock_item_set_cas,
         .get_item_info = mock_get_item_info,
-        .errinfo = mock_errinfo
+        .errinfo = mock_errinfo,
+        .get_multi = mock_get_multi
     }
 };
 struct mock_engine mock_engine;
@@ -619,6 +629,9 @@ static ENGINE_HANDLE_V1 *start_your_engines(const char *engine, const char* cfg,
     if (mock_engine.the_engine->errinfo == NULL) {
         mock_engine.me.errinfo = NULL;
     }
+    if (mock_engine.the_engine->get_multi == NULL) {
+        mock_engine.me.get_multi = NULL;
+    }
 
     return &mock_engine.me;
 }
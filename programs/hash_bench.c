@@ -0,0 +1,184 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark for the hash index of the default engine. It fills the
+ * cache with small items and times lookups of keys that are there and of
+ * keys that aren't, one at a time, and multi-gets of keys that are there,
+ * for each of the index configurations:
+ *
+ *   chained       the hash chains
+ *   bucketed      the cache line buckets with the scalar tag match
+ *   bucketed+simd the cache line buckets with the SIMD tag match
+ *
+ * and for the chains and SIMD buckets without prefetching the buckets and
+ * items of a multi-get. Use enough items to make the cache much larger
+ * than the last level cache of the CPU.
+ *
+ * Usage: hash_bench -E .libs/default_engine.so [-n items] [-l lookups]
+ *                   [-m keys per multi-get]
+ */
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "utilities/engine_loader.h"
+#include <memcached/extension_loggers.h>
+#include <mock_server.h>
+
+static const struct {
+    const char *name;
+    const char *config;
+} configs[] = {
+    { "chained", "" },
+    { "bucketed", "bucketed_hash=true;simd_tags=false;" },
+    { "bucketed+simd", "bucketed_hash=true;simd_tags=true;" },
+    { "chained-pf", "prefetch_lookups=false;" },
+    { "bucketed+simd-pf",
+      "bucketed_hash=true;simd_tags=true;prefetch_lookups=false;" }
+};
+
+static uint64_t usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static double lookup(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                     const char *prefix, unsigned int nitems,
+                     unsigned int nlookups, ENGINE_ERROR_CODE expected) {
+    uint64_t start = usec();
+    for (unsigned int ii = 0; ii < nlookups; ++ii) {
+        char key[32];
+        /* Jump around so that we don't walk the table in order */
+        unsigned int idx = (unsigned int)(((uint64_t)ii * 2654435761U) % nitems);
+        size_t nkey = snprintf(key, sizeof(key), "%s%u", prefix, idx);
+        item *it = NULL;
+        ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, nkey, 0);
+        assert(ret == expected);
+        if (ret == ENGINE_SUCCESS) {
+            h1->release(h, NULL, it);
+        }
+    }
+    return (double)(usec() - start) * 1000.0 / nlookups;
+}
+
+static double multi_lookup(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           unsigned int nitems, unsigned int nlookups,
+                           unsigned int nkeys) {
+    item_lookup *lookups = calloc(nkeys, sizeof(*lookups));
+    char (*keys)[32] = calloc(nkeys, sizeof(*keys));
+    assert(lookups != NULL && keys != NULL);
+
+    uint64_t start = usec();
+    for (unsigned int ii = 0; ii < nlookups; ii += nkeys) {
+        for (unsigned int jj = 0; jj < nkeys; ++jj) {
+            unsigned int idx = (unsigned int)(((uint64_t)(ii + jj) * 2654435761U) % nitems);
+            lookups[jj].key = keys[jj];
+            lookups[jj].nkey = snprintf(keys[jj], sizeof(keys[jj]),
+                                        "key_%u", idx);
+            lookups[jj].vbucket = 0;
+        }
+        h1->get_multi(h, NULL, lookups, nkeys);
+        for (unsigned int jj = 0; jj < nkeys; ++jj) {
+            assert(lookups[jj].status == ENGINE_SUCCESS);
+            h1->release(h, NULL, lookups[jj].item);
+        }
+    }
+    double ns = (double)(usec() - start) * 1000.0 / nlookups;
+
+    free(keys);
+    free(lookups);
+    return ns;
+}
+
+static void run(const char *engine, const char *name, const char *config,
+                unsigned int nitems, unsigned int nlookups,
+                unsigned int nkeys) {
+    ENGINE_HANDLE *h = NULL;
+    char cfg[256];
+
+    /* Room for every item, so that none of them are evicted */
+    snprintf(cfg, sizeof(cfg), "%scache_size=%llu", config,
+             (unsigned long long)nitems * 128 + 64 * 1024 * 1024);
+
+    init_mock_server(NULL);
+    if (!load_engine(engine, &get_mock_server_api, get_null_logger(), &h) ||
+        !init_engine(h, cfg, get_null_logger())) {
+        fprintf(stderr, "Failed to load %s with config %s\n", engine, cfg);
+        exit(EXIT_FAILURE);
+    }
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1 *)h;
+
+    for (unsigned int ii = 0; ii < nitems; ++ii) {
+        char key[32];
+        size_t nkey = snprintf(key, sizeof(key), "key_%u", ii);
+        item *it = NULL;
+        uint64_t cas = 0;
+        if (h1->allocate(h, NULL, &it, key, nkey, 8, 0, 0) != ENGINE_SUCCESS ||
+            h1->store(h, NULL, it, &cas, OPERATION_SET, 0) != ENGINE_SUCCESS) {
+            fprintf(stderr, "Failed to store %s\n", key);
+            exit(EXIT_FAILURE);
+        }
+        h1->release(h, NULL, it);
+    }
+
+    /* Let a background expansion finish before we measure */
+    sleep(1);
+
+    double hit = lookup(h, h1, "key_", nitems, nlookups, ENGINE_SUCCESS);
+    double miss = lookup(h, h1, "miss_", nitems, nlookups, ENGINE_KEY_ENOENT);
+    double mget = multi_lookup(h, h1, nitems, nlookups, nkeys);
+    printf("%-17s %10.1f %10.1f %10.1f\n", name, hit, miss, mget);
+
+    h1->destroy(h, false);
+}
+
+int main(int argc, char **argv) {
+    const char *engine = NULL;
+    unsigned int nitems = 1000000;
+    unsigned int nlookups = 5000000;
+    unsigned int nkeys = 100;
+    int c;
+
+    while ((c = getopt(argc, argv, "E:n:l:m:")) != -1) {
+        switch (c) {
+        case 'E':
+            engine = optarg;
+            break;
+        case 'n':
+            nitems = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            nlookups = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            nkeys = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s -E engine [-n items] [-l lookups] [-m keys]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (engine == NULL || nitems == 0 || nlookups == 0 || nkeys == 0) {
+        fprintf(stderr,
+                "Usage: %s -E engine [-n items] [-l lookups] [-m keys]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%u items, %u lookups, %u keys per multi-get (ns per key)\n",
+           nitems, nlookups, nkeys);
+    printf("%-17s %10s %10s %10s\n", "index", "hit", "miss", "mget hit");
+    for (size_t ii = 0; ii < sizeof(configs) / sizeof(configs[0]); ++ii) {
+        run(engine, configs[ii].name, configs[ii].config, nitems, nlookups,
+            nkeys);
+    }
+
+    return EXIT_SUCCESS;
+}
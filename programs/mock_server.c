@@ -7,6 +7,7 @@
 #include <memcached/engine.h>
 #include <memcached/extension.h>
 #include <memcached/extension_loggers.h>
+#include <memcached/genhash.h>
 #include <mock_server.h>
 
 #define REALTIME_MAXDELTA 60*60*24*3
@@ -78,8 +79,8 @@ static const char *mock_get_server_version() {
 }
 
 static uint32_t mock_hash( const void *key, size_t length, const uint32_t initval) {
-    //this is a very stupid hash indeed
-    return 1;
+    /* spread the keys so that tests exercise more than one hash chain */
+    return (uint32_t)genhash_string_hash(key, length) ^ initval;
 }
 
 /* time-sensitive callers can call it by hand with this, outside the
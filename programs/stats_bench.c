@@ -0,0 +1,222 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Benchmark for the "stats" command. It opens a connection per worker
+ * thread of the server (so that every thread has counters to report),
+ * stores and fetches items of many sizes on each of them (so that the
+ * per slab class counters of every thread are in use), and then times
+ * "stats" requests, optionally while other connections keep sending
+ * gets. Start the server with the number of threads to measure, e.g.
+ *
+ *   memcached -t 64 -m 1024 &
+ *   stats_bench -t 64 -n 1000 -l 8
+ *
+ * Usage: stats_bench [-h host] [-p port] [-t server threads]
+ *                    [-n stats requests] [-l load connections]
+ */
+#include "config.h"
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+static const char *host = "127.0.0.1";
+static const char *port = "11211";
+static volatile int stop;
+
+static uint64_t usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int connect_server(void) {
+    struct addrinfo *ai = NULL;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                              .ai_protocol = IPPROTO_TCP,
+                              .ai_socktype = SOCK_STREAM };
+
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        fprintf(stderr, "Failed to look up %s:%s\n", host, port);
+        exit(1);
+    }
+    int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock == -1 || connect(sock, ai->ai_addr, ai->ai_addrlen) == -1) {
+        fprintf(stderr, "Failed to connect to %s:%s: %s\n", host, port,
+                strerror(errno));
+        exit(1);
+    }
+    freeaddrinfo(ai);
+    return sock;
+}
+
+static void send_all(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t nw = send(sock, buf, len, 0);
+        if (nw == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to write: %s\n", strerror(errno));
+            exit(1);
+        }
+        buf += nw;
+        len -= nw;
+    }
+}
+
+/* Read until the response ends with the terminator */
+static void recv_until(int sock, const char *terminator) {
+    static __thread char buf[65536];
+    size_t tlen = strlen(terminator);
+    size_t have = 0;
+    for (;;) {
+        ssize_t nr = recv(sock, buf + have, sizeof(buf) - have, 0);
+        if (nr == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nr <= 0) {
+            fprintf(stderr, "Failed to read: %s\n",
+                    nr == 0 ? "connection closed" : strerror(errno));
+            exit(1);
+        }
+        have += nr;
+        if (have >= tlen && memcmp(buf + have - tlen, terminator, tlen) == 0) {
+            return;
+        }
+        if (have > sizeof(buf) / 2) {
+            /* Keep the tail only; it is all we need to match */
+            memmove(buf, buf + have - tlen, tlen);
+            have = tlen;
+        }
+    }
+}
+
+/* Store and fetch items of sizes spread over the slab classes */
+static void populate(int sock, int conn) {
+    static char value[512 * 1024];
+    memset(value, 'x', sizeof(value));
+    for (size_t size = 16; size < sizeof(value); size += size / 8 + 1) {
+        char cmd[128];
+        int len = snprintf(cmd, sizeof(cmd), "set bench_%d_%zu 0 0 %zu\r\n",
+                           conn, size, size);
+        send_all(sock, cmd, len);
+        send_all(sock, value, size);
+        send_all(sock, "\r\n", 2);
+        recv_until(sock, "\r\n");
+        len = snprintf(cmd, sizeof(cmd), "get bench_%d_%zu\r\n", conn, size);
+        send_all(sock, cmd, len);
+        recv_until(sock, "END\r\n");
+    }
+}
+
+static void *load(void *arg) {
+    int sock = connect_server();
+    int conn = (int)(intptr_t)arg;
+    char cmd[64];
+    int len = snprintf(cmd, sizeof(cmd), "get bench_%d_16\r\n", conn);
+    while (!stop) {
+        send_all(sock, cmd, len);
+        recv_until(sock, "END\r\n");
+    }
+    close(sock);
+    return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    int nthreads = 4;
+    int nrequests = 1000;
+    int nload = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "h:p:t:n:l:")) != -1) {
+        switch (c) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            nrequests = atoi(optarg);
+            break;
+        case 'l':
+            nload = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] [-p port] [-t server threads]"
+                    " [-n stats requests] [-l load connections]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1 || nrequests < 1 || nload < 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    /* New connections go round robin over the worker threads */
+    int *socks = calloc(nthreads, sizeof(int));
+    assert(socks != NULL);
+    for (int ii = 0; ii < nthreads; ++ii) {
+        socks[ii] = connect_server();
+        populate(socks[ii], ii);
+    }
+
+    pthread_t *loaders = calloc(nload + 1, sizeof(pthread_t));
+    assert(loaders != NULL);
+    for (int ii = 0; ii < nload; ++ii) {
+        if (pthread_create(&loaders[ii], NULL, load,
+                           (void *)(intptr_t)(ii % nthreads)) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            return 1;
+        }
+    }
+
+    uint64_t *times = calloc(nrequests, sizeof(uint64_t));
+    assert(times != NULL);
+    int sock = socks[0];
+    uint64_t total = 0;
+    for (int ii = 0; ii < nrequests; ++ii) {
+        uint64_t start = usec();
+        send_all(sock, "stats\r\n", 7);
+        recv_until(sock, "END\r\n");
+        times[ii] = usec() - start;
+        total += times[ii];
+    }
+
+    stop = 1;
+    for (int ii = 0; ii < nload; ++ii) {
+        pthread_join(loaders[ii], NULL);
+    }
+
+    qsort(times, nrequests, sizeof(uint64_t), compare);
+    printf("%d server threads, %d load connections, %d stats requests\n",
+           nthreads, nload, nrequests);
+    printf("stats: mean %.1f us, median %"PRIu64" us, p99 %"PRIu64" us\n",
+           (double)total / nrequests, times[nrequests / 2],
+           times[(nrequests * 99) / 100]);
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        close(socks[ii]);
+    }
+    free(socks);
+    free(loaders);
+    free(times);
+    return 0;
+}
@@ -139,6 +139,66 @@ static enum test_return cache_bulkalloc(size_t datasize)
     return TEST_PASS;
 }
 
+#ifndef HAVE_UMEM_H
+static void *cache_magazine_thread(void *arg) {
+    cache_t *cache = arg;
+    cache_free(cache, cache_alloc(cache));
+    return NULL;
+}
+#endif
+
+static enum test_return cache_magazine_test(void)
+{
+#ifndef HAVE_UMEM_H
+    cache_t *cache = cache_create("test", sizeof(uint32_t), sizeof(char*),
+                                  NULL, NULL);
+    assert(cache != NULL);
+    cache_stats_t stats;
+#define ITERATIONS (2 * CACHE_MAGAZINE_SIZE)
+    void *ptr[ITERATIONS];
+
+    /* Nothing to refill the magazine with yet */
+    for (int ii = 0; ii < ITERATIONS; ++ii) {
+        ptr[ii] = cache_alloc(cache);
+        assert(ptr[ii] != NULL);
+    }
+    cache_get_stats(cache, &stats);
+    assert(stats.magazine_hits == 0);
+    assert(stats.pool_refills == ITERATIONS);
+
+    /* The magazine overflows twice, half of it at a time */
+    for (int ii = 0; ii < ITERATIONS; ++ii) {
+        cache_free(cache, ptr[ii]);
+    }
+    cache_get_stats(cache, &stats);
+    assert(stats.pool_flushes == 2);
+
+    /* A full magazine, then one refill from the shared pool */
+    for (int ii = 0; ii < CACHE_MAGAZINE_SIZE + 1; ++ii) {
+        ptr[ii] = cache_alloc(cache);
+    }
+    cache_get_stats(cache, &stats);
+    assert(stats.magazine_hits == CACHE_MAGAZINE_SIZE);
+    assert(stats.pool_refills == ITERATIONS + 1);
+    for (int ii = 0; ii < CACHE_MAGAZINE_SIZE + 1; ++ii) {
+        cache_free(cache, ptr[ii]);
+    }
+
+    /* The counters of a thread are kept when it exits */
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, cache_magazine_thread, cache) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    cache_get_stats(cache, &stats);
+    assert(stats.pool_refills == ITERATIONS + 2);
+
+#undef ITERATIONS
+    cache_destroy(cache);
+    return TEST_PASS;
+#else
+    return TEST_SKIP;
+#endif
+}
+
 static enum test_return test_issue_161(void)
 {
     enum test_return ret = cache_bulkalloc(1);
@@ -2107,6 +2167,7 @@ struct testcase testcases[] = {
     { "cache_destructor", cache_destructor_test },
     { "cache_reuse", cache_reuse_test },
     { "cache_redzone", cache_redzone_test },
+    { "cache_magazine", cache_magazine_test },
     { "issue_161", test_issue_161 },
     { "strtof", test_safe_strtof },
     { "strtol", test_safe_strtol },
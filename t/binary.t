@@ -2,7 +2,7 @@
 
 use strict;
 use warnings;
-use Test::More tests => 3430;
+use Test::More tests => 3676;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -0,0 +1,33 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 8;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Store values larger than a slab page in chunks of 16k
+my $server = new_memcached('-e slab_chunk_max=16384');
+my $sock = $server->sock;
+
+my $value = join('', map { chr(ord('a') + $_ % 26) } (0..99999));
+my $len = length($value);
+
+print $sock "set foo 0 0 $len\r\n$value\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored chunked value");
+mem_get_is($sock, "foo", $value);
+
+print $sock "append foo 0 0 5\r\nHELLO\r\n";
+is(scalar <$sock>, "STORED\r\n", "appended to chunked value");
+mem_get_is($sock, "foo", $value . "HELLO");
+
+print $sock "prepend foo 0 0 5\r\nWORLD\r\n";
+is(scalar <$sock>, "STORED\r\n", "prepended to chunked value");
+mem_get_is($sock, "foo", "WORLD" . $value . "HELLO");
+
+# A value spanning exactly a number of chunks
+$value = 'x' x (16384 * 4);
+$len = length($value);
+print $sock "set bar 0 0 $len\r\n$value\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored value of four chunks");
+mem_get_is($sock, "bar", $value);
@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 13;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub read_bytes {
+    my ($s, $len) = @_;
+    my $buf = '';
+    while (length($buf) < $len) {
+        my $n = read($s, $buf, $len - length($buf), length($buf));
+        last unless $n;
+    }
+    return $buf;
+}
+
+sub request {
+    my ($opcode, $key, $extras, $value, $opaque) = @_;
+    return pack("CCnCCnNNNN", 0x80, $opcode, length($key), length($extras),
+                0, 0, length($extras) + length($key) + length($value),
+                $opaque, 0, 0) . $extras . $key . $value;
+}
+
+sub read_response {
+    my $s = shift;
+    my ($magic, $opcode, $keylen, $extlen, $datatype, $status, $bodylen,
+        $opaque) = unpack("CCnCCnNN", read_bytes($s, 24));
+    my $body = read_bytes($s, $bodylen);
+    return { opcode => $opcode, status => $status, opaque => $opaque,
+             key => substr($body, $extlen, $keylen),
+             value => substr($body, $extlen + $keylen) };
+}
+
+my $stored = 0;
+for my $ii (1..25) {
+    my $val = sprintf("val%02d", $ii * 2);
+    print $sock "set key" . ($ii * 2) . " 0 0 5\r\n$val\r\n";
+    $stored++ if (scalar <$sock> eq "STORED\r\n");
+}
+is($stored, 25, "stored every other key");
+
+# Quiet gets for 50 keys (half of them exist) followed by a noop
+my $bin = $server->new_sock;
+my $req = join("", map { request(0x0d, "key$_", "", "", $_) } (1..50));
+print $bin $req . request(0x0a, "", "", "", 0xffff);
+
+my @keys;
+my $resp;
+while (($resp = read_response($bin))->{opcode} == 0x0d) {
+    push(@keys, $resp->{key})
+        if $resp->{value} eq sprintf("val%02d", substr($resp->{key}, 3));
+}
+is($resp->{opaque}, 0xffff, "noop answered last");
+is(scalar(@keys), 25, "got the values of all existing keys");
+is("@keys", join(" ", map { "key" . ($_ * 2) } (1..25)), "in request order");
+
+my $stats = mem_stats($sock);
+cmp_ok($stats->{responses_per_flush}, '>', 1, "responses were sent together");
+
+# Responses already parked are sent when the next request is incomplete
+my $set = request(0x01, "foo", pack("NN", 0, 0), "bar", 1);
+print $bin $set x 5 . substr($set, 0, 10);
+$stored = 0;
+for (1..5) {
+    $stored++ if read_response($bin)->{status} == 0;
+}
+is($stored, 5, "sets before the incomplete request answered");
+print $bin substr($set, 10);
+$resp = read_response($bin);
+is($resp->{opcode}, 0x01, "completed set answered");
+is($resp->{status}, 0, "completed set succeeded");
+
+# Errors aren't parked, but still come in order
+print $bin request(0x00, "missing", "", "", 7) . request(0x0a, "", "", "", 8);
+is(read_response($bin)->{status}, 1, "get miss");
+is(read_response($bin)->{opaque}, 8, "followed by the noop");
+
+# A run of quiet gets is looked up together, but a set in the middle of it
+# is seen by the gets following it
+print $sock "set key2 0 0 5\r\nval02\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored key2");
+print $bin request(0x0d, "key2", "", "", 1) .
+    request(0x0d, "key4", "", "", 2) .
+    request(0x11, "key2", pack("NN", 0, 0), "new02", 3) .
+    request(0x0d, "key2", "", "", 4) .
+    request(0x0a, "", "", "", 5);
+my @values;
+while (($resp = read_response($bin))->{opcode} == 0x0d) {
+    push(@values, $resp->{value});
+}
+is("@values", "val02 val04 new02", "gets around the set");
+is($resp->{opaque}, 5, "noop answered last");
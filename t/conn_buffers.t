@@ -0,0 +1,56 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 17;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+# The listeners and the connection asking for the stats hold buffers
+my $stats = mem_stats($sock);
+my $baseline = $stats->{conn_buffer_bytes};
+cmp_ok($baseline, '>', 0, "buffers of the connection asking for stats");
+
+# Connections in the middle of a request keep their buffers
+my @socks;
+for (1..10) {
+    my $s = $server->new_sock;
+    print $s "get foo";
+    push(@socks, $s);
+}
+select(undef, undef, undef, 0.5);
+$stats = mem_stats($sock);
+cmp_ok($stats->{conn_buffer_bytes}, '>=', $baseline + 10 * 4096,
+       "partial requests are kept in buffers");
+
+# ... and give them back when they become idle
+for my $s (@socks) {
+    print $s "\r\n";
+    is(scalar <$s>, "END\r\n", "request completed");
+}
+# the stats are read after the responses were sent
+select(undef, undef, undef, 0.1);
+$stats = mem_stats($sock);
+is($stats->{conn_buffer_bytes}, $baseline, "idle connections hold no buffers");
+
+# Pipelined sets of large values, and a request larger than any pooled buffer
+my $big = $server->new_sock;
+my $value = "x" x 1000;
+print $big join("", map { "set key$_ 0 0 1000\r\n$value\r\n" } (1..200));
+my $stored = 0;
+for (1..200) {
+    $stored++ if (scalar <$big> eq "STORED\r\n");
+}
+is($stored, 200, "stored all pipelined values");
+
+my @keys = map { "nokey_$_" } (1..10000);
+print $big "get @keys\r\n";
+is(scalar <$big>, "END\r\n", "multiget of more than 64KB");
+mem_get_is($big, "key200", $value);
+
+select(undef, undef, undef, 0.1);
+$stats = mem_stats($sock);
+is($stats->{conn_buffer_bytes}, $baseline, "large buffers given back too");
@@ -0,0 +1,52 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 15;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $stats = mem_stats($server->sock, 'settings');
+is($stats->{io_uring}, "no", "libevent drives the connections by default");
+
+$ENV{'MEMCACHED_IO_URING'} = "1";
+$server = new_memcached("-t 2");
+$stats = mem_stats($server->sock, 'settings');
+
+SKIP: {
+    skip "io_uring not supported", 14 unless $stats->{io_uring} eq "yes";
+    pass("the workers use io_uring");
+
+    my $sock = $server->sock;
+    print $sock "set foo 0 0 3\r\nbar\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored foo");
+    mem_get_is($sock, "foo", "bar");
+
+    # A value spanning several receive buffers
+    my $big = "x" x (100 * 1024);
+    my $len = length($big);
+    print $sock "set big 0 0 $len\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored big value");
+    mem_get_is($sock, "big", $big);
+
+    # Pipelined requests arrive in one receive
+    print $sock "set a 0 0 1\r\n1\r\nset b 0 0 1\r\n2\r\nget a b\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a");
+    is(scalar <$sock>, "STORED\r\n", "stored b");
+    is(scalar <$sock>, "VALUE a 0 1\r\n", "got a");
+    is(scalar <$sock>, "1\r\n", "value of a");
+
+    is(scalar <$sock>, "VALUE b 0 1\r\n", "got b");
+    is(scalar <$sock>, "2\r\n", "value of b");
+    is(scalar <$sock>, "END\r\n", "end of multiget");
+
+    $stats = mem_stats($sock, 'threads');
+    my ($submitted, $completed) = (0, 0);
+    for (0..1) {
+        $submitted += $stats->{"$_:ring_submitted"};
+        $completed += $stats->{"$_:ring_completed"};
+    }
+    cmp_ok($submitted, '>', 0, "requests were submitted to the rings");
+    cmp_ok($completed, '>', 0, "completions came back from the rings");
+}
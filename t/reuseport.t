@@ -0,0 +1,44 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 45;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $stats = mem_stats($server->sock, 'settings');
+is($stats->{reuseport}, "no", "one listener by default");
+
+# Every worker accepts its own connections
+$ENV{'MEMCACHED_REUSEPORT'} = "1";
+$server = new_memcached("-t 4");
+$stats = mem_stats($server->sock, 'settings');
+
+SKIP: {
+    skip "SO_REUSEPORT not supported", 44 unless $stats->{reuseport} eq "yes";
+    pass("one listener per worker thread");
+
+    my @socks;
+    for my $ii (0..19) {
+        my $sock = $server->new_sock;
+        ok($sock, "connection $ii");
+        push(@socks, $sock);
+    }
+
+    for my $ii (0..19) {
+        my $sock = $socks[$ii];
+        my $len = length("val$ii");
+        print $sock "set key$ii 0 0 $len\r\nval$ii\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored key$ii");
+    }
+
+    # Items stored through one connection are seen on the others
+    my $sock = $socks[0];
+    mem_get_is($sock, "key19", "val19");
+    $sock = $socks[19];
+    mem_get_is($sock, "key0", "val0");
+
+    $stats = mem_stats($server->sock);
+    cmp_ok($stats->{total_connections}, '>=', 21, "accepted all connections");
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 25;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-t 4");
+my $sock = $server->sock;
+
+sub read_bytes {
+    my ($s, $len) = @_;
+    my $buf = '';
+    while (length($buf) < $len) {
+        my $n = read($s, $buf, $len - length($buf), length($buf));
+        last unless $n;
+    }
+    return $buf;
+}
+
+# Fetch the histograms with a binary "latency" stat request
+sub bin_latency {
+    my $s = shift;
+    my $key = "latency";
+    print $s pack("CCnCCnNNNN", 0x80, 0x10, length($key), 0, 0, 0,
+                  length($key), 0, 0, 0) . $key;
+    my %stats;
+    for (;;) {
+        my ($magic, $opcode, $keylen, $extlen, $datatype, $status, $bodylen) =
+            unpack("CCnCCnN", read_bytes($s, 24));
+        my $body = read_bytes($s, $bodylen);
+        last if $keylen == 0;
+        $stats{substr($body, 0, $keylen)} = substr($body, $keylen);
+    }
+    return %stats;
+}
+
+sub histogram {
+    my $value = shift;
+    return { map { split(/=/, $_) } split(/,/, $value) };
+}
+
+my $stats = mem_stats($sock, "latency");
+is(join(",", sort keys %$stats),
+   join(",", sort map { ("${_}_total", "${_}_engine") }
+        qw(get set incr decr delete)),
+   "a histogram of each kind for each command");
+is(histogram($stats->{'get_total'})->{'count'}, 0, "nothing recorded yet");
+
+# Spread the commands over the threads, which keep their own histograms
+for my $ii (1..8) {
+    my $s = $server->new_sock;
+    print $s "set num$ii 0 0 1\r\n1\r\n";
+    <$s>;
+    mem_get_is($s, "num$ii", "1");
+    print $s "get num$ii nokey$ii\r\n";
+    while (scalar <$s> ne "END\r\n") {}
+    print $s "incr num$ii 2\r\n";
+    <$s>;
+    print $s "decr num$ii 1\r\n";
+    <$s>;
+    print $s "delete num$ii\r\n";
+    <$s>;
+}
+
+$stats = mem_stats($sock, "latency");
+my %count = map { $_ => histogram($stats->{"${_}_total"})->{'count'} }
+    qw(get set incr decr delete);
+is_deeply(\%count, { get => 16, set => 8, incr => 8, decr => 8, delete => 8 },
+          "commands of all threads counted");
+
+my $get = histogram($stats->{'get_total'});
+my $engine = histogram($stats->{'get_engine'});
+is($engine->{'count'}, 16, "engine time counted for each get");
+ok($get->{'p50'} > 0, "get p50 recorded");
+ok($get->{'p50'} <= $get->{'p99'} && $get->{'p99'} <= $get->{'p999'} &&
+   $get->{'p999'} <= $get->{'max'}, "get percentiles in order");
+ok($engine->{'max'} <= $get->{'max'}, "engine time within the total");
+ok($get->{'mean'} <= $get->{'max'}, "get mean within the max");
+
+# The binary protocol is timed too, and can fetch the histograms
+my $bsock = $server->new_sock;
+my $key = "bkey";
+print $bsock pack("CCnCCnNNNN", 0x80, 0x00, length($key), 0, 0, 0,
+                  length($key), 0, 0, 0) . $key;
+my ($magic, $opcode, $keylen, $extlen, $datatype, $status, $bodylen) =
+    unpack("CCnCCnN", read_bytes($bsock, 24));
+read_bytes($bsock, $bodylen);
+is($status, 1, "binary get of a missing key");
+
+my %latency = bin_latency($bsock);
+is(scalar keys %latency, 10, "binary latency stat has all histograms");
+is(histogram($latency{'get_total'})->{'count'}, 17, "binary get counted");
+is(histogram($latency{'set_engine'})->{'count'}, 8,
+   "binary stat reports the engine time");
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats cleared");
+$stats = mem_stats($sock, "latency");
+is(histogram($stats->{'get_total'})->{'count'}, 0, "no gets after reset");
+is(histogram($stats->{'get_total'})->{'max'}, 0, "no max after reset");
+
+mem_get_is($sock, "num1", undef);
+$stats = mem_stats($sock, "latency");
+is(histogram($stats->{'get_total'})->{'count'}, 1, "counting after reset");
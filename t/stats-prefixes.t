@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 13;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Keep the tables small enough to see the least recently used prefix go
+$ENV{'MEMCACHED_DETAIL_PREFIXES'} = 4;
+my $server = new_memcached("-t 1");
+my $sock = $server->sock;
+
+sub dump_prefixes {
+    my $s = shift;
+    my @lines;
+    print $s "stats detail dump\r\n";
+    while ((my $line = <$s>) ne "END\r\n") {
+        push(@lines, $line);
+    }
+    return join("", sort @lines);
+}
+
+sub read_bytes {
+    my ($s, $len) = @_;
+    my $buf = '';
+    while (length($buf) < $len) {
+        my $n = read($s, $buf, $len - length($buf), length($buf));
+        last unless $n;
+    }
+    return $buf;
+}
+
+# Fetch the prefixes with a binary "detail prefixes" stat request
+sub bin_prefixes {
+    my $s = shift;
+    my $key = "detail prefixes";
+    print $s pack("CCnCCnNNNN", 0x80, 0x10, length($key), 0, 0, 0,
+                  length($key), 0, 0, 0) . $key;
+    my %stats;
+    for (;;) {
+        my ($magic, $opcode, $keylen, $extlen, $datatype, $status, $bodylen) =
+            unpack("CCnCCnN", read_bytes($s, 24));
+        my $body = read_bytes($s, $bodylen);
+        last if $keylen == 0;
+        $stats{substr($body, 0, $keylen)} = substr($body, $keylen);
+    }
+    return %stats;
+}
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{'prefix_stats_max'}, 4, "prefix limit in the settings");
+
+print $sock "stats detail on\r\n";
+is(scalar <$sock>, "OK\r\n", "detail collection turned on");
+
+my $stored = 0;
+for my $prefix ('a'..'f') {
+    print $sock "set $prefix:1 0 0 1\r\nx\r\n";
+    $stored++ if (scalar <$sock> eq "STORED\r\n");
+}
+is($stored, 6, "stored a key for each of six prefixes");
+
+is(dump_prefixes($sock),
+   join("", map { "PREFIX $_ get 0 hit 0 set 1 del 0\r\n" } ('c'..'f')),
+   "only the four most recent prefixes are kept");
+
+mem_get_is($sock, "c:1", "x");
+print $sock "set g:1 0 0 1\r\nx\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored g:1");
+
+is(dump_prefixes($sock),
+   "PREFIX c get 1 hit 1 set 1 del 0\r\n" .
+   join("", map { "PREFIX $_ get 0 hit 0 set 1 del 0\r\n" } ('e'..'g')),
+   "the least recently used prefix made room");
+
+my %prefixes = bin_prefixes($server->new_sock);
+is(join(",", sort keys %prefixes), "c,e,f,g", "binary stat per prefix");
+is($prefixes{'c'}, "get=1,hit=1,set=1,del=0", "binary prefix counters");
+
+# The tables of all threads are merged
+$server = new_memcached("-t 4");
+$sock = $server->sock;
+print $sock "stats detail on\r\n";
+<$sock>;
+for my $ii (1..8) {
+    my $s = $server->new_sock;
+    print $s "set m:$ii 0 0 1\r\nx\r\n";
+    <$s>;
+    mem_get_is($s, "m:$ii", "x") if $ii == 8;
+}
+is(dump_prefixes($sock), "PREFIX m get 1 hit 1 set 8 del 0\r\n",
+   "prefixes of all threads merged");
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats cleared");
+is(dump_prefixes($sock), "", "no prefixes after reset");
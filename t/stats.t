@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 81;
+use Test::More tests => 83;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -45,6 +45,23 @@ my $sock = $server->sock;
 ## STAT limit_maxbytes 67108864
 ## STAT threads 4
 ## STAT conn_yields 0
+## STAT udp_recv_calls 0
+## STAT udp_datagrams_received 0
+## STAT udp_send_calls 0
+## STAT udp_datagrams_sent 0
+## STAT udp_reassembled 0
+## STAT udp_reassembly_dropped 0
+## STAT value_bytes_copied 0
+## STAT value_bytes_read_inplace 0
+## STAT response_flushes 0
+## STAT responses_per_flush 0.00
+## STAT conn_buffer_bytes 139264
+## STAT conn_cache_magazine_hits 0
+## STAT conn_cache_pool_refills 1
+## STAT conn_cache_pool_flushes 0
+## STAT suffix_cache_magazine_hits 0
+## STAT suffix_cache_pool_refills 0
+## STAT suffix_cache_pool_flushes 0
 ## STAT bytes 0
 ## STAT curr_items 0
 ## STAT total_items 0
@@ -62,7 +79,7 @@ if ($stats->{'auth_sasl_enabled'} == 'yes') {
     $sasl_enabled = 1;
 }
 
-is(scalar(keys(%$stats)), 42, "42 stats values");
+is(scalar(keys(%$stats)), 61, "61 stats values");
 
 # Test initial state
 foreach my $key (qw(curr_items total_items bytes cmd_get cmd_set get_hits evictions get_misses
@@ -200,3 +217,10 @@ is(scalar <$sock>, "OK\r\n", "flushed");
 
 my $stats = mem_stats($sock);
 is($stats->{cmd_flush}, 1, "after one flush cmd_flush is 1");
+
+# Every thread counts how often other threads woke it up
+$stats = mem_stats($sock, 'threads');
+is(scalar(grep(/wakeups/, keys(%$stats))), 10, "wakeups of four workers and the tap thread");
+my $wakeups = 0;
+$wakeups += $stats->{"$_:wakeups"} for (0..4);
+cmp_ok($wakeups, '>=', 1, "the connection was handed over with a wakeup");
@@ -0,0 +1,61 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 11;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+sub parse_stats {
+    my ($stats) = @_;
+    my %ret = ();
+    my $key;
+    foreach $key (keys %$stats) {
+        my %h = split /[,=]/,$stats->{$key};
+        $ret{$key} = \%h;
+    }
+    return \%ret;
+}
+
+$ENV{"MEMCACHED_TOP_KEYS"} = "10";
+$ENV{"MEMCACHED_TOP_KEYS_MODE"} = "frequent";
+my $server = new_memcached("-t 1");
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, 'settings');
+is($settings->{'topkeys_mode'}, "frequent", "topkeys mode in the settings");
+
+print $sock "set hot 0 0 3\r\nhot\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored hot");
+
+# Interleave the hot key with many keys used once. The most recent keys
+# would push it out; the most used keys keep it.
+my $hits = 0;
+for my $ii (1..100) {
+    print $sock "get hot\r\n";
+    $hits++ if (scalar <$sock> eq "VALUE hot 0 3\r\n");
+    <$sock>; <$sock>;
+    print $sock "get cold$ii\r\n";
+    <$sock>;
+}
+is($hits, 100, "got hot 100 times");
+
+my $stats = parse_stats(mem_stats($sock, 'topkeys'));
+is(scalar(keys %$stats), 10, "no more keys than asked for");
+is($stats->{'hot'}->{'get_hits'}, 100, "hot key kept with its get hits");
+is($stats->{'hot'}->{'cmd_set'}, 1, "and its set");
+is($stats->{'hot'}->{'count'}, 101, "and its count");
+is($stats->{'hot'}->{'error'}, 0, "counted exactly");
+ok(!defined $stats->{'cold1'}, "keys used once early on are gone");
+
+# The sketches of all threads are merged
+$server = new_memcached("-t 4");
+$sock = $server->sock;
+for my $ii (1..8) {
+    my $s = $server->new_sock;
+    print $s "set shared 0 0 1\r\nx\r\n";
+    <$s>;
+}
+$stats = parse_stats(mem_stats($sock, 'topkeys'));
+is($stats->{'shared'}->{'cmd_set'}, 8, "counts of all threads summed");
+is($stats->{'shared'}->{'count'}, 8, "estimates of all threads summed");
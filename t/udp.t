@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 48;
+use Test::More tests => 61;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -60,6 +60,52 @@ for my $prot (::IS_ASCII,::IS_BINARY) {
     udp_delete_test($prot,45,"aval$prot");
 }
 
+# requests sent back to back are all answered
+for my $req (1..10) {
+    send($usock, pack("nnnn", 200 + $req, 0, 1, 0) . "get foo\r\n", 0);
+}
+my %responses;
+for (1..10) {
+    my $rin = '';
+    vec($rin, fileno($usock), 1) = 1;
+    last unless select(my $rout = $rin, undef, undef, 1.5);
+    my $res;
+    $usock->recv($res, 1500, 0);
+    my ($resid) = unpack("n", $res);
+    $responses{$resid} = substr($res, 8);
+}
+is(scalar(keys %responses), 10, "got a response to every request");
+is(scalar(grep { $_ eq "VALUE foo 0 6\r\nfooval\r\nEND\r\n" } values %responses),
+   10, "every response is right");
+
+# requests spanning several datagrams, received in any order
+my $value = "x" x 4000;
+my $res = send_udp_multi_request($usock, 300, "set big 0 0 4000\r\n$value\r\n",
+                                 1400, 2, 0, 1);
+ok($res, "got result of multi-packet set");
+is(substr($res->{0}, 8), "STORED\r\n", "stored multi-packet set");
+mem_get_is($sock, "big", $value);
+
+my $keys = join(' ', map { "key$_" } (1..200));
+$res = send_udp_multi_request($usock, 301, "get foo $keys big\r\n",
+                              1000, 0, 1);
+is(construct_udp_message($res), "VALUE foo 0 6\r\nfooval\r\n" .
+   "VALUE big 0 4000\r\n$value\r\nEND\r\n", "multi-packet get");
+
+# an incomplete request isn't answered
+send($usock, pack("nnnn", 302, 0, 2, 0) . "get foo\r\n", 0);
+my $rin = '';
+vec($rin, fileno($usock), 1) = 1;
+ok(!select(my $rout = $rin, undef, undef, 0.5),
+   "no response to incomplete request");
+
+my $stats = mem_stats($sock);
+is($stats->{udp_reassembled}, 2, "two requests reassembled");
+cmp_ok($stats->{udp_recv_calls}, '<=', $stats->{udp_datagrams_received},
+       "at least one datagram per receive call");
+cmp_ok($stats->{udp_send_calls}, '<=', $stats->{udp_datagrams_sent},
+       "at least one datagram per send call");
+
 sub udp_set_test {
     my ($protocol, $req_id, $key, $value, $flags, $exp) = @_;
     my $req = "";
@@ -220,6 +266,31 @@ sub send_udp_request {
         return undef;
     };
     return $fail->("send") unless send($sock, $pkt, 0);
+    return recv_udp_response($sock, $reqid);
+}
+
+# sends the request in datagrams of at most $size bytes, in the order of
+# their sequence numbers given in @order, and returns the response like
+# send_udp_request
+sub send_udp_multi_request {
+    my ($sock, $reqid, $req, $size, @order) = @_;
+
+    my @parts = unpack("(a$size)*", $req);
+    die "wrong number of packets" unless @parts == @order;
+    foreach my $seq (@order) {
+        my $pkt = pack("nnnn", $reqid, $seq, scalar(@parts), 0) . $parts[$seq];
+        send($sock, $pkt, 0) or return undef;
+    }
+    return recv_udp_response($sock, $reqid);
+}
+
+sub recv_udp_response {
+    my ($sock, $reqid) = @_;
+    my $fail = sub {
+        my $msg = shift;
+        warn "  FAILING send_udp because: $msg\n";
+        return undef;
+    };
 
     my $ret = {};
 
@@ -0,0 +1,60 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 12;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub read_bytes {
+    my ($s, $len) = @_;
+    my $buf = '';
+    while (length($buf) < $len) {
+        my $n = read($s, $buf, $len - length($buf), length($buf));
+        last unless $n;
+    }
+    return $buf;
+}
+
+my $len = 256 * 1024;
+my $value = join("", map { chr(ord('a') + $_ % 26) } (1..$len));
+
+# A binary set followed by a noop in the same write
+my $key = "bigkey";
+my $extras = pack("NN", 0, 0);
+my $set = pack("CCnCCnNNNN", 0x80, 0x01, length($key), length($extras), 0, 0,
+               length($extras) + length($key) + $len, 0xdead, 0, 0)
+    . $extras . $key . $value;
+my $noop = pack("CCnCCnNNNN", 0x80, 0x0a, 0, 0, 0, 0, 0, 0xbeef, 0, 0);
+
+my $bin = $server->new_sock;
+print $bin $set . $noop;
+my ($magic, $opcode, $keylen, $extlen, $datatype, $status, $bodylen,
+    $opaque) = unpack("CCnCCnNN", read_bytes($bin, 24));
+is($opcode, 0x01, "set response");
+is($status, 0, "stored the large value");
+($magic, $opcode, $keylen, $extlen, $datatype, $status, $bodylen,
+ $opaque) = unpack("CCnCCnNN", read_bytes($bin, 24));
+is($opcode, 0x0a, "noop following the value");
+is($opaque, 0xbeef, "opaque of the noop");
+
+mem_get_is($sock, $key, $value);
+
+# Only what was read with the header is copied
+my $stats = mem_stats($sock);
+cmp_ok($stats->{value_bytes_copied}, '<', 4096, "copied the start of the value");
+is($stats->{value_bytes_copied} + $stats->{value_bytes_read_inplace}, $len,
+   "read the rest into the item");
+
+# The same for the text protocol, with the next request after the value
+print $sock "set textkey 0 0 $len\r\n$value\r\nget textkey\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored the large text value");
+is(scalar <$sock>, "VALUE textkey 0 $len\r\n", "value header");
+is(read_bytes($sock, $len + 2), "$value\r\n", "value");
+is(scalar <$sock>, "END\r\n", "end of get");
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{value_bytes_read_inplace}, '>', $len, "more values read in place");
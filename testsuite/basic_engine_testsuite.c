@@ -232,6 +232,49 @@ static enum test_result get_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * Make sure that get_multi finds the stored items (and only those), in
+ * more lookups than fit in one batch of the default engine.
+ */
+static enum test_result get_multi_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item_lookup lookups[100];
+    char keys[100][16];
+    uint64_t cas = 0;
+
+    if (h1->get_multi == NULL) {
+        return SUCCESS;
+    }
+
+    for (int ii = 0; ii < 100; ++ii) {
+        snprintf(keys[ii], sizeof(keys[ii]), "get_multi_%d", ii);
+        lookups[ii].key = keys[ii];
+        lookups[ii].nkey = strlen(keys[ii]);
+        lookups[ii].vbucket = 0;
+        if (ii % 3 == 0) {
+            item *it = NULL;
+            assert(h1->allocate(h, NULL, &it, keys[ii], strlen(keys[ii]),
+                                1, 0, 0) == ENGINE_SUCCESS);
+            assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
+
+    h1->get_multi(h, NULL, lookups, 100);
+    for (int ii = 0; ii < 100; ++ii) {
+        if (ii % 3 == 0) {
+            item_info info = { .nvalue = 1 };
+            assert(lookups[ii].status == ENGINE_SUCCESS);
+            assert(h1->get_item_info(h, NULL, lookups[ii].item, &info));
+            assert(info.nkey == lookups[ii].nkey);
+            assert(memcmp(info.key, keys[ii], info.nkey) == 0);
+            h1->release(h, NULL, lookups[ii].item);
+        } else {
+            assert(lookups[ii].status == ENGINE_KEY_ENOENT);
+        }
+    }
+    return SUCCESS;
+}
+
 static enum test_result expiry_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
     item *test_item_get = NULL;
@@ -278,6 +321,78 @@ static enum test_result remove_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static volatile int mt_get_test_writers;
+
+static void *mt_get_test_main(void *arg) {
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+    bool writer = __sync_fetch_and_add(&mt_get_test_writers, 1) < 2;
+
+    for (int ii = 0; ii < 20000; ++ii) {
+        char key[32];
+        int val = (ii * 7919) % 256;
+        size_t keylen = snprintf(key, sizeof(key), "mt_get_key_%d", val);
+        item *it = NULL;
+        uint64_t cas = 0;
+
+        if (writer) {
+            if (ii % 5 == 0) {
+                (void)h1->remove(h, NULL, key, keylen, 0, 0);
+                continue;
+            }
+            assert(h1->allocate(h, NULL, &it, key, keylen,
+                                sizeof(val), 0, 0) == ENGINE_SUCCESS);
+            item_info info = { .nvalue = 1 };
+            assert(h1->get_item_info(h, NULL, it, &info) == true);
+            memcpy(info.value[0].iov_base, &val, sizeof(val));
+            assert(h1->store(h, NULL, it, &cas,
+                             OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        } else if (h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS) {
+            /* Whatever we find must be a complete item for this key */
+            item_info info = { .nvalue = 1 };
+            assert(h1->get_item_info(h, NULL, it, &info) == true);
+            assert(info.nkey == keylen);
+            assert(memcmp(info.key, key, keylen) == 0);
+            assert(info.value[0].iov_len == sizeof(val));
+            assert(memcmp(info.value[0].iov_base, &val, sizeof(val)) == 0);
+            h1->release(h, NULL, it);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Look up keys from many threads while a couple of threads keep replacing
+ * and removing them, so that the lock free lookups race with the writers
+ */
+static enum test_result mt_get_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+#ifdef __arm__
+    const int max_threads = 1;
+#else
+    const int max_threads = 16;
+#endif
+    pthread_t tid[max_threads];
+
+    if (max_threads < 2) {
+        return SKIPPED;
+    }
+
+    mt_get_test_writers = 0;
+    for (int ii = 0; ii < max_threads; ++ii) {
+        assert(pthread_create(&tid[ii], NULL, mt_get_test_main, h) == 0);
+    }
+
+    for (int ii = 0; ii < max_threads; ++ii) {
+        void *ret;
+        assert(pthread_join(tid[ii], &ret) == 0);
+        assert(ret == NULL);
+    }
+
+    return SUCCESS;
+}
+
 /*
  * Make sure we can arithmetic operations to set the initial value of a key and
  * to then later increment that value
@@ -354,6 +469,72 @@ static enum test_result mt_incr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static void *mt_store_test_main(void *arg) {
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+
+    for (int ii = 0; ii < 5000; ++ii) {
+        char key[32];
+        int val = (ii * 7919) % 512;
+        size_t keylen = snprintf(key, sizeof(key), "mt_store_key_%d", val);
+        item *it = NULL;
+        uint64_t cas = 0;
+
+        assert(h1->allocate(h, NULL, &it, key, keylen,
+                            sizeof(val), 0, 0) == ENGINE_SUCCESS);
+        item_info info = { .nvalue = 1 };
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        memcpy(info.value[0].iov_base, &val, sizeof(val));
+        assert(h1->store(h, NULL, it, &cas,
+                         OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+
+        /* Other threads may remove the key (or it may get evicted) */
+        if (h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS) {
+            info.nvalue = 1;
+            assert(h1->get_item_info(h, NULL, it, &info) == true);
+            assert(info.value[0].iov_len == sizeof(val));
+            assert(memcmp(info.value[0].iov_base, &val, sizeof(val)) == 0);
+            h1->release(h, NULL, it);
+        }
+
+        if (ii % 3 == 0) {
+            (void)h1->remove(h, NULL, key, keylen, 0, 0);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Hammer a small cache from multiple threads so that stores, lookups,
+ * removals and evictions in different stripes and slab classes race
+ */
+static enum test_result mt_store_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+#ifdef __arm__
+    const int max_threads = 1;
+#else
+    const int max_threads = 16;
+#endif
+    pthread_t tid[max_threads];
+
+    if (max_threads < 2) {
+        return SKIPPED;
+    }
+
+    for (int ii = 0; ii < max_threads; ++ii) {
+        assert(pthread_create(&tid[ii], NULL, mt_store_test_main, h) == 0);
+    }
+
+    for (int ii = 0; ii < max_threads; ++ii) {
+        void *ret;
+        assert(pthread_join(tid[ii], &ret) == 0);
+        assert(ret == NULL);
+    }
+
+    return SUCCESS;
+}
+
 /*
  * Make sure we can arithmetic operations to set the initial value of a key and
  * to then later decrement that value
@@ -491,6 +672,278 @@ static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+int lru_number_warm;
+int lru_moves_to_cold;
+static void lru_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen > 12 && memcmp(key + klen - 12, ":number_warm", 12) == 0) {
+        lru_number_warm += atoi(buffer);
+    } else if (klen > 14 && memcmp(key + klen - 14, ":moves_to_cold", 14) == 0) {
+        lru_moves_to_cold += atoi(buffer);
+    }
+}
+
+static void lru_test_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const char *prefix, int ii) {
+    char key[32];
+    size_t keylen = snprintf(key, sizeof(key), "%s%d", prefix, ii);
+    item *it = NULL;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &it, key, keylen, 4096, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+/*
+ * Keys that were hit move to the warm segment of the LRU, where a scan of
+ * keys that are only stored once can't push them out.
+ */
+static enum test_result segmented_lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nhot = 5;
+    for (int ii = 0; ii < nhot; ++ii) {
+        lru_test_store(h, h1, "lru_hot_", ii);
+    }
+    /* Hitting the item that was just stored doesn't count */
+    lru_test_store(h, h1, "lru_scan_", -1);
+
+    /* Items are only flagged as active once per update interval */
+    test_harness.time_travel(61);
+    for (int ii = 0; ii < nhot; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "lru_hot_%d", ii);
+        item *it = NULL;
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    evictions = 0;
+    for (int ii = 0; evictions < 1000; ++ii) {
+        lru_test_store(h, h1, "lru_scan_", ii);
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             eviction_stats_handler) == ENGINE_SUCCESS);
+    }
+
+    for (int ii = 0; ii < nhot; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "lru_hot_%d", ii);
+        item *it = NULL;
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    /* The maintainer moves the scanned items to the cold segment */
+    for (int ii = 0; ii < 300; ++ii) {
+        lru_number_warm = lru_moves_to_cold = 0;
+        assert(h1->get_stats(h, NULL, "items", 5,
+                             lru_stats_handler) == ENGINE_SUCCESS);
+        if (lru_moves_to_cold > 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(lru_number_warm >= nhot);
+    assert(lru_moves_to_cold > 0);
+
+    return SUCCESS;
+}
+
+int crawler_reclaimed;
+int curr_items;
+static void crawler_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 17 && memcmp(key, "crawler:reclaimed", klen) == 0) {
+        crawler_reclaimed = atoi(buffer);
+    } else if (klen == 10 && memcmp(key, "curr_items", klen) == 0) {
+        curr_items = atoi(buffer);
+    }
+}
+
+/*
+ * The LRU crawler reclaims expired items without anybody asking for them
+ */
+static enum test_result lru_crawler_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 100;
+    for (int ii = 0; ii < nitems * 2; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "crawler_%d", ii);
+        item *it = NULL;
+        uint64_t cas = 0;
+        /* Every other item expires */
+        assert(h1->allocate(h, NULL, &it, key, keylen, 10, 0,
+                            (ii % 2) ? 10 : 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    test_harness.time_travel(11);
+
+    for (int ii = 0; ii < 500; ++ii) {
+        assert(h1->get_stats(h, NULL, "crawler", 7,
+                             crawler_stats_handler) == ENGINE_SUCCESS);
+        if (crawler_reclaimed >= nitems) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(crawler_reclaimed == nitems);
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         crawler_stats_handler) == ENGINE_SUCCESS);
+    assert(curr_items == nitems);
+
+    for (int ii = 0; ii < nitems * 2; ii += 2) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "crawler_%d", ii);
+        item *it = NULL;
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    return SUCCESS;
+}
+
+int hash_expansions;
+int hash_is_expanding;
+static void hash_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 15 && memcmp(key, "hash_expansions", klen) == 0) {
+        hash_expansions = atoi(buffer);
+    } else if (klen == 17 && memcmp(key, "hash_is_expanding", klen) == 0) {
+        hash_is_expanding = atoi(buffer);
+    }
+}
+
+static void hash_expand_test_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                   int ii) {
+    char key[32];
+    size_t keylen = snprintf(key, sizeof(key), "hash_expand_%d", ii);
+    item *it = NULL;
+    uint64_t cas = 0;
+    assert(h1->allocate(h, NULL, &it, key, keylen, 1, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+/*
+ * Store enough items to make the hash table grow, and make sure that the
+ * expansion completes and that every item can be found during and after it
+ */
+static enum test_result hash_expand_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 150000;
+    for (int ii = 0; ii < nitems; ++ii) {
+        hash_expand_test_store(h, h1, ii);
+    }
+
+    /* With inline expansion the stores move the remaining buckets */
+    for (int ii = 0; ii < 1000; ++ii) {
+        assert(h1->get_stats(h, NULL, "hash", 4,
+                             hash_stats_handler) == ENGINE_SUCCESS);
+        if (hash_expansions > 0 && !hash_is_expanding) {
+            break;
+        }
+        for (int jj = 0; jj < 100; ++jj) {
+            hash_expand_test_store(h, h1, (ii * 100 + jj) % nitems);
+        }
+        usleep(1000);
+    }
+    assert(hash_expansions > 0);
+    assert(!hash_is_expanding);
+
+    for (int ii = 0; ii < nitems; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "hash_expand_%d", ii);
+        item *it = NULL;
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Get all of the pieces the value of an item is stored in
+ */
+static item_info *get_item_value(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                 item *it) {
+    item_info info = { .nvalue = 1 };
+    assert(h1->get_item_info(h, NULL, it, &info) == true);
+    item_info *ret = malloc(sizeof(item_info) +
+                            info.nvalue * sizeof(struct iovec));
+    assert(ret != NULL);
+    ret->nvalue = info.nvalue;
+    assert(h1->get_item_info(h, NULL, it, ret) == true);
+    assert(ret->nvalue == info.nvalue);
+    return ret;
+}
+
+/*
+ * Verify that a value larger than a slab page is stored in chunks
+ */
+static enum test_result chunked_item_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *it;
+    void *key = "key";
+    uint64_t cas;
+    const size_t nbytes = 100000;
+
+    assert(h1->allocate(h, NULL, &it, key,
+                        strlen(key), nbytes, 0, 0) == ENGINE_SUCCESS);
+    item_info *info = get_item_value(h, h1, it);
+    assert(info->nvalue > 1);
+    size_t offset = 0;
+    for (int ii = 0; ii < info->nvalue; ++ii) {
+        char *ptr = info->value[ii].iov_base;
+        for (size_t jj = 0; jj < info->value[ii].iov_len; ++jj) {
+            ptr[jj] = (char)((offset + jj) % 251);
+        }
+        offset += info->value[ii].iov_len;
+    }
+    assert(offset == nbytes);
+    free(info);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    assert(h1->allocate(h, NULL, &it, key,
+                        strlen(key), 5, 0, 0) == ENGINE_SUCCESS);
+    info = get_item_value(h, h1, it);
+    assert(info->nvalue == 1);
+    memcpy(info->value[0].iov_base, "HELLO", 5);
+    free(info);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    assert(h1->get(h, NULL, &it, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info = get_item_value(h, h1, it);
+    assert(info->nbytes == nbytes + 5);
+    char *value = malloc(info->nbytes);
+    assert(value != NULL);
+    offset = 0;
+    for (int ii = 0; ii < info->nvalue; ++ii) {
+        memcpy(value + offset, info->value[ii].iov_base,
+               info->value[ii].iov_len);
+        offset += info->value[ii].iov_len;
+    }
+    assert(offset == nbytes + 5);
+    for (size_t ii = 0; ii < nbytes; ++ii) {
+        assert(value[ii] == (char)(ii % 251));
+    }
+    assert(memcmp(value + nbytes, "HELLO", 5) == 0);
+    free(value);
+    free(info);
+    h1->release(h, NULL, it);
+
+    return SUCCESS;
+}
+
 static enum test_result get_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return PENDING;
 }
@@ -788,6 +1241,126 @@ static enum test_result gatq_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/* Slab classes reported by "stats slabs" (POWER_LARGEST + 1) */
+#define TEST_SLAB_CLASSES 201
+
+int slab_pages[TEST_SLAB_CLASSES];
+int slabs_moved;
+int slab_reassign_evictions;
+static void slab_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[vlen + 1];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen > 12 && memcmp(key + klen - 12, ":total_pages", 12) == 0) {
+        int id = atoi(key);
+        if (id > 0 && id < TEST_SLAB_CLASSES) {
+            slab_pages[id] = atoi(buffer);
+        }
+    } else if (klen == 11 && memcmp(key, "slabs_moved", klen) == 0) {
+        slabs_moved = atoi(buffer);
+    } else if (klen == 23 && memcmp(key, "slab_reassign_evictions", klen) == 0) {
+        slab_reassign_evictions = atoi(buffer);
+    }
+}
+
+static void slab_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    memset(slab_pages, 0, sizeof(slab_pages));
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         slab_stats_handler) == ENGINE_SUCCESS);
+}
+
+static uint16_t slabs_reassign(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               int src, int dst) {
+    protocol_binary_request_slabs_reassign req = {
+        .message = {
+            .header.request = {
+                .magic = PROTOCOL_BINARY_REQ,
+                .opcode = PROTOCOL_BINARY_CMD_SLABS_REASSIGN,
+                .extlen = 8,
+                .datatype = PROTOCOL_BINARY_RAW_BYTES,
+                .bodylen = htonl(8)
+            },
+            .body = {
+                .src = htonl(src),
+                .dst = htonl(dst)
+            }
+        }
+    };
+    assert(h1->unknown_command(h, NULL, &req.message.header,
+                               response_handler) == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    uint16_t status = ntohs(last_response->response.status);
+    release_last_response();
+    return status;
+}
+
+/*
+ * Move a page from a slab class full of large items to the class of the
+ * small items, and make sure that the items in the page are evicted and
+ * that the small items can use it.
+ */
+static enum test_result slabs_reassign_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    for (int ii = 0; ii < 1000; ++ii) {
+        lru_test_store(h, h1, "slabs_large_", ii);
+    }
+    for (int ii = 0; ii < 10; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "slabs_small_%d", ii);
+        item *it = NULL;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &it, key, keylen, 10, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    slab_stats(h, h1);
+    int src = 0;
+    int dst = 0;
+    for (int ii = 1; ii < TEST_SLAB_CLASSES; ++ii) {
+        if (slab_pages[ii] > 1) {
+            src = ii;
+        } else if (slab_pages[ii] == 1) {
+            dst = ii;
+        }
+    }
+    assert(src != 0 && dst != 0);
+    int src_pages = slab_pages[src];
+
+    assert(slabs_reassign(h, h1, src, src) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    assert(slabs_reassign(h, h1, 0, dst) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    assert(slabs_reassign(h, h1, dst, src) == PROTOCOL_BINARY_RESPONSE_ENOMEM);
+    assert(slabs_reassign(h, h1, src, dst) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    for (int ii = 0; ii < 500; ++ii) {
+        slab_stats(h, h1);
+        if (slabs_moved > 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(slabs_moved == 1);
+    assert(slab_reassign_evictions > 0);
+    assert(slab_pages[src] == src_pages - 1);
+    assert(slab_pages[dst] == 2);
+
+    for (int ii = 0; ii < 10; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "slabs_small_%d", ii);
+        item *it = NULL;
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result slabs_reassign_disabled_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    assert(slabs_reassign(h, h1, 1, 2) == PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED);
+    return SUCCESS;
+}
+
 MEMCACHED_PUBLIC_API
 engine_test_t* get_tests(void) {
     static engine_test_t tests[]  = {
@@ -802,16 +1375,40 @@ engine_test_t* get_tests(void) {
         {"prepend test", prepend_test, NULL, NULL, NULL},
         {"store test", store_test, NULL, NULL, NULL},
         {"get test", get_test, NULL, NULL, NULL},
+        {"get multi test", get_multi_test, NULL, NULL, NULL},
+        {"bucketed get multi test", get_multi_test, NULL, NULL,
+         "bucketed_hash=true"},
         {"expiry test", expiry_test, NULL, NULL, NULL},
         {"remove test", remove_test, NULL, NULL, NULL},
         {"release test", release_test, NULL, NULL, NULL},
         {"incr test", incr_test, NULL, NULL, NULL},
         {"mt incr test", mt_incr_test, NULL, NULL, NULL},
+        {"mt store test", mt_store_test, NULL, NULL, "cache_size=4"},
+        {"mt get test", mt_get_test, NULL, NULL, "cache_size=4"},
+        {"hash expand test", hash_expand_test, NULL, NULL, NULL},
+        {"inline hash expand test", hash_expand_test, NULL, NULL,
+         "inline_expand=true"},
+        {"bucketed hash expand test", hash_expand_test, NULL, NULL,
+         "bucketed_hash=true"},
+        {"bucketed inline hash expand test", hash_expand_test, NULL, NULL,
+         "bucketed_hash=true;inline_expand=true"},
+        {"bucketed scalar hash expand test", hash_expand_test, NULL, NULL,
+         "bucketed_hash=true;simd_tags=false"},
+        {"bucketed mt store test", mt_store_test, NULL, NULL,
+         "cache_size=4;bucketed_hash=true"},
+        {"bucketed mt get test", mt_get_test, NULL, NULL,
+         "cache_size=4;bucketed_hash=true"},
         {"decr test", decr_test, NULL, NULL, NULL},
         {"flush test", flush_test, NULL, NULL, NULL},
         {"get item info test", get_item_info_test, NULL, NULL, NULL},
         {"set cas test", item_set_cas_test, NULL, NULL, NULL},
         {"LRU test", lru_test, NULL, NULL, "cache_size=48"},
+        {"segmented LRU test", segmented_lru_test, NULL, NULL,
+         "cache_size=48;lru_segmented=true"},
+        {"LRU crawler test", lru_crawler_test, NULL, NULL,
+         "lru_crawler_interval=1;lru_crawler_sleep=0;lru_segmented=false"},
+        {"chunked item test", chunked_item_test, NULL, NULL,
+         "slab_chunk_max=16384"},
         {"get stats test", get_stats_test, NULL, NULL, NULL},
         {"reset stats test", reset_stats_test, NULL, NULL, NULL},
         {"get stats struct test", get_stats_struct_test, NULL, NULL, NULL},
@@ -819,6 +1416,10 @@ engine_test_t* get_tests(void) {
         {"touch", touch_test, NULL, NULL, NULL},
         {"Get And Touch", gat_test, NULL, NULL, NULL},
         {"Get And Touch Quiet", gatq_test, NULL, NULL, NULL},
+        {"slabs reassign test", slabs_reassign_test, NULL, NULL,
+         "slab_reassign=true"},
+        {"slabs reassign disabled test", slabs_reassign_disabled_test,
+         NULL, NULL, NULL},
         {NULL, NULL, NULL, NULL, NULL}
     };
     return tests;